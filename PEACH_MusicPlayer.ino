@@ -4,10 +4,13 @@
 #include "SSD1322.h"
 #include "player.h"
 #include "playlist.h"
+#include "play_queue.h"
+#include "play_stats.h"
 #include "ir_remote.h"
 #include "oled_display.h"
 #include "spectrum_analyzer.h"
 #include "M41T62.h"
+#include "block_cache.h"
 
 // 試作基板（Arduino MEGA用基板使用）
 // #define OLED_CS         26
@@ -29,6 +32,17 @@
 #define MSGEQ7_RESET    3
 
 #define IDLE_TIMEOUT    60000
+// #define OLED_BENCHMARK  10      // 起動時にパネルへの転送速度と描画の速度を測る(回数)
+
+#define PLAYLIST_PATH           "playlist.dat"
+#define PLAYLIST_JOURNAL_PATH   "playlist.jnl"
+#define PLAYLIST_POLL_INTERVAL  5000
+#define PLAYLIST_LOAD_SLICE     20
+#define PREFETCH_INTERVAL       1000
+#define STATS_INTERVAL          60000
+#define QUEUE_PATH              "queue.dat"
+#define PLAYSTAT_LOG_PATH       "playstat.log"
+#define PLAYSTAT_PATH           "playstat.dat"
 
 SSD1322 g_oled(OLED_CS, OLED_DC, OLED_RES, OLED_E, OLED_RW);
 IRRemote  g_irr;
@@ -42,9 +56,64 @@ ArtistListView artist_list_view(&g_oled, &g_playlist);
 ScreenSaverView screensave_view(&g_oled, &g_playlist);
 ClockView clock_view(&g_oled, &g_playlist);
 ConfigView config_view(&g_oled, &g_playlist);
+SearchView search_view(&g_oled, &g_playlist);
+RankingView ranking_view(&g_oled, &g_playlist);
+AlbumIndexView album_index_view(&g_oled, &g_playlist);
+GenreListView genre_list_view(&g_oled, &g_playlist);
+FolderListView folder_list_view(&g_oled, &g_playlist);
 
 PopupView g_popup(&g_oled);
 
+// -----------------------------------------------------------------------------
+//  再生中の曲
+//  プレイリストの読み込み中はキューが使えないので、選択中のアルバムの中で移動する
+// -----------------------------------------------------------------------------
+Song *currentSong()
+{
+    if( g_playlist.isLoading() )
+    {
+        return g_playlist.getSelectedArtist()->getSelectedAlbum()->getCurrentSong();
+    }
+    return Queue().getCurrentSong();
+}
+
+// -----------------------------------------------------------------------------
+bool hasNextSong()
+{
+    if( g_playlist.isLoading() )
+    {
+        return g_playlist.getSelectedArtist()->getSelectedAlbum()->hasNext();
+    }
+    return Queue().hasNext();
+}
+
+// -----------------------------------------------------------------------------
+bool seekNextSong()
+{
+    if( g_playlist.isLoading() )
+    {
+        Album *album = g_playlist.getSelectedArtist()->getSelectedAlbum();
+        if( !album->hasNext() )
+        {
+            return false;
+        }
+        album->seekNext();
+        return true;
+    }
+    return Queue().next();
+}
+
+// -----------------------------------------------------------------------------
+void seekPrevSong()
+{
+    if( g_playlist.isLoading() )
+    {
+        g_playlist.getSelectedArtist()->getSelectedAlbum()->seekPrev();
+        return;
+    }
+    Queue().prev();
+}
+
 // -----------------------------------------------------------------------------
 bool controlAudio(IRRCODE code)
 {
@@ -60,9 +129,9 @@ bool controlAudio(IRRCODE code)
             if( Player().isStopped() )
             {
                 Serial.println("play");
-                const char *filename = album->getCurrentSong()->getFileName();
-                Serial.println(filename);
-                Player().play(filename);
+                Song *song = album->getCurrentSong();
+                Serial.println(song->getFileName());
+                Player().play(song->getFileName(), song->getFileSize());
             }
             else
             {
@@ -82,17 +151,24 @@ bool controlAudio(IRRCODE code)
         case IRRemote::FN_STOP:
             Serial.println("stop");
             Player().stop(true);
-            album->seekFirst();
+            if( g_playlist.isLoading() )
+            {
+                album->seekFirst();
+            }
+            else
+            {
+                Queue().seekFirst();
+            }
             break;
         case IRRemote::PREV:
             if( !Player().isStopped() )
             {
                 Serial.println("prev");
                 Player().stop(true);
-                album->seekPrev();
-                const char *filename = album->getCurrentSong()->getFileName();
-                Serial.println(filename);
-                Player().play(filename);
+                seekPrevSong();
+                Song *song = currentSong();
+                Serial.println(song->getFileName());
+                Player().play(song->getFileName(), song->getFileSize());
             }
             else
             {
@@ -100,14 +176,14 @@ bool controlAudio(IRRCODE code)
             }
             break;
         case IRRemote::NEXT:
-            if( !Player().isStopped() && album->hasNext() )
+            if( !Player().isStopped() && hasNextSong() )
             {
                 Serial.println("next");
                 Player().stop(true);
-                album->seekNext();
-                const char *filename = album->getCurrentSong()->getFileName();
-                Serial.println(filename);
-                Player().play(filename);
+                seekNextSong();
+                Song *song = currentSong();
+                Serial.println(song->getFileName());
+                Player().play(song->getFileName(), song->getFileSize());
             }
             else
             {
@@ -157,6 +233,97 @@ void controlLED()
     }
 }
 
+// -----------------------------------------------------------------------------
+//  playlist.dat の差分更新(playlist.jnl)を定期的に確認する
+//  曲やビューがオブジェクトを参照していないよう、停止中かつプレイバック画面の表示中に限る
+// -----------------------------------------------------------------------------
+void updatePlaylist()
+{
+    static uint32_t t = 0;
+
+    uint32_t now = millis();
+    if( now - t < PLAYLIST_POLL_INTERVAL )
+    {
+        return;
+    }
+    t = now;
+    if( Player().isStopped() && View::getView(PlaybackView::ID)->isVisible() )
+    {
+        if( g_playlist.update(PLAYLIST_JOURNAL_PATH) )
+        {
+            // 曲ファイルも書き換えられている可能性があるので、開いておいたものは捨てる
+            Player().clearFileCache();
+            folder_list_view.clearCache();
+            Queue().validate();
+            View::getView(PlaybackView::ID)->invalidate(false);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  再生中に次の曲のファイルを開いておき、曲の切り替えを速くする
+// -----------------------------------------------------------------------------
+void prefetchNextSong()
+{
+    static uint32_t t = 0;
+
+    uint32_t now = millis();
+    if( now - t < PREFETCH_INTERVAL || Player().isStopped() )
+    {
+        return;
+    }
+    t = now;
+    if( folder_list_view.isPlaying() )
+    {
+        return;
+    }
+    Song *song = Queue().peekNext();
+    if( song )
+    {
+        Player().prefetch(song->getFileName(), song->getFileSize());
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  プレイリストの残りを少しずつ読み込む
+//  読み込みが終わったらキューを復元する。読み込み中に再生を始めていれば、
+//  再生中の曲を優先する
+// -----------------------------------------------------------------------------
+void loadPlaylist()
+{
+    Album *album = g_playlist.getSelectedArtist()->getSelectedAlbum();
+    uint16_t index = album->getCurrentIndex();
+    if( !g_playlist.loadNext(PLAYLIST_LOAD_SLICE) )
+    {
+        return;
+    }
+    Queue().begin(&g_playlist, QUEUE_PATH);
+    if( !Player().isStopped() && !Queue().jumpTo(album, index) )
+    {
+        Queue().setAlbum(album, index);
+    }
+    View::getActiveView()->invalidate(false);
+}
+
+// -----------------------------------------------------------------------------
+//  キャッシュと画面転送の統計を定期的にシリアルに出力する(大きさの調整用)
+// -----------------------------------------------------------------------------
+void printStats()
+{
+    static uint32_t t = 0;
+
+    uint32_t now = millis();
+    if( now - t < STATS_INTERVAL )
+    {
+        return;
+    }
+    t = now;
+    Blocks().printStats();
+    g_oled.printFontStats();
+    ShapedTexts().printStats();
+    g_oled.printFlushStats();
+}
+
 // -----------------------------------------------------------------------------
 void setup()
 {
@@ -173,7 +340,11 @@ void setup()
 
     g_oled.init();
     g_oled.displayOn();
-    g_playlist.load("playlist.dat");
+#ifdef OLED_BENCHMARK
+    g_oled.benchmark(OLED_BENCHMARK);
+    g_oled.benchmarkDraw(OLED_BENCHMARK);
+#endif
+    Stats().begin(PLAYSTAT_LOG_PATH, PLAYSTAT_PATH);
     Player().begin();
 
     View::getView(PlaybackView::ID)->init();
@@ -182,24 +353,56 @@ void setup()
     View::getView(ScreenSaverView::ID)->init();
     View::getView(ClockView::ID)->init();
     View::getView(ConfigView::ID)->init();
+    View::getView(SearchView::ID)->init();
+    View::getView(RankingView::ID)->init();
+    View::getView(AlbumIndexView::ID)->init();
+    View::getView(GenreListView::ID)->init();
+    View::getView(FolderListView::ID)->init();
     g_popup.init();
+
+    // 選択中のアーティストだけを読み込んで表示し、残りは loop() で読み込む
+    if( !g_playlist.begin(PLAYLIST_PATH) )
+    {
+        g_oled.clear(0x00);
+        g_oled.drawASCIIText(0, 1, PLAYLIST_PATH, SSD1322::FONT_TINY, 0x0A);
+        g_oled.drawString(0, 28, "プレイリストを読み込めません", SSD1322::FONT_LARGE, 0x0F);
+        g_oled.display();
+        return;
+    }
+    if( !g_playlist.isLoading() )
+    {
+        Queue().begin(&g_playlist, QUEUE_PATH);
+    }
     View::show(PlaybackView::ID);
 }
 
 // -----------------------------------------------------------------------------
 void loop()
 {
+    if( g_playlist.getArtistCount() == 0 )
+    {
+        // プレイリストがなければ何もしない
+        controlLED();
+        return;
+    }
+
     IRRCODE code = g_irr.read();
     if( code )
     {
         if( !g_popup.handleIRR(code) )
         {
-            if( controlAudio(code) )
+            if( folder_list_view.controlAudio(code) )
+            {
+                // フォルダから再生中の曲は、プレイリストのキューとは別に移動する
+                View::show(FolderListView::ID);
+            }
+            else if( controlAudio(code) )
             {
                 View::show(PlaybackView::ID);
             }
-            else
+            else if( !g_playlist.isLoading() )
             {
+                // 読み込み中は、他の画面やキューの操作を受け付けない
                 View::getActiveView()->handleIRR(code);
             }
         }
@@ -211,22 +414,45 @@ void loop()
     if( Player().trackEnded() )
     {
         Serial.println("track ended");
-        Artist *artist = g_playlist.getSelectedArtist();
-        Album *album = artist->getSelectedAlbum();
-        if( album->hasNext() )
+        if( folder_list_view.isPlaying() )
+        {
+            // フォルダから再生した曲は、同じフォルダの次の曲に進む
+            folder_list_view.playNext(1);
+        }
+        else
         {
-            album->seekNext();
-            const char *filename = album->getCurrentSong()->getFileName();
-            Serial.println(filename);
-            Player().play(filename);
+            Stats().record(currentSong());
+            if( seekNextSong() )
+            {
+                Song *song = currentSong();
+                Serial.println(song->getFileName());
+                Player().play(song->getFileName(), song->getFileSize());
+            }
         }
         if( View::getView(PlaybackView::ID)->isVisible() )
         {
             View::getView(PlaybackView::ID)->invalidate(false);
         }
     }
+    // フォルダの次の曲は、一覧を少しずつ列挙しながら探す
+    folder_list_view.updateNext();
+    if( g_playlist.isLoading() )
+    {
+        loadPlaylist();
+    }
+    else
+    {
+        updatePlaylist();
+        prefetchNextSong();
+    }
+    Stats().update(Player().isStopped());
     g_popup.update();
     View::getActiveView()->update();
+    // スクロールするテキストは、画面に関係なくここでまとめて進める
+    Marquees().update(&g_oled);
+    // このループで描き換えた領域をまとめて画面に送る
+    g_oled.flush();
     controlLED();
+    printStats();
 }
 
@@ -1,31 +1,49 @@
 #include <Arduino.h>
 #include "SSD1322.h"
+#include "crc32.h"
+
+// -----------------------------------------------------------------------------
+//  1bpp の 8ピクセルを、フレームバッファの 4バイト分のマスク(点のあるニブルが 0xF)に
+//  展開する表
+// -----------------------------------------------------------------------------
+static const uint8_t (*getExpandTable())[4]
+{
+    static uint8_t table[256][4];
+    static bool initialized = false;
+    if( !initialized )
+    {
+        for( int b = 0 ; b < 256 ; b++ )
+        {
+            for( int k = 0 ; k < 4 ; k++ )
+            {
+                table[b][k] = ((b & (0x80 >> (k * 2)))? 0xF0 : 0x00) | ((b & (0x40 >> (k * 2)))? 0x0F : 0x00);
+            }
+        }
+        initialized = true;
+    }
+    return table;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //  Glyph
 ////////////////////////////////////////////////////////////////////////////////
 Glyph::Glyph() : m_code(0), m_width(0), m_height(0), m_offset(0), m_advance(0), 
-    m_data(NULL) //, m_anti_alias(false)
+    m_pitch(0), m_data(NULL) //, m_anti_alias(false)
 {
 }
 
 // -----------------------------------------------------------------------------
-void Glyph::load(File f, int16_t height) //, bool anti_alias)
+//  フォントファイルのレコードとビットマップ(ファイルを読み込んだメモリ上にあるもの)を使う
+// -----------------------------------------------------------------------------
+void Glyph::set(const FontGlyphRecord& r, int16_t height, const uint8_t *bitmap)
 {
-    // m_anti_alias = anti_alias;
+    m_code = r.code;
+    m_width = r.width;
     m_height = height;
-    // フォントファイルから読み込む
-    // uint8_t buffer[16*32];
-    // uint16_t glyph_size;
-    f.read(&m_code, sizeof(m_code));
-    f.read(&m_width, sizeof(m_width));
-    f.read(&m_offset, sizeof(m_offset));
-    f.read(&m_advance, sizeof(m_advance));
-    if( m_width > 0 )
-    {
-        m_data = (uint16_t *)malloc(2*m_width);
-        f.read(m_data, 2*m_width);
-    }
+    m_offset = r.offset;
+    m_advance = r.advance;
+    m_pitch = (m_width + 7) / 8;
+    m_data = (m_width > 0)? bitmap : NULL;
 }
 
 // -----------------------------------------------------------------------------
@@ -35,67 +53,436 @@ uint8_t Glyph::getPixel(int16_t x, int16_t y)
     {
         return 0x00;
     }
-    return (m_data[x] & (0x0001 << y))? 0x0F : 0x00;
+    return (m_data[y * m_pitch + x / 8] & (0x80 >> (x % 8)))? 0x0F : 0x00;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //  Font
 ////////////////////////////////////////////////////////////////////////////////
-Font::Font()
+Font::Font() : m_directory(NULL), m_header(NULL), m_records(NULL), m_pages(NULL), m_slot_of(NULL),
+    m_slots(NULL), m_slot_count(0), m_clock(0), m_hits(0), m_misses(0)
 {
-    memset(m_hash_table, 0, sizeof(m_hash_table));
 }
 
 // -----------------------------------------------------------------------------
-void Font::load(const char *path, int16_t height)
+//  v2 のフォントファイルの目次を読み込み、キャッシュを用意する
+//  ファイルはビットマップを読むために開いたままにしておく
+// -----------------------------------------------------------------------------
+void Font::load(const char *path, uint32_t cache_bytes)
 {
     // m_anti_alias = anti_alias;
-    File f = SD.open(path);
-    if( !f )
+    uint32_t start = millis();
+    if( !m_file.open(path, BlockCache::RANDOM) )
     {
         Serial.print("Cannot open ");
         Serial.println(path);
         while( true ){}
     }    
-    uint16_t glyph_num;
-    f.read(&glyph_num, 2);
-    for( uint16_t i = 0 ; i < glyph_num ; i++ )
+    FontHeader header;
+    if( m_file.read(&header, sizeof(header)) != sizeof(header) || header.magic != FONT_MAGIC ||
+        header.version != FONT_VERSION || header.file_size != m_file.size() ||
+        header.bitmap_offset < sizeof(header) || header.bitmap_offset > header.file_size )
     {
-        m_glyph[i].load(f, height); //, anti_alias);
-        insert_to_hash(&m_glyph[i]);
+        Serial.print(path);
+        Serial.println(" is not a v2 font (convert it with tools/mkfont)");
+        while( true ){}
     }
-    f.close();
+    m_directory = (uint8_t *)malloc(header.bitmap_offset);
+    m_slot_of = (uint16_t *)malloc(sizeof(uint16_t) * header.glyph_count);
+    if( !m_directory || !m_slot_of )
+    {
+        Serial.println("font: out of memory");
+        while( true ){}
+    }
+    memcpy(m_directory, &header, sizeof(header));
+    uint32_t size = header.bitmap_offset - sizeof(header);
+    if( m_file.read(m_directory + sizeof(header), size) != (int)size ||
+        header.crc != CRC32::calc(m_directory + sizeof(header), size) )
+    {
+        Serial.print(path);
+        Serial.println(" is broken");
+        while( true ){}
+    }
+    m_header = (FontHeader *)m_directory;
+    m_records = (const FontGlyphRecord *)(m_directory + header.glyph_offset);
+    memset(m_slot_of, 0, sizeof(uint16_t) * header.glyph_count);
+    if( !buildPages((const uint32_t *)(m_directory + header.lookup_offset)) )
+    {
+        Serial.println("font: out of memory");
+        while( true ){}
+    }
+
+    // スロットの大きさは最も大きいグリフに合わせる
+    uint32_t bitmap_size = 1;
+    for( uint32_t i = 0 ; i < header.glyph_count ; i++ )
+    {
+        uint32_t s = ((m_records[i].width + 7) / 8) * header.height;
+        if( s > bitmap_size )
+        {
+            bitmap_size = s;
+        }
+    }
+    uint32_t count = cache_bytes / (sizeof(Slot) + bitmap_size);
+    count = min(count, min(header.glyph_count, (uint32_t)0xFFFF));
+    m_slot_count = max(count, (uint32_t)1);
+    m_slots = new Slot[m_slot_count];
+    uint8_t *bitmaps = (uint8_t *)malloc(m_slot_count * bitmap_size);
+    if( !bitmaps )
+    {
+        Serial.println("font: out of memory");
+        while( true ){}
+    }
+    for( uint16_t i = 0 ; i < m_slot_count ; i++ )
+    {
+        m_slots[i].index = 0;
+        m_slots[i].used = 0;
+        m_slots[i].bitmap = bitmaps + i * bitmap_size;
+    }
+
     Serial.print(path);
     Serial.print(" successfully loaded. (");
-    Serial.print(glyph_num, DEC);
-    Serial.println(" glyphs)");
+    Serial.print(header.glyph_count, DEC);
+    Serial.print(" glyphs, ");
+    Serial.print(m_slot_count, DEC);
+    Serial.print(" cached, ");
+    Serial.print(millis() - start, DEC);
+    Serial.println(" ms)");
+}
+
+// -----------------------------------------------------------------------------
+//  ファイルの索引(上位バイトごとのグリフテーブルの先頭位置)からページを作る
+//  文字のない上位バイトはすべて空のページ(0 番)を指す
+//  (256 個すべてに文字があれば空のページは作らない)
+// -----------------------------------------------------------------------------
+bool Font::buildPages(const uint32_t *lookup)
+{
+    uint16_t used = 0;
+    for( int b = 0 ; b < 256 ; b++ )
+    {
+        if( lookup[b] < lookup[b + 1] )
+        {
+            used++;
+        }
+    }
+    uint16_t empty = (used < 256)? 1 : 0;
+    m_pages = (Page *)malloc(sizeof(Page) * (used + empty));
+    if( !m_pages )
+    {
+        return false;
+    }
+    memset(m_pages, 0, sizeof(Page) * (used + empty));
+    uint16_t n = empty;
+    for( int b = 0 ; b < 256 ; b++ )
+    {
+        if( lookup[b] == lookup[b + 1] )
+        {
+            m_page_of[b] = 0;
+            continue;
+        }
+        Page& p = m_pages[n];
+        m_page_of[b] = n++;
+        p.base = lookup[b];
+        for( uint32_t i = lookup[b] ; i < lookup[b + 1] ; i++ )
+        {
+            uint8_t low = m_records[i].code & 0xFF;
+            p.bits[low >> 5] |= (uint32_t)1 << (low & 31);
+        }
+        uint8_t rank = 0;
+        for( int w = 0 ; w < 8 ; w++ )
+        {
+            p.rank[w] = rank;
+            rank += __builtin_popcount(p.bits[w]);
+        }
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  グリフテーブル内の番号。なければ -1
+// -----------------------------------------------------------------------------
+int32_t Font::find(uint16_t code)
+{
+    if( !m_pages )
+    {
+        return -1;
+    }
+    const Page& p = m_pages[m_page_of[code >> 8]];
+    uint8_t low = code & 0xFF;
+    uint32_t word = p.bits[low >> 5];
+    uint32_t bit = (uint32_t)1 << (low & 31);
+    if( !(word & bit) )
+    {
+        return -1;
+    }
+    return p.base + p.rank[low >> 5] + __builtin_popcount(word & (bit - 1));
 }
 
 // -----------------------------------------------------------------------------
-void Font::insert_to_hash(Glyph *g)
+//  最も長く使っていないスロットに index 番目のグリフのビットマップを読み込む
+//  読み込めなければ NULL。SDLock は１グリフごとに取り、再生を長く止めないようにする
+// -----------------------------------------------------------------------------
+Font::Slot *Font::fetch(uint32_t index)
 {
-    int index = g->getCode() % MAX_GLYPH_NUM;
-    while( m_hash_table[index] )
+    Slot *s = &m_slots[0];
+    for( uint16_t i = 1 ; i < m_slot_count ; i++ )
+    {
+        if( m_slots[i].used < s->used )
+        {
+            s = &m_slots[i];
+        }
+    }
+    if( s->used )
+    {
+        m_slot_of[s->index] = 0;
+        s->used = 0;
+    }
+    const FontGlyphRecord& r = m_records[index];
+    uint32_t size = ((r.width + 7) / 8) * m_header->height;
+    // 再生中の描画でも読むので、読む間はタイマ割込みを止めておく
+    SDLock lock;
+    if( r.width > 0 &&
+        (!m_file.seek(m_header->bitmap_offset + r.bitmap) || m_file.read(s->bitmap, size) != (int)size) )
     {
-        //go to next cell
-        index = (index + 1) % MAX_GLYPH_NUM;
+        Serial.println("font: cannot read glyph");
+        return NULL;
     }
-    m_hash_table[index] = g;
+    m_misses++;
+    s->glyph.set(r, m_header->height, s->bitmap);
+    s->index = index;
+    s->used = ++m_clock;
+    m_slot_of[index] = (s - m_slots) + 1;
+    return s;
 }
 
 // -----------------------------------------------------------------------------
 Glyph *Font::getGlyph(uint16_t code)
 {
-    int index = code % MAX_GLYPH_NUM;
-    while( m_hash_table[index] )
+    int32_t index = find(code);
+    return (index < 0)? NULL : getGlyphAt(index);
+}
+
+// -----------------------------------------------------------------------------
+//  グリフテーブルの index 番目のグリフ
+// -----------------------------------------------------------------------------
+Glyph *Font::getGlyphAt(uint32_t index)
+{
+    Slot *s;
+    if( m_slot_of[index] )
+    {
+        s = &m_slots[m_slot_of[index] - 1];
+        m_hits++;
+    }
+    else
+    {
+        s = fetch(index);
+        if( !s )
+        {
+            return NULL;
+        }
+    }
+    s->used = ++m_clock;
+    return &s->glyph;
+}
+
+// -----------------------------------------------------------------------------
+//  文字の送り幅(ビットマップは読み込まない)。グリフがなければ 0
+// -----------------------------------------------------------------------------
+int16_t Font::getAdvance(uint16_t code)
+{
+    int32_t index = find(code);
+    return (index < 0)? 0 : m_records[index].advance;
+}
+
+// -----------------------------------------------------------------------------
+//  prefetch() の下請け。キャッシュにあれば使ったことにして追い出されないようにし、
+//  なければ missing に加える
+// -----------------------------------------------------------------------------
+void Font::touch(uint32_t index, uint32_t *missing, uint16_t& count)
+{
+    if( m_slot_of[index] )
+    {
+        m_slots[m_slot_of[index] - 1].used = ++m_clock;
+        return;
+    }
+    uint16_t i = 0;
+    while( i < count && missing[i] != index )
+    {
+        i++;
+    }
+    if( i == count && count < MAX_PREFETCH )
+    {
+        missing[count++] = index;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  missing のグリフをファイル内の順に並べてから読む(SDカードを前から順に読むことになる)
+// -----------------------------------------------------------------------------
+void Font::fetchAll(uint32_t *missing, uint16_t count)
+{
+    // ビットマップの位置の順に並べる(挿入ソート)
+    for( uint16_t i = 1 ; i < count ; i++ )
+    {
+        uint32_t v = missing[i];
+        uint16_t j = i;
+        for( ; j > 0 && m_records[missing[j - 1]].bitmap > m_records[v].bitmap ; j-- )
+        {
+            missing[j] = missing[j - 1];
+        }
+        missing[j] = v;
+    }
+    for( uint16_t i = 0 ; i < count ; i++ )
+    {
+        fetch(missing[i]);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  text の文字のグリフをまとめてキャッシュに読み込む
+// -----------------------------------------------------------------------------
+void Font::prefetch(const char *text)
+{
+    uint32_t missing[MAX_PREFETCH];
+    uint16_t count = 0;
+    char *p = const_cast<char *>(text);
+    uint16_t code;
+    while( *p )
+    {
+        p = getCharCodeAt(p, &code);
+        int32_t index = find(code);
+        if( index >= 0 )
+        {
+            touch(index, missing, count);
+        }
+    }
+    fetchAll(missing, count);
+}
+
+// -----------------------------------------------------------------------------
+//  グリフテーブル内の番号で指定したグリフをまとめてキャッシュに読み込む
+// -----------------------------------------------------------------------------
+void Font::prefetch(const uint16_t *indices, uint16_t count)
+{
+    uint32_t missing[MAX_PREFETCH];
+    uint16_t n = 0;
+    for( uint16_t i = 0 ; i < count ; i++ )
+    {
+        touch(indices[i], missing, n);
+    }
+    fetchAll(missing, n);
+}
+
+// -----------------------------------------------------------------------------
+//  グリフのキャッシュのヒット率をシリアルに出力する(キャッシュの大きさを決める目安)
+// -----------------------------------------------------------------------------
+void Font::printStats(const char *name)
+{
+    uint32_t total = m_hits + m_misses;
+    Serial.print("font ");
+    Serial.print(name);
+    Serial.print(": ");
+    Serial.print(m_hits, DEC);
+    Serial.print(" hit(s), ");
+    Serial.print(m_misses, DEC);
+    Serial.print(" miss(es) (");
+    Serial.print(total? (m_hits * 100 / total) : 0, DEC);
+    Serial.println("%)");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  ShapedTextCache
+////////////////////////////////////////////////////////////////////////////////
+ShapedTextCache& ShapedTexts()
+{
+    static ShapedTextCache cache;
+    return cache;
+}
+
+// -----------------------------------------------------------------------------
+ShapedTextCache::ShapedTextCache() : m_clock(0), m_hits(0), m_misses(0)
+{
+    for( int i = 0 ; i < NUM_ENTRIES ; i++ )
+    {
+        m_entries[i].font = NULL;
+        m_entries[i].used = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  font で描く text の ShapedText。キャッシュになければ最も長く使っていないものを
+//  置き換えて作る。次に get() を呼ぶまで有効
+//  グリフが MAX_GLYPHS、バイト数が MAX_BYTES を超える文字列はキャッシュしない(NULL を返す)
+// -----------------------------------------------------------------------------
+const ShapedText *ShapedTextCache::get(Font *font, const char *text)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    uint16_t length = 0;
+    for( const char *p = text ; *p ; p++, length++ )
+    {
+        hash = (hash ^ (uint8_t)*p) * 16777619UL;
+    }
+    ShapedText *e = &m_entries[0];
+    for( int i = 0 ; i < NUM_ENTRIES ; i++ )
+    {
+        ShapedText& s = m_entries[i];
+        if( s.font == font && s.hash == hash && s.length == length && !memcmp(s.text, text, length) )
+        {
+            m_hits++;
+            s.used = ++m_clock;
+            return &s;
+        }
+        if( s.used < e->used )
+        {
+            e = &s;
+        }
+    }
+
+    m_misses++;
+    if( length > ShapedText::MAX_BYTES )
+    {
+        return NULL;
+    }
+    e->font = NULL;
+    e->used = 0;
+    e->count = 0;
+    e->width = 0;
+    char *p = const_cast<char *>(text);
+    uint16_t code;
+    while( *p )
     {
-        if( m_hash_table[index]->getCode() == code )
+        p = Font::getCharCodeAt(p, &code);
+        int32_t index = font->find(code);
+        if( index < 0 )
+        {
+            continue;
+        }
+        if( e->count == ShapedText::MAX_GLYPHS )
         {
-            return m_hash_table[index];
+            return NULL;
         }
-        index = (index + 1) % MAX_GLYPH_NUM;
+        e->glyphs[e->count++] = index;
+        e->width += font->getAdvanceAt(index);
     }
-    return NULL;
+    e->font = font;
+    e->hash = hash;
+    e->length = length;
+    memcpy(e->text, text, length);
+    e->used = ++m_clock;
+    return e;
+}
+
+// -----------------------------------------------------------------------------
+void ShapedTextCache::printStats()
+{
+    uint32_t total = m_hits + m_misses;
+    Serial.print("text: ");
+    Serial.print(m_hits, DEC);
+    Serial.print(" hit(s), ");
+    Serial.print(m_misses, DEC);
+    Serial.print(" miss(es) (");
+    Serial.print(total? (m_hits * 100 / total) : 0, DEC);
+    Serial.println("%)");
 }
 
 //------------------------------------------------------------------------------
@@ -134,13 +521,13 @@ char *Font::getCharCodeAt(char *p, uint16_t *code)
 ////////////////////////////////////////////////////////////////////////////////
 //  Image
 ////////////////////////////////////////////////////////////////////////////////
-Image::Image() : m_width(0), m_height(0), m_data(NULL)
+Image::Image() : m_width(0), m_height(0), m_data(NULL), m_mask(NULL)
 {
 
 }
 
 // -----------------------------------------------------------------------------
-void Image::load(File f)
+void Image::load(CachedFile& f)
 {
     f.read(&m_width, sizeof(m_width));
     f.read(&m_height, sizeof(m_height));
@@ -167,6 +554,38 @@ uint8_t Image::getPixel(int16_t x, int16_t y)
     }
 }
 
+// -----------------------------------------------------------------------------
+//  color のピクセルを透明にする(マスクを作り直す)
+// -----------------------------------------------------------------------------
+void Image::setTransparentColor(uint8_t color)
+{
+    if( !m_data )
+    {
+        return;
+    }
+    int16_t pitch = (m_width + 7) / 8;
+    if( !m_mask )
+    {
+        m_mask = (uint8_t *)malloc(pitch * m_height);
+        if( !m_mask )
+        {
+            Serial.println("image: out of memory");
+            return;
+        }
+    }
+    memset(m_mask, 0x00, pitch * m_height);
+    for( int16_t y = 0 ; y < m_height ; y++ )
+    {
+        for( int16_t x = 0 ; x < m_width ; x++ )
+        {
+            if( getPixel(x, y) != (color & 0x0F) )
+            {
+                m_mask[y * pitch + x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //  ImageList
 ////////////////////////////////////////////////////////////////////////////////
@@ -178,8 +597,8 @@ ImageList::ImageList() : m_images(NULL), m_count(0)
 // -----------------------------------------------------------------------------
 void ImageList::load(const char *path, int16_t count)
 {
-    File f = SD.open(path);
-    if( !f )
+    CachedFile f;
+    if( !f.open(path, BlockCache::SEQUENTIAL) )
     {
         Serial.print("Cannot open ");
         Serial.println(path);
@@ -196,6 +615,15 @@ void ImageList::load(const char *path, int16_t count)
     Serial.println(" successfully loaded");
 }
 
+// -----------------------------------------------------------------------------
+void ImageList::setTransparentColor(uint8_t color)
+{
+    for( int16_t n = 0 ; n < m_count ; n++ )
+    {
+        m_images[n].setTransparentColor(color);
+    }
+}
+
 // -----------------------------------------------------------------------------
 int16_t ImageList::getImageWidth()
 {
@@ -228,189 +656,311 @@ Image *ImageList::getImage(int16_t index)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-//  ScrollText
+//  MarqueeRegion
 ////////////////////////////////////////////////////////////////////////////////
-ScrollText::ScrollText() : m_viewport_width(256), m_scroll_state(STATE_STATIC), m_offset(0)
+MarqueeRegion::MarqueeRegion() : m_rect(0, 0, 256, VIEWPORT_HEIGHT), m_color(0x0F), m_bg_color(0x00),
+    m_group(0), m_step(1), m_pause(PAUSE_TIMEOUT), m_state(STATE_IDLE), m_next_tick(0), m_offset(0),
+    m_ink_width(0), m_text_width(0)
 {
-    m_text_width[0] = 0;
-    m_text_width[0] = 0;
+    memset(m_lines, 0x00, sizeof(m_lines));
 }
 
 // -----------------------------------------------------------------------------
-void ScrollText::init(int16_t width)
+//  ビューポートを (x, y) から幅 width、高さ VIEWPORT_HEIGHT にする
+// -----------------------------------------------------------------------------
+void MarqueeRegion::init(int16_t x, int16_t y, int16_t width, uint8_t group)
 {
-    m_viewport_width = 2*(width/2); // 必ず偶数をセット
-    m_text_width[0] = 0;
-    m_text_width[1] = 0;
-    m_scroll_state = STATE_STATIC;
+    x &= ~1;
+    m_rect.setRect(x, y, 2*(min(width, (int16_t)(MAX_VIEWPORT_WIDTH - x))/2), VIEWPORT_HEIGHT);  // 必ず偶数をセット
+    m_group = group;
+    m_ink_width = 0;
+    m_text_width = 0;
+    m_state = STATE_IDLE;
     m_next_tick = 0;
     m_offset = 0;
 }
 
 // -----------------------------------------------------------------------------
-void ScrollText::setText(int row, const char *text, Font *font)
+//  テキストを描き直し、スクロールを先頭からやり直す(画面には描かない)
+// -----------------------------------------------------------------------------
+void MarqueeRegion::setText(const char *text, Font *font)
 {
     int16_t x = 0;
-    int16_t y = row*16; 
-    
-    for( int j = 0 ; j < 16 ; j++ )
-    {
-        m_buffer[y+j].clear();
-    }
 
-    char *p = const_cast<char *>(text);
-    uint16_t code;
-    while( *p )
+    memset(m_lines, 0x00, sizeof(m_lines));
+
+    const ShapedText *s = ShapedTexts().get(font, text);
+    if( s )
     {
-        p = Font::getCharCodeAt(p, &code);
-        Glyph *glyph = font->getGlyph(code);
-        if( glyph )
+        font->prefetch(s->glyphs, s->count);
+        for( uint16_t n = 0 ; n < s->count ; n++ )
         {
-            for( int16_t i = 0 ; i < glyph->getWidth() ; i++ )
-            {
-                for( int16_t j = 0 ; j < 16 ; j++ )
-                {
-                    m_buffer[y+j].setPixel(x+i, (glyph->getData()[i] & (0x0001<<j))? 0x0F : 0x00);
-                }
-            }
-            x += glyph->getAdvance();
+            x = drawGlyph(x, font->getGlyphAt(s->glyphs[n]));
         }
     }
-    m_text_width[row] = x;
-    Serial.print("scroll width [");
-    Serial.print(row, DEC);
-    Serial.print("] : ");
-    Serial.println(m_text_width[row], DEC);
-    if( m_text_width[row] > m_viewport_width )
+    else
     {
-        // スクロール表示が必要な場合は、スクロール領域幅ぶんの「空白」を追加する
-        x = m_text_width[row] + m_viewport_width;
-        for( int j = 0 ; j < 16 ; j++ )
+        font->prefetch(text);
+        char *p = const_cast<char *>(text);
+        uint16_t code;
+        while( *p )
         {
-            for( int i = 0 ; i < m_text_width[row] ; i++ )
-            {
-                m_buffer[y+j].setPixel(x+i, m_buffer[y+j].getPixel(i));
-            }
+            p = Font::getCharCodeAt(p, &code);
+            x = drawGlyph(x, font->getGlyph(code));
         }
-        m_text_width[row] += m_viewport_width;
+    }
+    m_ink_width = min(x, (int16_t)MAX_TEXT_WIDTH);
+    if( m_ink_width > m_rect.width )
+    {
+        // スクロール表示が必要な場合は、スクロール領域幅ぶんの「空白」を後ろに置く
+        // (先頭に戻る部分は expandLine() で折り返して読むので、テキストを複製しない)
+        m_text_width = m_ink_width + m_rect.width;
     }
     else
     {
-        m_text_width[row] = m_viewport_width;
+        m_text_width = m_rect.width;
     }
-}
-
-// -----------------------------------------------------------------------------
-void ScrollText::startScroll()
-{
-    m_scroll_state = STATE_STATIC;
+    m_state = STATE_IDLE;
     m_offset = 0;
-    m_next_tick = millis() + PAUSE_TIMEOUT;
 }
 
 // -----------------------------------------------------------------------------
-int ScrollText::updateScroll()
+//  グリフを行バッファの x に描き、次の文字の x を返す。glyph が NULL なら何もしない
+//  グリフの各行を x のビット位置にずらして OR する(MAX_TEXT_WIDTH を超える部分は捨てる)
+// -----------------------------------------------------------------------------
+int16_t MarqueeRegion::drawGlyph(int16_t x, Glyph *glyph)
 {
-    bool time_up = millis() >= m_next_tick;
-    uint8_t updated = 0;
-    switch( m_scroll_state )
+    if( !glyph )
     {
-        case STATE_STATIC:
-            if( time_up )
-            {
-                if( needScroll(0) )
-                {
-                    // 上段のスクロールを開始する
-                    m_scroll_state = STATE_SCROLL_1;
-                }
-                else if( needScroll(1) )
-                {
-                    // 下段のスクロールを開始する
-                    m_scroll_state = STATE_SCROLL_2;
-                }
-                else
-                {
-                    // 上段、下段とも、スクロールさせる必要はない
-                    break;
-                }
-                m_offset = 0;
-                m_next_tick = millis() + SCROLL_INTERVAL;
-            }
-            break;
-        case STATE_SCROLL_1:
-            if( time_up )
+        return x;
+    }
+    int16_t pitch = glyph->getPitch();
+    int16_t height = min(glyph->getHeight(), (int16_t)VIEWPORT_HEIGHT);
+    int16_t start = x / 8;
+    int16_t shift = x % 8;
+    for( int16_t j = 0 ; j < height && glyph->getWidth() > 0 ; j++ )
+    {
+        const uint8_t *src = glyph->getRow(j);
+        uint8_t *dst = m_lines[j];
+        for( int16_t k = 0 ; k < pitch ; k++ )
+        {
+            int16_t n = start + k;
+            if( n < MAX_TEXT_WIDTH / 8 )
             {
-                if( ++m_offset >= m_text_width[0] )
-                {
-                    // 上段のスクロールが終わった（表示は先頭に戻っている）
-                    if( needScroll(1) )
-                    {
-                        // 下段のスクロールを開始する
-                        m_offset = 0;
-                        m_scroll_state = STATE_SCROLL_2;
-                        m_next_tick += SCROLL_INTERVAL;
-                    }
-                    else
-                    {
-                        // 下段はスクロールの必要がないので、両段静止表示に戻る
-                        m_scroll_state = STATE_STATIC;
-                        m_next_tick = millis() + PAUSE_TIMEOUT;
-                    }
-                }
-                else
-                {
-                    // 上段のスクロールを継続
-                    m_next_tick += SCROLL_INTERVAL;
-                }
-                updated = 1;
+                dst[n] |= src[k] >> shift;
             }
-            break;
-        case STATE_SCROLL_2:
-            if( time_up )
+            if( shift && n + 1 < MAX_TEXT_WIDTH / 8 )
             {
-                if( ++m_offset >= m_text_width[1] )
-                {
-                    // 下段のスクロールが終わったので、両段静止表示に戻る
-                    m_scroll_state = STATE_STATIC;
-                    m_next_tick = millis() + PAUSE_TIMEOUT;
-                }
-                else
-                {
-                    // 下段のスクロールを継続
-                    m_next_tick = millis() + SCROLL_INTERVAL;
-                }
-                updated = 2;
+                dst[n + 1] |= src[k] << (8 - shift);
             }
-            break;
+        }
     }
-    return updated;
+    return x + glyph->getAdvance();
 }
 
 // -----------------------------------------------------------------------------
-uint8_t *ScrollText::getLineData(int row, int16_t dy)
+//  dy 行目のうちビューポートに見える部分を、m_color と m_bg_color の 4bpp にして
+//  data に m_rect.width / 2 バイト書き出す
+//  8ピクセルずつビット列を取り出して表で 4バイトのマスクに展開し、32ビット単位で
+//  色を合成する。テキストの末尾と折り返しをまたぐところだけ１ピクセルずつ取り出す
+// -----------------------------------------------------------------------------
+void MarqueeRegion::expandLine(int16_t dy, uint8_t *data)
 {
-    if( isScrolling(row) )
+    const uint8_t (*table)[4] = getExpandTable();
+    const uint8_t *bits = m_lines[dy];
+    uint32_t fg = m_color * 0x11111111;
+    uint32_t bg = m_bg_color * 0x11111111;
+    int16_t width = m_rect.width;
+    int16_t ink = m_ink_width;
+    int16_t period = max(m_text_width, width);
+    int16_t q = m_offset % period;
+    for( int16_t i = 0 ; i < width ; i += 8 )
     {
-        return m_buffer[row*16+dy].getDataPtr(m_offset);
+        uint8_t b = 0;
+        if( q + 8 <= ink )
+        {
+            int16_t k = q / 8;
+            b = (((bits[k] << 8) | bits[k + 1]) >> (8 - q % 8)) & 0xFF;
+        }
+        else if( q < ink || q + 8 > period )
+        {
+            for( int16_t t = 0 ; t < 8 ; t++ )
+            {
+                int16_t p = (q + t) % period;
+                if( p < ink && (bits[p / 8] & (0x80 >> (p % 8))) )
+                {
+                    b |= 0x80 >> t;
+                }
+            }
+        }
+        uint32_t mask;
+        memcpy(&mask, table[b], 4);
+        uint32_t pixels = (fg & mask) | (bg & ~mask);
+        memcpy(data + i / 2, &pixels, min(4, (width - i) / 2));
+        q += 8;
+        if( q >= period )
+        {
+            q -= period;
+        }
     }
-    else
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  Marquee
+////////////////////////////////////////////////////////////////////////////////
+Marquee& Marquees()
+{
+    static Marquee marquee;
+    return marquee;
+}
+
+// -----------------------------------------------------------------------------
+Marquee::Marquee() : m_count(0), m_next_tick(0)
+{
+}
+
+// -----------------------------------------------------------------------------
+//  region を登録する(登録済みなら何もしない)。いっぱいなら false
+// -----------------------------------------------------------------------------
+bool Marquee::add(MarqueeRegion *region)
+{
+    for( uint8_t i = 0 ; i < m_count ; i++ )
+    {
+        if( m_regions[i] == region )
+        {
+            return true;
+        }
+    }
+    if( m_count >= MAX_REGIONS )
+    {
+        Serial.println("marquee: too many regions");
+        return false;
+    }
+    m_regions[m_count++] = region;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  region の登録を外す(画面には何もしない)
+// -----------------------------------------------------------------------------
+void Marquee::remove(MarqueeRegion *region)
+{
+    for( uint8_t i = 0 ; i < m_count ; i++ )
+    {
+        if( m_regions[i] == region )
+        {
+            // 同じグループの順番が変わらないように詰める
+            for( uint8_t j = i + 1 ; j < m_count ; j++ )
+            {
+                m_regions[j - 1] = m_regions[j];
+            }
+            m_count--;
+            region->m_state = MarqueeRegion::STATE_IDLE;
+            region->m_offset = 0;
+            return;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  group のどれかが待機中かスクロール中なら true(グループ 0 は常に false)
+// -----------------------------------------------------------------------------
+bool Marquee::isGroupBusy(uint8_t group)
+{
+    if( group == 0 )
+    {
+        return false;
+    }
+    for( uint8_t i = 0 ; i < m_count ; i++ )
     {
-        return m_buffer[row*16+dy].getDataPtr(0);
+        if( m_regions[i]->m_group == group && m_regions[i]->m_state != MarqueeRegion::STATE_IDLE )
+        {
+            return true;
+        }
     }
+    return false;
 }
 
-// uint8_t ScrollText::getPixel(int row, int16_t dx, int16_t dy)
-// {
-//     if( isScrolling(row) )
-//     {
-//         int16_t x = (m_offset + dx) % m_text_width[row];
-//         return (m_buffer[row][x] & (0x0001 << dy))? 0x0F : 0x00;
-//     }
-//     else
-//     {
-//         return (m_buffer[row][dx] & (0x0001 << dy))? 0x0F : 0x00;
-//     }
-// }
+// -----------------------------------------------------------------------------
+//  index 番目の領域のスクロールが終わったとき、同じグループで後ろにある領域の
+//  スクロールをすぐに始める。後ろになければ、次のティックで先頭の領域が待機から始める
+// -----------------------------------------------------------------------------
+void Marquee::startNext(uint8_t index, uint32_t now)
+{
+    uint8_t group = m_regions[index]->m_group;
+    if( group == 0 )
+    {
+        return;
+    }
+    for( uint8_t i = index + 1 ; i < m_count ; i++ )
+    {
+        MarqueeRegion *r = m_regions[i];
+        if( r->m_group == group && r->needScroll() )
+        {
+            r->m_state = MarqueeRegion::STATE_PAUSE;
+            r->m_next_tick = now;
+            return;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  TICK_INTERVAL ごとに各領域を進め、動いた領域を描いてまとめて invalidateRect() する
+// -----------------------------------------------------------------------------
+void Marquee::update(SSD1322 *oled)
+{
+    uint32_t now = millis();
+    if( m_count == 0 || now < m_next_tick )
+    {
+        return;
+    }
+    m_next_tick = now + TICK_INTERVAL;
+
+    Rectangle dirty;
+    for( uint8_t i = 0 ; i < m_count ; i++ )
+    {
+        MarqueeRegion *r = m_regions[i];
+        switch( r->m_state )
+        {
+            case MarqueeRegion::STATE_IDLE:
+                if( r->needScroll() && !isGroupBusy(r->m_group) )
+                {
+                    r->m_state = MarqueeRegion::STATE_PAUSE;
+                    r->m_next_tick = now + r->m_pause;
+                }
+                break;
+            case MarqueeRegion::STATE_PAUSE:
+                if( now >= r->m_next_tick )
+                {
+                    r->m_state = MarqueeRegion::STATE_SCROLL;
+                }
+                break;
+            case MarqueeRegion::STATE_SCROLL:
+                r->m_offset += r->m_step;
+                if( r->m_offset >= r->m_text_width )
+                {
+                    // 一周した(表示は先頭に戻っている)
+                    r->m_offset = 0;
+                    r->m_state = MarqueeRegion::STATE_IDLE;
+                    startNext(i, now);
+                }
+                oled->drawMarquee(r);
+                if( dirty.isEmpty() )
+                {
+                    dirty = r->getRect();
+                }
+                else
+                {
+                    dirty.unionWith(r->getRect());
+                }
+                break;
+        }
+    }
+    if( !dirty.isEmpty() )
+    {
+        oled->invalidateRect(dirty);
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //  SSD1322
@@ -433,8 +983,29 @@ SSD1322::SSD1322(int csPin, int dcPin, int resetPin, int ePin, int rwPin)
     m_endCol   = ((SSD1322_SEG_COUNT / 4) - m_startCol) - 1;
 
     m_buf = NULL;
+    m_shadow = NULL;
+    m_shadow_valid[0] = false;
+    m_shadow_valid[1] = false;
+    m_page = 0;
 
     m_popup_drawing = false;
+
+    m_ePsr = NULL;
+    m_eHigh = 0;
+    m_eLow = 0;
+    m_strobe_wait = 20;
+
+    m_dirty_count = 0;
+    m_stat_requests = 0;
+    m_stat_windows = 0;
+    m_stat_requested = 0;
+    m_stat_sent = 0;
+    m_stat_frames = 0;
+    m_stat_frame_sent = 0;
+
+    m_start_line = 0;
+    m_slide_step = 0;
+    m_slide_tick = 0;
 }
 
 // -----------------------------------------------------------------------------
@@ -479,6 +1050,136 @@ void SSD1322::writeData(uint8_t d)
     digitalWrite(m_dcPin, HIGH);
 }
 
+// -----------------------------------------------------------------------------
+//  E の High/Low をそれぞれ保持する時間(ns)
+//  データシート: 書き込みサイクル 300ns 以上、E の High/Low 幅それぞれ 60ns 以上
+//  High/Low を半分ずつにしてサイクル時間を満たす。表示が乱れる場合は増やすこと
+// -----------------------------------------------------------------------------
+#define SSD1322_STROBE_NS   150
+
+static inline void waitStrobe(uint16_t count)
+{
+    for( volatile uint16_t i = 0 ; i < count ; i++ ){}
+}
+
+// -----------------------------------------------------------------------------
+//  E のピンが GPIO のどのポートのどのビットかを調べ、PSR で直接動かせるようにする
+//  ピン番号とポートの対応表は持っていないので、digitalWrite で E を動かしたときに
+//  変わった P レジスタのビットから求める。１ビットに決まらなければ digitalWrite のまま
+// -----------------------------------------------------------------------------
+void SSD1322::findStrobePort()
+{
+    static volatile uint16_t *const ports[] = {
+        &GPIO.P1, &GPIO.P2, &GPIO.P3, &GPIO.P4, &GPIO.P5, &GPIO.P6,
+        &GPIO.P7, &GPIO.P8, &GPIO.P9, &GPIO.P10, &GPIO.P11
+    };
+    static volatile uint32_t *const psrs[] = {
+        &GPIO.PSR1, &GPIO.PSR2, &GPIO.PSR3, &GPIO.PSR4, &GPIO.PSR5, &GPIO.PSR6,
+        &GPIO.PSR7, &GPIO.PSR8, &GPIO.PSR9, &GPIO.PSR10, &GPIO.PSR11
+    };
+    const int count = sizeof(ports) / sizeof(ports[0]);
+    uint16_t before[count];
+
+    m_ePsr = NULL;
+    digitalWrite(m_ePin, LOW);
+    for( int i = 0 ; i < count ; i++ )
+    {
+        before[i] = *ports[i];
+    }
+    digitalWrite(m_ePin, HIGH);
+    int port = -1;
+    uint16_t bit = 0;
+    for( int i = 0 ; i < count ; i++ )
+    {
+        uint16_t diff = before[i] ^ *ports[i];
+        if( !diff )
+        {
+            continue;
+        }
+        if( port >= 0 || (diff & (diff - 1)) )
+        {
+            return;
+        }
+        port = i;
+        bit = diff;
+    }
+    if( port < 0 )
+    {
+        return;
+    }
+    // PSR は上位 16 ビットで書き換えるビットを選ぶ(他のビットを読み書きせずに済む)
+    m_ePsr = psrs[port];
+    m_eHigh = ((uint32_t)bit << 16) | bit;
+    m_eLow = (uint32_t)bit << 16;
+}
+
+// -----------------------------------------------------------------------------
+//  waitStrobe() が SSD1322_STROBE_NS 以上待つループ回数を、実際に回した時間から求める
+//  (CPU のクロックから決まる。割込みで長く測れると短くなるので、３回の最短を使い、
+//  短いループでは１回あたりが速くなることもあるので 1.5 倍の余裕を持たせる)
+// -----------------------------------------------------------------------------
+void SSD1322::calibrateStrobe()
+{
+    const uint16_t loops = 50000;
+    uint32_t best = 0xFFFFFFFF;
+    for( int n = 0 ; n < 3 ; n++ )
+    {
+        uint32_t start = micros();
+        waitStrobe(loops);
+        uint32_t us = micros() - start;
+        if( us < best )
+        {
+            best = us;
+        }
+    }
+    if( best == 0 )
+    {
+        best = 1;
+    }
+    m_strobe_wait = (uint16_t)(((uint32_t)SSD1322_STROBE_NS * 3 * loops) / (best * 2000)) + 1;
+}
+
+// -----------------------------------------------------------------------------
+//  データをまとめて書き込む
+//  CS, D/C, R/W はブロックの間ずっと保持し、１バイトごとには P3 へのデータの
+//  書き込みと E のストローブだけを行う(E の立ち下がりでラッチされる)
+//  E のポートが分かっていれば、データも E も PSR への１回の書き込みで動かす
+// -----------------------------------------------------------------------------
+void SSD1322::writeDataBlock(const uint8_t *data, size_t length)
+{
+    digitalWrite(m_dcPin, HIGH);
+    digitalWrite(m_csPin, LOW);
+    digitalWrite(m_rwPin, LOW);
+    if( m_ePsr )
+    {
+        volatile uint32_t *e = m_ePsr;
+        uint32_t high = m_eHigh;
+        uint32_t low = m_eLow;
+        uint16_t wait = m_strobe_wait;
+        for( size_t i = 0 ; i < length ; i++ )
+        {
+            GPIO.PSR3 = 0xFF000000 | (((uint32_t)data[i])<<8);
+            *e = high;
+            waitStrobe(wait);
+            *e = low;
+            waitStrobe(wait);
+        }
+    }
+    else
+    {
+        for( size_t i = 0 ; i < length ; i++ )
+        {
+            GPIO.P3 = (GPIO.P3 & 0x00FF) | (((uint16_t)data[i])<<8);
+            digitalWrite(m_ePin, HIGH);
+            waitStrobe(m_strobe_wait);
+            digitalWrite(m_ePin, LOW);
+            waitStrobe(m_strobe_wait);
+        }
+    }
+    digitalWrite(m_rwPin, HIGH);
+    digitalWrite(m_csPin, HIGH);
+}
+
 // -----------------------------------------------------------------------------
 void SSD1322::reset(void)
 {
@@ -493,6 +1194,12 @@ void SSD1322::reset(void)
 bool SSD1322::initFrameBuffer(void)
 {
     free(m_buf);
+    free(m_shadow);
+    m_shadow = NULL;
+    for( int n = 0 ; n < NUM_PAGES ; n++ )
+    {
+        m_shadow_valid[n] = false;
+    }
 
     // Calculate stride for each row
     int stridebits = m_width * SSD1322_DEPTH;
@@ -506,6 +1213,11 @@ bool SSD1322::initFrameBuffer(void)
     // Zero out buffer
     memset(m_buf, 0x00, m_stride * m_height);
 
+    // パネルの内容はまだ分からないので、各ページの最初の display() ではすべて送る
+    m_shadow = (uint8_t *)malloc(m_stride * m_height * NUM_PAGES);
+    if( !m_shadow )
+        return false;
+
     return true;
 }
 
@@ -585,6 +1297,10 @@ bool SSD1322::init(void)
         pinMode(p, OUTPUT);
     }
 
+    // writeDataBlock() の E のストローブを準備する
+    findStrobePort();
+    calibrateStrobe();
+
     reset();
 
     // After power on, wait at least 300 ms before sending a command
@@ -657,9 +1373,9 @@ bool SSD1322::init(void)
 
     writeCmd(SSD1322_CMD_DISPLAY_ON);   // Sleep mode OFF
 
-    m_font[FONT_TINY ].load("font_t.dat", 9);
-    m_font[FONT_SMALL].load("font_s.dat", 14);
-    m_font[FONT_LARGE].load("font_l.dat", 16);
+    m_font[FONT_TINY ].load("font_t.dat", SSD1322_GLYPH_CACHE_BYTES);
+    m_font[FONT_SMALL].load("font_s.dat", SSD1322_GLYPH_CACHE_BYTES);
+    m_font[FONT_LARGE].load("font_l.dat", SSD1322_GLYPH_CACHE_BYTES);
 
     return true;
 }
@@ -766,20 +1482,86 @@ void SSD1322::drawPixel(int16_t x, int16_t y, uint16_t color)
 }
 
 // -----------------------------------------------------------------------------
-void SSD1322::drawHzLine(int16_t x, int16_t y, int16_t len, uint16_t color)
+//  y 行目の x1～x2(画面内に切り取り済み)を color で塗る。ポップアップは考えない
+//  両端の半端なニブルだけを読み書きし、間のバイトは memset() で埋める
+// -----------------------------------------------------------------------------
+void SSD1322::fillNibbles(int16_t x1, int16_t x2, int16_t y, uint8_t color)
+{
+    uint8_t *p = m_buf + y * m_stride;
+    color &= 0x0F;
+    if( x1 & 1 )
+    {
+        p[x1 / 2] = (p[x1 / 2] & 0xF0) | color;
+        x1++;
+    }
+    if( !(x2 & 1) && x1 <= x2 )
+    {
+        p[x2 / 2] = (p[x2 / 2] & 0x0F) | (color << 4);
+        x2--;
+    }
+    if( x1 < x2 )
+    {
+        memset(p + x1 / 2, (color << 4) | color, (x2 - x1 + 1) / 2);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  y 行目の x1～x2(画面内に切り取り済み)を塗る
+//  ポップアップの表示中は、ポップアップ矩形領域にかかる部分を除く
+// -----------------------------------------------------------------------------
+void SSD1322::fillSpan(int16_t x1, int16_t x2, int16_t y, uint8_t color)
 {
-    for( int16_t e = x + len ; x < e ; x++ )
+    Rectangle& rc = m_popup_rect;
+    if( !rc.isEmpty() && !m_popup_drawing && rc.top <= y && y <= rc.bottom() &&
+        x1 <= rc.right() && rc.left <= x2 )
     {
-        drawPixel(x, y, color);
+        if( x1 < rc.left )
+        {
+            fillNibbles(x1, rc.left - 1, y, color);
+        }
+        if( rc.right() < x2 )
+        {
+            fillNibbles(rc.right() + 1, x2, y, color);
+        }
+        return;
     }
+    fillNibbles(x1, x2, y, color);
+}
+
+// -----------------------------------------------------------------------------
+void SSD1322::drawHzLine(int16_t x, int16_t y, int16_t len, uint16_t color)
+{
+    fillRect(x, y, len, 1, color);
 }
 
 // -----------------------------------------------------------------------------
 void SSD1322::drawVtLine(int16_t x, int16_t y, int16_t len, uint16_t color)
 {
-    for( int16_t e = y + len ; y < e ; y++ )
+    int16_t y1 = max(y, 0);
+    int16_t y2 = min(y + len - 1, m_height - 1);
+    if( !m_buf || x < 0 || x >= m_width || y2 < y1 )
     {
-        drawPixel(x, y, color);
+        return;
+    }
+
+    // ポップアップに隠れる行
+    int16_t hide_top = 1;
+    int16_t hide_bottom = 0;
+    if( !m_popup_rect.isEmpty() && !m_popup_drawing && m_popup_rect.left <= x && x <= m_popup_rect.right() )
+    {
+        hide_top = m_popup_rect.top;
+        hide_bottom = m_popup_rect.bottom();
+    }
+
+    uint8_t mask = (x & 1)? 0xF0 : 0x0F;
+    uint8_t data = (x & 1)? (color & 0x0F) : ((color & 0x0F) << 4);
+    uint8_t *p = m_buf + y1 * m_stride + x / 2;
+    for( ; y1 <= y2 ; y1++, p += m_stride )
+    {
+        if( y1 < hide_top || hide_bottom < y1 )
+        {
+            *p = (*p & mask) | data;
+        }
     }
 }
 
@@ -796,12 +1578,22 @@ void SSD1322::drawRect(Rectangle& rc, uint16_t color)
     drawRect(rc.left, rc.top, rc.width, rc.height, color);
 }
 
+// -----------------------------------------------------------------------------
+//  画面の外は最初にまとめて切り捨て、行ごとに fillSpan() で塗る
 // -----------------------------------------------------------------------------
 void SSD1322::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color)
 {
-    for( int16_t e = y + h ; y < e ; y++ )
+    int16_t x1 = max(x, 0);
+    int16_t x2 = min(x + w - 1, m_width - 1);
+    int16_t y1 = max(y, 0);
+    int16_t y2 = min(y + h - 1, m_height - 1);
+    if( !m_buf || x2 < x1 )
+    {
+        return;
+    }
+    for( ; y1 <= y2 ; y1++ )
     {
-        drawHzLine(x, y, w, color);
+        fillSpan(x1, x2, y1, color);
     }
 }
 void SSD1322::fillRect(Rectangle& rc, uint16_t color)
@@ -810,31 +1602,136 @@ void SSD1322::fillRect(Rectangle& rc, uint16_t color)
 }
 
 // -----------------------------------------------------------------------------
-int16_t SSD1322::drawChar(int16_t x, int16_t y, uint16_t code, uint8_t size, uint8_t color)
+//  グリフを１ピクセルずつ描く(drawGlyph() で描けない幅のグリフ用)
+// -----------------------------------------------------------------------------
+void SSD1322::drawGlyphByPixel(int16_t left, int16_t y, Glyph *glyph, uint8_t color)
 {
-    Glyph *glyph = m_font[size].getGlyph(code);
-    if( !glyph )
+    for( int16_t j = 0 ; j < glyph->getHeight() ; j++ )
     {
-        return x;
+        for( int16_t i = 0 ; i < glyph->getWidth() ; i++ )
+        {
+            if( glyph->getPixel(i, j) )
+            {
+                drawPixel(left+i, y+j, color);
+            }
+        }
     }
+}
+
+// -----------------------------------------------------------------------------
+//  グリフを (left, y) に描く
+//  画面の外とポップアップに隠れる部分は、最初に列のビットマスクと行の範囲にしておき、
+//  行ごとに 8ピクセルずつ表でニブルのマスクに展開して書き込む
+//  left が奇数のときは、ビット列を１ピクセル右にずらしてから展開する
+// -----------------------------------------------------------------------------
+void SSD1322::drawGlyph(int16_t left, int16_t y, Glyph *glyph, uint8_t color)
+{
     int16_t width = glyph->getWidth();
     int16_t height = glyph->getHeight();
-    int16_t left = x + glyph->getOffset();
-    if( left < 0 )
+    if( !m_buf || width <= 0 )
     {
-        left = 0;
+        return;
+    }
+    if( width > MAX_BLIT_WIDTH )
+    {
+        drawGlyphByPixel(left, y, glyph, color);
+        return;
     }
-    for( int16_t j = 0 ; j < height ; j++ )
+
+    // 行の範囲と、見える列のマスク(ビット 31 が グリフの左端)
+    int16_t j1 = max(0, -y);
+    int16_t j2 = min(height, m_height - y) - 1;
+    int16_t i1 = max(0, -left);
+    int16_t i2 = min(width, m_width - left) - 1;
+    if( j2 < j1 || i2 < i1 )
+    {
+        return;
+    }
+    uint32_t visible = (0xFFFFFFFF >> i1) & ~(0xFFFFFFFF >> (i2 + 1));
+
+    // ポップアップに隠れる行と列
+    int16_t hide_top = 1;
+    int16_t hide_bottom = 0;
+    uint32_t hidden = 0;
+    Rectangle& rc = m_popup_rect;
+    if( !rc.isEmpty() && !m_popup_drawing )
+    {
+        int16_t h1 = max(rc.left - left, 0);
+        int16_t h2 = min(rc.right() - left, width - 1);
+        if( h1 <= h2 )
+        {
+            hidden = (0xFFFFFFFF >> h1) & ~(0xFFFFFFFF >> (h2 + 1));
+            hide_top = rc.top - y;
+            hide_bottom = rc.bottom() - y;
+        }
+    }
+
+    const uint8_t (*table)[4] = getExpandTable();
+    int16_t shift = left & 1;
+    int16_t start = (left - shift) / 2;                 // 左端のピクセルを含むバイト
+    int16_t count = (width + shift + 1) / 2;            // 書き込むバイト数
+    int16_t n1 = max(0, -start);
+    int16_t n2 = min(count, m_stride - start);
+    uint8_t fill = (color & 0x0F) * 0x11;
+    int16_t pitch = glyph->getPitch();
+    for( int16_t j = j1 ; j <= j2 ; j++ )
     {
-        for( int16_t i = 0 ; i < width ; i++ )
+        const uint8_t *src = glyph->getRow(j);
+        uint32_t bits = (uint32_t)src[0] << 24;
+        if( pitch > 1 )
+        {
+            bits |= (uint32_t)src[1] << 16;
+        }
+        if( pitch > 2 )
         {
-            uint8_t p = glyph->getPixel(i, j);
-            if( p )
+            bits |= (uint32_t)src[2] << 8;
+        }
+        bits &= visible;
+        if( hide_top <= j && j <= hide_bottom )
+        {
+            bits &= ~hidden;
+        }
+        bits >>= shift;
+        if( !bits )
+        {
+            continue;
+        }
+        uint8_t *dst = m_buf + (y + j) * m_stride + start;
+        for( int16_t n = 0 ; n < count ; n += 4, bits <<= 8 )
+        {
+            const uint8_t *masks = table[bits >> 24];
+            if( !(bits >> 24) )
             {
-                drawPixel(left+i, y+j, color);
+                continue;
+            }
+            for( int16_t k = 0 ; k < 4 ; k++ )
+            {
+                uint8_t mask = masks[k];
+                if( mask && n1 <= n + k && n + k < n2 )
+                {
+                    dst[n + k] = (dst[n + k] & ~mask) | (fill & mask);
+                }
             }
         }
     }
+}
+
+// -----------------------------------------------------------------------------
+int16_t SSD1322::drawChar(int16_t x, int16_t y, uint16_t code, uint8_t size, uint8_t color)
+{
+    Glyph *glyph = m_font[size].getGlyph(code);
+    return glyph? drawChar(x, y, glyph, color) : x;
+}
+
+// -----------------------------------------------------------------------------
+int16_t SSD1322::drawChar(int16_t x, int16_t y, Glyph *glyph, uint8_t color)
+{
+    int16_t left = x + glyph->getOffset();
+    if( left < 0 )
+    {
+        left = 0;
+    }
+    drawGlyph(left, y, glyph, color);
     return x + glyph->getAdvance();
 }
 
@@ -848,9 +1745,27 @@ int16_t SSD1322::drawASCIIText(int16_t x, int16_t y, const char *text, uint8_t s
     return x;
 }
 
+// -----------------------------------------------------------------------------
+//  ShapedTextCache にあれば、UTF-8 の解釈とグリフの検索を省く
 // -----------------------------------------------------------------------------
 int16_t SSD1322::drawString(int16_t x, int16_t y, const char *text, uint8_t size, uint8_t color)
 {
+    Font& font = m_font[size];
+    const ShapedText *s = ShapedTexts().get(&font, text);
+    if( s )
+    {
+        font.prefetch(s->glyphs, s->count);
+        for( uint16_t n = 0 ; n < s->count ; n++ )
+        {
+            Glyph *glyph = font.getGlyphAt(s->glyphs[n]);
+            if( glyph )
+            {
+                x = drawChar(x, y, glyph, color);
+            }
+        }
+        return x;
+    }
+    font.prefetch(text);
     char *p = const_cast<char *>(text);
     uint16_t code;
     while( *p )
@@ -864,32 +1779,112 @@ int16_t SSD1322::drawString(int16_t x, int16_t y, const char *text, uint8_t size
 // -----------------------------------------------------------------------------
 int16_t SSD1322::getTextWidth(const char *text, uint8_t size)
 {
+    const ShapedText *s = ShapedTexts().get(&m_font[size], text);
+    if( s )
+    {
+        return s->width;
+    }
     char *p = const_cast<char *>(text);
     uint16_t code;
     int16_t w = 0;
     while( *p )
     {
         p = Font::getCharCodeAt(p, &code);
-        Glyph *glyph = m_font[size].getGlyph(code);
-        if( glyph )
+        w += m_font[size].getAdvance(code);
+    }
+    return w;
+}
+
+// -----------------------------------------------------------------------------
+//  画像の１行 src のピクセル i1～i2 を、フレームバッファの行 dst の x+i1～x+i2 に写す
+//  (画面内に切り取り済み)。mask があれば、0 のピクセルは写さない
+//  x が偶数でマスクがなければ、両端の半端なニブル以外は memcpy() で写す
+//  x が奇数のときは、隣り合う２バイトからニブルをずらして１バイトを作る
+// -----------------------------------------------------------------------------
+void SSD1322::drawImageRow(uint8_t *dst, const uint8_t *src, const uint8_t *mask, int16_t x, int16_t i1, int16_t i2)
+{
+    int16_t p1 = x + i1;
+    int16_t p2 = x + i2;
+    if( !mask && !(x & 1) )
+    {
+        if( p1 & 1 )
+        {
+            dst[p1 / 2] = (dst[p1 / 2] & 0xF0) | (src[i1 / 2] & 0x0F);
+            p1++;
+            i1++;
+        }
+        if( !(p2 & 1) && p1 <= p2 )
         {
-            w += glyph->getAdvance();
+            dst[p2 / 2] = (dst[p2 / 2] & 0x0F) | (src[i2 / 2] & 0xF0);
+            p2--;
+        }
+        if( p1 < p2 )
+        {
+            memcpy(dst + p1 / 2, src + i1 / 2, (p2 - p1 + 1) / 2);
+        }
+        return;
+    }
+    for( int16_t p = p1 & ~1 ; p <= p2 ; p += 2 )
+    {
+        // フレームバッファの１バイト(ピクセル p と p+1)に入る画像のピクセル
+        int16_t i = p - x;
+        uint8_t data = 0;
+        uint8_t m = 0;
+        if( p1 <= p && (!mask || (mask[i / 8] & (0x80 >> (i % 8)))) )
+        {
+            data |= (x & 1)? (src[i / 2] << 4) : (src[i / 2] & 0xF0);
+            m |= 0xF0;
+        }
+        if( p + 1 <= p2 && (!mask || (mask[(i + 1) / 8] & (0x80 >> ((i + 1) % 8)))) )
+        {
+            data |= (x & 1)? (src[(i + 1) / 2] >> 4) : (src[(i + 1) / 2] & 0x0F);
+            m |= 0x0F;
+        }
+        if( m == 0xFF )
+        {
+            dst[p / 2] = data;
+        }
+        else if( m )
+        {
+            dst[p / 2] = (dst[p / 2] & ~m) | data;
         }
     }
-    return w;
 }
 
+// -----------------------------------------------------------------------------
+//  画面の外は最初にまとめて切り捨て、行ごとに drawImageRow() で写す
+//  ポップアップに隠れる行は、ポップアップの左右に分けて写す
 // -----------------------------------------------------------------------------
 void SSD1322::drawImage(int16_t x, int16_t y, Image *image)
 {
-    int16_t w = image->getWidth();
-    int16_t h = image->getHeight();
-    for( int j = 0 ; j < h ; j++ )
+    int16_t i1 = max(0, -x);
+    int16_t i2 = min(image->getWidth(), m_width - x) - 1;
+    int16_t j1 = max(0, -y);
+    int16_t j2 = min(image->getHeight(), m_height - y) - 1;
+    if( !m_buf || i2 < i1 || j2 < j1 )
     {
-        for( int i = 0 ; i < w ; i++ )
+        return;
+    }
+    Rectangle& rc = m_popup_rect;
+    bool popup = !rc.isEmpty() && !m_popup_drawing && x + i1 <= rc.right() && rc.left <= x + i2;
+    for( int16_t j = j1 ; j <= j2 ; j++ )
+    {
+        uint8_t *dst = m_buf + (y + j) * m_stride;
+        const uint8_t *src = image->getRow(j);
+        const uint8_t *mask = image->getMaskRow(j);
+        if( popup && rc.top <= y + j && y + j <= rc.bottom() )
         {
-            drawPixel(x+i, y+j, image->getPixel(i, j));
+            if( x + i1 < rc.left )
+            {
+                drawImageRow(dst, src, mask, x, i1, rc.left - 1 - x);
+            }
+            if( rc.right() < x + i2 )
+            {
+                drawImageRow(dst, src, mask, x, rc.right() + 1 - x, i2);
+            }
+            continue;
         }
+        drawImageRow(dst, src, mask, x, i1, i2);
     }
 }
 
@@ -906,15 +1901,20 @@ bool SSD1322::getPopupRectAddress(int16_t y, uint32_t& start, uint32_t& end)
 }
 
 // ---------------------------------------------------------------------------
-void SSD1322::drawScrollText(int row, int16_t x, int16_t y, ScrollText *text)
+//  マーキーのビューポートを現在のスクロール位置で描く(ポップアップに隠れる部分は描かない)
+// ---------------------------------------------------------------------------
+void SSD1322::drawMarquee(MarqueeRegion *region)
 {
-    int16_t width = text->getViewportWidth() / 2;
+    Rectangle& rc = region->getRect();
+    int16_t width = rc.width / 2;
+    uint8_t data[MarqueeRegion::MAX_VIEWPORT_WIDTH / 2];
     uint32_t s, e;
-    for( int16_t j = 0 ; j < ScrollText::VIEWPORT_HEIGHT ; j++ )
+    for( int16_t j = 0 ; j < rc.height && rc.top + j < m_height ; j++ )
     {
-        uint32_t addr = (y+j)*m_stride + x/2;
-        uint8_t *data = text->getLineData(row, j);
-        if( getPopupRectAddress(y+j, s, e) )
+        int16_t y = rc.top + j;
+        uint32_t addr = y*m_stride + rc.left/2;
+        region->expandLine(j, data);
+        if( getPopupRectAddress(y, s, e) )
         {
             for( int16_t i = 0 ; i < width ; i++, addr++ )
             {
@@ -941,50 +1941,383 @@ void SSD1322::clear(uint8_t color)
 //------------------------------------------------------------------------------
 void SSD1322::display(void)
 {
+    // 画面全体を比べるので、予約していた領域は不要になる
+    m_dirty_count = 0;
+    Rectangle rc(0, 0, m_width, m_height);
+    uint32_t windows = 0;
+    m_stat_frames++;
+    m_stat_frame_sent += writeDiff(rc, windows);
+    m_shadow_valid[m_page] = true;
+}
+
+// -----------------------------------------------------------------------------
+//  フレームバッファを表示していないページに送ってから、表示開始行を切り替えて
+//  そのページを表示する(描いている途中が見えない)
+//  direction が 0 なら一度に切り替え、正なら新しいページが下から、負なら上から
+//  スライドして入ってくる(flush() のたびに表示開始行を動かす)
+//  以降の描画は新しいページに送る
+// -----------------------------------------------------------------------------
+void SSD1322::flipPage(int direction)
+{
+    if( m_slide_step )
+    {
+        // 前のスライドが終わっていなければ、先に終わらせる(両方のページが見えているため)
+        m_start_line = m_page * m_height;
+        setStartRow(m_start_line);
+        m_slide_step = 0;
+    }
+    m_page = (m_page + 1) % NUM_PAGES;
+    display();
+    if( direction == 0 )
+    {
+        m_start_line = m_page * m_height;
+        setStartRow(m_start_line);
+    }
+    else
+    {
+        m_slide_step = (direction > 0)? SLIDE_STEP : -SLIDE_STEP;
+        m_slide_tick = millis();
+        updateSlide();
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  スライド中なら、時刻になっていれば表示開始行を m_slide_step 行動かす
+//  (コマンド１つと１バイトだけなので、ほとんど転送の手間はかからない)
+// -----------------------------------------------------------------------------
+void SSD1322::updateSlide()
+{
+    if( !m_slide_step || millis() < m_slide_tick )
+    {
+        return;
+    }
+    int16_t target = m_page * m_height;
+    int16_t rest = (m_slide_step > 0)? (target - m_start_line) : (m_start_line - target);
+    rest = (rest + SSD1322_COM_COUNT) % SSD1322_COM_COUNT;
+    if( rest <= abs(m_slide_step) )
+    {
+        m_start_line = target;
+        m_slide_step = 0;
+    }
+    else
+    {
+        m_start_line = (m_start_line + m_slide_step + SSD1322_COM_COUNT) % SSD1322_COM_COUNT;
+        m_slide_tick += SLIDE_INTERVAL;
+    }
+    setStartRow(m_start_line);
+}
+
+// -----------------------------------------------------------------------------
+//  パネルへの転送速度を測ってシリアルに出力する(フレームバッファの内容を frames 回送る)
+//  比較のため、１バイトずつ writeData() で送った場合も１フレームだけ測る
+// -----------------------------------------------------------------------------
+void SSD1322::benchmark(int frames)
+{
+    uint32_t size = m_stride * m_height;
     setColumnRange(m_startCol, m_endCol);
-    setRowRange(0, m_height - 1);
-        
+    setRowRange(m_page * m_height, m_page * m_height + m_height - 1);
     writeCmd(SSD1322_CMD_WRITE_RAM);
+    uint32_t start = micros();
+    for( uint32_t i = 0 ; i < size ; i++ )
+    {
+        writeData(m_buf[i]);
+    }
+    uint32_t single = micros() - start;
+
+    start = micros();
+    for( int n = 0 ; n < frames ; n++ )
+    {
+        // 差分がなくても毎回すべて送らせる
+        m_shadow_valid[m_page] = false;
+        display();
+    }
+    uint32_t burst = micros() - start;
+
+    Serial.print("oled: writeData ");
+    Serial.print(single? (uint32_t)((uint64_t)size * 1000000 / single) : 0, DEC);
+    Serial.print(" bytes/s, writeDataBlock ");
+    Serial.print(burst? (uint32_t)((uint64_t)size * frames * 1000000 / burst) : 0, DEC);
+    Serial.print(" bytes/s (");
+    Serial.print(burst / (frames? frames : 1), DEC);
+    Serial.print(" us/frame, E ");
+    Serial.print(m_ePsr? "PSR" : "digitalWrite");
+    Serial.print(", wait ");
+    Serial.print(m_strobe_wait, DEC);
+    Serial.println(" loop(s))");
+}
 
-    for (int y = 0; y < m_height; y++)
+// -----------------------------------------------------------------------------
+//  描画の速度を測ってシリアルに出力する(フレームバッファの内容は消える)
+//  drawPixel() で１ピクセルずつ塗った場合と fillRect() を比べる
+//  画面全体と、スペクトラムのバー(7本)をそれぞれ count 回塗る
+// -----------------------------------------------------------------------------
+void SSD1322::benchmarkDraw(int count)
+{
+    static const int16_t BAR_X = 207, BAR_PITCH = 7, BAR_W = 6, BAR_Y = 40, BAR_H = 22;
+    uint32_t t[4];
+    uint32_t start = micros();
+    for( int n = 0 ; n < count ; n++ )
     {
-        uint32_t addr = y * m_stride;
-        for (int s = 0; s < m_stride; s++)
+        for( int16_t y = 0 ; y < m_height ; y++ )
         {
-            writeData(m_buf[addr++]);
+            for( int16_t x = 0 ; x < m_width ; x++ )
+            {
+                drawPixel(x, y, n);
+            }
+        }
+    }
+    t[0] = micros() - start;
+
+    start = micros();
+    for( int n = 0 ; n < count ; n++ )
+    {
+        fillRect(0, 0, m_width, m_height, n);
+    }
+    t[1] = micros() - start;
+
+    start = micros();
+    for( int n = 0 ; n < count ; n++ )
+    {
+        for( int ch = 0 ; ch < 7 ; ch++ )
+        {
+            for( int16_t y = BAR_Y ; y < BAR_Y + BAR_H ; y++ )
+            {
+                for( int16_t x = BAR_X + ch * BAR_PITCH ; x < BAR_X + ch * BAR_PITCH + BAR_W ; x++ )
+                {
+                    drawPixel(x, y, n);
+                }
+            }
         }
-    }  
+    }
+    t[2] = micros() - start;
+
+    start = micros();
+    for( int n = 0 ; n < count ; n++ )
+    {
+        for( int ch = 0 ; ch < 7 ; ch++ )
+        {
+            fillRect(BAR_X + ch * BAR_PITCH, BAR_Y, BAR_W, BAR_H, n);
+        }
+    }
+    t[3] = micros() - start;
+
+    static const char *names[4] = {"screen drawPixel ", ", fillRect ", "; bars drawPixel ", ", fillRect "};
+    Serial.print("oled: ");
+    for( int i = 0 ; i < 4 ; i++ )
+    {
+        Serial.print(names[i]);
+        Serial.print(t[i] / (count? count : 1), DEC);
+        Serial.print(" us");
+    }
+    Serial.println();
+    clear(0);
 }
 
-//------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------
+//  領域を画面に送るよう予約する。実際に送るのは flush() を呼んだとき
+//  領域は 4ピクセル(1カラム)単位に広げ、画面の外は切り捨てる
+// -----------------------------------------------------------------------------
 void SSD1322::invalidateRect(int16_t left, int16_t top, int16_t w, int16_t h)
 {
-    int col_l = m_startCol + left/4;        // 領域の左端（を含む）カラムのアドレス
-    int col_r = m_startCol + (left + w)/4;  // 領域の右端（を含む）カラムのアドレス
-    if( col_r > m_endCol )
+    int16_t right = min(left + w - 1, m_width - 1) | 3;
+    int16_t bottom = min(top + h - 1, m_height - 1);
+    left = max(left, 0) & ~3;
+    top = max(top, 0);
+    if( right < left || bottom < top )
     {
-        col_r = m_endCol;
+        return;
     }
-    setColumnRange(col_l, col_r);
-    
-    int16_t bottom = top + h;
-    setRowRange(top, bottom-1);
+    Rectangle rc(left, top, right - left + 1, bottom - top + 1);
+    m_stat_requests++;
+    m_stat_requested += getRectBytes(rc);
+    addDirtyRect(rc);
+}
+
+// -----------------------------------------------------------------------------
+void SSD1322::invalidateRect(Rectangle& rc)
+{
+    invalidateRect(rc.left, rc.top, rc.width, rc.height);
+}
+
+// -----------------------------------------------------------------------------
+//  予約済みの領域に rc を加える
+//  重なるか接する領域は、まとめても余分に送るバイト数が WINDOW_COST 以下であれば
+//  １つにまとめる。空きがなければ、まとめたときの増分が最も小さい領域とまとめる
+// -----------------------------------------------------------------------------
+void SSD1322::addDirtyRect(Rectangle& rc)
+{
+    Rectangle r = rc;
+    bool merged = true;
+    while( merged )
+    {
+        merged = false;
+        for( uint8_t i = 0 ; i < m_dirty_count ; i++ )
+        {
+            Rectangle& d = m_dirty[i];
+            if( r.left > d.right() + 1 || d.left > r.right() + 1 || r.top > d.bottom() + 1 || d.top > r.bottom() + 1 )
+            {
+                continue;
+            }
+            Rectangle u = r;
+            u.unionWith(d);
+            if( getRectBytes(u) <= getRectBytes(r) + getRectBytes(d) + WINDOW_COST )
+            {
+                r = u;
+                m_dirty[i] = m_dirty[--m_dirty_count];
+                merged = true;
+                break;
+            }
+        }
+    }
+    if( m_dirty_count < MAX_DIRTY_RECTS )
+    {
+        m_dirty[m_dirty_count++] = r;
+        return;
+    }
+    uint8_t best = 0;
+    int32_t best_growth = 0;
+    for( uint8_t i = 0 ; i < m_dirty_count ; i++ )
+    {
+        Rectangle u = r;
+        u.unionWith(m_dirty[i]);
+        int32_t growth = getRectBytes(u) - getRectBytes(m_dirty[i]);
+        if( i == 0 || growth < best_growth )
+        {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    m_dirty[best].unionWith(r);
+}
 
+// -----------------------------------------------------------------------------
+//  ワード(4バイト = 8ピクセル)単位の範囲 left～right、行 top～bottom を m_page のページに送り
+//  m_shadow にも写す。戻り値は送ったバイト数
+// -----------------------------------------------------------------------------
+uint32_t SSD1322::writeWindow(int16_t left, int16_t right, int16_t top, int16_t bottom)
+{
+    uint16_t length = (right - left + 1) * 4;
+    uint8_t *shadow = m_shadow + m_page * m_stride * m_height;
+    setColumnRange(m_startCol + left * 2, m_startCol + right * 2 + 1);
+    setRowRange(m_page * m_height + top, m_page * m_height + bottom);
     writeCmd(SSD1322_CMD_WRITE_RAM);
-    int start_byte = (left/4)*2;                // 水平方向のアドレス（バイト単位）のオフセット
-    int byte_len   = (col_r - col_l + 1) * 2;   // 水平方向のバイト長
-    for( int y = top ; y < bottom ; y++ )
+    for( int16_t y = top ; y <= bottom ; y++ )
     {
-        uint32_t addr = y * m_stride + start_byte;
-        for( int b = 0 ; b < byte_len ; b++, addr++ )
+        uint32_t addr = y * m_stride + left * 4;
+        writeDataBlock(m_buf + addr, length);
+        memcpy(shadow + addr, m_buf + addr, length);
+    }
+    return (uint32_t)length * (bottom - top + 1);
+}
+
+// -----------------------------------------------------------------------------
+//  領域(4ピクセル単位に揃っていること)のうち、m_page のページの内容(m_shadow)と違う部分だけを送る
+//  行ごとに 32bit ずつ比べて変わった範囲を求め、続く行はまとめても余分に送るバイト数が
+//  WINDOW_COST 以下であれば１つの転送領域にまとめる
+//  (m_buf、m_shadow は malloc() で確保し、m_stride は 4 の倍数なので、ワード単位で読める)
+//  戻り値は送ったバイト数。windows には設定した転送領域の数を加える
+// -----------------------------------------------------------------------------
+uint32_t SSD1322::writeDiff(Rectangle& rc, uint32_t& windows)
+{
+    int16_t first = rc.left / 8;
+    int16_t last = rc.right() / 8;
+    int16_t band_top = -1;
+    int16_t band_bottom = 0;
+    int16_t band_left = 0;
+    int16_t band_right = 0;
+    uint32_t sent = 0;
+    for( int16_t y = rc.top ; y <= rc.bottom() ; y++ )
+    {
+        int16_t l = first;
+        int16_t r = last;
+        if( m_shadow_valid[m_page] )
         {
-            writeData(m_buf[addr]);
+            const uint32_t *a = (const uint32_t *)(m_buf + y * m_stride);
+            const uint32_t *b = (const uint32_t *)(m_shadow + (m_page * m_height + y) * m_stride);
+            while( l <= r && a[l] == b[l] )
+            {
+                l++;
+            }
+            while( r >= l && a[r] == b[r] )
+            {
+                r--;
+            }
+            if( r < l )
+            {
+                continue;
+            }
         }
+        if( band_top >= 0 )
+        {
+            int16_t ul = min(l, band_left);
+            int16_t ur = max(r, band_right);
+            int32_t merged = (int32_t)(ur - ul + 1) * (y - band_top + 1);
+            int32_t separate = (int32_t)(band_right - band_left + 1) * (band_bottom - band_top + 1) + (r - l + 1);
+            if( merged * 4 <= separate * 4 + WINDOW_COST )
+            {
+                band_left = ul;
+                band_right = ur;
+                band_bottom = y;
+                continue;
+            }
+            sent += writeWindow(band_left, band_right, band_top, band_bottom);
+            windows++;
+        }
+        band_top = band_bottom = y;
+        band_left = l;
+        band_right = r;
+    }
+    if( band_top >= 0 )
+    {
+        sent += writeWindow(band_left, band_right, band_top, band_bottom);
+        windows++;
     }
+    return sent;
 }
-void SSD1322::invalidateRect(Rectangle& rc)
+
+// -----------------------------------------------------------------------------
+//  予約した領域をまとめて送る。loop() の最後に１回呼ぶ
+// -----------------------------------------------------------------------------
+void SSD1322::flush()
 {
-    invalidateRect(rc.left, rc.top, rc.width, rc.height);
+    for( uint8_t i = 0 ; i < m_dirty_count ; i++ )
+    {
+        m_stat_sent += writeDiff(m_dirty[i], m_stat_windows);
+    }
+    m_dirty_count = 0;
+    updateSlide();
+}
+
+// -----------------------------------------------------------------------------
+//  invalidateRect() の領域をまとめた効果と、display() で差分だけ送った効果を
+//  シリアルに出力する
+// -----------------------------------------------------------------------------
+void SSD1322::printFlushStats()
+{
+    Serial.print("oled: ");
+    Serial.print(m_stat_requests, DEC);
+    Serial.print(" rect(s) sent as ");
+    Serial.print(m_stat_windows, DEC);
+    Serial.print(" window(s), ");
+    Serial.print(m_stat_requested, DEC);
+    Serial.print(" bytes requested, ");
+    Serial.print(m_stat_sent, DEC);
+    Serial.println(" bytes sent");
+    Serial.print("oled: ");
+    Serial.print(m_stat_frames, DEC);
+    Serial.print(" frame(s), ");
+    Serial.print(m_stat_frame_sent, DEC);
+    Serial.print(" of ");
+    Serial.print(m_stat_frames * m_stride * m_height, DEC);
+    Serial.println(" bytes sent");
+}
+
+// -----------------------------------------------------------------------------
+void SSD1322::printFontStats()
+{
+    m_font[FONT_TINY ].printStats("tiny");
+    m_font[FONT_SMALL].printStats("small");
+    m_font[FONT_LARGE].printStats("large");
 }
 
 // -----------------------------------------------------------------------------
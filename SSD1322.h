@@ -3,7 +3,12 @@
 
 #include <Arduino.h>
 #include <SD.h>
+#include "block_cache.h"
+#include "font_format.h"
 
+// -----------------------------------------------------------------------------
+//  グリフのビットマップは行優先で、１行を m_pitch バイトに詰めて持つ
+//  (各バイトの最上位ビットが左端のピクセル)
 // -----------------------------------------------------------------------------
 class Glyph
 {
@@ -13,8 +18,9 @@ class Glyph
         int16_t  m_height;
         int16_t  m_offset;
         int16_t  m_advance;
+        int16_t  m_pitch;
         // bool     m_anti_alias;
-        uint16_t *m_data;
+        const uint8_t *m_data;
 
     public:
         enum
@@ -26,33 +32,118 @@ class Glyph
         // static const int16_t HEIGHT[2];
         // enum{HEIGHT = 16};
         Glyph();
-        void load(File f, int16_t height);
+        void set(const FontGlyphRecord& r, int16_t height, const uint8_t *bitmap);
         uint16_t getCode(){ return m_code; }
         int16_t  getWidth(){ return m_width; }
         int16_t  getHeight(){ return m_height; }
         int16_t  getOffset(){ return m_offset; }
         int16_t  getAdvance(){ return m_advance; }
-        uint16_t *getData(){ return m_data; }
+        int16_t  getPitch(){ return m_pitch; }
+        const uint8_t *getRow(int16_t y){ return m_data + y * m_pitch; }
         uint8_t  getPixel(int16_t x, int16_t y);
 };
 
+// -----------------------------------------------------------------------------
+//  フォント(v2)
+//  索引とグリフテーブル(目次)だけをメモリに置き、ビットマップは初めて使うときに
+//  SDカードから読み込んで、cache_bytes バイト以内のキャッシュ(LRU)に置く
+//  getGlyph() で得た Glyph は、次に getGlyph() か prefetch() を呼ぶまで有効
 // -----------------------------------------------------------------------------
 class Font
 {
     private:
-        enum{MAX_GLYPH_NUM = 1023};
-        Glyph  m_glyph[MAX_GLYPH_NUM];
-        Glyph *m_hash_table[MAX_GLYPH_NUM];
+        enum{MAX_PREFETCH = 64};        // prefetch() で一度に読み込むグリフの数
+        struct Slot
+        {
+            Glyph    glyph;
+            uint32_t index;             // グリフテーブル内の番号
+            uint32_t used;              // 最後に使った順番(0 は未使用)
+            uint8_t  *bitmap;
+        };
+        // 文字コードの上位バイトごとのページ。下位バイトの文字があるかどうかをビットで持ち、
+        // グリフテーブル内の番号は base + (そのビットより前にある 1 の数) で求める
+        struct Page
+        {
+            uint32_t base;              // このページの最初のグリフのグリフテーブル内の番号
+            uint32_t bits[8];
+            uint8_t  rank[8];           // bits[n] より前のワードにある 1 の数
+        };
+        CachedFile m_file;
+        uint8_t  *m_directory;          // ファイルの先頭から bitmap_offset まで
+        FontHeader *m_header;
+        const FontGlyphRecord *m_records;   // 文字コードの昇順
+        uint8_t  m_page_of[256];        // 上位バイトごとの m_pages の番号(文字のないものは空のページ)
+        Page     *m_pages;
+        uint16_t *m_slot_of;            // グリフごとのスロットの番号 + 1 (0 はキャッシュにない)
+        Slot     *m_slots;
+        uint16_t m_slot_count;
+        uint32_t m_clock;
+        uint32_t m_hits;
+        uint32_t m_misses;
         // bool m_anti_alias;
-        void insert_to_hash(Glyph *g);
+        bool     buildPages(const uint32_t *lookup);
+        Slot    *fetch(uint32_t index);
+        void     touch(uint32_t index, uint32_t *missing, uint16_t& count);
+        void     fetchAll(uint32_t *missing, uint16_t count);
     public:
         Font();
-        void load(const char *path, int16_t height); //, bool anti_alias=false);
+        void load(const char *path, uint32_t cache_bytes); //, bool anti_alias=false);
+        int32_t find(uint16_t code);
         Glyph *getGlyph(uint16_t code);
+        Glyph *getGlyphAt(uint32_t index);
+        int16_t getAdvance(uint16_t code);
+        int16_t getAdvanceAt(uint32_t index){ return m_records[index].advance; }
+        void prefetch(const char *text);
+        void prefetch(const uint16_t *indices, uint16_t count);
+        void printStats(const char *name);
         // bool isAntiAlias(){ return m_anti_alias; }
         static char *getCharCodeAt(char *p, uint16_t *code);
 };
 
+// -----------------------------------------------------------------------------
+//  文字列をグリフテーブル内の番号の列にしたもの(UTF-8 の解釈とグリフの検索が済んだもの)
+// -----------------------------------------------------------------------------
+struct ShapedText
+{
+    enum{MAX_GLYPHS = 128};
+    enum{MAX_BYTES = MAX_GLYPHS * 3};   // UTF-8 で MAX_GLYPHS 文字ぶん
+    Font     *font;             // NULL は未使用
+    uint32_t hash;              // 文字列のハッシュ値
+    uint16_t length;            // 文字列のバイト数
+    uint16_t count;
+    int16_t  width;             // 送り幅の合計
+    uint32_t used;              // 最後に使った順番
+    uint16_t glyphs[MAX_GLYPHS];
+    char     text[MAX_BYTES];   // 元の文字列(ハッシュが衝突しても取り違えないように比べる)
+};
+
+// -----------------------------------------------------------------------------
+//  ShapedText のキャッシュ(LRU)
+//  同じアーティスト名、曲名などを描くたびに UTF-8 を解釈し直さないようにする
+//  文字列は内容のハッシュ値とバイト数で区別するので、同じバッファを書き換えて使ってもよい
+// -----------------------------------------------------------------------------
+class ShapedTextCache
+{
+    private:
+        enum{NUM_ENTRIES = 16};
+        ShapedText m_entries[NUM_ENTRIES];
+        uint32_t m_clock;
+        uint32_t m_hits;
+        uint32_t m_misses;
+        ShapedTextCache();
+
+    public:
+        friend ShapedTextCache& ShapedTexts();
+        const ShapedText *get(Font *font, const char *text);
+        void printStats();
+};
+
+ShapedTextCache& ShapedTexts();
+
+// -----------------------------------------------------------------------------
+//  4bpp の画像(行優先、１行は幅/2 バイト)
+//  setTransparentColor() で透明色を決めると、その色のピクセルは描かない
+//  (1bpp のマスクを作る。各バイトの最上位ビットが左端のピクセルで、1 が不透明)
 // -----------------------------------------------------------------------------
 class Image
 {
@@ -60,12 +151,16 @@ class Image
         int16_t m_width;
         int16_t m_height;
         uint8_t *m_data;
+        uint8_t *m_mask;
     public:
         Image();
-        void load(File f);
+        void load(CachedFile& f);
         int16_t getWidth(){ return m_width; }
         int16_t getHeight(){ return m_height; }
         uint8_t getPixel(int16_t x, int16_t y);
+        const uint8_t *getRow(int16_t y){ return m_data + y * (m_width / 2); }
+        const uint8_t *getMaskRow(int16_t y){ return m_mask? (m_mask + y * ((m_width + 7) / 8)) : NULL; }
+        void setTransparentColor(uint8_t color);
 };
 
 // -----------------------------------------------------------------------------
@@ -81,16 +176,20 @@ class ImageList
         int16_t getImageWidth();
         int16_t getImageHeight();
         Image *getImage(int16_t index);
+        void setTransparentColor(uint8_t color);
 };
 
 // -----------------------------------------------------------------------------
 #define SSD1322_SEG_COUNT 480
+#define SSD1322_COM_COUNT 128   // GDDRAM の行数(画面は 64 行なので２ページ分ある)
 
 #define SSD1322_WHITE 0x0F
 #define SSD1322_BLACK 0x00
 
 #define SSD1322_DEPTH 4  // 4 bits per pixel
 
+#define SSD1322_GLYPH_CACHE_BYTES 16384     // フォントごとのグリフのキャッシュの大きさ
+
 enum SSD1322_Mode
 {
     SSD1322_MODE_NORMAL,
@@ -176,104 +275,83 @@ class Rectangle
 };
 
 // -----------------------------------------------------------------------------
-class ScrollLineBuffer
+//  横にスクロールするテキストの領域(マーキー)
+//  テキストは 1bpp で行ごとに持ち(各バイトの最上位ビットが左端)、描くときに
+//  表示する範囲だけをフレームバッファの形式(4bpp)に展開する
+//  スクロール中は、テキストの後ろにビューポート幅の空白を置いて先頭に戻る
+//  スクロールの時刻の管理は Marquee がまとめて行う
+// -----------------------------------------------------------------------------
+class MarqueeRegion
 {
-    private:
-        enum{BUFFER_SIZE = 1024};       // バッファの横幅(バイト単位、１バイトで横２ピクセル分)
-        // m_buffer[0] : 偶数オリジンでニブル単位でピクセルデータを格納
-        // m_buffer[1] : 奇数オリジンでニブル単位でピクセルデータを格納(先頭ピクセルは格納しない)
-        uint8_t *m_buffer[2];
+    friend class Marquee;
     public:
-        ScrollLineBuffer(){
-            m_buffer[0] = (uint8_t *)malloc(BUFFER_SIZE);
-            m_buffer[1] = (uint8_t *)malloc(BUFFER_SIZE);
-            clear();
-        }
-        void clear(){
-            memset(m_buffer[0], 0x00, BUFFER_SIZE);
-            memset(m_buffer[1], 0x00, BUFFER_SIZE);
-        }
-        void setPixel(int16_t x, uint8_t color){
-
-            //           x   0   1   2   3   4   5   6   7
-            // m_buffer[0] [HH  LL][HH  LL][HH  LL][HH  LL]...
-            // m_buffer[0]     [HH  LL][HH  LL][HH  LL][HH ... 
-
-            // x が偶数の場合は m_buffer[0][x/2]     の上位ニブルに書き込む
-            //                  m_buffer[1][(x-1)/2] の下位ニブルに書き込む
-            // x が奇数の場合は m_buffer[0][x/2]     の下位ニブルに書き込む
-            //                  m_buffer[1][(x-1)/2] の上位ニブルに書き込む
-
-            if( !color ){ return; }
-            if( x % 2 )
-            {
-                m_buffer[0][x/2] |= (color & 0x0F);
-                m_buffer[1][(x-1)/2] |= ((color << 4) & 0xF0);
-            }
-            else
-            {
-                m_buffer[0][x/2] |= ((color << 4) & 0xF0);
-                if( x > 0 )
-                {
-                    m_buffer[1][(x-1)/2] |= (color & 0x0F);
-                }
-            }
-        }
-        uint8_t getPixel(int16_t x){
-            return (m_buffer[0][x/2] & ((x % 2)? 0x0F : 0xF0))? 0x0F : 0x00; 
-        }
-        
-        uint8_t *getDataPtr(int16_t x){
-            if( x % 2 )
-            {
-                return &m_buffer[1][(x-1)/2];
-            }
-            else
-            {
-                return &m_buffer[0][x/2];
-            }
-        }
-};
+        enum{VIEWPORT_HEIGHT = 16};
+        enum{MAX_VIEWPORT_WIDTH = 256};
 
-class ScrollText
-{
     private:
-        enum{SCROLL_INTERVAL = 40};
+        enum{MAX_TEXT_WIDTH = 1024};    // テキストの幅の上限(ピクセル)。超えた部分は描かない
+        enum{LINE_BYTES = MAX_TEXT_WIDTH / 8 + 1};  // 展開するときに１バイト先まで読むので１バイト余分に持つ
         enum{PAUSE_TIMEOUT = 4000};
         enum
         {
-            STATE_STATIC   = 0,     // 上段、下段とも静止表示している状態
-            STATE_SCROLL_1 = 1,     // 上段がスクロール表示中
-            STATE_SCROLL_2 = 2      // 下段がスクロール表示中
+            STATE_IDLE   = 0,       // 静止表示(スクロールの順番待ち)
+            STATE_PAUSE  = 1,       // 先頭を表示したまま、スクロールを始めるのを待っている
+            STATE_SCROLL = 2        // スクロール表示中
         };
 
-        int16_t   m_viewport_width;     // ビューポート（実際に画面に表示させる範囲）の幅（ピクセル単位。必ず偶数を指定する）
-        ScrollLineBuffer m_buffer[32];  
-        int16_t   m_text_width[2];      // テキストの描画サイズ([上段、下段])。これが m_viewport_width 以下であればスクロールは機能させず、常時静的表示のみとなる
-        int       m_scroll_state;       // STATE_??? のいずれか
-        uint32_t  m_next_tick;          // 次に描画する時刻(msec)
-        int       m_offset;             // スクロール表示中の領域で、次に描画する際の先頭(左端)位置
-
-        bool needScroll(int row){
-            return m_text_width[row] > m_viewport_width;
-        }
-        bool isScrolling(int row){
-            return ((row == 0) && (m_scroll_state == STATE_SCROLL_1)) || ((row == 1) && (m_scroll_state == STATE_SCROLL_2)); 
-        }
+        Rectangle m_rect;               // ビューポート（実際に画面に表示させる範囲。left と width は必ず偶数を指定する）
+        uint8_t   m_color;              // テキストの色
+        uint8_t   m_bg_color;           // 背景の色
+        uint8_t   m_group;              // 同じグループ(0 以外)の領域は、登録した順に１つずつスクロールする
+        uint8_t   m_step;               // １ティックで進めるピクセル数
+        uint16_t  m_pause;              // スクロールを始めるまでの時間(msec)
+        uint8_t   m_state;              // STATE_??? のいずれか
+        uint32_t  m_next_tick;          // STATE_PAUSE を終える時刻(msec)
+        int16_t   m_offset;             // 次に描画する際の先頭(左端)位置
+        int16_t   m_ink_width;          // テキストそのものの幅
+        int16_t   m_text_width;         // テキストの描画サイズ。これが m_rect.width 以下であればスクロールは機能させず、常時静的表示のみとなる
+        uint8_t   m_lines[VIEWPORT_HEIGHT][LINE_BYTES];
+
+        int16_t drawGlyph(int16_t x, Glyph *glyph);
 
     public:
-        enum{VIEWPORT_HEIGHT = 16};
-        ScrollText();
-        void init(int16_t width);
-        void setText(int row, const char *text, Font *font);
-        int16_t getViewportWidth(){ return m_viewport_width; }
-        void startScroll();
-        int updateScroll();
-        // uint8_t getPixel(int row, int16_t dx, int16_t dy);
-        uint8_t *getLineData(int row, int16_t dy);
+        MarqueeRegion();
+        void init(int16_t x, int16_t y, int16_t width, uint8_t group = 0);
+        void setColor(uint8_t color, uint8_t bg_color){ m_color = color; m_bg_color = bg_color; }
+        void setSpeed(uint8_t step, uint16_t pause){ m_step = step; m_pause = pause; }
+        void setText(const char *text, Font *font);
+        bool needScroll(){ return m_text_width > m_rect.width; }
+        Rectangle& getRect(){ return m_rect; }
+        void expandLine(int16_t dy, uint8_t *data);
+};
+
+class SSD1322;
 
+// -----------------------------------------------------------------------------
+//  登録されたマーキーを１つのタイマーで進める
+//  １ティックで描き換えた領域は、まとめて１つの矩形として invalidateRect() する
+// -----------------------------------------------------------------------------
+class Marquee
+{
+    private:
+        enum{MAX_REGIONS = 8};
+        enum{TICK_INTERVAL = 40};
+        MarqueeRegion *m_regions[MAX_REGIONS];
+        uint8_t   m_count;
+        uint32_t  m_next_tick;
+
+        bool isGroupBusy(uint8_t group);
+        void startNext(uint8_t index, uint32_t now);
+
+    public:
+        Marquee();
+        bool add(MarqueeRegion *region);
+        void remove(MarqueeRegion *region);
+        void update(SSD1322 *oled);
 };
 
+Marquee& Marquees();
+
 // -----------------------------------------------------------------------------
 class SSD1322
 {
@@ -288,6 +366,10 @@ class SSD1322
         int m_rwPin;
 
         uint8_t *m_buf;
+        enum{NUM_PAGES = SSD1322_COM_COUNT / 64};
+        uint8_t *m_shadow;      // パネルの GDDRAM に送った内容の写し(ページごとに m_stride * m_height バイト)
+        bool m_shadow_valid[NUM_PAGES];     // false のときは m_shadow を使わずにすべて送る
+        uint8_t m_page;         // 表示しているページ(フレームバッファはこのページに送る)
         int m_stride;
 
         int m_startCol;  // First displayed column of each row
@@ -299,8 +381,35 @@ class SSD1322
         // bool m_popup_visible;
         bool m_popup_drawing;
 
+        enum{MAX_BLIT_WIDTH = 24};  // drawGlyph() で描けるグリフの幅(これより広ければ１ピクセルずつ描く)
+
+        enum{MAX_DIRTY_RECTS = 8};
+        enum{WINDOW_COST = 32};     // 転送領域を設定するコマンドの手間(データのバイト数に換算)
+        Rectangle m_dirty[MAX_DIRTY_RECTS];     // まだ送っていない領域(4ピクセル単位に揃えてある)
+        uint8_t   m_dirty_count;
+        uint32_t  m_stat_requests;  // invalidateRect() が呼ばれた回数
+        uint32_t  m_stat_windows;   // flush() で実際に送った領域の数
+        uint32_t  m_stat_requested; // invalidateRect() の領域をそのまま送った場合のバイト数
+        uint32_t  m_stat_sent;      // flush() で実際に送ったバイト数
+        uint32_t  m_stat_frames;    // display() が呼ばれた回数
+        uint32_t  m_stat_frame_sent; // display() で実際に送ったバイト数
+
+        enum{SLIDE_STEP = 4};       // スライドで１回に動かす行数
+        enum{SLIDE_INTERVAL = 10};  // スライドで表示開始行を動かす間隔(msec)
+        uint8_t   m_start_line;     // 表示開始行(スライド中はページの途中)
+        int8_t    m_slide_step;     // スライド中は１回に動かす行数(新しいページが下から来るときは正)。止まっていれば 0
+        uint32_t  m_slide_tick;     // 次に表示開始行を動かす時刻(msec)
+
+        volatile uint32_t *m_ePsr;  // E のピンがあるポートの PSR(分からなければ NULL で digitalWrite を使う)
+        uint32_t  m_eHigh;          // E を High にするときに m_ePsr に書く値
+        uint32_t  m_eLow;           // E を Low にするときに m_ePsr に書く値
+        uint16_t  m_strobe_wait;    // E の High/Low を保持するループ回数
+
         void writeCmd(uint8_t c);
         void writeData(uint8_t d);
+        void writeDataBlock(const uint8_t *data, size_t length);
+        void findStrobePort();
+        void calibrateStrobe();
 
         void reset(void);
 
@@ -315,7 +424,18 @@ class SSD1322
         void setStartRow(int r);
         void setOffsetRow(int r);
         uint8_t getPixel(int16_t x, int16_t y);
+        void fillNibbles(int16_t x1, int16_t x2, int16_t y, uint8_t color);
+        void fillSpan(int16_t x1, int16_t x2, int16_t y, uint8_t color);
+        void drawGlyphByPixel(int16_t left, int16_t y, Glyph *glyph, uint8_t color);
+        void drawGlyph(int16_t left, int16_t y, Glyph *glyph, uint8_t color);
+        int16_t drawChar(int16_t x, int16_t y, Glyph *glyph, uint8_t color);
+        void drawImageRow(uint8_t *dst, const uint8_t *src, const uint8_t *mask, int16_t x, int16_t i1, int16_t i2);
         bool getPopupRectAddress(int16_t y, uint32_t& start, uint32_t& end);
+        static int32_t getRectBytes(Rectangle& rc){ return (int32_t)(rc.width / 2) * rc.height; }
+        void addDirtyRect(Rectangle& rc);
+        uint32_t writeWindow(int16_t left, int16_t right, int16_t top, int16_t bottom);
+        uint32_t writeDiff(Rectangle& rc, uint32_t& windows);
+        void updateSlide();
 
     public:
         enum{FONT_SMALL = 0, FONT_LARGE = 1, FONT_TINY = 2};
@@ -339,12 +459,19 @@ class SSD1322
         int16_t drawString(int16_t x, int16_t y, const char *text, uint8_t size, uint8_t color);
         int16_t getTextWidth(const char *text, uint8_t size);
         void drawImage(int16_t x, int16_t y, Image *image);
-        void drawScrollText(int row, int16_t x, int16_t y, ScrollText *text);
+        void drawMarquee(MarqueeRegion *region);
         // void scroll(Rectangle& rect, uint8_t *fill_data, bool refresh);
         void clear(uint8_t color);
         void display(void);
+        void flipPage(int direction = 0);
+        bool isSliding(){ return m_slide_step != 0; }
+        void benchmark(int frames);
+        void benchmarkDraw(int count);
         void invalidateRect(int16_t left, int16_t top, int16_t w, int16_t h);
         void invalidateRect(Rectangle& rc);
+        void flush();
+        void printFlushStats();
+        void printFontStats();
 
         void enablePopup(Rectangle& rc);
         void disablePopup();
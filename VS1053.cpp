@@ -192,7 +192,7 @@ boolean Adafruit_VS1053_FilePlayer::isMP3File(const char *fileName)
     return (strlen(fileName) > 4) && !strcasecmp(fileName + strlen(fileName) - 4, ".mp3");
 }
 
-unsigned long Adafruit_VS1053_FilePlayer::mp3_ID3Jumper(File mp3) 
+unsigned long Adafruit_VS1053_FilePlayer::mp3_ID3Jumper(CachedFile &mp3) 
 {
     char tag[4];
     uint32_t start;
@@ -248,6 +248,18 @@ unsigned long Adafruit_VS1053_FilePlayer::mp3_ID3Jumper(File mp3)
 }
 
 boolean Adafruit_VS1053_FilePlayer::startPlayingFile(const char *trackname) 
+{
+    File track = SD.open(trackname);
+    if (!track) 
+    {
+        Serial.print("Cannot open ");
+        Serial.println(trackname);
+        return false;
+    }
+    return startPlayingFile(track, trackname);
+}
+
+boolean Adafruit_VS1053_FilePlayer::startPlayingFile(File track, const char *trackname) 
 {
     // reset playback
     sciWrite(VS1053_REG_MODE, VS1053_MODE_SM_LINE1 | VS1053_MODE_SM_SDINEW | VS1053_MODE_SM_LAYER12);
@@ -255,13 +267,7 @@ boolean Adafruit_VS1053_FilePlayer::startPlayingFile(const char *trackname)
     sciWrite(VS1053_REG_WRAMADDR, 0x1e29);
     sciWrite(VS1053_REG_WRAM, 0);
 
-    currentTrack = SD.open(trackname);
-    if (!currentTrack) 
-    {
-        Serial.print("Cannot open ");
-        Serial.println(trackname);
-        return false;
-    }
+    currentTrack.attach(track, trackname, BlockCache::STREAM);
 
     // We know we have a valid file. Check if .mp3
     // If so, check for ID3 tag and jump it if present.
@@ -24,6 +24,7 @@ extern SdFat SD;
 #else
 #include <SD.h>
 #endif
+#include "block_cache.h"
 
 // define here the size of a register!
 #if defined(ARDUINO_STM32_FEATHER)
@@ -353,7 +354,7 @@ public:
    * @return Returs true/false for success/failure
    */
   boolean useInterrupt(uint8_t type);
-  File currentTrack;             //!< File that is currently playing
+  CachedFile currentTrack;       //!< File that is currently playing (read with the stream policy)
   volatile boolean playingMusic; //!< Whether or not music is playing
   /*!
    * @brief Feeds the buffer. Reads mp3 file data from the SD card and file and
@@ -371,7 +372,7 @@ public:
    * @param mp3 File to read
    * @return returns the seek position within the file where the mp3 data starts
    */
-  unsigned long mp3_ID3Jumper(File mp3);
+  unsigned long mp3_ID3Jumper(CachedFile &mp3);
   /*!
    * @brief Begin playing the specified file from the SD card using
    * interrupt-drive playback.
@@ -379,6 +380,14 @@ public:
    * @return Returns true when file starts playing
    */
   boolean startPlayingFile(const char *trackname);
+  /*!
+   * @brief Begin playing a file that is already open (the file is closed
+   * when playback ends)
+   * @param track File to play
+   * @param *trackname Name of the file, used to detect the file type
+   * @return Returns true when file starts playing
+   */
+  boolean startPlayingFile(File track, const char *trackname);
   /*!
    * @brief Play the complete file. This function will not return until the
    * playback is complete
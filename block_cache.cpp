@@ -0,0 +1,305 @@
+#include <Arduino.h>
+#include <SD.h>
+#include "block_cache.h"
+#include "crc32.h"
+
+static const char *POLICY_NAMES[BlockCache::NUM_POLICIES] = {"random", "sequential", "stream"};
+
+// -----------------------------------------------------------------------------
+BlockCache& Blocks()
+{
+    static BlockCache cache;
+    return cache;
+}
+
+// -----------------------------------------------------------------------------
+BlockCache::BlockCache() : m_clock(0), m_stream_id(0), m_stream_size(0), m_stream_start(0), m_stream_length(0)
+{
+    for( int i = 0 ; i < NUM_BLOCKS ; i++ )
+    {
+        m_blocks[i].file_id = 0;
+        m_blocks[i].used = 0;
+    }
+    memset(m_counters, 0, sizeof(m_counters));
+}
+
+// -----------------------------------------------------------------------------
+//  パスからファイルを区別する ID を求める(0 にはならない)
+// -----------------------------------------------------------------------------
+uint32_t BlockCache::getFileID(const char *path)
+{
+    uint32_t id = CRC32::calc(path, strlen(path));
+    return id? id : 1;
+}
+
+// -----------------------------------------------------------------------------
+BlockCache::Block *BlockCache::find(uint32_t file_id, uint32_t file_size, uint32_t index)
+{
+    for( int i = 0 ; i < NUM_BLOCKS ; i++ )
+    {
+        Block& b = m_blocks[i];
+        if( b.file_id == file_id && b.file_size == file_size && b.index == index )
+        {
+            return &b;
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+//  最も長く使っていないブロックに index 番目のブロックを読み込む
+//  読み込めなければ NULL
+// -----------------------------------------------------------------------------
+BlockCache::Block *BlockCache::load(File& f, uint32_t file_id, uint32_t file_size, uint32_t index)
+{
+    Block *b = &m_blocks[0];
+    for( int i = 1 ; i < NUM_BLOCKS ; i++ )
+    {
+        if( m_blocks[i].used < b->used )
+        {
+            b = &m_blocks[i];
+        }
+    }
+    uint32_t pos = index * BLOCK_SIZE;
+    uint32_t length = (file_size - pos < BLOCK_SIZE)? (file_size - pos) : BLOCK_SIZE;
+    b->file_id = 0;
+    b->used = ++m_clock;
+    if( (f.position() != pos && !f.seek(pos)) || f.read(b->data, length) != (int)length )
+    {
+        b->used = 0;
+        return NULL;
+    }
+    b->file_id = file_id;
+    b->file_size = file_size;
+    b->index = index;
+    b->length = length;
+    return b;
+}
+
+// -----------------------------------------------------------------------------
+//  ファイルの pos の位置のデータ。length にはそこから読めるバイト数を返す
+//  pos はファイルサイズ未満であること。読み込めなければ NULL
+// -----------------------------------------------------------------------------
+const uint8_t *BlockCache::get(File& f, uint32_t file_id, uint32_t file_size, uint32_t pos,
+                               uint8_t policy, uint32_t& length)
+{
+    Counter& c = m_counters[policy];
+    if( policy == STREAM )
+    {
+        if( m_stream_id != file_id || m_stream_size != file_size ||
+            pos < m_stream_start || pos >= m_stream_start + m_stream_length )
+        {
+            uint32_t start = pos - pos % BLOCK_SIZE;
+            uint32_t size = (file_size - start < sizeof(m_stream))? (file_size - start) : sizeof(m_stream);
+            m_stream_id = 0;
+            if( (f.position() != start && !f.seek(start)) || f.read(m_stream, size) != (int)size )
+            {
+                return NULL;
+            }
+            m_stream_id = file_id;
+            m_stream_size = file_size;
+            m_stream_start = start;
+            m_stream_length = size;
+            c.misses += (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+        else
+        {
+            c.hits++;
+        }
+        length = m_stream_start + m_stream_length - pos;
+        return m_stream + (pos - m_stream_start);
+    }
+
+    uint32_t index = pos / BLOCK_SIZE;
+    Block *b = find(file_id, file_size, index);
+    if( b )
+    {
+        c.hits++;
+        b->used = ++m_clock;
+    }
+    else
+    {
+        b = load(f, file_id, file_size, index);
+        if( !b )
+        {
+            return NULL;
+        }
+        c.misses++;
+        if( policy == SEQUENTIAL )
+        {
+            // 続くブロックを先読みする(使われなければ LRU で先に捨てられる)
+            uint32_t count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for( uint32_t i = index + 1 ; i < index + 1 + READ_AHEAD && i < count ; i++ )
+            {
+                if( !find(file_id, file_size, i) && load(f, file_id, file_size, i) )
+                {
+                    c.misses++;
+                }
+            }
+            b->used = ++m_clock;
+        }
+    }
+    length = b->length - pos % BLOCK_SIZE;
+    return b->data + pos % BLOCK_SIZE;
+}
+
+// -----------------------------------------------------------------------------
+//  path のブロックを捨てる(ファイルが書き換えられたとき)
+// -----------------------------------------------------------------------------
+void BlockCache::invalidate(const char *path)
+{
+    uint32_t id = getFileID(path);
+    for( int i = 0 ; i < NUM_BLOCKS ; i++ )
+    {
+        if( m_blocks[i].file_id == id )
+        {
+            m_blocks[i].file_id = 0;
+            m_blocks[i].used = 0;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  すべてのブロックを捨てる(曲の再生中は STREAM のバッファは残す)
+// -----------------------------------------------------------------------------
+void BlockCache::clear()
+{
+    for( int i = 0 ; i < NUM_BLOCKS ; i++ )
+    {
+        m_blocks[i].file_id = 0;
+        m_blocks[i].used = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  ポリシーごとのヒット率をシリアルに出力する(キャッシュの大きさを決める目安)
+// -----------------------------------------------------------------------------
+void BlockCache::printStats()
+{
+    for( int p = 0 ; p < NUM_POLICIES ; p++ )
+    {
+        Counter& c = m_counters[p];
+        uint32_t total = c.hits + c.misses;
+        Serial.print("cache ");
+        Serial.print(POLICY_NAMES[p]);
+        Serial.print(": ");
+        Serial.print(c.hits, DEC);
+        Serial.print(" hit(s), ");
+        Serial.print(c.misses, DEC);
+        Serial.print(" miss(es), ");
+        Serial.print(c.direct, DEC);
+        Serial.print(" direct (");
+        Serial.print(total? (c.hits * 100 / total) : 0, DEC);
+        Serial.println("%)");
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  SDLock
+////////////////////////////////////////////////////////////////////////////////
+volatile uint8_t SDLock::m_count = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//  CachedFile
+////////////////////////////////////////////////////////////////////////////////
+bool CachedFile::open(const char *path, uint8_t policy)
+{
+    SDLock lock;
+    attach(SD.open(path), path, policy);
+    return m_file;
+}
+
+// -----------------------------------------------------------------------------
+//  開いてあるファイルを使う(位置は先頭に戻る)
+// -----------------------------------------------------------------------------
+void CachedFile::attach(File f, const char *path, uint8_t policy)
+{
+    SDLock lock;
+    m_file = f;
+    m_id = BlockCache::getFileID(path);
+    m_size = f? f.size() : 0;
+    m_pos = 0;
+    m_policy = policy;
+}
+
+// -----------------------------------------------------------------------------
+void CachedFile::close()
+{
+    SDLock lock;
+    if( m_file )
+    {
+        m_file.close();
+    }
+    m_file = File();
+}
+
+// -----------------------------------------------------------------------------
+//  size バイトを読み込む。戻り値は読み込んだバイト数
+//  ブロック境界から始まる BLOCK_SIZE 以上の部分は、キャッシュを通さずに直接読む
+//  (セクション全体のような大きな読み込みでキャッシュを押し流さないため)
+// -----------------------------------------------------------------------------
+int CachedFile::read(void *buffer, uint32_t size)
+{
+    if( !m_file )
+    {
+        return 0;
+    }
+    SDLock lock;
+    if( size > m_size - m_pos )
+    {
+        size = m_size - m_pos;
+    }
+    uint8_t *p = (uint8_t *)buffer;
+    uint32_t done = 0;
+    while( done < size )
+    {
+        uint32_t rest = size - done;
+        uint32_t length;
+        if( m_policy != BlockCache::STREAM && m_pos % BlockCache::BLOCK_SIZE == 0 && rest >= BlockCache::BLOCK_SIZE )
+        {
+            length = rest - rest % BlockCache::BLOCK_SIZE;
+            if( (m_file.position() != m_pos && !m_file.seek(m_pos)) || m_file.read(p, length) != (int)length )
+            {
+                break;
+            }
+            Blocks().countDirect(m_policy, length / BlockCache::BLOCK_SIZE);
+        }
+        else
+        {
+            const uint8_t *data = Blocks().get(m_file, m_id, m_size, m_pos, m_policy, length);
+            if( !data )
+            {
+                break;
+            }
+            if( length > rest )
+            {
+                length = rest;
+            }
+            memcpy(p, data, length);
+        }
+        p += length;
+        done += length;
+        m_pos += length;
+    }
+    return done;
+}
+
+// -----------------------------------------------------------------------------
+//  1バイト読み込む。ファイルの末尾では -1
+// -----------------------------------------------------------------------------
+int CachedFile::read()
+{
+    uint8_t c;
+    return (read(&c, 1) == 1)? c : -1;
+}
+
+// -----------------------------------------------------------------------------
+bool CachedFile::seek(uint32_t pos)
+{
+    if( !m_file || pos > m_size )
+    {
+        return false;
+    }
+    m_pos = pos;
+    return true;
+}
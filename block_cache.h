@@ -0,0 +1,114 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <Arduino.h>
+#include <SD.h>
+
+// -----------------------------------------------------------------------------
+//  SDカードのファイルをセクタ(BLOCK_SIZE)単位で保持するキャッシュ(LRU)
+//  ファイルはパスの CRC とサイズで区別する。書き換えたファイルは invalidate() すること
+//
+//  読み込み方(ポリシー)
+//    RANDOM     : 必要なブロックだけを読む(プレイリストなどのメタデータ)
+//    SEQUENTIAL : 先頭から順に読むファイル。ミスしたら READ_AHEAD ブロック先読みする
+//                 (フォント、画像)
+//    STREAM     : 曲ファイル。共有のブロックは使わず、専用のバッファに STREAM_BLOCKS
+//                 ずつ読む。タイマ割込みから読むので、他のポリシーとは状態を共有しない
+//                 (SDカードのドライバは共有するので、loop() 側は SDLock で割込みを止める)
+// -----------------------------------------------------------------------------
+class BlockCache
+{
+    public:
+        enum{BLOCK_SIZE = 512};
+        enum{NUM_BLOCKS = 32};
+        enum{READ_AHEAD = 4};
+        enum{STREAM_BLOCKS = 2};
+        enum{RANDOM = 0, SEQUENTIAL = 1, STREAM = 2, NUM_POLICIES = 3};
+
+    private:
+        struct Block
+        {
+            uint32_t file_id;           // 0 は未使用
+            uint32_t file_size;
+            uint32_t index;
+            uint16_t length;            // ファイル末尾のブロックは BLOCK_SIZE より短い
+            uint32_t used;              // 最後に使った順番
+            uint8_t  data[BLOCK_SIZE];
+        };
+        struct Counter
+        {
+            uint32_t hits;              // キャッシュから読んだブロック数
+            uint32_t misses;            // SDカードから読んだブロック数
+            uint32_t direct;            // キャッシュを通さずに読んだブロック数
+        };
+        Block    m_blocks[NUM_BLOCKS];
+        uint32_t m_clock;
+        uint8_t  m_stream[STREAM_BLOCKS * BLOCK_SIZE];
+        uint32_t m_stream_id;
+        uint32_t m_stream_size;
+        uint32_t m_stream_start;        // m_stream の先頭のファイル内位置
+        uint32_t m_stream_length;
+        Counter  m_counters[NUM_POLICIES];
+        BlockCache();
+        Block   *find(uint32_t file_id, uint32_t file_size, uint32_t index);
+        Block   *load(File& f, uint32_t file_id, uint32_t file_size, uint32_t index);
+
+    public:
+        friend BlockCache& Blocks();
+        static uint32_t getFileID(const char *path);
+        const uint8_t *get(File& f, uint32_t file_id, uint32_t file_size, uint32_t pos,
+                           uint8_t policy, uint32_t& length);
+        void     countDirect(uint8_t policy, uint32_t blocks){ m_counters[policy].direct += blocks; }
+        void     invalidate(const char *path);
+        void     clear();
+        uint32_t getHits(uint8_t policy){ return m_counters[policy].hits; }
+        uint32_t getMisses(uint8_t policy){ return m_counters[policy].misses; }
+        void     printStats();
+};
+
+BlockCache& Blocks();
+
+// -----------------------------------------------------------------------------
+//  loop() から SDカードに触る間、タイマ割込み(曲の再生)を止めておくロック
+//  SDカードのドライバは割込みとの排他をしないので、再生中に割込みがディレクトリの
+//  探索や書き込みの途中に入ると壊れる。loop() から SDカードを使うところは必ず
+//  このオブジェクトのスコープで囲む(入れ子にしてよい)。タイマ割込みはロック中は何もしない
+//  CachedFile は中でロックする
+// -----------------------------------------------------------------------------
+class SDLock
+{
+    private:
+        static volatile uint8_t m_count;
+    public:
+        SDLock(){ m_count++; }
+        ~SDLock(){ m_count--; }
+        static bool isLocked(){ return m_count != 0; }
+};
+
+// -----------------------------------------------------------------------------
+//  BlockCache を通して読み込むファイル(読み込み専用)
+//  File と違って位置を自分で持つので、関数に渡すときは参照で渡すこと
+// -----------------------------------------------------------------------------
+class CachedFile
+{
+    private:
+        File     m_file;
+        uint32_t m_id;
+        uint32_t m_size;
+        uint32_t m_pos;
+        uint8_t  m_policy;
+
+    public:
+        CachedFile() : m_id(0), m_size(0), m_pos(0), m_policy(BlockCache::RANDOM){}
+        bool     open(const char *path, uint8_t policy);
+        void     attach(File f, const char *path, uint8_t policy);
+        void     close();
+        operator bool(){ return m_file; }
+        int      read(void *buffer, uint32_t size);
+        int      read();
+        bool     seek(uint32_t pos);
+        uint32_t position(){ return m_pos; }
+        uint32_t size(){ return m_size; }
+};
+
+#endif
@@ -0,0 +1,35 @@
+#include "crc32.h"
+
+uint32_t CRC32::m_table[256];
+bool     CRC32::m_initialized = false;
+
+// -----------------------------------------------------------------------------
+void CRC32::init()
+{
+    for( uint32_t n = 0 ; n < 256 ; n++ )
+    {
+        uint32_t c = n;
+        for( int k = 0 ; k < 8 ; k++ )
+        {
+            c = (c & 1)? (0xEDB88320UL ^ (c >> 1)) : (c >> 1);
+        }
+        m_table[n] = c;
+    }
+    m_initialized = true;
+}
+
+// -----------------------------------------------------------------------------
+uint32_t CRC32::update(uint32_t crc, const void *data, uint32_t length)
+{
+    if( !m_initialized )
+    {
+        init();
+    }
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = crc ^ 0xFFFFFFFFUL;
+    while( length-- )
+    {
+        c = m_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFUL;
+}
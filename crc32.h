@@ -0,0 +1,24 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+//  CRC-32 (IEEE 802.3, zlib 互換)
+//  ホスト側ツール(tools/)からも使用するため、Arduino のヘッダには依存しないこと
+// -----------------------------------------------------------------------------
+class CRC32
+{
+    private:
+        static uint32_t m_table[256];
+        static bool     m_initialized;
+        static void     init();
+    public:
+        // crc : 直前までの計算結果(最初は0)
+        static uint32_t update(uint32_t crc, const void *data, uint32_t length);
+        static uint32_t calc(const void *data, uint32_t length){
+            return update(0, data, length);
+        }
+};
+
+#endif
@@ -0,0 +1,430 @@
+#include <Arduino.h>
+#include <SD.h>
+#include "folder_cache.h"
+
+// 一覧に表示する曲ファイルの拡張子(VS1053 が再生できるもの)
+static const char *PLAYABLE_EXTENSIONS[] = {
+    ".mp3", ".ogg", ".wav", ".wma", ".m4a", ".aac", ".flac", ".mid"
+};
+
+// 曲名として読み込む最大バイト数(UTF-8 に変換した後)
+#define MAX_TITLE_BYTES     127
+
+// -----------------------------------------------------------------------------
+static char *duplicate(const char *s)
+{
+    char *p = (char *)malloc(strlen(s) + 1);
+    if( p )
+    {
+        strcpy(p, s);
+    }
+    return p;
+}
+
+// -----------------------------------------------------------------------------
+static bool isPlayable(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if( !ext )
+    {
+        return false;
+    }
+    for( size_t i = 0 ; i < sizeof(PLAYABLE_EXTENSIONS) / sizeof(PLAYABLE_EXTENSIONS[0]) ; i++ )
+    {
+        if( !strcasecmp(ext, PLAYABLE_EXTENSIONS[i]) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+//  文字コード c を UTF-8 で p に書き込む。end を超える場合は書き込まずに NULL を返す
+// -----------------------------------------------------------------------------
+static char *putUTF8(char *p, char *end, uint16_t c)
+{
+    uint8_t n = (c < 0x80)? 1 : (c < 0x800)? 2 : 3;
+    if( p + n > end )
+    {
+        return NULL;
+    }
+    if( n == 1 )
+    {
+        *p++ = (char)c;
+    }
+    else if( n == 2 )
+    {
+        *p++ = (char)(0xC0 | (c >> 6));
+        *p++ = (char)(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        *p++ = (char)(0xE0 | (c >> 12));
+        *p++ = (char)(0x80 | ((c >> 6) & 0x3F));
+        *p++ = (char)(0x80 | (c & 0x3F));
+    }
+    return p;
+}
+
+// -----------------------------------------------------------------------------
+//  ID3 のテキストフレーム(先頭はエンコーディング)を UTF-8 にして title に格納する
+//  UTF-16 のサロゲートペアは '?' にする
+// -----------------------------------------------------------------------------
+static void decodeText(const uint8_t *data, uint32_t size, char *title)
+{
+    char *p = title;
+    char *end = title + MAX_TITLE_BYTES;
+    uint8_t encoding = (size > 0)? data[0] : 0;
+    uint32_t i = 1;
+    if( encoding == 0 || encoding == 3 )
+    {
+        // ISO-8859-1, UTF-8(UTF-8 は文字の途中で切らないよう、先頭バイトごとに長さを見る)
+        while( i < size && data[i] )
+        {
+            if( encoding == 0 )
+            {
+                char *q = putUTF8(p, end, data[i++]);
+                if( !q )
+                {
+                    break;      // 書き込めなかった文字の手前で終わる
+                }
+                p = q;
+                continue;
+            }
+            uint8_t c = data[i];
+            uint8_t n = (c < 0x80)? 1 : (c < 0xE0)? 2 : (c < 0xF0)? 3 : 4;
+            if( p + n > end || i + n > size )
+            {
+                break;
+            }
+            memcpy(p, &data[i], n);
+            p += n;
+            i += n;
+        }
+    }
+    else
+    {
+        // UTF-16(BOM 付き), UTF-16BE
+        bool big_endian = (encoding == 2);
+        if( encoding == 1 && i + 1 < size )
+        {
+            big_endian = (data[i] == 0xFE && data[i+1] == 0xFF);
+            if( (data[i] == 0xFE && data[i+1] == 0xFF) || (data[i] == 0xFF && data[i+1] == 0xFE) )
+            {
+                i += 2;
+            }
+        }
+        while( i + 1 < size )
+        {
+            uint16_t c = big_endian? ((data[i] << 8) | data[i+1]) : (data[i] | (data[i+1] << 8));
+            i += 2;
+            if( c == 0 )
+            {
+                break;
+            }
+            if( c >= 0xD800 && c < 0xE000 )
+            {
+                if( c < 0xDC00 )
+                {
+                    i += 2;
+                }
+                c = '?';
+            }
+            char *q = putUTF8(p, end, c);
+            if( !q )
+            {
+                break;
+            }
+            p = q;
+        }
+    }
+    *p = '\0';
+}
+
+// -----------------------------------------------------------------------------
+//  ID3v2 (2.2, 2.3, 2.4) タグから曲名(TIT2, TT2)を読み込む
+//  曲名がなければ false。非同期化、圧縮されたフレームには対応しない
+// -----------------------------------------------------------------------------
+static bool readTitle(File f, char *title)
+{
+    uint8_t header[10];
+    if( f.read(header, sizeof(header)) != sizeof(header) || memcmp(header, "ID3", 3) ||
+        header[3] < 2 || header[3] > 4 )
+    {
+        return false;
+    }
+    uint8_t version = header[3];
+    uint32_t end = 10 + (((uint32_t)header[6] << 21) | ((uint32_t)header[7] << 14) |
+                         ((uint32_t)header[8] << 7) | header[9]);
+    uint32_t pos = 10;
+    if( version >= 3 && (header[5] & 0x40) )
+    {
+        // 拡張ヘッダを読み飛ばす(2.3 はサイズ自身を含まない)
+        uint8_t ext[4];
+        if( f.read(ext, sizeof(ext)) != sizeof(ext) )
+        {
+            return false;
+        }
+        uint32_t ext_size = (version == 3)?
+            ((((uint32_t)ext[0] << 24) | ((uint32_t)ext[1] << 16) | ((uint32_t)ext[2] << 8) | ext[3]) + 4) :
+            (((uint32_t)ext[0] << 21) | ((uint32_t)ext[1] << 14) | ((uint32_t)ext[2] << 7) | ext[3]);
+        if( ext_size > end - pos )
+        {
+            return false;
+        }
+        pos += ext_size;
+    }
+
+    uint8_t header_size = (version == 2)? 6 : 10;
+    while( pos + header_size <= end )
+    {
+        uint8_t fh[10];
+        if( !f.seek(pos) || f.read(fh, header_size) != header_size || fh[0] == 0 )
+        {
+            return false;   // パディング
+        }
+        uint32_t size;
+        bool found;
+        if( version == 2 )
+        {
+            size = ((uint32_t)fh[3] << 16) | ((uint32_t)fh[4] << 8) | fh[5];
+            found = !memcmp(fh, "TT2", 3);
+        }
+        else
+        {
+            size = (version == 3)?
+                ((((uint32_t)fh[4] << 24) | ((uint32_t)fh[5] << 16) | ((uint32_t)fh[6] << 8) | fh[7])) :
+                (((uint32_t)fh[4] << 21) | ((uint32_t)fh[5] << 14) | ((uint32_t)fh[6] << 7) | fh[7]);
+            found = !memcmp(fh, "TIT2", 4);
+        }
+        pos += header_size;
+        if( size > end - pos )
+        {
+            return false;   // タグの外にはみ出すフレームは壊れている(pos が一周しないように)
+        }
+        if( found )
+        {
+            // UTF-16 でも MAX_TITLE_BYTES 程度の文字数が読めれば十分
+            uint8_t data[MAX_TITLE_BYTES * 2 + 3];
+            uint32_t n = (size < sizeof(data))? size : sizeof(data);
+            if( f.read(data, n) != (int)n )
+            {
+                return false;
+            }
+            decodeText(data, n, title);
+            return title[0] != '\0';
+        }
+        pos += size;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  FolderListing
+////////////////////////////////////////////////////////////////////////////////
+FolderListing::FolderListing(const char *path) : m_path(duplicate(path)), m_complete(false), m_selection(0)
+{
+    m_entries.alloc(MAX_ENTRIES);
+}
+
+// -----------------------------------------------------------------------------
+FolderListing::~FolderListing()
+{
+    if( m_dir )
+    {
+        SDLock lock;
+        m_dir.close();
+    }
+    for( uint16_t i = 0 ; i < m_entries.size() ; i++ )
+    {
+        free(m_entries[i].name);
+        free(m_entries[i].title);
+    }
+    free(m_path);
+}
+
+// -----------------------------------------------------------------------------
+//  最大 count 個のエントリを列挙する。View::update() から繰り返し呼ぶこと
+//  戻り値は一覧に項目を追加したかどうか
+//  サブフォルダと曲ファイルだけを残し、隠しファイルやパスが長すぎるものは除く
+//  再生中にも呼ばれるので、列挙する間はタイマ割込みを止める(count は小さくすること)
+// -----------------------------------------------------------------------------
+bool FolderListing::loadNext(uint16_t count)
+{
+    if( m_complete || !m_path )
+    {
+        m_complete = true;
+        return false;
+    }
+    SDLock lock;
+    if( !m_dir )
+    {
+        m_dir = SD.open(m_path[0]? m_path : "/");
+        if( !m_dir || !m_dir.isDirectory() )
+        {
+            Serial.print("Cannot open ");
+            Serial.println(m_path);
+            m_complete = true;
+            return false;
+        }
+    }
+
+    uint16_t added = 0;
+    for( uint16_t n = 0 ; n < count ; n++ )
+    {
+        File e = m_dir.openNextFile();
+        if( !e )
+        {
+            m_complete = true;
+            break;
+        }
+        const char *name = e.name();
+        bool directory = e.isDirectory();
+        if( name[0] != '.' && (directory || isPlayable(name)) &&
+            strlen(m_path) + 1 + strlen(name) < MAX_PATH_LENGTH )
+        {
+            Entry entry;
+            entry.name = duplicate(name);
+            entry.title = NULL;
+            entry.directory = directory;
+            entry.title_loaded = directory;
+            if( entry.name )
+            {
+                m_entries.push_back(entry);
+                added++;
+            }
+        }
+        e.close();
+        if( m_entries.size() >= m_entries.capacity() )
+        {
+            Serial.print(m_path);
+            Serial.println(": too many entries");
+            m_complete = true;
+            break;
+        }
+    }
+    if( m_complete )
+    {
+        m_dir.close();
+    }
+    return added > 0;
+}
+
+// -----------------------------------------------------------------------------
+//  index 番目の項目のパス(path は MAX_PATH_LENGTH バイト以上)
+// -----------------------------------------------------------------------------
+bool FolderListing::getEntryPath(uint16_t index, char *path)
+{
+    Entry *e = getEntry(index);
+    if( !e )
+    {
+        return false;
+    }
+    path[0] = '\0';
+    if( m_path[0] )
+    {
+        strcpy(path, m_path);
+        strcat(path, "/");
+    }
+    strcat(path, e->name);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  index 番目の曲の曲名。初めて表示するときに ID3 タグを読み込む
+//  曲名がなければ NULL(ファイル名を表示する)
+// -----------------------------------------------------------------------------
+const char *FolderListing::getTitle(uint16_t index)
+{
+    Entry *e = getEntry(index);
+    if( !e )
+    {
+        return NULL;
+    }
+    if( !e->title_loaded )
+    {
+        e->title_loaded = true;
+        char path[MAX_PATH_LENGTH];
+        getEntryPath(index, path);
+        SDLock lock;
+        File f = SD.open(path);
+        if( f )
+        {
+            char title[MAX_TITLE_BYTES + 1];
+            if( readTitle(f, title) )
+            {
+                e->title = duplicate(title);
+            }
+            f.close();
+        }
+    }
+    return e->title;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  FolderCache
+////////////////////////////////////////////////////////////////////////////////
+FolderCache::FolderCache() : m_clock(0), m_pinned(NULL)
+{
+    for( int i = 0 ; i < MAX_LISTINGS ; i++ )
+    {
+        m_listings[i] = NULL;
+        m_used[i] = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  キャッシュにある path の一覧(なければ NULL)
+// -----------------------------------------------------------------------------
+FolderListing *FolderCache::find(const char *path)
+{
+    for( int i = 0 ; i < MAX_LISTINGS ; i++ )
+    {
+        if( m_listings[i] && !strcmp(m_listings[i]->getPath(), path) )
+        {
+            m_used[i] = ++m_clock;
+            return m_listings[i];
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+//  path の一覧。キャッシュになければ、最も長く使っていない一覧を捨てて新しく作る
+//  (列挙はまだ始めていないので、loadNext() で読み込むこと。pin() した一覧は捨てない)
+// -----------------------------------------------------------------------------
+FolderListing *FolderCache::get(const char *path)
+{
+    FolderListing *listing = find(path);
+    if( listing )
+    {
+        return listing;
+    }
+    int slot = (m_pinned && m_listings[0] == m_pinned)? 1 : 0;
+    for( int i = slot + 1 ; i < MAX_LISTINGS ; i++ )
+    {
+        if( (!m_pinned || m_listings[i] != m_pinned) && m_used[i] < m_used[slot] )
+        {
+            slot = i;
+        }
+    }
+    delete m_listings[slot];
+    m_listings[slot] = new FolderListing(path);
+    m_used[slot] = ++m_clock;
+    return m_listings[slot];
+}
+
+// -----------------------------------------------------------------------------
+//  すべての一覧を捨てる(SDカードの内容が変わったときなど)
+// -----------------------------------------------------------------------------
+void FolderCache::clear()
+{
+    for( int i = 0 ; i < MAX_LISTINGS ; i++ )
+    {
+        delete m_listings[i];
+        m_listings[i] = NULL;
+        m_used[i] = 0;
+    }
+    m_pinned = NULL;
+}
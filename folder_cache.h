@@ -0,0 +1,69 @@
+#ifndef FOLDER_CACHE_H
+#define FOLDER_CACHE_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include "playlist.h"
+
+// -----------------------------------------------------------------------------
+//  SDカードのフォルダ１つぶんの一覧
+//  loadNext() を呼ぶたびに少しずつ列挙するので、大きなフォルダでも画面が止まらない
+//  並びはディレクトリエントリの順。曲名は表示する項目だけ ID3 タグから読み込む
+// -----------------------------------------------------------------------------
+class FolderListing
+{
+    public:
+        enum{MAX_PATH_LENGTH = 128};    // パスはルートからの相対パス(先頭の '/' なし)
+        enum{MAX_ENTRIES = 512};
+        struct Entry
+        {
+            char    *name;
+            char    *title;             // ID3 タグの曲名(読み込んでいないか、なければ NULL)
+            bool     directory;
+            bool     title_loaded;
+        };
+
+    private:
+        char         *m_path;
+        File          m_dir;            // 列挙中のディレクトリ
+        Vector<Entry> m_entries;
+        bool          m_complete;
+        uint16_t      m_selection;      // 最後に選択していた項目(親フォルダに戻ったときに使う)
+
+    public:
+        FolderListing(const char *path);
+        ~FolderListing();
+        bool        loadNext(uint16_t count);
+        bool        isComplete(){ return m_complete; }
+        const char *getPath(){ return m_path; }
+        uint16_t    getCount(){ return m_entries.size(); }
+        Entry      *getEntry(uint16_t index){ return (index < m_entries.size())? &m_entries[index] : NULL; }
+        bool        getEntryPath(uint16_t index, char *path);
+        const char *getTitle(uint16_t index);
+        uint16_t    getSelection(){ return m_selection; }
+        void        setSelection(uint16_t index){ m_selection = index; }
+};
+
+// -----------------------------------------------------------------------------
+//  フォルダの一覧のキャッシュ(パスごとに MAX_LISTINGS 個まで、LRU)
+//  親フォルダに戻ったときなどに列挙し直さずに済む
+//  pin() した一覧(再生中の曲のフォルダ)は追い出さない
+// -----------------------------------------------------------------------------
+class FolderCache
+{
+    private:
+        enum{MAX_LISTINGS = 4};
+        FolderListing *m_listings[MAX_LISTINGS];
+        uint32_t       m_used[MAX_LISTINGS];    // 最後に使った順番
+        uint32_t       m_clock;
+        FolderListing *m_pinned;
+
+    public:
+        FolderCache();
+        FolderListing *find(const char *path);
+        FolderListing *get(const char *path);
+        void           pin(FolderListing *listing){ m_pinned = listing; }
+        void           clear();
+};
+
+#endif
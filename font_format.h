@@ -0,0 +1,63 @@
+#ifndef FONT_FORMAT_H
+#define FONT_FORMAT_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+//  フォントファイル (v2) のフォーマット
+//  ホスト側ツール(tools/)とも共有するため、Arduino のヘッダには依存しないこと
+//  数値はすべてリトルエンディアン
+//
+//  +------------------------------+ 0
+//  | FontHeader                   |
+//  +------------------------------+ lookup_offset
+//  | uint32_t x FONT_LOOKUP_SIZE  | 文字コードの上位バイトごとの、グリフテーブル内の先頭位置
+//  +------------------------------+ glyph_offset
+//  | FontGlyphRecord x N          | グリフテーブル(文字コードの昇順、重複なし)
+//  +------------------------------+ bitmap_offset
+//  | ビットマップ                  | グリフごとに行優先で、１行を (width + 7) / 8 バイトに詰めて
+//  |                              | height 行並べたもの(各バイトの最上位ビットが左端のピクセル)
+//  +------------------------------+ file_size
+//
+//  各部分は4バイト境界に配置する。プレイヤーは bitmap_offset までの目次だけを読み込んでおき、
+//  ビットマップは使うときに読む
+//  上位バイトが b の文字は、グリフテーブルの lookup[b] ～ lookup[b+1]-1 の範囲にある
+//  (プレイヤーはこれから上位バイトごとのページを作り、二分探索せずに引く)
+//
+//  v1 (先頭がマジックナンバーでないもの) は従来の形式
+//      uint16_t グリフ数に続いて、グリフごとに code, width, offset, advance (各 uint16_t/int16_t) と
+//      width 個の列データ(uint16_t、最下位ビットが上端)を並べたもの。高さはファイルに含まれない
+//      tools/mkfont で v2 に変換する
+// -----------------------------------------------------------------------------
+#define FONT_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define FONT_MAGIC                  FONT_FOURCC('F', 'O', 'N', 'T')
+#define FONT_VERSION                2
+#define FONT_LOOKUP_SIZE            257
+
+// 32 bytes
+struct FontHeader
+{
+    uint32_t magic;             // FONT_MAGIC
+    uint16_t version;           // FONT_VERSION
+    uint16_t height;            // グリフの高さ(ピクセル)
+    uint32_t glyph_count;
+    uint32_t file_size;         // ファイル全体のサイズ
+    uint32_t crc;               // ヘッダの後ろから bitmap_offset まで(索引とグリフテーブル)の CRC-32
+    uint32_t lookup_offset;     // ファイル先頭からのオフセット
+    uint32_t glyph_offset;
+    uint32_t bitmap_offset;
+};
+
+// 12 bytes
+struct FontGlyphRecord
+{
+    uint16_t code;              // UCS-2
+    int16_t  width;             // ビットマップの幅(ピクセル)
+    int16_t  offset;            // 描画位置から左端までのずれ
+    int16_t  advance;           // 次の文字までの幅
+    uint32_t bitmap;            // ビットマップ領域内のオフセット
+};
+
+#endif
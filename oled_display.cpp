@@ -3,6 +3,20 @@
 #include "M41T62.h"
 #include "eeprom_24lc.h"
 
+// -----------------------------------------------------------------------------
+//  n を10進で end の手前に書き込み、書き込んだ先頭を返す(終端の '\0' は書かない)
+// -----------------------------------------------------------------------------
+static char *formatNumber(uint16_t n, char *end)
+{
+    char *p = end;
+    do
+    {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while( n );
+    return p;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //  View
 ////////////////////////////////////////////////////////////////////////////////
@@ -50,20 +64,29 @@ View *View::getActiveView()
     return NULL;
 }
 
+// -----------------------------------------------------------------------------
+//  id のビューに切り替える
+//  先に他のビューをすべて隠してから表示する(登録順に関係なく、隠すビューが
+//  共有している MarqueeRegion などを、表示するビューが登録した後に外さないように)
 // -----------------------------------------------------------------------------
 void View::show(uint8_t id)
 {
+    View *target = NULL;
     for( uint16_t i = 0 ; i < m_views.size() ; i++ )
     {
         if( m_views[i]->m_id == id )
         {
-            m_views[i]->show();
-        }        
+            target = m_views[i];
+        }
         else
         {
             m_views[i]->hide();
         }
     }
+    if( target )
+    {
+        target->show();
+    }
 }
 
 // -----------------------------------------------------------------------------
@@ -72,7 +95,8 @@ void View::show()
     m_visible = true;
     m_oled->clear(0x00);
     refresh();
-    m_oled->display();
+    // 表示していないページに描いてから切り替える(描いている途中を見せない)
+    m_oled->flipPage();
 }
 
 // -----------------------------------------------------------------------------
@@ -118,7 +142,7 @@ void View::invalidate(bool partial)
 ////////////////////////////////////////////////////////////////////////////////
 PlaybackView::PlaybackView(SSD1322 *oled, Playlist *playlist, SpectrumAnalyzer *analyzer)
     : View(oled, playlist, PlaybackView::ID), m_state(STOP), m_analyzer(analyzer),
-    m_spectrum_gain(2)
+    m_spectrum_gain(2), m_load_progress(0)
 {
     for( int n = 0 ; n < 2 ; n++ )
     {
@@ -143,7 +167,10 @@ void PlaybackView::init()
     m_label_images.load("label_1.dat", 2);
     m_icon_images.load("icon.dat", 3);
 
-    m_scroll_text.init(236);
+    for( int n = 0 ; n < 2 ; n++ )
+    {
+        m_track_info[n].init(20, 28+20*n, 236, 1);
+    }
 }
 
 // -----------------------------------------------------------------------------
@@ -153,11 +180,18 @@ void PlaybackView::update()
     drawTrackNumber(false);
     drawElapsedTime(false);
     drawSpectrum(false);
-    int r = m_scroll_text.updateScroll();
-    if( r )
+    drawLoadProgress(false);
+}
+
+// -----------------------------------------------------------------------------
+void PlaybackView::hide()
+{
+    if( isVisible() )
     {
-        drawTrackInfo(r-1);
+        Marquees().remove(&m_track_info[0]);
+        Marquees().remove(&m_track_info[1]);
     }
+    View::hide();
 }
 
 // -----------------------------------------------------------------------------
@@ -167,6 +201,10 @@ void PlaybackView::refresh()
 
     m_oled->drawASCIIText(24, 1, "TRACK", SSD1322::FONT_TINY, 0x0A);
     m_oled->drawASCIIText(98, 1, "TIME", SSD1322::FONT_TINY, 0x0A);
+    if( Queue().isShuffle() )
+    {
+        m_oled->drawASCIIText(24, 12, "SHUF", SSD1322::FONT_TINY, 0x0A);
+    }
     // m_oled->drawImage(24, 2, m_label_images.getImage(1));
     // m_oled->drawImage(100, 2, m_label_images.getImage(0));
     drawState(true);
@@ -174,6 +212,7 @@ void PlaybackView::refresh()
     drawElapsedTime(true);
     drawSpectrum(true);
     drawAlbumInfo(true);
+    drawLoadProgress(true);
     setScrollText();
     drawTrackInfo();
 }
@@ -200,20 +239,22 @@ void PlaybackView::setScrollText()
     if( Player().isStopped() )
     {
         // 停止中は、上段にアーティスト名、下段にアルバムタイトルを表示
-        m_scroll_text.setText(0, artist->getName(), m_oled->getFont(SSD1322::FONT_LARGE));
-        m_scroll_text.setText(1, album->getTitle(), m_oled->getFont(SSD1322::FONT_LARGE));
+        m_track_info[0].setText(artist->getName(), m_oled->getFont(SSD1322::FONT_LARGE));
+        m_track_info[1].setText(album->getTitle(), m_oled->getFont(SSD1322::FONT_LARGE));
     }
     else
     {
         // 再生中は、上段に「曲名」を表示、
         // 下段は「下段にアルバムタイトル」＋「アーティスト名」を表示
-        m_scroll_text.setText(0, album->getCurrentSong()->getTitle(), m_oled->getFont(SSD1322::FONT_LARGE));
+        m_track_info[0].setText(album->getCurrentSong()->getTitle(), m_oled->getFont(SSD1322::FONT_LARGE));
         strcpy(text, album->getTitle());
         strcat(text, " - ");
         strcat(text, artist->getName());
-        m_scroll_text.setText(1, text, m_oled->getFont(SSD1322::FONT_LARGE));
+        m_track_info[1].setText(text, m_oled->getFont(SSD1322::FONT_LARGE));
     }
-    m_scroll_text.startScroll();
+    // スクロールは Marquee が進める(上段、下段の順)
+    Marquees().add(&m_track_info[0]);
+    Marquees().add(&m_track_info[1]);
 }
 
 // -----------------------------------------------------------------------------
@@ -385,6 +426,28 @@ void PlaybackView::drawAlbumInfo(bool force_redraw)
     }
 }
 
+// -----------------------------------------------------------------------------
+//  プレイリストの読み込み中は、上段と曲名の間に進捗を細い線で表示する
+// -----------------------------------------------------------------------------
+void PlaybackView::drawLoadProgress(bool force_redraw)
+{
+    uint8_t progress = m_playlist->getLoadProgress();
+    if( progress == m_load_progress && !force_redraw )
+    {
+        return;
+    }
+    m_oled->drawHzLine(0, 24, 256, 0x00);
+    if( m_playlist->isLoading() && progress > 0 )
+    {
+        m_oled->drawHzLine(0, 24, (int16_t)(256 * progress / 100), 0x05);
+    }
+    if( !force_redraw )
+    {
+        m_oled->invalidateRect(0, 24, 256, 1);
+    }
+    m_load_progress = progress;
+}
+
 // -----------------------------------------------------------------------------
 void PlaybackView::drawTrackInfo(int row)
 {
@@ -406,7 +469,7 @@ void PlaybackView::drawTrackInfo(int row)
     {
         if( n == row || row < 0 )
         {
-            m_oled->drawScrollText(n, 20, 28+20*n, &m_scroll_text);
+            m_oled->drawMarquee(&m_track_info[n]);
             if( row >= 0 )
             {
                 m_oled->invalidateRect(20, 28+20*n, 236, 16);
@@ -471,10 +534,17 @@ bool PlaybackView::handleIRR(IRRCODE code)
     }
 
     int d = IRRemote::codeToDigit(code);
-    if( d <= 0 )
+    if( d < 0 )
     {
         return false;
     }
+    if( d == 0 )
+    {
+        // [0]キー : シャッフルの切り替え
+        Queue().setShuffle(!Queue().isShuffle());
+        show();
+        return true;
+    }
     Album *album = m_playlist->getSelectedArtist()->getSelectedAlbum();
     if( d <= album->getSongCount() )
     {
@@ -482,10 +552,14 @@ bool PlaybackView::handleIRR(IRRCODE code)
         {
             Player().stop(true);
         }
-        album->seekTo((uint16_t)(d-1));
-        const char *filename = album->getCurrentSong()->getFileName();
-        Serial.println(filename);
-        Player().play(filename);
+        // キューにあればその位置に移動し、なければキューをこのアルバムに置き換える
+        if( !Queue().jumpTo(album, (uint16_t)(d-1)) )
+        {
+            Queue().setAlbum(album, (uint16_t)(d-1));
+        }
+        Song *song = album->getCurrentSong();
+        Serial.println(song->getFileName());
+        Player().play(song->getFileName(), song->getFileSize());
         show();
     }
     return true;
@@ -504,6 +578,7 @@ bool PlaybackView::handleIRR(IRRCODE code)
 //  ListView
 ////////////////////////////////////////////////////////////////////////////////
 ImageList ListView::m_cursor_images;
+MarqueeRegion ListView::m_marquee;
 
 // -----------------------------------------------------------------------------
 ListView::ListView(SSD1322 *oled, Playlist *playlist, uint8_t id)
@@ -535,6 +610,17 @@ void ListView::show()
     View::show();
 }
 
+// -----------------------------------------------------------------------------
+void ListView::hide()
+{
+    // m_marquee はすべてのリストで共有しているので、表示中のリストだけが外す
+    if( isVisible() )
+    {
+        Marquees().remove(&m_marquee);
+    }
+    View::hide();
+}
+
 // -----------------------------------------------------------------------------
 void ListView::refresh()
 {
@@ -584,6 +670,11 @@ void ListView::drawListItems()
 // -----------------------------------------------------------------------------
 void ListView::drawItem(uint16_t index, Rectangle& rc, bool selected)
 {
+    if( m_marquee.getRect().top == rc.top )
+    {
+        // この項目でスクロールしていたものを止める(選択中なら drawItemText() でまた始める)
+        Marquees().remove(&m_marquee);
+    }
     m_oled->fillRect(rc.left, rc.top, 16, 16, 0x00);
     m_oled->fillRect(rc.left+16, rc.top, rc.width-16, rc.height, selected? 0x02 : 0x00);
     if( selected )
@@ -592,6 +683,24 @@ void ListView::drawItem(uint16_t index, Rectangle& rc, bool selected)
     }
 }
 
+// -----------------------------------------------------------------------------
+//  項目の文字列を x から描く。選択中の項目で右端に収まらなければ、マーキーでスクロールさせる
+// -----------------------------------------------------------------------------
+void ListView::drawItemText(int16_t x, Rectangle& rc, const char *text, bool selected)
+{
+    int16_t width = rc.right() + 1 - x;
+    if( !selected || m_oled->getTextWidth(text, SSD1322::FONT_SMALL) <= width )
+    {
+        m_oled->drawString(x, rc.top, text, SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+        return;
+    }
+    m_marquee.init(x, rc.top, width);
+    m_marquee.setColor(0x0F, 0x02);
+    m_marquee.setText(text, m_oled->getFont(SSD1322::FONT_SMALL));
+    m_oled->drawMarquee(&m_marquee);
+    Marquees().add(&m_marquee);
+}
+
 // -----------------------------------------------------------------------------
 void ListView::moveCursor(int direction)
 {
@@ -616,9 +725,8 @@ void ListView::moveCursor(int direction)
             --m_page_pos;
             m_cursor_pos = ITEMS_PER_PAGE - 1;
             drawListItems();
-            m_oled->invalidateRect(0, 16, 256, 48);
             drawIndex();
-            m_oled->invalidateRect(221, 0, 35, 16);
+            m_oled->flipPage(-1);
         }
     }
     else
@@ -640,9 +748,8 @@ void ListView::moveCursor(int direction)
             ++m_page_pos;
             m_cursor_pos = 0;
             drawListItems();
-            m_oled->invalidateRect(0, 16, 256, 48);
             drawIndex();
-            m_oled->invalidateRect(221, 0, 35, 16);
+            m_oled->flipPage(1);
         }
     }
 }
@@ -657,9 +764,8 @@ void ListView::movePage(int direction)
             --m_page_pos;
             m_cursor_pos = ITEMS_PER_PAGE - 1;
             drawListItems();
-            m_oled->invalidateRect(0, 16, 256, 48);
             drawIndex();
-            m_oled->invalidateRect(221, 0, 35, 16);
+            m_oled->flipPage(-1);
         }
     }
     else
@@ -669,11 +775,98 @@ void ListView::movePage(int direction)
             ++m_page_pos;
             m_cursor_pos = 0;
             drawListItems();
-            m_oled->invalidateRect(0, 16, 256, 48);
             drawIndex();
-            m_oled->invalidateRect(221, 0, 35, 16);
+            m_oled->flipPage(1);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  index 番目の項目を選択する
+// -----------------------------------------------------------------------------
+void ListView::moveTo(uint16_t index)
+{
+    if( index >= m_item_count || index == getSelectedIndex() )
+    {
+        return;
+    }
+    m_page_pos = index / ITEMS_PER_PAGE;
+    m_cursor_pos = index % ITEMS_PER_PAGE;
+    drawListItems();
+    m_oled->invalidateRect(0, 16, 256, 48);
+    drawIndex();
+    m_oled->invalidateRect(221, 0, 35, 16);
+}
+
+// -----------------------------------------------------------------------------
+//  照合キーが key 以上の最初の項目(項目は照合キーの順に並んでいること)
+// -----------------------------------------------------------------------------
+uint16_t ListView::findSortKey(uint32_t key)
+{
+    uint16_t l = 0;
+    uint16_t r = m_item_count;
+    while( l < r )
+    {
+        uint16_t m = (l + r) / 2;
+        if( getSortKey(m) < key )
+        {
+            l = m + 1;
+        }
+        else
+        {
+            r = m;
+        }
+    }
+    return l;
+}
+
+// -----------------------------------------------------------------------------
+//  次(direction > 0)または前の頭文字の先頭に移動する
+//  前に移動するときは、頭文字の途中にいればまずその頭文字の先頭に移動する
+//  照合キーのないリストでは何もしない
+// -----------------------------------------------------------------------------
+void ListView::jumpInitial(int direction)
+{
+    if( m_item_count == 0 )
+    {
+        return;
+    }
+    uint16_t index = getSelectedIndex();
+    uint32_t initial = getSortKey(index) & 0xFF000000;
+    uint16_t target;
+    if( direction > 0 )
+    {
+        if( initial == 0xFF000000 )
+        {
+            return;
+        }
+        target = findSortKey(initial + 0x01000000);
+    }
+    else
+    {
+        target = findSortKey(initial);
+        if( target == index && index > 0 )
+        {
+            target = findSortKey(getSortKey(index - 1) & 0xFF000000);
         }
     }
+    moveTo(target);
+}
+
+// -----------------------------------------------------------------------------
+//  キューに追加した曲数をヘッダに表示する(次に画面を描き直すまで)
+// -----------------------------------------------------------------------------
+void ListView::showQueued(uint16_t count)
+{
+    char str[8];
+    char *p = str + sizeof(str) - 1;
+    *p = '\0';
+    p = formatNumber(count, p);
+    m_oled->fillRect(0, 0, 221, 15, 0x00);
+    int16_t x = m_oled->drawString(0, 0, "キューに", SSD1322::FONT_SMALL, 0x0F);
+    x = m_oled->drawString(x, 0, p, SSD1322::FONT_SMALL, 0x0F);
+    m_oled->drawString(x, 0, "曲追加しました", SSD1322::FONT_SMALL, 0x0F);
+    m_oled->invalidateRect(0, 0, 221, 15);
 }
 
 // -----------------------------------------------------------------------------
@@ -704,11 +897,21 @@ bool ListView::handleIRR(IRRCODE code)
 //  AlbumListView
 ////////////////////////////////////////////////////////////////////////////////
 AlbumListView::AlbumListView(SSD1322 *oled, Playlist *playlist)
-    : ListView(oled, playlist, AlbumListView::ID), m_artist(NULL)
+    : ListView(oled, playlist, AlbumListView::ID), m_artist(NULL), m_sorted(false)
 {
 
 }
 
+// -----------------------------------------------------------------------------
+Album *AlbumListView::getAlbum(uint16_t index)
+{
+    if( m_sorted )
+    {
+        return m_playlist->getSortedAlbum(m_artist, index);
+    }
+    return m_artist->getAlbums()[index];
+}
+
 // -----------------------------------------------------------------------------
 uint16_t AlbumListView::getItemCount()
 {
@@ -725,6 +928,10 @@ uint16_t AlbumListView::getInitialSelection()
     if( m_artist )
     {
         Album *album = m_artist->getSelectedAlbum();
+        if( m_sorted )
+        {
+            return m_playlist->getSortedIndexOfAlbum(m_artist, album);
+        }
         return m_artist->getIndexOfAlbum(album);
     }
     return 0;
@@ -743,14 +950,22 @@ void AlbumListView::drawHeader()
 void AlbumListView::drawItem(uint16_t index, Rectangle& rc, bool selected)
 {
     ListView::drawItem(index, rc, selected);
-    Album *album = m_artist->getAlbums()[index];
-    m_oled->drawString(rc.left+18, rc.top, album->getTitle(), SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+    Album *album = getAlbum(index);
+    drawItemText(rc.left+18, rc, album->getTitle(), selected);
+}
+
+// -----------------------------------------------------------------------------
+//  年順では頭文字で移動しない
+// -----------------------------------------------------------------------------
+uint32_t AlbumListView::getSortKey(uint16_t index)
+{
+    return m_sorted? m_playlist->getAlbumSortKey(m_artist, index) : 0;
 }
 
 // -----------------------------------------------------------------------------
 Album *AlbumListView::getSelection()
 {
-    return m_artist->getAlbums()[getSelectedIndex()];
+    return getAlbum(getSelectedIndex());
 }
 
 // -----------------------------------------------------------------------------
@@ -768,6 +983,7 @@ bool AlbumListView::handleIRR(IRRCODE code)
             m_playlist->selectArtistByID(m_artist->getID());
             m_artist->selectAlbumByID(getSelection()->getID());
             m_playlist->save();
+            Queue().setAlbum(getSelection());
             // breakしない
         case IRRemote::ZERO:
             // [0]キー : プレイバック画面に切り替える
@@ -781,6 +997,32 @@ bool AlbumListView::handleIRR(IRRCODE code)
                 View::show(ArtistListView::ID);
             }
             break;
+        case IRRemote::ONE:
+            // [1]キー : アルバムをキューの末尾に追加する
+            showQueued(Queue().appendAlbum(getSelection()));
+            break;
+        case IRRemote::THREE:
+            // [3]キー : 年順とタイトル順を切り替える
+            m_sorted = !m_sorted;
+            ListView::show();
+            break;
+        case IRRemote::FIVE:
+            // [5]キー : 次の頭文字に移動する(タイトル順のみ)
+            jumpInitial(1);
+            break;
+        case IRRemote::SEVEN:
+            // [7]キー : 前の頭文字に移動する(タイトル順のみ)
+            jumpInitial(-1);
+            break;
+        case IRRemote::POWER:
+            // [POWER]キー : 検索画面に切り替える
+            {
+                setArtist(m_artist);
+                SearchView *view = (SearchView *)(View::getView(SearchView::ID));
+                view->start(AlbumListView::ID);
+                View::show(SearchView::ID);
+            }
+            break;
         default:
             return false;
     }
@@ -808,7 +1050,7 @@ uint16_t ArtistListView::getInitialSelection()
 {
     if( m_artist )
     {
-        return m_playlist->getIndexOfArtist(m_artist);
+        return m_playlist->getSortedIndexOfArtist(m_artist);
     }
     return 0;
 }
@@ -824,14 +1066,22 @@ void ArtistListView::drawHeader()
 void ArtistListView::drawItem(uint16_t index, Rectangle& rc, bool selected)
 {
     ListView::drawItem(index, rc, selected);
-    Artist *artist = m_playlist->getArtists()[index];
-    m_oled->drawString(rc.left+18, rc.top, artist->getName(), SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+    Artist *artist = m_playlist->getSortedArtist(index);
+    drawItemText(rc.left+18, rc, artist->getName(), selected);
+}
+
+// -----------------------------------------------------------------------------
+uint32_t ArtistListView::getSortKey(uint16_t index)
+{
+    return m_playlist->getArtistSortKey(index);
 }
 
+// -----------------------------------------------------------------------------
+//  アーティストは読みの照合順(ASRT)で表示する
 // -----------------------------------------------------------------------------
 Artist *ArtistListView::getSelection()
 {
-    return m_playlist->getArtists()[getSelectedIndex()];
+    return m_playlist->getSortedArtist(getSelectedIndex());
 }
 
 // -----------------------------------------------------------------------------
@@ -855,6 +1105,1092 @@ bool ArtistListView::handleIRR(IRRCODE code)
             // [0]キー: プレイバック画面に切り替える
             View::show(PlaybackView::ID);
             break;
+        case IRRemote::ONE:
+            // [1]キー : アーティストの全アルバムをキューの末尾に追加する
+            showQueued(Queue().appendArtist(getSelection()));
+            break;
+        case IRRemote::THREE:
+            // [3]キー : よく聴く曲の画面に切り替える
+            setArtist(getSelection());
+            View::show(RankingView::ID);
+            break;
+        case IRRemote::FOUR:
+            // [4]キー : 年代順のアルバム一覧に切り替える
+            {
+                setArtist(getSelection());
+                AlbumIndexView *view = (AlbumIndexView *)(View::getView(AlbumIndexView::ID));
+                view->setIndex(Playlist::INDEX_YEAR);
+                View::show(AlbumIndexView::ID);
+            }
+            break;
+        case IRRemote::SIX:
+            // [6]キー : ジャンルの一覧に切り替える
+            setArtist(getSelection());
+            View::show(GenreListView::ID);
+            break;
+        case IRRemote::FIVE:
+            // [5]キー : 次の頭文字に移動する
+            jumpInitial(1);
+            break;
+        case IRRemote::SEVEN:
+            // [7]キー : 前の頭文字に移動する
+            jumpInitial(-1);
+            break;
+        case IRRemote::POWER:
+            // [POWER]キー : 検索画面に切り替える
+            {
+                setArtist(getSelection());
+                SearchView *view = (SearchView *)(View::getView(SearchView::ID));
+                view->start(ArtistListView::ID);
+                View::show(SearchView::ID);
+            }
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//  SearchView
+//  数字キーで名前を入力する(英字は ABC=2 ... WXYZ=9、かなは あ=1 か=2 ... わ=0)
+//  一致したアーティスト、アルバム、曲の順に表示する
+////////////////////////////////////////////////////////////////////////////////
+SearchView::SearchView(SSD1322 *oled, Playlist *playlist)
+    : ListView(oled, playlist, SearchView::ID), m_return_view(ArtistListView::ID),
+    m_digit_count(0), m_key(0)
+{
+    memset(m_digits, 0, sizeof(m_digits));
+}
+
+// -----------------------------------------------------------------------------
+void SearchView::init()
+{
+    ListView::init();
+    m_results.alloc(MAX_RESULTS);
+}
+
+// -----------------------------------------------------------------------------
+//  入力を空にして検索を始める。return_view は[POWER]で戻る画面
+// -----------------------------------------------------------------------------
+void SearchView::start(uint8_t return_view)
+{
+    m_return_view = return_view;
+    m_digit_count = 0;
+    m_digits[0] = '\0';
+    m_key = 0;
+    m_results.clear();
+}
+
+// -----------------------------------------------------------------------------
+//  検索結果のアルバム(曲であれば index にアルバム内の番号を返す)
+//  索引が playlist.dat と食い違っていて見つからなければ NULL
+// -----------------------------------------------------------------------------
+static Album *findAlbum(Artist *artist, const PlaylistSearchEntry& e, uint16_t& index)
+{
+    index = 0;
+    if( e.item & PLAYLIST_SEARCH_ALBUM )
+    {
+        uint16_t n = e.item & ~PLAYLIST_SEARCH_ALBUM;
+        return (n < artist->getAlbumCount())? artist->getAlbums()[n] : NULL;
+    }
+    return artist->getAlbumOfSong(e.item, index);
+}
+
+// -----------------------------------------------------------------------------
+//  索引の一致範囲から、重複を除いてアーティスト、アルバム、曲の順に取り出す
+//  プレイリストにない項目を指しているものは除く
+//  範囲は二分探索で求めるので、キー入力ごとに全体を調べ直しても十分に速い
+// -----------------------------------------------------------------------------
+void SearchView::search()
+{
+    m_results.clear();
+    uint32_t first;
+    uint32_t count = m_playlist->findSearchRange(m_key, m_digit_count, first);
+    for( int kind = 0 ; kind < 3 ; kind++ )
+    {
+        for( uint32_t i = 0 ; i < count && m_results.size() < m_results.capacity() ; i++ )
+        {
+            const PlaylistSearchEntry *e = m_playlist->getSearchEntry(first + i);
+            int k = (e->item == PLAYLIST_SEARCH_ARTIST)? 0 : (e->item & PLAYLIST_SEARCH_ALBUM)? 1 : 2;
+            if( k != kind || e->artist >= m_playlist->getArtistCount() )
+            {
+                continue;
+            }
+            uint16_t index;
+            if( k != 0 && !findAlbum(m_playlist->getArtists()[e->artist], *e, index) )
+            {
+                continue;
+            }
+            bool found = false;
+            for( uint16_t n = 0 ; n < m_results.size() && !found ; n++ )
+            {
+                found = (m_results[n].artist == e->artist && m_results[n].item == e->item);
+            }
+            if( !found )
+            {
+                m_results.push_back(*e);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+void SearchView::select(const PlaylistSearchEntry& e)
+{
+    Artist *artist = m_playlist->getArtists()[e.artist];
+    if( e.item == PLAYLIST_SEARCH_ARTIST )
+    {
+        // アーティスト : アルバム選択画面に切り替える
+        AlbumListView *view = (AlbumListView *)(View::getView(AlbumListView::ID));
+        view->setArtist(artist);
+        View::show(AlbumListView::ID);
+        return;
+    }
+
+    uint16_t index;
+    Album *album = findAlbum(artist, e, index);
+    if( !album )
+    {
+        return;
+    }
+    // アルバム : キューをそのアルバムに置き換えてプレイバック画面に切り替える
+    // 曲       : さらにその曲から再生を始める
+    Player().stop(true);
+    m_playlist->selectArtistByID(artist->getID());
+    artist->selectAlbumByID(album->getID());
+    m_playlist->save();
+    Queue().setAlbum(album, index);
+    if( !(e.item & PLAYLIST_SEARCH_ALBUM) )
+    {
+        Song *song = album->getCurrentSong();
+        Player().play(song->getFileName(), song->getFileSize());
+    }
+    View::show(PlaybackView::ID);
+}
+
+// -----------------------------------------------------------------------------
+uint16_t SearchView::getItemCount()
+{
+    return m_results.size();
+}
+
+// -----------------------------------------------------------------------------
+void SearchView::refresh()
+{
+    ListView::refresh();
+    if( m_results.size() == 0 )
+    {
+        const char *msg = (m_digit_count == 0)? "数字キーで名前を入力" : "見つかりません";
+        m_oled->drawString(18, 32, msg, SSD1322::FONT_SMALL, 0x07);
+    }
+}
+
+// -----------------------------------------------------------------------------
+void SearchView::drawHeader()
+{
+    int16_t x = m_oled->drawString(0, 0, "検索 : ", SSD1322::FONT_SMALL, 0x0F);
+    x = m_oled->drawString(x, 0, m_digits, SSD1322::FONT_SMALL, 0x0F);
+    m_oled->drawString(x, 0, "_", SSD1322::FONT_SMALL, 0x07);
+    m_oled->drawHzLine(0, 15, 256, 0x0F);
+}
+
+// -----------------------------------------------------------------------------
+void SearchView::drawItem(uint16_t index, Rectangle& rc, bool selected)
+{
+    ListView::drawItem(index, rc, selected);
+    const PlaylistSearchEntry& e = m_results[index];
+    if( e.artist >= m_playlist->getArtistCount() )
+    {
+        return;     // 検索した後にプレイリストが読み直された
+    }
+    Artist *artist = m_playlist->getArtists()[e.artist];
+    const char *name = artist->getName();
+    const char *owner = NULL;
+    if( e.item != PLAYLIST_SEARCH_ARTIST )
+    {
+        uint16_t n;
+        Album *album = findAlbum(artist, e, n);
+        if( !album )
+        {
+            return;
+        }
+        name = (e.item & PLAYLIST_SEARCH_ALBUM)? album->getTitle() : album->getSongs()[n]->getTitle();
+        owner = (e.item & PLAYLIST_SEARCH_ALBUM)? artist->getName() : album->getTitle();
+    }
+    int16_t x = m_oled->drawString(rc.left+18, rc.top, name, SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+    if( owner )
+    {
+        x = m_oled->drawString(x, rc.top, " / ", SSD1322::FONT_SMALL, 0x04);
+        m_oled->drawString(x, rc.top, owner, SSD1322::FONT_SMALL, 0x04);
+    }
+}
+
+// -----------------------------------------------------------------------------
+bool SearchView::handleIRR(IRRCODE code)
+{
+    int d = IRRemote::codeToDigit(code);
+    if( d >= 0 )
+    {
+        // [0]～[9]キー : １桁追加して検索し直す
+        if( m_digit_count < PLAYLIST_SEARCH_MAX_DIGITS )
+        {
+            m_key |= (uint32_t)(d + 1) << (28 - m_digit_count * 4);
+            m_digits[m_digit_count++] = '0' + d;
+            m_digits[m_digit_count] = '\0';
+            search();
+            ListView::show();
+        }
+        return true;
+    }
+    switch( code )
+    {
+        case IRRemote::UP:
+            moveCursor(-1);
+            break;
+        case IRRemote::DOWN:
+            moveCursor(1);
+            break;
+        case IRRemote::PREV:
+            movePage(-1);
+            break;
+        case IRRemote::NEXT:
+            movePage(1);
+            break;
+        case IRRemote::ST_REPT:
+            // [ST/REPT]キー : 選択中の項目を開く
+            if( m_results.size() > 0 )
+            {
+                select(m_results[getSelectedIndex()]);
+            }
+            break;
+        case IRRemote::POWER:
+            // [POWER]キー : １桁削除する。入力が空であれば元の画面に戻る
+            if( m_digit_count == 0 )
+            {
+                View::show(m_return_view);
+                break;
+            }
+            m_digits[--m_digit_count] = '\0';
+            m_key &= ~((uint32_t)0x0F << (28 - m_digit_count * 4));
+            search();
+            ListView::show();
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//  RankingView
+////////////////////////////////////////////////////////////////////////////////
+RankingView::RankingView(SSD1322 *oled, Playlist *playlist)
+    : ListView(oled, playlist, RankingView::ID), m_type(PlayStats::MOST_PLAYED)
+{
+}
+
+// -----------------------------------------------------------------------------
+//  index 番目の曲。playlist.dat から削除された曲は NULL
+// -----------------------------------------------------------------------------
+Song *RankingView::getSong(uint16_t index)
+{
+    const PlayStats::Counter *c = Stats().getRanking(m_type, index);
+    Album *album = c? m_playlist->getAlbumByID(c->album_id) : NULL;
+    if( !album || c->index >= album->getSongCount() )
+    {
+        return NULL;
+    }
+    return album->getSongs()[c->index];
+}
+
+// -----------------------------------------------------------------------------
+uint16_t RankingView::getItemCount()
+{
+    return Stats().getRankingCount(m_type);
+}
+
+// -----------------------------------------------------------------------------
+void RankingView::drawHeader()
+{
+    const char *title = (m_type == PlayStats::MOST_PLAYED)? "よく聴く曲" : "最近聴いた曲";
+    m_oled->drawString(0, 0, title, SSD1322::FONT_SMALL, 0x0F);
+    m_oled->drawHzLine(0, 15, 256, 0x0F);
+}
+
+// -----------------------------------------------------------------------------
+void RankingView::drawItem(uint16_t index, Rectangle& rc, bool selected)
+{
+    ListView::drawItem(index, rc, selected);
+    Song *song = getSong(index);
+    if( !song )
+    {
+        m_oled->drawString(rc.left+18, rc.top, "---", SSD1322::FONT_SMALL, 0x04);
+        return;
+    }
+    int16_t x = rc.left+18;
+    if( m_type == PlayStats::MOST_PLAYED )
+    {
+        // 再生回数
+        char str[8];
+        char *p = str + sizeof(str) - 1;
+        *p = '\0';
+        p = formatNumber(Stats().getRanking(m_type, index)->count, p);
+        x = m_oled->drawASCIIText(x, rc.top+4, p, SSD1322::FONT_TINY, 0x0A) + 4;
+    }
+    x = m_oled->drawString(x, rc.top, song->getTitle(), SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+    x = m_oled->drawString(x, rc.top, " / ", SSD1322::FONT_SMALL, 0x04);
+    m_oled->drawString(x, rc.top, song->getAlbum()->getArtist()->getName(), SSD1322::FONT_SMALL, 0x04);
+}
+
+// -----------------------------------------------------------------------------
+bool RankingView::handleIRR(IRRCODE code)
+{
+    if( ListView::handleIRR(code) )
+    {
+        return true;
+    }
+    switch( code )
+    {
+        case IRRemote::ST_REPT:
+            // [ST/REPT]キー : 曲のアルバムをキューにして、その曲から再生する
+            {
+                Song *song = (getItemCount() > 0)? getSong(getSelectedIndex()) : NULL;
+                if( !song )
+                {
+                    break;
+                }
+                Album *album = song->getAlbum();
+                Player().stop(true);
+                m_playlist->selectArtistByID(album->getArtist()->getID());
+                album->getArtist()->selectAlbumByID(album->getID());
+                m_playlist->save();
+                Queue().setAlbum(album, Stats().getRanking(m_type, getSelectedIndex())->index);
+                Player().play(song->getFileName(), song->getFileSize());
+                View::show(PlaybackView::ID);
+            }
+            break;
+        case IRRemote::THREE:
+            // [3]キー : よく聴く曲と最近聴いた曲を切り替える
+            m_type = (m_type == PlayStats::MOST_PLAYED)? PlayStats::RECENTLY_PLAYED : PlayStats::MOST_PLAYED;
+            ListView::show();
+            break;
+        case IRRemote::ZERO:
+            // [0]キー: プレイバック画面に切り替える
+            View::show(PlaybackView::ID);
+            break;
+        case IRRemote::NINE:
+            // [9]キー: アーティスト選択画面に切り替える
+            View::show(ArtistListView::ID);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//  AlbumIndexView
+////////////////////////////////////////////////////////////////////////////////
+AlbumIndexView::AlbumIndexView(SSD1322 *oled, Playlist *playlist)
+    : ListView(oled, playlist, AlbumIndexView::ID), m_type(Playlist::INDEX_YEAR), m_genre(0)
+{
+}
+
+// -----------------------------------------------------------------------------
+static bool isLeapYear(uint16_t year)
+{
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// -----------------------------------------------------------------------------
+//  UNIX時間を "YY/MM/DD" にする
+// -----------------------------------------------------------------------------
+static void formatDate(uint32_t t, char *str)
+{
+    static const uint8_t DAYS[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    uint32_t days = t / 86400;
+    uint16_t year = 1970;
+    while( days >= (isLeapYear(year)? 366U : 365U) )
+    {
+        days -= isLeapYear(year)? 366 : 365;
+        year++;
+    }
+    uint8_t month = 0;
+    while( month < 11 && days >= DAYS[month] + ((month == 1 && isLeapYear(year))? 1U : 0U) )
+    {
+        days -= DAYS[month] + ((month == 1 && isLeapYear(year))? 1 : 0);
+        month++;
+    }
+    uint16_t values[3] = {(uint16_t)(year % 100), (uint16_t)(month + 1), (uint16_t)(days + 1)};
+    for( int i = 0 ; i < 3 ; i++ )
+    {
+        str[i*3]   = '0' + values[i] / 10;
+        str[i*3+1] = '0' + values[i] % 10;
+        str[i*3+2] = (i < 2)? '/' : '\0';
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  表示する索引の範囲。戻り値は件数、first に索引内の先頭を返す
+//  playlist.dat が読み直されても、ジャンルの番号から範囲を求め直す
+// -----------------------------------------------------------------------------
+uint32_t AlbumIndexView::getRange(uint32_t& first)
+{
+    first = 0;
+    uint32_t count = m_playlist->getAlbumIndexCount(m_type);
+    if( m_type == Playlist::INDEX_GENRE )
+    {
+        const PlaylistGenreRecord *g = m_playlist->getGenre(m_genre);
+        if( !g || g->first_album >= count )
+        {
+            return 0;
+        }
+        first = g->first_album;
+        count = (g->album_count < count - first)? g->album_count : (count - first);
+    }
+    return (count < 0xFFFF)? count : 0xFFFF;
+}
+
+// -----------------------------------------------------------------------------
+const PlaylistAlbumIndexEntry *AlbumIndexView::getEntry(uint16_t index)
+{
+    uint32_t first;
+    if( index >= getRange(first) )
+    {
+        return NULL;
+    }
+    return m_playlist->getAlbumIndexEntry(m_type, first + index);
+}
+
+// -----------------------------------------------------------------------------
+//  index 番目のアルバム。索引が壊れていれば NULL
+// -----------------------------------------------------------------------------
+Album *AlbumIndexView::getAlbum(uint16_t index)
+{
+    return m_playlist->getIndexedAlbum(getEntry(index));
+}
+
+// -----------------------------------------------------------------------------
+uint16_t AlbumIndexView::getItemCount()
+{
+    uint32_t first;
+    return getRange(first);
+}
+
+// -----------------------------------------------------------------------------
+void AlbumIndexView::refresh()
+{
+    ListView::refresh();
+    if( getItemCount() == 0 )
+    {
+        m_oled->drawString(18, 32, "アルバムの索引がありません", SSD1322::FONT_SMALL, 0x07);
+    }
+}
+
+// -----------------------------------------------------------------------------
+void AlbumIndexView::drawHeader()
+{
+    if( m_type == Playlist::INDEX_GENRE )
+    {
+        const PlaylistGenreRecord *g = m_playlist->getGenre(m_genre);
+        int16_t x = m_oled->drawString(0, 0, "ジャンル : ", SSD1322::FONT_SMALL, 0x0F);
+        m_oled->drawString(x, 0, (g && g->name[0])? g->name : "不明", SSD1322::FONT_SMALL, 0x0F);
+    }
+    else
+    {
+        const char *title = (m_type == Playlist::INDEX_YEAR)? "年代順のアルバム" : "最近追加したアルバム";
+        m_oled->drawString(0, 0, title, SSD1322::FONT_SMALL, 0x0F);
+    }
+    m_oled->drawHzLine(0, 15, 256, 0x0F);
+}
+
+// -----------------------------------------------------------------------------
+//  追加日時順では追加した日付、それ以外では年を表示する
+// -----------------------------------------------------------------------------
+void AlbumIndexView::drawItem(uint16_t index, Rectangle& rc, bool selected)
+{
+    ListView::drawItem(index, rc, selected);
+    Album *album = getAlbum(index);
+    if( !album )
+    {
+        m_oled->drawString(rc.left+18, rc.top, "---", SSD1322::FONT_SMALL, 0x04);
+        return;
+    }
+    char str[10];
+    if( m_type == Playlist::INDEX_ADDED )
+    {
+        formatDate(getEntry(index)->key, str);
+    }
+    else
+    {
+        uint16_t year = album->getYear();
+        for( int i = 3 ; i >= 0 ; i-- )
+        {
+            str[i] = year? ('0' + year % 10) : '-';
+            year /= 10;
+        }
+        str[4] = '\0';
+    }
+    int16_t x = m_oled->drawASCIIText(rc.left+18, rc.top+4, str, SSD1322::FONT_TINY, 0x0A) + 4;
+    x = m_oled->drawString(x, rc.top, album->getTitle(), SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+    x = m_oled->drawString(x, rc.top, " / ", SSD1322::FONT_SMALL, 0x04);
+    m_oled->drawString(x, rc.top, album->getArtist()->getName(), SSD1322::FONT_SMALL, 0x04);
+}
+
+// -----------------------------------------------------------------------------
+bool AlbumIndexView::handleIRR(IRRCODE code)
+{
+    if( ListView::handleIRR(code) )
+    {
+        return true;
+    }
+    Album *album = (getItemCount() > 0)? getAlbum(getSelectedIndex()) : NULL;
+    switch( code )
+    {
+        case IRRemote::ST_REPT:
+            // [ST/REPT]キー : アルバム(アーティスト)を選択し、プレイバック画面に切り替える
+            if( !album )
+            {
+                break;
+            }
+            Player().stop(true);
+            m_playlist->selectArtistByID(album->getArtist()->getID());
+            album->getArtist()->selectAlbumByID(album->getID());
+            m_playlist->save();
+            Queue().setAlbum(album);
+            // breakしない
+        case IRRemote::ZERO:
+            // [0]キー : プレイバック画面に切り替える
+            View::show(PlaybackView::ID);
+            break;
+        case IRRemote::ONE:
+            // [1]キー : アルバムをキューの末尾に追加する
+            if( album )
+            {
+                showQueued(Queue().appendAlbum(album));
+            }
+            break;
+        case IRRemote::THREE:
+            // [3]キー : 年代順と追加日時順を切り替える
+            m_type = (m_type == Playlist::INDEX_YEAR)? Playlist::INDEX_ADDED : Playlist::INDEX_YEAR;
+            ListView::show();
+            break;
+        case IRRemote::SIX:
+            // [6]キー : ジャンルの一覧に切り替える
+            View::show(GenreListView::ID);
+            break;
+        case IRRemote::NINE:
+            // [9]キー: アーティスト選択画面に切り替える
+            View::show(ArtistListView::ID);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//  GenreListView
+////////////////////////////////////////////////////////////////////////////////
+GenreListView::GenreListView(SSD1322 *oled, Playlist *playlist)
+    : ListView(oled, playlist, GenreListView::ID)
+{
+}
+
+// -----------------------------------------------------------------------------
+uint16_t GenreListView::getItemCount()
+{
+    uint32_t count = m_playlist->getGenreCount();
+    return (count < 0xFFFF)? count : 0xFFFF;
+}
+
+// -----------------------------------------------------------------------------
+void GenreListView::refresh()
+{
+    ListView::refresh();
+    if( getItemCount() == 0 )
+    {
+        m_oled->drawString(18, 32, "ジャンルの索引がありません", SSD1322::FONT_SMALL, 0x07);
+    }
+}
+
+// -----------------------------------------------------------------------------
+void GenreListView::drawHeader()
+{
+    m_oled->drawString(0, 0, "ジャンル選択", SSD1322::FONT_SMALL, 0x0F);
+    m_oled->drawHzLine(0, 15, 256, 0x0F);
+}
+
+// -----------------------------------------------------------------------------
+//  アルバム数とジャンル名。ジャンルが不明なアルバムは「不明」にまとめる
+// -----------------------------------------------------------------------------
+void GenreListView::drawItem(uint16_t index, Rectangle& rc, bool selected)
+{
+    ListView::drawItem(index, rc, selected);
+    const PlaylistGenreRecord *g = m_playlist->getGenre(index);
+    char str[8];
+    char *p = str + sizeof(str) - 1;
+    *p = '\0';
+    p = formatNumber(g->album_count, p);
+    int16_t x = m_oled->drawASCIIText(rc.left+18, rc.top+4, p, SSD1322::FONT_TINY, 0x0A) + 4;
+    m_oled->drawString(x, rc.top, g->name[0]? g->name : "不明", SSD1322::FONT_SMALL, selected? 0x0F : 0x07);
+}
+
+// -----------------------------------------------------------------------------
+bool GenreListView::handleIRR(IRRCODE code)
+{
+    if( ListView::handleIRR(code) )
+    {
+        return true;
+    }
+    switch( code )
+    {
+        case IRRemote::ST_REPT:
+            // [ST/REPT]キー : 選択中のジャンルのアルバム一覧に切り替える
+            if( getItemCount() > 0 )
+            {
+                AlbumIndexView *view = (AlbumIndexView *)(View::getView(AlbumIndexView::ID));
+                view->setIndex(Playlist::INDEX_GENRE, getSelectedIndex());
+                View::show(AlbumIndexView::ID);
+            }
+            break;
+        case IRRemote::FOUR:
+            // [4]キー : 年代順のアルバム一覧に切り替える
+            {
+                AlbumIndexView *view = (AlbumIndexView *)(View::getView(AlbumIndexView::ID));
+                view->setIndex(Playlist::INDEX_YEAR);
+                View::show(AlbumIndexView::ID);
+            }
+            break;
+        case IRRemote::THREE:
+            // [3]キー : フォルダ選択画面に切り替える
+            View::show(FolderListView::ID);
+            break;
+        case IRRemote::ZERO:
+            // [0]キー: プレイバック画面に切り替える
+            View::show(PlaybackView::ID);
+            break;
+        case IRRemote::NINE:
+            // [9]キー: アーティスト選択画面に切り替える
+            View::show(ArtistListView::ID);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//  FolderListView
+////////////////////////////////////////////////////////////////////////////////
+FolderListView::FolderListView(SSD1322 *oled, Playlist *playlist)
+    : ListView(oled, playlist, FolderListView::ID), m_listing(NULL), m_next_direction(0)
+{
+    m_path[0] = '\0';
+    m_playing[0] = '\0';
+}
+
+// -----------------------------------------------------------------------------
+//  列挙済みの項目から、name の次(direction > 0)または前の曲(フォルダ以外)を探す
+//  戻り値は見つかった項目の位置。なければ -1、まだ列挙していない項目が要れば -2
+// -----------------------------------------------------------------------------
+static int16_t findNext(FolderListing *listing, const char *name, int direction)
+{
+    int16_t more = listing->isComplete()? -1 : -2;
+    uint16_t index = 0;
+    FolderListing::Entry *e;
+    while( (e = listing->getEntry(index)) && strcmp(e->name, name) )
+    {
+        index++;
+    }
+    if( !e )
+    {
+        return more;
+    }
+    do
+    {
+        if( direction < 0 && index == 0 )
+        {
+            return -1;
+        }
+        index += (direction < 0)? -1 : 1;
+        e = listing->getEntry(index);
+    } while( e && e->directory );
+    return e? index : more;
+}
+
+// -----------------------------------------------------------------------------
+//  path のフォルダを表示する。一覧がキャッシュにあれば、前回選択していた項目に戻る
+// -----------------------------------------------------------------------------
+void FolderListView::open(const char *path)
+{
+    if( m_listing )
+    {
+        m_listing->setSelection(getSelectedIndex());
+    }
+    strcpy(m_path, path);
+    m_listing = m_cache.get(m_path);
+    m_listing->loadNext(ENTRIES_PER_FRAME);
+    ListView::show();
+}
+
+// -----------------------------------------------------------------------------
+void FolderListView::openParent()
+{
+    if( !m_path[0] )
+    {
+        return;
+    }
+    char path[FolderListing::MAX_PATH_LENGTH];
+    strcpy(path, m_path);
+    char *p = strrchr(path, '/');
+    if( p )
+    {
+        *p = '\0';
+    }
+    else
+    {
+        path[0] = '\0';
+    }
+    open(path);
+}
+
+// -----------------------------------------------------------------------------
+//  列挙が進んだ分だけ項目数を更新する。戻り値は更新前の項目数
+// -----------------------------------------------------------------------------
+uint16_t FolderListView::updateCount()
+{
+    uint16_t count = m_item_count;
+    m_item_count = getItemCount();
+    m_page_count = (m_item_count / ITEMS_PER_PAGE) + ((m_item_count % ITEMS_PER_PAGE)? 1 : 0);
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+uint16_t FolderListView::getItemCount()
+{
+    return m_listing? m_listing->getCount() : 0;
+}
+
+// -----------------------------------------------------------------------------
+uint16_t FolderListView::getInitialSelection()
+{
+    uint16_t index = m_listing? m_listing->getSelection() : 0;
+    return (index < getItemCount())? index : 0;
+}
+
+// -----------------------------------------------------------------------------
+void FolderListView::show()
+{
+    if( !m_listing )
+    {
+        m_listing = m_cache.get(m_path);
+        m_listing->loadNext(ENTRIES_PER_FRAME);
+    }
+    ListView::show();
+}
+
+// -----------------------------------------------------------------------------
+void FolderListView::refresh()
+{
+    ListView::refresh();
+    if( getItemCount() == 0 && m_listing && m_listing->isComplete() )
+    {
+        m_oled->drawString(18, 32, "ファイルがありません", SSD1322::FONT_SMALL, 0x07);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  フォルダの列挙を ENTRIES_PER_FRAME ずつ進め、表示中のページに入った項目を描く
+// -----------------------------------------------------------------------------
+void FolderListView::update()
+{
+    if( !m_listing || m_listing->isComplete() )
+    {
+        return;
+    }
+    if( !m_listing->loadNext(ENTRIES_PER_FRAME) )
+    {
+        if( m_listing->isComplete() && getItemCount() == 0 )
+        {
+            invalidate(false);
+        }
+        return;
+    }
+    uint16_t first = updateCount();
+    drawIndex();
+    m_oled->invalidateRect(221, 0, 35, 16);
+    uint16_t last = cursorPosToIndex(ITEMS_PER_PAGE);
+    for( uint16_t index = first ; index < m_item_count && index < last ; index++ )
+    {
+        if( index < cursorPosToIndex(0) )
+        {
+            continue;
+        }
+        Rectangle rc;
+        getItemRect(index, rc);
+        drawItem(index, rc, index == getSelectedIndex());
+        m_oled->invalidateRect(rc);
+    }
+}
+
+// -----------------------------------------------------------------------------
+void FolderListView::drawHeader()
+{
+    int16_t x = m_oled->drawString(0, 0, "フォルダ : ", SSD1322::FONT_SMALL, 0x0F);
+    m_oled->drawString(x, 0, m_path[0]? m_path : "/", SSD1322::FONT_SMALL, 0x0F);
+    m_oled->drawHzLine(0, 15, 256, 0x0F);
+}
+
+// -----------------------------------------------------------------------------
+//  ListView::drawIndex は２桁までなので、100項目以上は小さい文字で表示する
+// -----------------------------------------------------------------------------
+void FolderListView::drawIndex()
+{
+    if( m_item_count < 100 )
+    {
+        ListView::drawIndex();
+        return;
+    }
+    char str[12];
+    char *p = str + sizeof(str) - 1;
+    *p = '\0';
+    p = formatNumber(m_item_count, p);
+    *--p = '/';
+    p = formatNumber(1 + getSelectedIndex(), p);
+    m_oled->fillRect(221, 0, 35, 15, 0x00);
+    m_oled->drawASCIIText(221, 4, p, SSD1322::FONT_TINY, 0x0F);
+}
+
+// -----------------------------------------------------------------------------
+//  フォルダは "DIR"、再生中の曲は "PLAY" を付ける
+//  曲は ID3 タグの曲名とファイル名(曲名がなければファイル名だけ)
+// -----------------------------------------------------------------------------
+void FolderListView::drawItem(uint16_t index, Rectangle& rc, bool selected)
+{
+    ListView::drawItem(index, rc, selected);
+    FolderListing::Entry *e = m_listing->getEntry(index);
+    if( !e )
+    {
+        return;
+    }
+    int16_t x = rc.left+18;
+    uint8_t color = selected? 0x0F : 0x07;
+    if( e->directory )
+    {
+        x = m_oled->drawASCIIText(x, rc.top+4, "DIR", SSD1322::FONT_TINY, 0x0A) + 4;
+        m_oled->drawString(x, rc.top, e->name, SSD1322::FONT_SMALL, color);
+        return;
+    }
+    char path[FolderListing::MAX_PATH_LENGTH];
+    m_listing->getEntryPath(index, path);
+    if( !Player().isStopped() && !strcmp(path, m_playing) )
+    {
+        x = m_oled->drawASCIIText(x, rc.top+4, "PLAY", SSD1322::FONT_TINY, 0x0A) + 4;
+    }
+    const char *title = m_listing->getTitle(index);
+    if( title )
+    {
+        x = m_oled->drawString(x, rc.top, title, SSD1322::FONT_SMALL, color);
+        x = m_oled->drawString(x, rc.top, " / ", SSD1322::FONT_SMALL, 0x04);
+        m_oled->drawString(x, rc.top, e->name, SSD1322::FONT_SMALL, 0x04);
+    }
+    else
+    {
+        m_oled->drawString(x, rc.top, e->name, SSD1322::FONT_SMALL, color);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  最後に再生した曲がこのビューから再生したものかどうか
+// -----------------------------------------------------------------------------
+bool FolderListView::isPlaying()
+{
+    return m_playing[0] && !strcmp(Player().getFileName(), m_playing);
+}
+
+// -----------------------------------------------------------------------------
+//  再生中の曲と同じフォルダの次(direction > 0)または前の曲を探し始める
+//  実際に探して再生するのは updateNext()。一覧がキャッシュから消えていても、
+//  列挙し直すのは１回のループで ENTRIES_PER_FRAME ずつにとどめる
+// -----------------------------------------------------------------------------
+void FolderListView::playNext(int direction)
+{
+    m_next_direction = (direction < 0)? -1 : 1;
+    updateNext();
+}
+
+// -----------------------------------------------------------------------------
+//  playNext() で探している曲が見つかれば再生する。loop() から毎回呼ぶこと
+//  足りなければ再生中の曲のフォルダを ENTRIES_PER_FRAME だけ列挙して、次のループで続ける
+// -----------------------------------------------------------------------------
+void FolderListView::updateNext()
+{
+    if( !m_next_direction )
+    {
+        return;
+    }
+    if( !Player().isStopped() && !isPlaying() )
+    {
+        // 探している間に、プレイリストの曲が再生された
+        m_next_direction = 0;
+        return;
+    }
+    char path[FolderListing::MAX_PATH_LENGTH];
+    strcpy(path, m_playing);
+    char *p = strrchr(path, '/');
+    const char *name = m_playing + (p? (p - path + 1) : 0);
+    if( p )
+    {
+        *p = '\0';
+    }
+    else
+    {
+        path[0] = '\0';
+    }
+    // 再生中の曲のフォルダはキャッシュに残しておく(表示中の一覧は追い出さないよう先に触れておく)
+    if( m_listing )
+    {
+        m_cache.find(m_path);
+    }
+    FolderListing *listing = m_cache.get(path);
+    m_cache.pin(listing);
+
+    int16_t index = findNext(listing, name, m_next_direction);
+    if( index == -2 )
+    {
+        if( listing->loadNext(ENTRIES_PER_FRAME) && listing == m_listing && isVisible() )
+        {
+            updateCount();
+            invalidate(false);
+        }
+        return;
+    }
+    m_next_direction = 0;
+    if( index >= 0 )
+    {
+        listing->getEntryPath(index, path);
+        Serial.println(path);
+        Player().stop(true);
+        if( Player().play(path) )
+        {
+            strcpy(m_playing, path);
+        }
+        if( listing == m_listing && isVisible() )
+        {
+            invalidate(false);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  このビューから再生中の曲に対する[PREV][NEXT]キー。同じフォルダの中で移動する
+//  プレイリストの曲を再生中であれば何もせず false を返す
+// -----------------------------------------------------------------------------
+bool FolderListView::controlAudio(IRRCODE code)
+{
+    if( Player().isStopped() || !isPlaying() )
+    {
+        return false;
+    }
+    switch( code )
+    {
+        case IRRemote::PREV:
+            Serial.println("prev");
+            playNext(-1);
+            break;
+        case IRRemote::NEXT:
+            Serial.println("next");
+            playNext(1);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  フォルダの一覧をすべて捨てる(SDカードの内容が変わったとき)
+//  表示中でないときに呼ぶこと
+// -----------------------------------------------------------------------------
+void FolderListView::clearCache()
+{
+    m_cache.clear();
+    m_listing = NULL;
+    m_next_direction = 0;
+}
+
+// -----------------------------------------------------------------------------
+bool FolderListView::handleIRR(IRRCODE code)
+{
+    if( ListView::handleIRR(code) )
+    {
+        m_listing->setSelection(getSelectedIndex());
+        return true;
+    }
+    switch( code )
+    {
+        case IRRemote::ST_REPT:
+            // [ST/REPT]キー : フォルダに入る。曲であれば再生する
+            {
+                uint16_t index = getSelectedIndex();
+                FolderListing::Entry *e = m_listing->getEntry(index);
+                char path[FolderListing::MAX_PATH_LENGTH];
+                if( !e || !m_listing->getEntryPath(index, path) )
+                {
+                    break;
+                }
+                if( e->directory )
+                {
+                    open(path);
+                    break;
+                }
+                Serial.println(path);
+                m_next_direction = 0;
+                Player().stop(true);
+                if( Player().play(path) )
+                {
+                    strcpy(m_playing, path);
+                    m_cache.pin(m_listing);
+                }
+                invalidate(false);
+            }
+            break;
+        case IRRemote::ONE:
+            // [1]キー : 親フォルダに戻る
+            openParent();
+            break;
+        case IRRemote::FOUR:
+            // [4]キー : 年代順のアルバム一覧に切り替える
+            {
+                AlbumIndexView *view = (AlbumIndexView *)(View::getView(AlbumIndexView::ID));
+                view->setIndex(Playlist::INDEX_YEAR);
+                View::show(AlbumIndexView::ID);
+            }
+            break;
+        case IRRemote::SIX:
+            // [6]キー : ジャンルの一覧に切り替える
+            View::show(GenreListView::ID);
+            break;
+        case IRRemote::ZERO:
+            // [0]キー: プレイバック画面に切り替える
+            View::show(PlaybackView::ID);
+            break;
+        case IRRemote::NINE:
+            // [9]キー: アーティスト選択画面に切り替える
+            View::show(ArtistListView::ID);
+            break;
         default:
             return false;
     }
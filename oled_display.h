@@ -7,8 +7,11 @@
 #include "playlist.h"
 #include "ir_remote.h"
 #include "spectrum_analyzer.h"
+#include "play_queue.h"
+#include "play_stats.h"
+#include "folder_cache.h"
 
-#define NUM_VIEWS   8   // 余裕を持った値だが、ビューを追加するときはこの値を超えていないかチェック
+#define NUM_VIEWS   11  // 余裕を持った値だが、ビューを追加するときはこの値を超えていないかチェック
 
 // -----------------------------------------------------------------------------
 class View
@@ -60,11 +63,12 @@ class PlaybackView : public View
         uint8_t    m_state;
         uint8_t    m_track_number[2];    // トラックNo.（十の位、一の位）
         uint8_t    m_elapsed_time[5];    // 演奏時間（MM:SS）
-        ScrollText m_scroll_text;
+        MarqueeRegion m_track_info[2];  // 上段、下段(同じグループで１段ずつスクロールする)
 
         SpectrumAnalyzer *m_analyzer;
         uint8_t m_spectrum[SpectrumAnalyzer::NUM_CHANNELS];     // 各バンドのスペアナ表示値(0～16)
         uint8_t m_spectrum_gain;
+        uint8_t m_load_progress;    // プレイリストの読み込みの進捗(%)
 
         void setScrollText();
         void drawState(bool force_redraw);
@@ -73,8 +77,10 @@ class PlaybackView : public View
         void drawSpectrum(bool force_redraw);
         void drawAlbumInfo(bool force_redraw);
         void drawTrackInfo(int row = -1);  //bool force_redraw);
+        void drawLoadProgress(bool force_redraw);
     
     protected:
+        void hide();
         void refresh();
 
     public:
@@ -96,6 +102,7 @@ class ListView : public View
         uint16_t m_page_pos;
         uint16_t m_cursor_pos;
         void show();
+        void hide();
         void refresh();
         uint16_t cursorPosToIndex(uint16_t pos){
             return m_page_pos * ITEMS_PER_PAGE + pos; 
@@ -111,10 +118,17 @@ class ListView : public View
         virtual void drawHeader(){}
         virtual void drawIndex();
         virtual void drawItem(uint16_t index, Rectangle& rc, bool selected);
+        void drawItemText(int16_t x, Rectangle& rc, const char *text, bool selected);
+        virtual uint32_t getSortKey(uint16_t index){ return 0; }
+        void showQueued(uint16_t count);
+        void moveTo(uint16_t index);
+        void jumpInitial(int direction);
 
     private:
         static ImageList m_cursor_images;
+        static MarqueeRegion m_marquee;     // 選択中の項目が収まらないときにスクロールさせる
         void drawListItems();
+        uint16_t findSortKey(uint32_t key);
 
     public:
         ListView(SSD1322 *oled, Playlist *playlist, uint8_t id);
@@ -130,12 +144,15 @@ class AlbumListView : public ListView
 {
     private:
         Artist *m_artist;
+        bool    m_sorted;           // タイトル順(false は年順)
+        Album  *getAlbum(uint16_t index);
 
     protected:
         uint16_t getItemCount();
         uint16_t getInitialSelection();
         void drawHeader();
         void drawItem(uint16_t index, Rectangle& rc, bool selected);
+        uint32_t getSortKey(uint16_t index);
 
     public:
         enum{ID = 2};
@@ -156,6 +173,7 @@ class ArtistListView : public ListView
         uint16_t getInitialSelection();
         void drawHeader();
         void drawItem(uint16_t index, Rectangle& rc, bool selected);
+        uint32_t getSortKey(uint16_t index);
 
     public:
         enum{ID = 3};
@@ -165,6 +183,135 @@ class ArtistListView : public ListView
         bool handleIRR(IRRCODE code);
 };
 
+// -----------------------------------------------------------------------------
+//  数字キーによる前方一致検索(アーティスト、アルバム、曲)
+// -----------------------------------------------------------------------------
+class SearchView : public ListView
+{
+    private:
+        enum{MAX_RESULTS = 99};     // ListView::drawIndex が表示できる件数
+        uint8_t  m_return_view;     // [POWER]で戻る画面
+        uint8_t  m_digit_count;
+        char     m_digits[PLAYLIST_SEARCH_MAX_DIGITS + 1];
+        uint32_t m_key;
+        Vector<PlaylistSearchEntry> m_results;
+        void search();
+        void select(const PlaylistSearchEntry& e);
+
+    protected:
+        uint16_t getItemCount();
+        void refresh();
+        void drawHeader();
+        void drawItem(uint16_t index, Rectangle& rc, bool selected);
+
+    public:
+        enum{ID = 7};
+        SearchView(SSD1322 *oled, Playlist *playlist);
+        void init();
+        void start(uint8_t return_view);
+        bool handleIRR(IRRCODE code);
+};
+
+// -----------------------------------------------------------------------------
+//  よく聴く曲、最近聴いた曲(PlayStats のランキング)
+// -----------------------------------------------------------------------------
+class RankingView : public ListView
+{
+    private:
+        uint8_t m_type;             // PlayStats::MOST_PLAYED, RECENTLY_PLAYED
+        Song   *getSong(uint16_t index);
+
+    protected:
+        uint16_t getItemCount();
+        void drawHeader();
+        void drawItem(uint16_t index, Rectangle& rc, bool selected);
+
+    public:
+        enum{ID = 8};
+        RankingView(SSD1322 *oled, Playlist *playlist);
+        bool handleIRR(IRRCODE code);
+};
+
+// -----------------------------------------------------------------------------
+//  年代順、追加日時順、ジャンル別のアルバム一覧(playlist.dat のアルバムの索引)
+// -----------------------------------------------------------------------------
+class AlbumIndexView : public ListView
+{
+    private:
+        uint8_t  m_type;            // Playlist::INDEX_YEAR, INDEX_ADDED, INDEX_GENRE
+        uint32_t m_genre;           // INDEX_GENRE のときのジャンルの番号
+        uint32_t getRange(uint32_t& first);
+        const PlaylistAlbumIndexEntry *getEntry(uint16_t index);
+        Album   *getAlbum(uint16_t index);
+
+    protected:
+        uint16_t getItemCount();
+        void refresh();
+        void drawHeader();
+        void drawItem(uint16_t index, Rectangle& rc, bool selected);
+
+    public:
+        enum{ID = 9};
+        AlbumIndexView(SSD1322 *oled, Playlist *playlist);
+        void setIndex(uint8_t type, uint32_t genre=0){ m_type = type; m_genre = genre; }
+        bool handleIRR(IRRCODE code);
+};
+
+// -----------------------------------------------------------------------------
+//  ジャンルの一覧
+// -----------------------------------------------------------------------------
+class GenreListView : public ListView
+{
+    protected:
+        uint16_t getItemCount();
+        void refresh();
+        void drawHeader();
+        void drawItem(uint16_t index, Rectangle& rc, bool selected);
+
+    public:
+        enum{ID = 10};
+        GenreListView(SSD1322 *oled, Playlist *playlist);
+        bool handleIRR(IRRCODE code);
+};
+
+// -----------------------------------------------------------------------------
+//  SDカードのフォルダをたどって曲を選ぶ(playlist.dat にない曲も再生できる)
+//  フォルダの一覧は update() で少しずつ列挙し、FolderCache に残しておく
+// -----------------------------------------------------------------------------
+class FolderListView : public ListView
+{
+    private:
+        enum{ENTRIES_PER_FRAME = 8};    // update() １回で列挙するエントリ数
+        FolderCache    m_cache;
+        FolderListing *m_listing;
+        char           m_path[FolderListing::MAX_PATH_LENGTH];       // 表示中のフォルダ
+        char           m_playing[FolderListing::MAX_PATH_LENGTH];    // このビューから再生した曲
+        int8_t         m_next_direction;    // playNext() で探している方向(0 なら探していない)
+        void open(const char *path);
+        void openParent();
+        uint16_t updateCount();
+
+    protected:
+        uint16_t getItemCount();
+        uint16_t getInitialSelection();
+        void show();
+        void refresh();
+        void drawHeader();
+        void drawIndex();
+        void drawItem(uint16_t index, Rectangle& rc, bool selected);
+
+    public:
+        enum{ID = 11};
+        FolderListView(SSD1322 *oled, Playlist *playlist);
+        void update();
+        bool isPlaying();
+        void playNext(int direction);
+        void updateNext();
+        bool controlAudio(IRRCODE code);
+        void clearCache();
+        bool handleIRR(IRRCODE code);
+};
+
 // -----------------------------------------------------------------------------
 class SSLine
 {
@@ -0,0 +1,506 @@
+#include <Arduino.h>
+#include <SD.h>
+#include "play_queue.h"
+#include "eeprom_24lc.h"
+
+// queue.dat のヘッダ
+struct PlayQueueHeader
+{
+    uint32_t magic;
+    uint16_t serial;
+    uint16_t count;         // 曲数。続いて Entry[count], 再生順 uint16_t[count]
+    uint16_t shuffle;
+    uint16_t fixed;         // 保存時点で再生順が確定していた範囲
+    uint32_t seed;
+};
+
+// -----------------------------------------------------------------------------
+PlayQueue& Queue()
+{
+    static PlayQueue queue;
+    return queue;
+}
+
+// -----------------------------------------------------------------------------
+PlayQueue::PlayQueue() : m_playlist(NULL), m_path(NULL), m_pos(0), m_fixed(0),
+    m_shuffle(false), m_seed(1), m_rand(1), m_serial(0)
+{
+}
+
+// -----------------------------------------------------------------------------
+//  乱数(xorshift32)。同じ種からは常に同じ系列になる
+// -----------------------------------------------------------------------------
+uint32_t PlayQueue::random()
+{
+    m_rand ^= m_rand << 13;
+    m_rand ^= m_rand >> 17;
+    m_rand ^= m_rand << 5;
+    return m_rand;
+}
+
+// -----------------------------------------------------------------------------
+//  m_order の pos までの再生順を確定させる
+//  シャッフル中は、未確定の範囲から１曲を選んで入れ替える(Fisher-Yates の１段)
+// -----------------------------------------------------------------------------
+void PlayQueue::fix(uint16_t pos)
+{
+    uint16_t count = m_order.size();
+    while( m_fixed <= pos && m_fixed < count )
+    {
+        if( m_shuffle )
+        {
+            uint16_t j = m_fixed + random() % (count - m_fixed);
+            uint16_t t = m_order[m_fixed];
+            m_order[m_fixed] = m_order[j];
+            m_order[j] = t;
+        }
+        m_fixed++;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  再生順を初期化し、m_entries の first 番目の曲を現在位置にする
+//  シャッフル中は first を先頭に置き、残りは再生するにつれて決める
+// -----------------------------------------------------------------------------
+void PlayQueue::resetOrder(uint16_t first)
+{
+    m_order.clear();
+    for( uint16_t i = 0 ; i < m_entries.size() ; i++ )
+    {
+        m_order.push_back(i);
+    }
+    if( m_shuffle )
+    {
+        m_order[0] = first;
+        m_order[first] = 0;
+        m_pos = 0;
+        m_fixed = 1;
+    }
+    else
+    {
+        m_pos = first;
+        m_fixed = m_order.size();
+    }
+}
+
+// -----------------------------------------------------------------------------
+Song *PlayQueue::resolve(uint16_t pos)
+{
+    if( pos >= m_order.size() )
+    {
+        return NULL;
+    }
+    Entry& e = m_entries[m_order[pos]];
+    Album *album = m_playlist->getAlbumByID(e.album_id);
+    if( !album || e.index >= album->getSongCount() )
+    {
+        return NULL;
+    }
+    return album->getSongs()[e.index];
+}
+
+// -----------------------------------------------------------------------------
+//  pos の曲を現在位置とし、その曲をプレイリストの選択状態(表示される曲)にする
+// -----------------------------------------------------------------------------
+bool PlayQueue::select(uint16_t pos)
+{
+    Song *song = resolve(pos);
+    if( !song )
+    {
+        return false;
+    }
+    Album *album = song->getAlbum();
+    Artist *artist = album->getArtist();
+    m_pos = pos;
+    m_playlist->selectArtistByID(artist->getID());
+    artist->selectAlbumByID(album->getID());
+    album->seekTo(m_entries[m_order[pos]].index);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  曲の m_order 上の位置。見つからなければ 0xFFFF
+// -----------------------------------------------------------------------------
+uint16_t PlayQueue::find(uint16_t album_id, uint16_t index)
+{
+    for( uint16_t p = 0 ; p < m_order.size() ; p++ )
+    {
+        Entry& e = m_entries[m_order[p]];
+        if( e.album_id == album_id && e.index == index )
+        {
+            return p;
+        }
+    }
+    return 0xFFFF;
+}
+
+// -----------------------------------------------------------------------------
+//  queue.dat と EEPROM から復元する。失敗した場合は選択中のアルバムをキューにする
+// -----------------------------------------------------------------------------
+void PlayQueue::begin(Playlist *playlist, const char *path)
+{
+    m_playlist = playlist;
+    m_path = path;
+    m_entries.alloc(MAX_ENTRIES);
+    m_order.alloc(MAX_ENTRIES);
+    if( loadFile() )
+    {
+        Serial.print(m_entries.size(), DEC);
+        Serial.println(" song(s) in queue");
+        validate();
+    }
+    else
+    {
+        Artist *artist = m_playlist->getSelectedArtist();
+        setAlbum(artist->getSelectedAlbum());
+    }
+}
+
+// -----------------------------------------------------------------------------
+bool PlayQueue::loadFile()
+{
+    SDLock lock;
+    File f = SD.open(m_path);
+    if( !f )
+    {
+        return false;
+    }
+    PlayQueueHeader header;
+    bool result = (f.read(&header, sizeof(header)) == sizeof(header) && header.magic == MAGIC &&
+        header.count > 0 && header.count <= MAX_ENTRIES && header.fixed <= header.count);
+    for( uint16_t i = 0 ; i < header.count && result ; i++ )
+    {
+        Entry e;
+        result = (f.read(&e, sizeof(e)) == sizeof(e));
+        m_entries.push_back(e);
+    }
+    for( uint16_t i = 0 ; i < header.count && result ; i++ )
+    {
+        uint16_t n;
+        result = (f.read(&n, sizeof(n)) == sizeof(n) && n < header.count);
+        m_order.push_back(n);
+    }
+    f.close();
+    if( !result )
+    {
+        Serial.println("queue: broken file ignored");
+        m_entries.clear();
+        m_order.clear();
+        return false;
+    }
+    m_serial = header.serial;
+    m_shuffle = (header.shuffle != 0);
+    m_fixed = header.fixed;
+    m_seed = m_rand = header.seed;
+    m_pos = 0;
+
+    // EEPROM から現在位置を読み込む
+    // +00 +01 : queue.dat の serial
+    // +02 +03 : 現在位置
+    // +04     : チェックサム
+    uint8_t config[5];
+    EEPROM().read(EEPROM_ADDR, 5, config);
+    uint8_t sum = 0;
+    for( int i = 0 ; i < 5 ; i++ )
+    {
+        sum += config[i];
+    }
+    uint16_t *p = (uint16_t *)config;
+    if( sum == 0xFF && *p == m_serial && *(p+1) < m_order.size() )
+    {
+        m_pos = *(p+1);
+    }
+    // 保存時点から現在位置までのシャッフルをやり直す
+    fix(m_pos);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  キュー全体を書き直す(キューの内容、シャッフルの状態が変わったとき)
+//  以降の再生順は新しい種から決める
+// -----------------------------------------------------------------------------
+void PlayQueue::saveFile()
+{
+    m_serial++;
+    m_seed = m_rand = (micros() ^ (m_seed << 7) ^ m_serial) | 1;
+
+    PlayQueueHeader header;
+    header.magic = MAGIC;
+    header.serial = m_serial;
+    header.count = m_entries.size();
+    header.shuffle = m_shuffle? 1 : 0;
+    header.fixed = m_fixed;
+    header.seed = m_seed;
+    {
+        // 再生中でも書き換えるので、タイマ割込みを止めておく
+        SDLock lock;
+        SD.remove((char *)m_path);
+        File f = SD.open(m_path, FILE_WRITE);
+        if( !f )
+        {
+            Serial.print("Cannot write ");
+            Serial.println(m_path);
+            return;
+        }
+        f.write((const uint8_t *)&header, sizeof(header));
+        f.write((const uint8_t *)&m_entries[0], m_entries.size() * sizeof(Entry));
+        f.write((const uint8_t *)&m_order[0], m_order.size() * sizeof(uint16_t));
+        f.close();
+    }
+    saveCursor();
+}
+
+// -----------------------------------------------------------------------------
+//  現在位置だけを保存する(曲が進むたびに呼ばれる)
+// -----------------------------------------------------------------------------
+void PlayQueue::saveCursor()
+{
+    uint8_t config[5];
+    uint16_t *p = (uint16_t *)config;
+    *p = m_serial;
+    *(p+1) = m_pos;
+    uint8_t sum = 0x00;
+    for( int i = 0 ; i < 4 ; i++ )
+    {
+        sum += config[i];
+    }
+    config[4] = 0xFF - sum;
+    EEPROM().write(EEPROM_ADDR, 5, config);
+}
+
+// -----------------------------------------------------------------------------
+//  プレイリストから削除された曲をキューから取り除く
+//  playlist.dat を読み直した後に呼ぶこと
+// -----------------------------------------------------------------------------
+void PlayQueue::validate()
+{
+    uint16_t count = m_entries.size();
+    uint16_t *remap = new uint16_t[count];
+    Vector<Entry> entries;
+    entries.alloc(MAX_ENTRIES);
+    for( uint16_t i = 0 ; i < count ; i++ )
+    {
+        Entry& e = m_entries[i];
+        Album *album = m_playlist->getAlbumByID(e.album_id);
+        remap[i] = 0xFFFF;
+        if( album && e.index < album->getSongCount() )
+        {
+            remap[i] = entries.size();
+            entries.push_back(e);
+        }
+    }
+
+    bool removed = (entries.size() < count);
+    if( removed )
+    {
+        Serial.print(count - entries.size(), DEC);
+        Serial.println(" song(s) removed from queue");
+        // 再生順を詰める。現在位置、確定範囲は取り除いた曲の数だけ前にずらす
+        Vector<uint16_t> order;
+        order.alloc(MAX_ENTRIES);
+        uint16_t pos = m_pos;
+        uint16_t fixed = m_fixed;
+        for( uint16_t p = 0 ; p < count ; p++ )
+        {
+            if( remap[m_order[p]] != 0xFFFF )
+            {
+                order.push_back(remap[m_order[p]]);
+            }
+            else
+            {
+                m_pos   -= (p < pos)? 1 : 0;
+                m_fixed -= (p < fixed)? 1 : 0;
+            }
+        }
+        m_entries.swap(entries);
+        m_order.swap(order);
+    }
+    delete [] remap;
+
+    if( m_entries.size() == 0 )
+    {
+        Artist *artist = m_playlist->getSelectedArtist();
+        setAlbum(artist->getSelectedAlbum());
+        return;
+    }
+    if( m_pos >= m_order.size() )
+    {
+        m_pos = m_order.size() - 1;
+    }
+    if( removed )
+    {
+        saveFile();
+    }
+    select(m_pos);
+}
+
+// -----------------------------------------------------------------------------
+//  キューをアルバムの曲で置き換え、index 番目の曲を現在位置にする
+// -----------------------------------------------------------------------------
+void PlayQueue::setAlbum(Album *album, uint16_t index)
+{
+    if( album->getSongCount() == 0 )
+    {
+        return;
+    }
+    m_entries.clear();
+    for( uint16_t i = 0 ; i < album->getSongCount() && i < MAX_ENTRIES ; i++ )
+    {
+        Entry e;
+        e.album_id = album->getID();
+        e.index = i;
+        m_entries.push_back(e);
+    }
+    resetOrder((index < m_entries.size())? index : 0);
+    saveFile();
+    select(m_pos);
+}
+
+// -----------------------------------------------------------------------------
+//  アルバムの曲をキューの末尾に追加する。戻り値は追加した曲数
+// -----------------------------------------------------------------------------
+uint16_t PlayQueue::appendAlbum(Album *album)
+{
+    uint16_t added = 0;
+    for( uint16_t i = 0 ; i < album->getSongCount() && m_entries.size() < MAX_ENTRIES ; i++ )
+    {
+        Entry e;
+        e.album_id = album->getID();
+        e.index = i;
+        m_order.push_back(m_entries.size());
+        m_entries.push_back(e);
+        added++;
+    }
+    if( !m_shuffle )
+    {
+        m_fixed = m_order.size();
+    }
+    if( added )
+    {
+        saveFile();
+    }
+    return added;
+}
+
+// -----------------------------------------------------------------------------
+uint16_t PlayQueue::appendArtist(Artist *artist)
+{
+    uint16_t added = 0;
+    for( uint16_t i = 0 ; i < artist->getAlbumCount() ; i++ )
+    {
+        added += appendAlbum(artist->getAlbums()[i]);
+    }
+    return added;
+}
+
+// -----------------------------------------------------------------------------
+//  キューの中の曲に移動する。キューになければ false
+// -----------------------------------------------------------------------------
+bool PlayQueue::jumpTo(Album *album, uint16_t index)
+{
+    uint16_t p = find(album->getID(), index);
+    if( p == 0xFFFF )
+    {
+        return false;
+    }
+    if( p >= m_fixed )
+    {
+        // シャッフルで未確定の曲であれば、次に確定する位置に持ってくる
+        uint16_t t = m_order[m_fixed];
+        m_order[m_fixed] = m_order[p];
+        m_order[p] = t;
+        p = m_fixed++;
+        select(p);
+        saveFile();
+        return true;
+    }
+    select(p);
+    saveCursor();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+void PlayQueue::seekFirst()
+{
+    select(0);
+    saveCursor();
+}
+
+// -----------------------------------------------------------------------------
+//  シャッフル中は、最後まで再生すると次の巡に入るので常に次がある
+// -----------------------------------------------------------------------------
+bool PlayQueue::hasNext()
+{
+    return (m_pos + 1 < m_order.size()) || (m_shuffle && m_order.size() > 1);
+}
+
+// -----------------------------------------------------------------------------
+bool PlayQueue::next()
+{
+    if( m_pos + 1 < m_order.size() )
+    {
+        fix(m_pos + 1);
+        select(m_pos + 1);
+        saveCursor();
+        return true;
+    }
+    if( !hasNext() )
+    {
+        return false;
+    }
+    // 次の巡。直前に再生した曲(末尾)が続けて選ばれないよう、先頭はそれ以外から選ぶ
+    uint16_t count = m_order.size();
+    uint16_t j = random() % (count - 1);
+    uint16_t t = m_order[0];
+    m_order[0] = m_order[j];
+    m_order[j] = t;
+    m_fixed = 1;
+    select(0);
+    saveFile();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool PlayQueue::prev()
+{
+    if( m_pos == 0 )
+    {
+        return false;
+    }
+    select(m_pos - 1);
+    saveCursor();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  次に再生する曲(先読み用)。現在位置は変えない
+// -----------------------------------------------------------------------------
+Song *PlayQueue::peekNext()
+{
+    if( m_pos + 1 >= m_order.size() )
+    {
+        return NULL;
+    }
+    fix(m_pos + 1);
+    return resolve(m_pos + 1);
+}
+
+// -----------------------------------------------------------------------------
+void PlayQueue::setShuffle(bool shuffle)
+{
+    if( shuffle == m_shuffle )
+    {
+        return;
+    }
+    if( m_order.size() == 0 )
+    {
+        // 空のキューは並べ直すものがない。次に setAlbum() したときから反映する
+        m_shuffle = shuffle;
+        return;
+    }
+    uint16_t current = m_order[m_pos];
+    m_shuffle = shuffle;
+    resetOrder(current);
+    saveFile();
+    select(m_pos);
+}
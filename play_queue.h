@@ -0,0 +1,74 @@
+#ifndef PLAY_QUEUE_H
+#define PLAY_QUEUE_H
+
+#include <Arduino.h>
+#include "playlist.h"
+
+// -----------------------------------------------------------------------------
+//  再生キュー
+//  アルバム、アーティストをまたいだ曲の並び。曲はアルバムIDとアルバム内の番号で
+//  参照するので、playlist.dat を読み直しても同じ曲を指す
+//
+//  シャッフルは Fisher-Yates を１曲進むごとに１段ずつ行う(未再生の曲から１曲を選ぶ)
+//  ので、１巡するまで同じ曲は再生されない
+//  乱数は queue.dat に保存した種から決まるので、再起動後も EEPROM に保存した
+//  位置まで同じ手順をたどれば、同じ再生順が復元できる
+// -----------------------------------------------------------------------------
+class PlayQueue
+{
+    friend PlayQueue& Queue();
+    public:
+        enum{MAX_ENTRIES = 4096};
+        struct Entry
+        {
+            uint16_t album_id;
+            uint16_t index;         // アルバム内の曲の番号
+        };
+
+    private:
+        enum{MAGIC = 0x45555150};   // "PQUE"
+        enum{EEPROM_ADDR = 0x0300};
+        Playlist        *m_playlist;
+        const char      *m_path;
+        Vector<Entry>    m_entries;
+        Vector<uint16_t> m_order;   // 再生順(m_entries のインデックス)
+        uint16_t         m_pos;     // m_order 上の現在位置
+        uint16_t         m_fixed;   // m_order のうち再生順が確定している範囲
+        bool             m_shuffle;
+        uint32_t         m_seed;    // queue.dat に保存した時点以降の再生順を決める乱数の種
+        uint32_t         m_rand;
+        uint16_t         m_serial;  // queue.dat を書き直すたびに増やす
+
+        PlayQueue();
+        uint32_t random();
+        void     fix(uint16_t pos);
+        void     resetOrder(uint16_t first);
+        bool     select(uint16_t pos);
+        Song    *resolve(uint16_t pos);
+        uint16_t find(uint16_t album_id, uint16_t index);
+        bool     loadFile();
+        void     saveFile();
+        void     saveCursor();
+
+    public:
+        void     begin(Playlist *playlist, const char *path);
+        void     validate();
+        void     setAlbum(Album *album, uint16_t index=0);
+        uint16_t appendAlbum(Album *album);
+        uint16_t appendArtist(Artist *artist);
+        bool     jumpTo(Album *album, uint16_t index);
+        void     seekFirst();
+        bool     hasNext();
+        bool     next();
+        bool     prev();
+        Song    *getCurrentSong(){ return resolve(m_pos); }
+        Song    *peekNext();
+        void     setShuffle(bool shuffle);
+        bool     isShuffle(){ return m_shuffle; }
+        uint16_t getCount(){ return m_entries.size(); }
+        uint16_t getPosition(){ return m_pos; }
+};
+
+PlayQueue& Queue();
+
+#endif
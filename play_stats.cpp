@@ -0,0 +1,377 @@
+#include <Arduino.h>
+#include <SD.h>
+#include "play_stats.h"
+#include "M41T62.h"
+#include "crc32.h"
+
+// playstat.dat のヘッダ
+struct PlayStatsHeader
+{
+    uint32_t magic;
+    uint32_t serial;        // 畳み込み済みのログの serial
+    uint32_t count;         // 続く Counter の数
+    uint32_t crc;           // Counter[count] の CRC-32
+};
+
+// playstat.log の先頭(LogEntry と同じ大きさにして、エントリがセクタをまたがないようにする)
+struct PlayStatsLogHeader
+{
+    uint32_t magic;
+    uint32_t serial;
+};
+
+// -----------------------------------------------------------------------------
+static uint32_t keyOf(uint16_t album_id, uint16_t index)
+{
+    return ((uint32_t)album_id << 16) | index;
+}
+
+// -----------------------------------------------------------------------------
+//  ランキングの順位付け。a が b より上位であれば true
+// -----------------------------------------------------------------------------
+static bool isBetter(uint8_t type, const PlayStats::Counter& a, const PlayStats::Counter& b)
+{
+    if( type == PlayStats::MOST_PLAYED && a.count != b.count )
+    {
+        return a.count > b.count;
+    }
+    return a.last_played > b.last_played;
+}
+
+// -----------------------------------------------------------------------------
+PlayStats& Stats()
+{
+    static PlayStats stats;
+    return stats;
+}
+
+// -----------------------------------------------------------------------------
+PlayStats::PlayStats() : m_log_path(NULL), m_dat_path(NULL), m_counters(NULL), m_counter_count(0),
+    m_folded_serial(0), m_log_size(0), m_log_pending(false), m_buffered(0), m_idle_since(0)
+{
+    for( int t = 0 ; t < NUM_RANKINGS ; t++ )
+    {
+        m_ranking_count[t] = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  現在時刻(RTC)を 2000/1/1 からの秒数で返す
+// -----------------------------------------------------------------------------
+uint32_t PlayStats::now()
+{
+    static const uint16_t DAYS[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    uint16_t year, month, day, wday, hour, minute, second;
+    M41T62& rtc = M41T62::getInstance();
+    rtc.update();
+    rtc.get(year, month, day, wday, hour, minute, second);
+    uint32_t y = (year >= 2000)? (year - 2000) : 0;
+    uint32_t days = y * 365 + (y + 3) / 4 + DAYS[(month - 1) % 12] + day - 1;
+    if( month > 2 && (y % 4) == 0 )
+    {
+        days++;
+    }
+    return ((days * 24 + hour) * 60 + minute) * 60 + second;
+}
+
+// -----------------------------------------------------------------------------
+int PlayStats::compareEntry(const void *a, const void *b)
+{
+    const LogEntry *p = (const LogEntry *)a;
+    const LogEntry *q = (const LogEntry *)b;
+    uint32_t ka = keyOf(p->album_id, p->index);
+    uint32_t kb = keyOf(q->album_id, q->index);
+    return (ka < kb)? -1 : (ka > kb)? 1 : 0;
+}
+
+// -----------------------------------------------------------------------------
+//  集計とログを読み込む
+// -----------------------------------------------------------------------------
+void PlayStats::begin(const char *log_path, const char *dat_path)
+{
+    m_log_path = log_path;
+    m_dat_path = dat_path;
+    SDLock lock;
+    if( !loadCounters() )
+    {
+        m_counter_count = 0;
+        m_folded_serial = 0;
+    }
+
+    File f = SD.open(m_log_path);
+    if( f )
+    {
+        PlayStatsLogHeader header;
+        bool valid = (f.read(&header, sizeof(header)) == sizeof(header) && header.magic == LOG_MAGIC);
+        m_log_size = f.size();
+        f.close();
+        if( !valid || header.serial == m_folded_serial )
+        {
+            // 壊れている、または畳み込んだ後に削除できなかったログ
+            SD.remove((char *)m_log_path);
+            m_log_size = 0;
+        }
+        else
+        {
+            m_log_pending = true;
+        }
+    }
+    buildRanking();
+    Serial.print(m_counter_count, DEC);
+    Serial.println(" song(s) in play statistics");
+}
+
+// -----------------------------------------------------------------------------
+bool PlayStats::loadCounters()
+{
+    SDLock lock;
+    File f = SD.open(m_dat_path);
+    if( !f )
+    {
+        return false;
+    }
+    PlayStatsHeader header;
+    bool result = (f.read(&header, sizeof(header)) == sizeof(header) && header.magic == DAT_MAGIC &&
+        header.count * sizeof(Counter) == f.size() - sizeof(header));
+    if( result )
+    {
+        m_counters = (Counter *)malloc(header.count * sizeof(Counter) + 1);
+        result = m_counters &&
+            f.read(m_counters, header.count * sizeof(Counter)) == (int)(header.count * sizeof(Counter)) &&
+            CRC32::calc(m_counters, header.count * sizeof(Counter)) == header.crc;
+    }
+    f.close();
+    if( !result )
+    {
+        Serial.println("playstat: broken file ignored");
+        free(m_counters);
+        m_counters = NULL;
+        return false;
+    }
+    m_counter_count = header.count;
+    m_folded_serial = header.serial;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool PlayStats::saveCounters(Counter *counters, uint32_t count, uint32_t serial)
+{
+    PlayStatsHeader header;
+    header.magic = DAT_MAGIC;
+    header.serial = serial;
+    header.count = count;
+    header.crc = CRC32::calc(counters, count * sizeof(Counter));
+    SDLock lock;
+    SD.remove((char *)m_dat_path);
+    File f = SD.open(m_dat_path, FILE_WRITE);
+    if( !f )
+    {
+        return false;
+    }
+    bool result = (f.write((const uint8_t *)&header, sizeof(header)) == sizeof(header)) &&
+        (f.write((const uint8_t *)counters, count * sizeof(Counter)) == count * sizeof(Counter));
+    f.close();
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+//  曲の再生が終わったときに呼ぶ
+//  ログの現在のセクタが埋まるまではバッファにためておく
+// -----------------------------------------------------------------------------
+void PlayStats::record(Song *song)
+{
+    if( !song )
+    {
+        return;
+    }
+    Album *album = song->getAlbum();
+    LogEntry& e = m_buffer[m_buffered++];
+    e.album_id = album->getID();
+    e.index = 0;
+    for( uint16_t i = 0 ; i < album->getSongCount() ; i++ )
+    {
+        if( album->getSongs()[i] == song )
+        {
+            e.index = i;
+        }
+    }
+    e.time = now();
+
+    uint32_t used = (m_log_size == 0)? sizeof(PlayStatsLogHeader) : m_log_size;
+    uint16_t room = (SECTOR_SIZE - used % SECTOR_SIZE) / sizeof(LogEntry);
+    if( m_buffered >= room )
+    {
+        flush();
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  バッファの内容をログに追記する
+// -----------------------------------------------------------------------------
+void PlayStats::flush()
+{
+    if( m_buffered == 0 )
+    {
+        return;
+    }
+    // 曲の終わりに呼ばれるので、タイマ割込み(VS1053 へのコマンド)を止めてから書く
+    SDLock lock;
+    File f = SD.open(m_log_path, FILE_WRITE);
+    if( f )
+    {
+        f.seek(f.size());
+        if( f.size() == 0 )
+        {
+            PlayStatsLogHeader header;
+            header.magic = LOG_MAGIC;
+            header.serial = m_folded_serial + 1;
+            f.write((const uint8_t *)&header, sizeof(header));
+        }
+        f.write((const uint8_t *)m_buffer, m_buffered * sizeof(LogEntry));
+        m_log_size = f.size();
+        f.close();
+        m_log_pending = true;
+    }
+    else
+    {
+        Serial.print("Cannot write ");
+        Serial.println(m_log_path);
+    }
+    m_buffered = 0;
+}
+
+// -----------------------------------------------------------------------------
+//  毎回の loop から呼ぶ。idle は再生停止中かどうか
+//  停止したまま IDLE_DELAY が経過したら、ログを書き出して集計に畳み込む
+// -----------------------------------------------------------------------------
+void PlayStats::update(bool idle)
+{
+    uint32_t t = millis();
+    if( !idle )
+    {
+        m_idle_since = t;
+        return;
+    }
+    if( t - m_idle_since < IDLE_DELAY )
+    {
+        return;
+    }
+    flush();
+    if( m_log_pending )
+    {
+        compact();
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  ログを読み込んで曲ごとに並べ替え、集計と併合して playstat.dat を書き直す
+//  書き直した後でログを削除する(途中で電源が切れても、serial で二重の畳み込みを防ぐ)
+// -----------------------------------------------------------------------------
+void PlayStats::compact()
+{
+    uint32_t start = millis();
+    m_log_pending = false;
+    SDLock lock;
+    File f = SD.open(m_log_path);
+    if( !f )
+    {
+        return;
+    }
+    PlayStatsLogHeader header;
+    uint32_t count = (f.size() >= sizeof(header))? (f.size() - sizeof(header)) / sizeof(LogEntry) : 0;
+    LogEntry *entries = (LogEntry *)malloc(count * sizeof(LogEntry) + 1);
+    Counter *merged = (Counter *)malloc((m_counter_count + count) * sizeof(Counter) + 1);
+    bool result = entries && merged &&
+        f.read(&header, sizeof(header)) == sizeof(header) && header.magic == LOG_MAGIC &&
+        f.read(entries, count * sizeof(LogEntry)) == (int)(count * sizeof(LogEntry));
+    f.close();
+
+    uint32_t n = 0;
+    if( result )
+    {
+        qsort(entries, count, sizeof(LogEntry), compareEntry);
+        uint32_t i = 0;
+        uint32_t j = 0;
+        while( i < m_counter_count || j < count )
+        {
+            Counter c;
+            if( j >= count || (i < m_counter_count &&
+                keyOf(m_counters[i].album_id, m_counters[i].index) <= keyOf(entries[j].album_id, entries[j].index)) )
+            {
+                c = m_counters[i++];
+            }
+            else
+            {
+                memset(&c, 0, sizeof(c));
+                c.album_id = entries[j].album_id;
+                c.index = entries[j].index;
+            }
+            uint32_t key = keyOf(c.album_id, c.index);
+            while( j < count && keyOf(entries[j].album_id, entries[j].index) == key )
+            {
+                if( c.count < 0xFFFF )
+                {
+                    c.count++;
+                }
+                if( entries[j].time > c.last_played )
+                {
+                    c.last_played = entries[j].time;
+                }
+                j++;
+            }
+            merged[n++] = c;
+        }
+        result = saveCounters(merged, n, header.serial);
+    }
+    free(entries);
+    if( !result )
+    {
+        Serial.println("playstat: compaction failed");
+        free(merged);
+        return;
+    }
+
+    free(m_counters);
+    m_counters = merged;
+    m_counter_count = n;
+    m_folded_serial = header.serial;
+    SD.remove((char *)m_log_path);
+    m_log_size = 0;
+    buildRanking();
+    Serial.print("playstat: ");
+    Serial.print(count, DEC);
+    Serial.print(" play(s) folded in ");
+    Serial.print(millis() - start, DEC);
+    Serial.println(" ms");
+}
+
+// -----------------------------------------------------------------------------
+//  上位 MAX_RANKING 曲の一覧を作る
+// -----------------------------------------------------------------------------
+void PlayStats::buildRanking()
+{
+    for( uint8_t t = 0 ; t < NUM_RANKINGS ; t++ )
+    {
+        uint32_t *ranking = m_ranking[t];
+        uint16_t& size = m_ranking_count[t];
+        size = 0;
+        for( uint32_t i = 0 ; i < m_counter_count ; i++ )
+        {
+            uint16_t p = size;
+            while( p > 0 && isBetter(t, m_counters[i], m_counters[ranking[p-1]]) )
+            {
+                p--;
+            }
+            if( p >= MAX_RANKING )
+            {
+                continue;
+            }
+            uint16_t last = (size < MAX_RANKING)? size++ : (MAX_RANKING - 1);
+            for( uint16_t k = last ; k > p ; k-- )
+            {
+                ranking[k] = ranking[k-1];
+            }
+            ranking[p] = i;
+        }
+    }
+}
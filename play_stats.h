@@ -0,0 +1,79 @@
+#ifndef PLAY_STATS_H
+#define PLAY_STATS_H
+
+#include <Arduino.h>
+#include "playlist.h"
+
+// -----------------------------------------------------------------------------
+//  再生統計(再生回数、最後に再生した日時)
+//
+//  playstat.log : 再生のたびに LogEntry を追記するだけのログ
+//                 RAM 上にためておき、SDカードのセクタ(512バイト)単位で書き込む
+//  playstat.dat : 曲ごとの集計(Counter の配列。アルバムID、曲番号の順)
+//                 停止したまましばらく操作がないときに、ログを畳み込んで書き直す
+//
+//  曲はアルバムIDとアルバム内の番号で識別する(playlist.dat を作り直しても変わらない)
+// -----------------------------------------------------------------------------
+class PlayStats
+{
+    friend PlayStats& Stats();
+    public:
+        enum{MOST_PLAYED = 0, RECENTLY_PLAYED = 1, NUM_RANKINGS = 2};
+        enum{MAX_RANKING = 30};
+        struct Counter
+        {
+            uint16_t album_id;
+            uint16_t index;
+            uint16_t count;
+            uint16_t reserved;
+            uint32_t last_played;   // 2000/1/1 からの秒数
+        };
+
+    private:
+        struct LogEntry
+        {
+            uint16_t album_id;
+            uint16_t index;
+            uint32_t time;
+        };
+        enum{LOG_MAGIC = 0x474C5350};   // "PSLG"
+        enum{DAT_MAGIC = 0x54415350};   // "PSAT"
+        enum{SECTOR_SIZE = 512};
+        enum{BUFFER_ENTRIES = SECTOR_SIZE / 8};
+        enum{IDLE_DELAY = 30000};       // 停止してから畳み込みを始めるまでの時間(ms)
+
+        const char *m_log_path;
+        const char *m_dat_path;
+        Counter    *m_counters;
+        uint32_t    m_counter_count;
+        uint32_t    m_folded_serial;    // playstat.dat に畳み込み済みのログの serial
+        uint32_t    m_log_size;         // playstat.log のサイズ(バッファ分を除く)
+        bool        m_log_pending;      // 畳み込んでいないログがある
+        LogEntry    m_buffer[BUFFER_ENTRIES];
+        uint16_t    m_buffered;
+        uint32_t    m_idle_since;
+        uint32_t    m_ranking[NUM_RANKINGS][MAX_RANKING];   // m_counters のインデックス
+        uint16_t    m_ranking_count[NUM_RANKINGS];
+
+        PlayStats();
+        static uint32_t now();
+        static int  compareEntry(const void *a, const void *b);
+        bool        loadCounters();
+        bool        saveCounters(Counter *counters, uint32_t count, uint32_t serial);
+        void        flush();
+        void        compact();
+        void        buildRanking();
+
+    public:
+        void begin(const char *log_path, const char *dat_path);
+        void record(Song *song);
+        void update(bool idle);
+        uint16_t getRankingCount(uint8_t type){ return m_ranking_count[type]; }
+        const Counter *getRanking(uint8_t type, uint16_t n){
+            return (n < m_ranking_count[type])? &m_counters[m_ranking[type][n]] : NULL;
+        }
+};
+
+PlayStats& Stats();
+
+#endif
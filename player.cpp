@@ -5,6 +5,7 @@
 #include "VS1053.h"
 #include "player.h"
 #include "eeprom_24lc.h"
+#include "block_cache.h"
 
 // -----------------------------------------------------------------------------
 MusicPlayer& Player()
@@ -17,6 +18,11 @@ MusicPlayer& Player()
 void MusicPlayer::onTimer()
 {
     MusicPlayer& player = Player();
+    if( SDLock::isLocked() )
+    {
+        // loop() が SDカード(と SPI)を使っている。コマンドも次の割込みまで待たせる
+        return;
+    }
     if( !player.isStopped() )
     {
         player.m_player.feedBuffer();
@@ -88,7 +94,7 @@ Adafruit_VS1053_FilePlayer MusicPlayer::m_player(
 // -----------------------------------------------------------------------------
 MusicPlayer::MusicPlayer() : m_volume(0), m_bass(0), m_treble(0)
 {
-
+    m_filename[0] = '\0';
 }
 
 // -----------------------------------------------------------------------------
@@ -270,20 +276,30 @@ void MusicPlayer::stop(bool wait_for)
 
 // -----------------------------------------------------------------------------
 //  指定した曲を再生する
-//  曲の再生が終了（または停止させる）までこの関数からは戻らないことに注意
-//  再生中は setPlayingProc() で指定した関数が定期的に呼び出される
+//  file_size はプレイリストに記録されたファイルのサイズ(不明なら 0)。先に開いて
+//  おいたファイルがあり、サイズが一致すればそれを使う
 // -----------------------------------------------------------------------------
-bool MusicPlayer::play(const char *filename)
+bool MusicPlayer::play(const char *filename, uint32_t file_size)
 {
     if( !m_player.stopped() )
     {
         return false;
     }
 
-    if( !m_player.startPlayingFile(filename) )
+    SDLock lock;
+    File track = m_files.open(filename, file_size);
+    if( !track )
+    {
+        Serial.print("Cannot open ");
+        Serial.println(filename);
+        return false;
+    }
+    if( !m_player.startPlayingFile(track, filename) )
     {
         return false;
     }
+    strncpy(m_filename, filename, sizeof(m_filename) - 1);
+    m_filename[sizeof(m_filename) - 1] = '\0';
 
     m_time_counter.start();
     
@@ -308,3 +324,104 @@ bool MusicPlayer::trackEnded()
     uint8_t c = m_ui_queue.pop();
     return c == MSG_STOP;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//  OpenFileCache
+////////////////////////////////////////////////////////////////////////////////
+OpenFileCache::Entry *OpenFileCache::find(const char *path)
+{
+    for( int i = 0 ; i < SIZE ; i++ )
+    {
+        if( m_entries[i].file && !strcmp(m_entries[i].path, path) )
+        {
+            return &m_entries[i];
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+//  曲ファイルを開く。size はプレイリストに記録されたサイズ(不明なら 0)
+//  キャッシュにあればそれを返し(キャッシュからは取り除く)、なければ SD.open する
+// -----------------------------------------------------------------------------
+File OpenFileCache::open(const char *path, uint32_t size)
+{
+    SDLock lock;
+    Entry *e = find(path);
+    if( e )
+    {
+        File f = e->file;
+        e->file = File();
+        e->path[0] = '\0';
+        if( size == 0 || f.size() == size )
+        {
+            return f;
+        }
+        f.close();
+    }
+    return SD.open(path);
+}
+
+// -----------------------------------------------------------------------------
+//  次に再生する曲のファイルを先に開いておく。loop() から呼ぶこと
+//  サイズがプレイリストと違う場合は保持せず、再生時に改めて開く
+// -----------------------------------------------------------------------------
+void OpenFileCache::prefetch(const char *path, uint32_t size)
+{
+    if( strlen(path) >= MAX_PATH_LENGTH )
+    {
+        return;
+    }
+    SDLock lock;
+    Entry *e = find(path);
+    if( e )
+    {
+        e->used = ++m_clock;
+        return;
+    }
+    e = &m_entries[0];
+    for( int i = 1 ; i < SIZE ; i++ )
+    {
+        if( m_entries[i].used < e->used )
+        {
+            e = &m_entries[i];
+        }
+    }
+    if( e->file )
+    {
+        e->file.close();
+    }
+    e->path[0] = '\0';
+    e->used = ++m_clock;
+    e->file = SD.open(path);
+    if( !e->file )
+    {
+        return;
+    }
+    if( size != 0 && e->file.size() != size )
+    {
+        Serial.print("stale file size: ");
+        Serial.println(path);
+        e->file.close();
+        e->file = File();
+        return;
+    }
+    strcpy(e->path, path);
+}
+
+// -----------------------------------------------------------------------------
+//  保持しているファイルをすべて閉じる(プレイリストを読み直したときなど)
+// -----------------------------------------------------------------------------
+void OpenFileCache::clear()
+{
+    SDLock lock;
+    for( int i = 0 ; i < SIZE ; i++ )
+    {
+        if( m_entries[i].file )
+        {
+            m_entries[i].file.close();
+        }
+        m_entries[i].file = File();
+        m_entries[i].path[0] = '\0';
+    }
+}
@@ -78,6 +78,40 @@ class CommandFIFO
         }
 };
 
+// -----------------------------------------------------------------------------
+//  曲ファイルを開いたまま保持しておくキャッシュ
+//  次に再生する曲を先に開いておき、曲の切り替え時にディレクトリをたどる SD.open を
+//  省く。ファイルのサイズがプレイリストに記録されたものと違う場合は、古いものとして
+//  捨てて開き直す
+// -----------------------------------------------------------------------------
+class OpenFileCache
+{
+    private:
+        enum{SIZE = 2};
+        enum{MAX_PATH_LENGTH = 64};     // Song::MAX_FILENAME_LENGTH
+        struct Entry
+        {
+            File     file;
+            char     path[MAX_PATH_LENGTH];
+            uint32_t used;              // 最後に使った順番(LRU)
+        };
+        Entry    m_entries[SIZE];
+        uint32_t m_clock;
+        Entry   *find(const char *path);
+
+    public:
+        OpenFileCache() : m_clock(0){
+            for( int i = 0 ; i < SIZE ; i++ )
+            {
+                m_entries[i].path[0] = '\0';
+                m_entries[i].used = 0;
+            }
+        }
+        File open(const char *path, uint32_t size);
+        void prefetch(const char *path, uint32_t size);
+        void clear();
+};
+
 // -----------------------------------------------------------------------------
 class MusicPlayer
 {
@@ -117,6 +151,8 @@ class MusicPlayer
         PlayerTimeCounter m_time_counter;
         CommandFIFO m_timer_queue;  // タイマ割込みハンドラへの通知用
         CommandFIFO m_ui_queue;     // ユーザインタフェースへの通知用
+        OpenFileCache m_files;
+        char m_filename[128];       // 再生中(最後に再生した)曲のパス
         static void onTimer();
         void loadConfig();
 
@@ -138,8 +174,11 @@ class MusicPlayer
         uint16_t getTreble(){ return m_treble; }
         void pause(bool pause);
         void stop(bool wait_for=false);
-        bool play(const char *filename);
+        bool play(const char *filename, uint32_t file_size=0);
+        void prefetch(const char *filename, uint32_t file_size){ m_files.prefetch(filename, file_size); }
+        void clearFileCache(){ m_files.clear(); }
         bool trackEnded();
+        const char *getFileName(){ return m_filename; }
 };
 
 MusicPlayer& Player();
@@ -4,23 +4,35 @@
 #include <Wire.h>
 #include "playlist.h"
 #include "eeprom_24lc.h"
+#include "crc32.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //  Song
 ////////////////////////////////////////////////////////////////////////////////
-Song::Song(Album *album) : m_album(album), m_length(0), m_track_index(0)
+Song::Song(Album *album) : m_album(album), m_length(0), m_track_index(0), m_file_size(0)
 {
     memset(m_title, 0, sizeof(m_title));
     memset(m_filename, 0, sizeof(m_filename));
 }
 
 // -----------------------------------------------------------------------------
-void Song::load(File f)
+void Song::load(const PlaylistV1SongRecord *rec)
 {
-    f.read(&m_track_index, sizeof(m_track_index));
-    f.read(&m_length, sizeof(m_length));
-    f.read(m_filename, sizeof(m_filename));
-    f.read(m_title, sizeof(m_title));
+    m_track_index = rec->track_index;
+    m_length = rec->length;
+    memcpy(m_filename, rec->filename, sizeof(m_filename));
+    memcpy(m_title, rec->title, sizeof(m_title));
+}
+
+// -----------------------------------------------------------------------------
+bool Song::load(const PlaylistSongRecord *rec, PlaylistImage& image)
+{
+    m_track_index = rec->track_index;
+    m_length = rec->length;
+    m_file_size = image.getFileSize(rec);
+    strncpy(m_filename, image.getString(rec->filename), sizeof(m_filename)-1);
+    strncpy(m_title, image.getString(rec->title), sizeof(m_title)-1);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -32,22 +44,74 @@ Album::Album(Artist *artist) : m_artist(artist),
     memset(m_title, 0, sizeof(m_title));
 }
 
+// -----------------------------------------------------------------------------
+Album::~Album()
+{
+    for( uint16_t i = 0 ; i < m_songs.size() ; i++ )
+    {
+        delete m_songs[i];
+    }
+}
+
 //------------------------------------------------------------------------------
-void Album::load(File f)
+//  v1 形式の読み込み
+//  アルバムのヘッダと曲のレコード(固定長で連続している)を、それぞれ１回の read で読み込む
+//  戻り値は最後まで読み込めたかどうか
+//------------------------------------------------------------------------------
+bool Album::load(CachedFile& f)
+{
+    PlaylistV1AlbumRecord rec;
+    if( f.read(&rec, sizeof(rec)) != sizeof(rec) )
+    {
+        return false;
+    }
+    m_id = rec.id;
+    memcpy(m_title, rec.title, sizeof(m_title));
+    m_year = rec.year;
+    m_total_length = rec.total_length;
+
+    uint32_t size = rec.song_count * sizeof(PlaylistV1SongRecord);
+    PlaylistV1SongRecord *songs = (PlaylistV1SongRecord *)malloc(size + 1);
+    if( !songs )
+    {
+        Serial.println("playlist: out of memory");
+        return false;
+    }
+    bool result = (f.read(songs, size) == (int)size);
+    if( result )
+    {
+        m_songs.alloc(rec.song_count);
+        for( uint16_t i = 0 ; i < rec.song_count ; i++ )
+        {
+            Song *s = new Song(this);
+            m_songs.push_back(s);
+            s->load(&songs[i]);
+        }
+    }
+    free(songs);
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+bool Album::load(const PlaylistAlbumRecord *rec, PlaylistImage& image)
 {
-    f.read(&m_id, sizeof(m_id));
-    f.read(m_title, sizeof(m_title));
-    f.read(&m_year, sizeof(m_year));
-    f.read(&m_total_length, sizeof(m_total_length));
-    uint16_t num_tracks;
-    f.read(&num_tracks, sizeof(num_tracks));
-    m_songs.alloc(num_tracks);
-    for( uint16_t i = 0 ; i < num_tracks ; i++ )
+    m_id = rec->id;
+    m_year = rec->year;
+    m_total_length = rec->total_length;
+    strncpy(m_title, image.getString(rec->title), sizeof(m_title)-1);
+    m_songs.alloc(rec->song_count);
+    for( uint16_t i = 0 ; i < rec->song_count ; i++ )
     {
+        const PlaylistSongRecord *song_rec = image.getSong(rec->first_song + i);
+        if( !song_rec )
+        {
+            return false;
+        }
         Song *s = new Song(this);
         m_songs.push_back(s);
-        s->load(f);
+        s->load(song_rec, image);
     }
+    return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -100,19 +164,60 @@ Artist::Artist() : m_id(0), m_selected_album_id(0)
 }
 
 // -----------------------------------------------------------------------------
-void Artist::load(File f)
+Artist::~Artist()
+{
+    for( uint16_t i = 0 ; i < m_albums.size() ; i++ )
+    {
+        delete m_albums[i];
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  v1 形式の読み込み。戻り値は最後まで読み込めたかどうか
+// -----------------------------------------------------------------------------
+bool Artist::load(CachedFile& f)
+{
+    PlaylistV1ArtistRecord rec;
+    if( f.read(&rec, sizeof(rec)) != sizeof(rec) )
+    {
+        return false;
+    }
+    m_id = rec.id;
+    memcpy(m_name, rec.name, sizeof(m_name));
+    m_albums.alloc(rec.album_count);
+    for( uint16_t i = 0 ; i < rec.album_count ; i++ )
+    {
+        Album *a = new Album(this);
+        m_albums.push_back(a);
+        if( !a->load(f) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool Artist::load(const PlaylistArtistRecord *rec, PlaylistImage& image)
 {
-    f.read(&m_id, sizeof(m_id));
-    f.read(m_name, sizeof(m_name));
-    uint16_t num_albums;
-    f.read(&num_albums, sizeof(num_albums));
-    m_albums.alloc(num_albums);
-    for( uint16_t i = 0 ; i < num_albums ; i++ )
+    m_id = rec->id;
+    strncpy(m_name, image.getString(rec->name), sizeof(m_name)-1);
+    m_albums.alloc(rec->album_count);
+    for( uint16_t i = 0 ; i < rec->album_count ; i++ )
     {
+        const PlaylistAlbumRecord *album_rec = image.getAlbum(rec->first_album + i);
+        if( !album_rec )
+        {
+            return false;
+        }
         Album *a = new Album(this);
         m_albums.push_back(a);
-        a->load(f);
+        if( !a->load(album_rec, image) )
+        {
+            return false;
+        }
     }
+    return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -160,37 +265,1020 @@ uint16_t Artist::getIndexOfAlbum(Album *album)
     return 0;
 }
 
+// -----------------------------------------------------------------------------
+//  アーティスト内の通し番号(全アルバムを通した曲の順番)から、アルバムと
+//  アルバム内の番号を求める。範囲外であれば NULL
+// -----------------------------------------------------------------------------
+Album *Artist::getAlbumOfSong(uint16_t song_index, uint16_t& index_in_album)
+{
+    for( uint16_t i = 0 ; i < m_albums.size() ; i++ )
+    {
+        uint16_t count = m_albums[i]->getSongCount();
+        if( song_index < count )
+        {
+            index_in_album = song_index;
+            return m_albums[i];
+        }
+        song_index -= count;
+    }
+    return NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //  Playlist
 ////////////////////////////////////////////////////////////////////////////////
-Playlist::Playlist() : m_selected_artist_id(0)
+// 段階的な読み込みで、１回に読み込むバイト数
+#define PLAYLIST_LOAD_CHUNK     2048
+
+// 省略可能な索引のセクション(LoadState::INDEXES 以降の順)
+static const uint32_t INDEX_SECTIONS[] = {
+    PLAYLIST_SECTION_SEARCH, PLAYLIST_SECTION_YEARS, PLAYLIST_SECTION_ADDED, PLAYLIST_SECTION_GENRES,
+    PLAYLIST_SECTION_GENRE_ALBUMS, PLAYLIST_SECTION_ARTIST_ORDER, PLAYLIST_SECTION_ALBUM_ORDER
+};
+#define NUM_INDEX_SECTIONS  (sizeof(INDEX_SECTIONS) / sizeof(INDEX_SECTIONS[0]))
+
+// 段階的な読み込みの途中経過
+struct Playlist::LoadState
+{
+    enum{ALBUMS, SONGS, STRINGS, FILE_SIZES, SEARCH, YEARS, ADDED, GENRES, GENRE_ALBUMS, ARTIST_ORDER,
+         ALBUM_ORDER, NUM_SECTIONS};    // 読み込む順
+    enum{OPTIONAL = FILE_SIZES};        // これ以降は省略可能
+    enum{INDEXES = SEARCH};             // これ以降は索引
+    CachedFile            file;
+    PlaylistHeader        header;
+    PlaylistSection      *sections;
+    PlaylistArtistRecord *records;
+    PlaylistSection      *reading[NUM_SECTIONS];    // 省略されたセクションは NULL
+    uint8_t              *buffers[NUM_SECTIONS];
+    uint8_t               section;      // 読み込み中のセクション
+    uint32_t              offset;       // セクション内の読み込み済みバイト数
+    uint32_t              crc;
+    PlaylistImage         image;
+    Vector<Artist *>      artists;      // 構築中のリスト(ファイルの順)
+    Artist               *first;        // 最初に読み込んだ(選択中の)アーティスト
+    uint32_t              artist;       // 次に構築する records の番号
+    uint32_t              done;         // 進捗(読み込んだチャンク数 + 構築したアーティスト数)
+    uint32_t              total;
+    uint8_t               reported;     // 最後にシリアルに出力した進捗(%)
+    uint32_t              start;
+
+    LoadState() : sections(NULL), records(NULL), section(0), offset(0), crc(0), first(NULL),
+        artist(0), done(0), total(0), reported(0), start(0){
+        for( int i = 0 ; i < NUM_SECTIONS ; i++ )
+        {
+            reading[i] = NULL;
+            buffers[i] = NULL;
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+//  セクションテーブルから指定された ID のセクションを探す
+// -----------------------------------------------------------------------------
+static PlaylistSection *findSection(PlaylistSection *sections, uint16_t count, uint32_t id)
+{
+    for( uint16_t i = 0 ; i < count ; i++ )
+    {
+        if( sections[i].id == id )
+        {
+            return &sections[i];
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+//  artists のうち keep に含まれないものを削除し、artists を解放する
+// -----------------------------------------------------------------------------
+static void deleteArtists(Vector<Artist *>& artists, Vector<Artist *>& keep)
 {
+    for( uint16_t i = 0 ; i < artists.size() ; i++ )
+    {
+        bool found = false;
+        for( uint16_t j = 0 ; j < keep.size() && !found ; j++ )
+        {
+            found = (keep[j] == artists[i]);
+        }
+        if( !found )
+        {
+            delete artists[i];
+        }
+    }
+    artists.release();
 }
 
 // -----------------------------------------------------------------------------
-void Playlist::load(const char *path)
+Playlist::Playlist() : m_selected_artist_id(0), m_path(NULL), m_generation(0),
+    m_search(NULL), m_search_count(0), m_genres(NULL), m_genre_count(0),
+    m_artist_order(NULL), m_artist_order_count(0), m_album_order(NULL), m_album_order_count(0), m_load(NULL)
 {
-    File f = SD.open(path);
-    if( !f )
+    for( int i = 0 ; i < NUM_ALBUM_INDEXES ; i++ )
+    {
+        m_album_index[i] = NULL;
+        m_album_index_count[i] = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  読み込みを開始する
+//  v2 形式では選択中のアーティストだけをすぐに読み込み、残りは loadNext() で少しずつ
+//  読み込む(v1 形式は索引がないので、ここで全体を読み込む)
+//  戻り値はアーティストを読み込めたかどうか。false の場合、リストは空のまま
+// -----------------------------------------------------------------------------
+bool Playlist::begin(const char *path)
+{
+    m_path = path;
+    Blocks().invalidate(path);
+    CachedFile f;
+    if( !f.open(path, BlockCache::RANDOM) )
     {
         Serial.print("Cannot open ");
         Serial.println(path);
-        while(true){}
+        return false;
     }
 
-    uint16_t num_artists;
+    // 先頭がマジックナンバーであれば v2、そうでなければ v1 として読み込む
+    uint32_t magic = 0;
+    f.read(&magic, sizeof(magic));
+    f.seek(0);
+    if( magic == PLAYLIST_MAGIC )
+    {
+        if( !beginV2(f) )
+        {
+            f.close();
+            Serial.print(path);
+            Serial.println(" is corrupted.");
+            return false;
+        }
+        // ファイルは読み込みが終わるまで開いたままにする
+        return true;
+    }
+
+    loadV1(f);
+    f.close();
+    Serial.print(m_artists.size(), DEC);
+    Serial.println(" artist(s) successfully loaded");
+    if( m_artists.size() == 0 )
+    {
+        return false;
+    }
+    restoreSelection();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  v1 形式の読み込み
+//  アルバムごとに曲のレコードをまとめて読むので、read の回数はアルバム数の２倍程度になる
+// -----------------------------------------------------------------------------
+void Playlist::loadV1(CachedFile& f)
+{
+    uint32_t start = millis();
+    m_generation = 0;
+    uint16_t num_artists = 0;
     f.read(&num_artists, sizeof(num_artists));
     m_artists.alloc(num_artists);
     for( uint16_t i = 0 ; i < num_artists ; i++ )
     {
+        // 途中で切れているアーティストは捨てる
         Artist *a = new Artist();
+        if( !a->load(f) )
+        {
+            Serial.println("playlist: unexpected end of file");
+            delete a;
+            break;
+        }
         m_artists.push_back(a);
-        a->load(f);
     }
-    Serial.print(num_artists, DEC);
-    Serial.println(" artist(s) successfully loaded");
+    Serial.print("playlist: v1 loaded in ");
+    Serial.print(millis() - start, DEC);
+    Serial.println(" ms");
+}
 
-    // EEPROM から読み込む
+// -----------------------------------------------------------------------------
+//  v2 形式の読み込み
+//  ヘッダ、セクションテーブル、各セクションをそれぞれ１回の read で読み込み、
+//  CRC を検証してからオブジェクトを構築する
+// -----------------------------------------------------------------------------
+bool Playlist::loadV2(CachedFile& f)
+{
+    PlaylistHeader header;
+    PlaylistSection *sections = readHeader(f, header);
+    if( !sections )
+    {
+        return false;
+    }
+    PlaylistSection *arts = findSection(sections, header.section_count, PLAYLIST_SECTION_ARTISTS);
+    PlaylistSection *albm = findSection(sections, header.section_count, PLAYLIST_SECTION_ALBUMS);
+    PlaylistSection *song = findSection(sections, header.section_count, PLAYLIST_SECTION_SONGS);
+    PlaylistSection *strs = findSection(sections, header.section_count, PLAYLIST_SECTION_STRINGS);
+    PlaylistSection *fsiz = findSection(sections, header.section_count, PLAYLIST_SECTION_FILE_SIZES);
+
+    bool result = false;
+    PlaylistArtistRecord *artists = NULL;
+    PlaylistImage image;
+    if( arts && albm && song && strs &&
+        arts->size >= header.artist_count * sizeof(PlaylistArtistRecord) &&
+        header.artist_count <= 0xFFFF )
+    {
+        artists       = (PlaylistArtistRecord *)readSection(f, arts);
+        image.albums  = (PlaylistAlbumRecord *)readSection(f, albm);
+        image.songs   = (PlaylistSongRecord *)readSection(f, song);
+        image.strings = (char *)readSection(f, strs);
+        image.album_count = albm->size / sizeof(PlaylistAlbumRecord);
+        image.song_count  = song->size / sizeof(PlaylistSongRecord);
+        image.string_size = strs->size;
+        result = artists && image.albums && image.songs && image.strings;
+        // 曲ファイルのサイズは省略可能
+        if( result && fsiz && fsiz->size > 0 && fsiz->size >= image.song_count * sizeof(uint32_t) )
+        {
+            image.file_sizes = (uint32_t *)readSection(f, fsiz);
+        }
+    }
+
+    if( result )
+    {
+        m_artists.alloc(header.artist_count);
+        for( uint32_t i = 0 ; i < header.artist_count && result ; i++ )
+        {
+            Artist *a = new Artist();
+            m_artists.push_back(a);
+            result = a->load(&artists[i], image);
+        }
+    }
+
+    if( result )
+    {
+        m_generation = header.generation;
+        loadIndexes(f, header, sections);
+    }
+    free(artists);
+    free(image.albums);
+    free(image.songs);
+    free(image.file_sizes);
+    free(image.strings);
+    free(sections);
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+//  v2 形式の段階的な読み込みを開始する
+//  ヘッダとアーティストのセクションを読み込み、EEPROM に保存された選択中のアーティスト
+//  だけを先に構築する。残りのセクションは loadNext() でチャンクごとに読み込む
+// -----------------------------------------------------------------------------
+bool Playlist::beginV2(CachedFile& f)
+{
+    uint32_t start = millis();
+    PlaylistHeader header;
+    PlaylistSection *sections = readHeader(f, header);
+    if( !sections )
+    {
+        return false;
+    }
+    PlaylistSection *arts = findSection(sections, header.section_count, PLAYLIST_SECTION_ARTISTS);
+    PlaylistSection *albm = findSection(sections, header.section_count, PLAYLIST_SECTION_ALBUMS);
+    PlaylistSection *song = findSection(sections, header.section_count, PLAYLIST_SECTION_SONGS);
+    PlaylistSection *strs = findSection(sections, header.section_count, PLAYLIST_SECTION_STRINGS);
+    PlaylistSection *fsiz = findSection(sections, header.section_count, PLAYLIST_SECTION_FILE_SIZES);
+    PlaylistArtistRecord *records = NULL;
+    if( arts && albm && song && strs && header.artist_count > 0 && header.artist_count <= 0xFFFF &&
+        arts->size >= header.artist_count * sizeof(PlaylistArtistRecord) )
+    {
+        records = (PlaylistArtistRecord *)readSection(f, arts);
+    }
+    if( !records )
+    {
+        free(sections);
+        return false;
+    }
+
+    // 選択中のアーティスト(見つからなければ先頭)
+    uint16_t artist_id = 0;
+    uint16_t album_id = 0;
+    bool selected = readSelection(artist_id, album_id);
+    uint32_t index = 0;
+    for( uint32_t i = 0 ; i < header.artist_count && selected ; i++ )
+    {
+        if( records[i].id == artist_id )
+        {
+            index = i;
+        }
+    }
+    Artist *a = loadArtist(f, &records[index], albm, song, strs, fsiz);
+    if( !a )
+    {
+        free(records);
+        free(sections);
+        return false;
+    }
+    m_artists.alloc(1);
+    m_artists.push_back(a);
+    m_selected_artist_id = a->getID();
+    a->selectAlbumByID(selected? album_id : 0);
+
+    LoadState *s = new LoadState();
+    s->file     = f;
+    s->header   = header;
+    s->sections = sections;
+    s->records  = records;
+    s->reading[LoadState::ALBUMS]  = albm;
+    s->reading[LoadState::SONGS]   = song;
+    s->reading[LoadState::STRINGS] = strs;
+    s->reading[LoadState::FILE_SIZES] = (fsiz && fsiz->size > 0)? fsiz : NULL;
+    for( uint8_t i = 0 ; i < NUM_INDEX_SECTIONS ; i++ )
+    {
+        PlaylistSection *index = findSection(sections, header.section_count, INDEX_SECTIONS[i]);
+        s->reading[LoadState::INDEXES + i] = (index && index->size > 0)? index : NULL;
+    }
+    s->first = a;
+    s->total = header.artist_count;
+    for( int i = 0 ; i < LoadState::NUM_SECTIONS ; i++ )
+    {
+        if( s->reading[i] )
+        {
+            s->total += (s->reading[i]->size + PLAYLIST_LOAD_CHUNK - 1) / PLAYLIST_LOAD_CHUNK;
+        }
+    }
+    s->start = start;
+    m_load = s;
+
+    Serial.print("playlist: ");
+    Serial.print(a->getName());
+    Serial.print(" loaded in ");
+    Serial.print(millis() - start, DEC);
+    Serial.println(" ms");
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  読み込みの続きを、slice ミリ秒を目安に行う。loop() から繰り返し呼ぶこと
+//  戻り値は読み込みが終わった(または中止した)かどうか
+//  再生中にも呼ばれる。ファイルは CachedFile で読むので、読むたびに SDLock でタイマ割込みを
+//  止める(slice の間ずっと止めると音が途切れるので、チャンクの解析中は止めない)
+// -----------------------------------------------------------------------------
+bool Playlist::loadNext(uint32_t slice)
+{
+    if( !m_load )
+    {
+        return true;
+    }
+    uint32_t t = millis();
+    bool result = true;
+    do
+    {
+        if( m_load->section < LoadState::NUM_SECTIONS )
+        {
+            result = readChunk();
+        }
+        else if( m_load->artist < m_load->header.artist_count )
+        {
+            result = buildArtist();
+        }
+        else
+        {
+            finishLoading(true);
+            return true;
+        }
+    } while( result && millis() - t < slice );
+
+    if( !result )
+    {
+        finishLoading(false);
+        return true;
+    }
+    uint8_t progress = getLoadProgress();
+    if( progress / 10 != m_load->reported / 10 )
+    {
+        Serial.print("playlist: ");
+        Serial.print(progress, DEC);
+        Serial.println("%");
+        m_load->reported = progress;
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+//  読み込み中のセクションを１チャンクぶん読み込む
+//  セクションの最後まで読んだら CRC を検証する
+// -----------------------------------------------------------------------------
+bool Playlist::readChunk()
+{
+    LoadState *s = m_load;
+    PlaylistSection *section = s->reading[s->section];
+    if( !section )
+    {
+        s->section++;
+        return true;
+    }
+    bool result = true;
+    if( s->offset == 0 )
+    {
+        s->buffers[s->section] = (uint8_t *)malloc(section->size + 1);
+        s->crc = 0;
+        if( !s->buffers[s->section] )
+        {
+            Serial.println("playlist: out of memory");
+            result = false;
+        }
+        else
+        {
+            result = s->file.seek(section->offset);
+        }
+    }
+
+    uint8_t *buffer = s->buffers[s->section];
+    uint32_t size = section->size - s->offset;
+    if( size > PLAYLIST_LOAD_CHUNK )
+    {
+        size = PLAYLIST_LOAD_CHUNK;
+    }
+    if( result )
+    {
+        result = (s->file.read(buffer + s->offset, size) == (int)size);
+        s->crc = CRC32::update(s->crc, buffer + s->offset, size);
+        s->offset += size;
+        s->done++;
+    }
+    if( result && s->offset == section->size )
+    {
+        buffer[section->size] = 0x00;
+        result = (s->crc == section->crc);
+        if( !result )
+        {
+            Serial.print("playlist: CRC error in section at ");
+            Serial.println(section->offset, DEC);
+        }
+        else
+        {
+            s->section++;
+            s->offset = 0;
+        }
+    }
+
+    if( !result )
+    {
+        free(s->buffers[s->section]);
+        s->buffers[s->section] = NULL;
+        if( s->section < LoadState::OPTIONAL )
+        {
+            return false;
+        }
+        // 省略可能なセクションは、読めなければ検索や索引からの選曲などができないだけとする
+        s->section++;
+        s->offset = 0;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  読み込んだセクションからアーティストを１人ぶん構築する
+//  先に読み込んだアーティストは構築し直さずにそのまま使う
+// -----------------------------------------------------------------------------
+bool Playlist::buildArtist()
+{
+    LoadState *s = m_load;
+    if( s->artist == 0 )
+    {
+        s->image.albums  = (PlaylistAlbumRecord *)s->buffers[LoadState::ALBUMS];
+        s->image.songs   = (PlaylistSongRecord *)s->buffers[LoadState::SONGS];
+        s->image.strings = (char *)s->buffers[LoadState::STRINGS];
+        s->image.album_count = s->reading[LoadState::ALBUMS]->size / sizeof(PlaylistAlbumRecord);
+        s->image.song_count  = s->reading[LoadState::SONGS]->size / sizeof(PlaylistSongRecord);
+        s->image.string_size = s->reading[LoadState::STRINGS]->size;
+        if( s->buffers[LoadState::FILE_SIZES] &&
+            s->reading[LoadState::FILE_SIZES]->size >= s->image.song_count * sizeof(uint32_t) )
+        {
+            s->image.file_sizes = (uint32_t *)s->buffers[LoadState::FILE_SIZES];
+        }
+        s->artists.alloc(s->header.artist_count);
+    }
+    const PlaylistArtistRecord *rec = &s->records[s->artist++];
+    s->done++;
+    if( rec->id == s->first->getID() )
+    {
+        s->artists.push_back(s->first);
+        return true;
+    }
+    Artist *a = new Artist();
+    s->artists.push_back(a);
+    return a->load(rec, s->image);
+}
+
+// -----------------------------------------------------------------------------
+//  読み込みを終える。失敗した場合は先に読み込んだアーティストだけを残す
+// -----------------------------------------------------------------------------
+void Playlist::finishLoading(bool result)
+{
+    LoadState *s = m_load;
+    s->file.close();
+    if( result )
+    {
+        deleteArtists(m_artists, s->artists);
+        m_artists.swap(s->artists);
+        m_generation = s->header.generation;
+        for( uint8_t i = 0 ; i < NUM_INDEX_SECTIONS ; i++ )
+        {
+            uint8_t n = LoadState::INDEXES + i;
+            setIndex(INDEX_SECTIONS[i], s->buffers[n], s->buffers[n]? s->reading[n]->size : 0);
+            s->buffers[n] = NULL;
+        }
+        Serial.print(m_artists.size(), DEC);
+        Serial.print(" artist(s) successfully loaded in ");
+        Serial.print(millis() - s->start, DEC);
+        Serial.println(" ms");
+    }
+    else
+    {
+        deleteArtists(s->artists, m_artists);
+        Serial.print(m_path);
+        Serial.println(" is corrupted.");
+    }
+    for( int i = 0 ; i < LoadState::NUM_SECTIONS ; i++ )
+    {
+        free(s->buffers[i]);
+    }
+    free(s->records);
+    free(s->sections);
+    delete s;
+    m_load = NULL;
+}
+
+// -----------------------------------------------------------------------------
+//  読み込みの進捗(%)。読み込み中でなければ 100
+// -----------------------------------------------------------------------------
+uint8_t Playlist::getLoadProgress()
+{
+    if( !m_load )
+    {
+        return 100;
+    }
+    return (uint8_t)(m_load->done * 100 / m_load->total);
+}
+
+// -----------------------------------------------------------------------------
+//  ヘッダとセクションテーブルを読み込み、CRC を検証する
+//  戻り値は malloc したセクションテーブル。エラー時は NULL
+// -----------------------------------------------------------------------------
+PlaylistSection *Playlist::readHeader(CachedFile& f, PlaylistHeader& header)
+{
+    if( !f.seek(0) || f.read(&header, sizeof(header)) != sizeof(header) )
+    {
+        return NULL;
+    }
+    if( header.magic != PLAYLIST_MAGIC || header.version != PLAYLIST_VERSION || header.file_size != f.size() )
+    {
+        Serial.println("playlist: unsupported version or truncated file");
+        return NULL;
+    }
+
+    uint32_t table_size = header.section_count * sizeof(PlaylistSection);
+    PlaylistSection *sections = (PlaylistSection *)malloc(table_size);
+    if( !sections || f.read(sections, table_size) != (int)table_size )
+    {
+        free(sections);
+        return NULL;
+    }
+    uint32_t crc = header.header_crc;
+    header.header_crc = 0;
+    if( CRC32::update(CRC32::calc(&header, sizeof(header)), sections, table_size) != crc )
+    {
+        Serial.println("playlist: header CRC error");
+        free(sections);
+        return NULL;
+    }
+    header.header_crc = crc;
+    return sections;
+}
+
+// -----------------------------------------------------------------------------
+//  セクション本体を１回の read で読み込み、CRC を検証する
+//  戻り値は malloc したバッファ(末尾に NUL を１バイト付加)。エラー時は NULL
+// -----------------------------------------------------------------------------
+void *Playlist::readSection(CachedFile& f, PlaylistSection *section)
+{
+    uint8_t *buffer = (uint8_t *)malloc(section->size + 1);
+    if( !buffer )
+    {
+        Serial.println("playlist: out of memory");
+        return NULL;
+    }
+    if( !f.seek(section->offset) || 
+        f.read(buffer, section->size) != (int)section->size ||
+        CRC32::calc(buffer, section->size) != section->crc )
+    {
+        Serial.print("playlist: CRC error in section at ");
+        Serial.println(section->offset, DEC);
+        free(buffer);
+        return NULL;
+    }
+    buffer[section->size] = 0x00;
+    return buffer;
+}
+
+// -----------------------------------------------------------------------------
+//  セクション本体の一部を読み込む(CRC は検証しない)
+//  offset, size はセクション先頭からの範囲。戻り値は readSection と同じ
+// -----------------------------------------------------------------------------
+void *Playlist::readRange(CachedFile& f, PlaylistSection *section, uint32_t offset, uint32_t size)
+{
+    if( offset > section->size || size > section->size - offset )
+    {
+        Serial.println("playlist: record out of range");
+        return NULL;
+    }
+    uint8_t *buffer = (uint8_t *)malloc(size + 1);
+    if( !buffer )
+    {
+        Serial.println("playlist: out of memory");
+        return NULL;
+    }
+    if( !f.seek(section->offset + offset) || f.read(buffer, size) != (int)size )
+    {
+        free(buffer);
+        return NULL;
+    }
+    buffer[size] = 0x00;
+    return buffer;
+}
+
+// -----------------------------------------------------------------------------
+//  アーティスト１人ぶんのアルバム、曲、文字列だけを読み込んでオブジェクトを構築する
+//  fsiz は省略可能(NULL 可)
+// -----------------------------------------------------------------------------
+Artist *Playlist::loadArtist(CachedFile& f, const PlaylistArtistRecord *rec, PlaylistSection *albm,
+    PlaylistSection *song, PlaylistSection *strs, PlaylistSection *fsiz)
+{
+    PlaylistImage image;
+    image.album_base  = rec->first_album;
+    image.album_count = rec->album_count;
+    image.song_base   = rec->first_song;
+    image.song_count  = rec->song_count;
+    image.string_base = rec->string_offset;
+    image.string_size = rec->string_size;
+    image.albums  = (PlaylistAlbumRecord *)readRange(f, albm, 
+        rec->first_album * sizeof(PlaylistAlbumRecord), rec->album_count * sizeof(PlaylistAlbumRecord));
+    image.songs   = (PlaylistSongRecord *)readRange(f, song, 
+        rec->first_song * sizeof(PlaylistSongRecord), rec->song_count * sizeof(PlaylistSongRecord));
+    image.strings = (char *)readRange(f, strs, rec->string_offset, rec->string_size);
+    if( fsiz && ((uint64_t)rec->first_song + rec->song_count) * sizeof(uint32_t) <= fsiz->size )
+    {
+        image.file_sizes = (uint32_t *)readRange(f, fsiz,
+            rec->first_song * sizeof(uint32_t), rec->song_count * sizeof(uint32_t));
+    }
+
+    Artist *a = NULL;
+    if( image.albums && image.songs && image.strings )
+    {
+        a = new Artist();
+        if( !a->load(rec, image) )
+        {
+            delete a;
+            a = NULL;
+        }
+    }
+    free(image.albums);
+    free(image.songs);
+    free(image.file_sizes);
+    free(image.strings);
+    return a;
+}
+
+// -----------------------------------------------------------------------------
+//  差分更新のジャーナルがあれば playlist.dat を読み直す
+//  ジャーナルの基準世代が読み込み済みの世代と一致すれば、列挙されたアーティストだけを
+//  読み直し、そうでなければ全体を読み直す。再生停止中に呼び出すこと
+//  戻り値は読み直しを行ったかどうか
+// -----------------------------------------------------------------------------
+bool Playlist::update(const char *journal_path)
+{
+    // 停止中でもタイマ割込みは VS1053 にコマンドを送るので、ジャーナルの確認から削除まで止めておく
+    SDLock lock;
+    if( !m_path || m_load || !SD.exists(journal_path) )
+    {
+        return false;
+    }
+
+    PlaylistJournalHeader journal;
+    uint16_t *ids = NULL;
+    bool journal_valid = false;
+    File j = SD.open(journal_path);
+    if( j && j.read(&journal, sizeof(journal)) == sizeof(journal) && journal.magic == PLAYLIST_JOURNAL_MAGIC )
+    {
+        uint32_t ids_size = journal.artist_count * sizeof(uint16_t);
+        ids = (uint16_t *)malloc(ids_size + 1);
+        if( ids && j.read(ids, ids_size) == (int)ids_size )
+        {
+            uint16_t crc = journal.crc;
+            journal.crc = 0;
+            journal_valid = ((CRC32::update(CRC32::calc(&journal, sizeof(journal)), ids, ids_size) & 0xFFFF) == crc);
+        }
+    }
+    j.close();
+
+    // playlist.dat は書き換えられているので、キャッシュしたブロックは使えない
+    Blocks().invalidate(m_path);
+    CachedFile f;
+    f.open(m_path, BlockCache::RANDOM);
+    // v1 形式にはヘッダも世代もないので、常に全体を読み直してジャーナルを消す
+    // (readHeader() は必ず失敗するので、そのままでは再試行を繰り返してしまう)
+    uint32_t magic = 0;
+    bool v1 = f && f.read(&magic, sizeof(magic)) == sizeof(magic) && magic != PLAYLIST_MAGIC;
+    PlaylistHeader header;
+    PlaylistSection *sections = (f && !v1)? readHeader(f, header) : NULL;
+    if( !sections && !v1 )
+    {
+        // 書き込み途中の可能性があるので、ジャーナルは残して次の機会に再試行する
+        f.close();
+        free(ids);
+        return false;
+    }
+
+    bool reloaded = false;
+    if( v1 || header.generation != m_generation )
+    {
+        uint16_t artist_id = m_selected_artist_id;
+        Artist *artist = getSelectedArtist();
+        uint16_t album_id = artist? artist->getSelectedAlbum()->getID() : 0;
+        uint32_t start = millis();
+
+        if( !v1 && journal_valid && journal.generation == header.generation &&
+            journal.base_generation != 0 && journal.base_generation == m_generation )
+        {
+            reloaded = reloadArtists(f, header, sections, ids, journal.artist_count);
+        }
+        if( !reloaded )
+        {
+            reloaded = reloadAll(f);
+        }
+        if( reloaded )
+        {
+            m_generation = v1? 0 : header.generation;
+            Serial.print("playlist: reloaded in ");
+            Serial.print(millis() - start, DEC);
+            Serial.println(" ms");
+            if( getArtistByID(artist_id) != artist )
+            {
+                // 選択中のアーティストが読み直された(または削除された)場合は選択し直す
+                selectArtistByID(artist_id);
+                getSelectedArtist()->selectAlbumByID(album_id);
+            }
+        }
+    }
+    f.close();
+    free(sections);
+    free(ids);
+    if( v1 || header.generation == m_generation )
+    {
+        SD.remove((char *)journal_path);
+    }
+    return reloaded;
+}
+
+// -----------------------------------------------------------------------------
+//  ids に含まれるアーティストと、新たに追加されたアーティストだけを読み込み、
+//  それ以外は読み込み済みのオブジェクトをそのまま使う
+// -----------------------------------------------------------------------------
+bool Playlist::reloadArtists(CachedFile& f, PlaylistHeader& header, PlaylistSection *sections,
+    const uint16_t *ids, uint16_t id_count)
+{
+    PlaylistSection *arts = findSection(sections, header.section_count, PLAYLIST_SECTION_ARTISTS);
+    PlaylistSection *albm = findSection(sections, header.section_count, PLAYLIST_SECTION_ALBUMS);
+    PlaylistSection *song = findSection(sections, header.section_count, PLAYLIST_SECTION_SONGS);
+    PlaylistSection *strs = findSection(sections, header.section_count, PLAYLIST_SECTION_STRINGS);
+    PlaylistSection *fsiz = findSection(sections, header.section_count, PLAYLIST_SECTION_FILE_SIZES);
+    if( !arts || !albm || !song || !strs || header.artist_count == 0 || header.artist_count > 0xFFFF ||
+        arts->size < header.artist_count * sizeof(PlaylistArtistRecord) )
+    {
+        return false;
+    }
+    PlaylistArtistRecord *records = (PlaylistArtistRecord *)readSection(f, arts);
+    if( !records )
+    {
+        return false;
+    }
+
+    Vector<Artist *> artists;
+    artists.alloc(header.artist_count);
+    bool result = true;
+    uint16_t loaded = 0;
+    for( uint32_t i = 0 ; i < header.artist_count && result ; i++ )
+    {
+        bool touched = false;
+        for( uint16_t n = 0 ; n < id_count && !touched ; n++ )
+        {
+            touched = (ids[n] == records[i].id);
+        }
+        Artist *a = touched? NULL : getArtistByID(records[i].id);
+        if( !a )
+        {
+            a = loadArtist(f, &records[i], albm, song, strs, fsiz);
+            result = (a != NULL);
+            loaded++;
+        }
+        if( a )
+        {
+            artists.push_back(a);
+        }
+    }
+    free(records);
+
+    if( result )
+    {
+        // 新しいリストに残らなかったアーティスト(変更、削除されたもの)を解放する
+        deleteArtists(m_artists, artists);
+        m_artists.swap(artists);
+        Serial.print(loaded, DEC);
+        Serial.println(" artist(s) reloaded");
+        // アーティストの並び順が変わるので、索引は常に全体を読み直す
+        loadIndexes(f, header, sections);
+    }
+    else
+    {
+        deleteArtists(artists, m_artists);
+    }
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+//  全体を読み直す。失敗した場合は読み込み済みのリストをそのまま残す
+//  v1 形式には索引がないので、読み直せたら v2 の索引は捨てる
+// -----------------------------------------------------------------------------
+bool Playlist::reloadAll(CachedFile& f)
+{
+    Vector<Artist *> old;
+    old.swap(m_artists);
+    uint32_t magic = 0;
+    f.seek(0);
+    f.read(&magic, sizeof(magic));
+    f.seek(0);
+    bool result;
+    if( magic == PLAYLIST_MAGIC )
+    {
+        result = loadV2(f) && m_artists.size() > 0;
+    }
+    else
+    {
+        uint32_t generation = m_generation;
+        loadV1(f);
+        result = m_artists.size() > 0;
+        if( result )
+        {
+            for( uint8_t i = 0 ; i < NUM_INDEX_SECTIONS ; i++ )
+            {
+                setIndex(INDEX_SECTIONS[i], NULL, 0);
+            }
+        }
+        else
+        {
+            m_generation = generation;
+        }
+    }
+    if( result )
+    {
+        deleteArtists(old, m_artists);
+        Serial.print(m_artists.size(), DEC);
+        Serial.println(" artist(s) successfully loaded");
+    }
+    else
+    {
+        deleteArtists(m_artists, old);
+        m_artists.swap(old);
+    }
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+//  検索、アルバム、並び順の索引(SRCH, YEAR, ADDD, GENR, GALB, ASRT, BSRT セクション)を読み込む
+//  省略可能なセクションなので、ない場合や壊れている場合はその索引が使えないだけとする
+// -----------------------------------------------------------------------------
+void Playlist::loadIndexes(CachedFile& f, PlaylistHeader& header, PlaylistSection *sections)
+{
+    for( uint8_t i = 0 ; i < NUM_INDEX_SECTIONS ; i++ )
+    {
+        PlaylistSection *index = findSection(sections, header.section_count, INDEX_SECTIONS[i]);
+        void *data = (index && index->size > 0)? readSection(f, index) : NULL;
+        setIndex(INDEX_SECTIONS[i], data, data? index->size : 0);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  読み込んだ索引のセクションを差し替える。data は malloc したもの(なければ NULL)
+// -----------------------------------------------------------------------------
+void Playlist::setIndex(uint32_t id, void *data, uint32_t size)
+{
+    switch( id )
+    {
+        case PLAYLIST_SECTION_SEARCH:
+            free(m_search);
+            m_search = (PlaylistSearchEntry *)data;
+            m_search_count = size / sizeof(PlaylistSearchEntry);
+            break;
+        case PLAYLIST_SECTION_YEARS:
+            free(m_album_index[INDEX_YEAR]);
+            m_album_index[INDEX_YEAR] = (PlaylistAlbumIndexEntry *)data;
+            m_album_index_count[INDEX_YEAR] = size / sizeof(PlaylistAlbumIndexEntry);
+            break;
+        case PLAYLIST_SECTION_ADDED:
+            free(m_album_index[INDEX_ADDED]);
+            m_album_index[INDEX_ADDED] = (PlaylistAlbumIndexEntry *)data;
+            m_album_index_count[INDEX_ADDED] = size / sizeof(PlaylistAlbumIndexEntry);
+            break;
+        case PLAYLIST_SECTION_GENRE_ALBUMS:
+            free(m_album_index[INDEX_GENRE]);
+            m_album_index[INDEX_GENRE] = (PlaylistAlbumIndexEntry *)data;
+            m_album_index_count[INDEX_GENRE] = size / sizeof(PlaylistAlbumIndexEntry);
+            break;
+        case PLAYLIST_SECTION_GENRES:
+            free(m_genres);
+            m_genres = (PlaylistGenreRecord *)data;
+            m_genre_count = size / sizeof(PlaylistGenreRecord);
+            break;
+        case PLAYLIST_SECTION_ARTIST_ORDER:
+            free(m_artist_order);
+            m_artist_order = (PlaylistSortEntry *)data;
+            m_artist_order_count = size / sizeof(PlaylistSortEntry);
+            break;
+        case PLAYLIST_SECTION_ALBUM_ORDER:
+            free(m_album_order);
+            m_album_order = (PlaylistSortEntry *)data;
+            m_album_order_count = size / sizeof(PlaylistSortEntry);
+            break;
+        default:
+            free(data);
+            break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  アルバムの索引のエントリが指すアルバム。範囲外であれば NULL
+// -----------------------------------------------------------------------------
+Album *Playlist::getIndexedAlbum(const PlaylistAlbumIndexEntry *entry)
+{
+    if( !entry || entry->artist >= m_artists.size() )
+    {
+        return NULL;
+    }
+    Artist *artist = m_artists[entry->artist];
+    if( entry->album >= artist->getAlbumCount() )
+    {
+        return NULL;
+    }
+    return artist->getAlbums()[entry->album];
+}
+
+// -----------------------------------------------------------------------------
+//  入力された数字キー列に前方一致する索引の範囲を求める
+//  key は playlist_format.h の形式で、digits 桁ぶんが有効
+//  戻り値は一致した件数。first に先頭のインデックスを返す
+// -----------------------------------------------------------------------------
+uint32_t Playlist::findSearchRange(uint32_t key, uint8_t digits, uint32_t& first)
+{
+    first = 0;
+    if( digits == 0 || digits > PLAYLIST_SEARCH_MAX_DIGITS )
+    {
+        return 0;
+    }
+    uint32_t mask = (digits == PLAYLIST_SEARCH_MAX_DIGITS)? 0 : (0xFFFFFFFF >> (digits * 4));
+    uint32_t lo = key & ~mask;
+    uint32_t hi = key | mask;
+
+    // lo 以上の最初の位置
+    uint32_t l = 0;
+    uint32_t r = m_search_count;
+    while( l < r )
+    {
+        uint32_t m = (l + r) / 2;
+        if( m_search[m].key < lo )
+        {
+            l = m + 1;
+        }
+        else
+        {
+            r = m;
+        }
+    }
+    first = l;
+    // hi より大きい最初の位置
+    r = m_search_count;
+    while( l < r )
+    {
+        uint32_t m = (l + r) / 2;
+        if( m_search[m].key <= hi )
+        {
+            l = m + 1;
+        }
+        else
+        {
+            r = m;
+        }
+    }
+    return l - first;
+}
+
+// -----------------------------------------------------------------------------
+//  選択中のアーティスト、アルバムを EEPROM から読み込む
+// -----------------------------------------------------------------------------
+bool Playlist::readSelection(uint16_t& artist_id, uint16_t& album_id)
+{
     // +00 +01 : アーティストID
     // +02 +03 : アルバムID
     // +04     : チェックサム
@@ -204,13 +1292,25 @@ void Playlist::load(const char *path)
     if( sum != 0xFF )
     {
         Serial.println("EEPROM Read Error (0x0000 - 0x0004) -- checksum unmatched.");
+        return false;
+    }
+    uint16_t *p = (uint16_t *)config;
+    artist_id = *p;
+    album_id  = *(p+1);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+void Playlist::restoreSelection()
+{
+    uint16_t artist_id;
+    uint16_t album_id;
+    if( !readSelection(artist_id, album_id) )
+    {
         selectArtistByID(0);
     }
     else
     {
-        uint16_t *p = (uint16_t *)config;
-        uint16_t artist_id = *p;
-        uint16_t album_id  = *(p+1);
         selectArtistByID(artist_id);
         Artist *artist = getSelectedArtist();
         artist->selectAlbumByID(album_id);
@@ -248,6 +1348,22 @@ Artist *Playlist::getArtistByID(uint16_t artist_id)
     return NULL;
 }
 
+// -----------------------------------------------------------------------------
+//  アルバムIDはアーティストをまたいで一意(mkplaylist が割り当てる)
+// -----------------------------------------------------------------------------
+Album *Playlist::getAlbumByID(uint16_t album_id)
+{
+    for( uint16_t i = 0 ; i < m_artists.size() ; i++ )
+    {
+        Album *album = m_artists[i]->getAlbumByID(album_id);
+        if( album )
+        {
+            return album;
+        }
+    }
+    return NULL;
+}
+
 // -----------------------------------------------------------------------------
 Artist *Playlist::getSelectedArtist()
 {
@@ -279,3 +1395,107 @@ uint16_t Playlist::getIndexOfArtist(Artist *artist)
     }
     return 0;
 }
+
+// -----------------------------------------------------------------------------
+//  表示順(読みの照合順)で n 番目のアーティスト
+//  ASRT がない、または読み込み済みのリストと対応しない場合はファイルの順
+// -----------------------------------------------------------------------------
+Artist *Playlist::getSortedArtist(uint16_t n)
+{
+    if( n >= m_artists.size() )
+    {
+        return NULL;
+    }
+    if( hasArtistOrder() && m_artist_order[n].artist < m_artists.size() )
+    {
+        return m_artists[m_artist_order[n].artist];
+    }
+    return m_artists[n];
+}
+
+// -----------------------------------------------------------------------------
+uint16_t Playlist::getSortedIndexOfArtist(Artist *artist)
+{
+    uint16_t index = getIndexOfArtist(artist);
+    if( !hasArtistOrder() )
+    {
+        return index;
+    }
+    for( uint16_t n = 0 ; n < m_artist_order_count ; n++ )
+    {
+        if( m_artist_order[n].artist == index )
+        {
+            return n;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+//  アーティストのアルバムの表示順(BSRT 内の範囲)。なければ NULL
+//  BSRT は ARTS の順に並んでいるので、先頭を二分探索で求める
+// -----------------------------------------------------------------------------
+const PlaylistSortEntry *Playlist::getAlbumOrder(Artist *artist)
+{
+    uint16_t index = getIndexOfArtist(artist);
+    uint16_t count = artist->getAlbumCount();
+    uint32_t l = 0;
+    uint32_t r = m_album_order_count;
+    while( l < r )
+    {
+        uint32_t m = (l + r) / 2;
+        if( m_album_order[m].artist < index )
+        {
+            l = m + 1;
+        }
+        else
+        {
+            r = m;
+        }
+    }
+    if( count == 0 || l + count > m_album_order_count ||
+        m_album_order[l].artist != index || m_album_order[l + count - 1].artist != index )
+    {
+        return NULL;
+    }
+    return &m_album_order[l];
+}
+
+// -----------------------------------------------------------------------------
+//  タイトルの照合順で n 番目のアルバム。BSRT がなければアーティスト内の順
+// -----------------------------------------------------------------------------
+Album *Playlist::getSortedAlbum(Artist *artist, uint16_t n)
+{
+    if( n >= artist->getAlbumCount() )
+    {
+        return NULL;
+    }
+    const PlaylistSortEntry *order = getAlbumOrder(artist);
+    if( order && order[n].album < artist->getAlbumCount() )
+    {
+        return artist->getAlbums()[order[n].album];
+    }
+    return artist->getAlbums()[n];
+}
+
+// -----------------------------------------------------------------------------
+uint16_t Playlist::getSortedIndexOfAlbum(Artist *artist, Album *album)
+{
+    uint16_t index = artist->getIndexOfAlbum(album);
+    const PlaylistSortEntry *order = getAlbumOrder(artist);
+    for( uint16_t n = 0 ; order && n < artist->getAlbumCount() ; n++ )
+    {
+        if( order[n].album == index )
+        {
+            return n;
+        }
+    }
+    return index;
+}
+
+// -----------------------------------------------------------------------------
+uint32_t Playlist::getAlbumSortKey(Artist *artist, uint16_t n)
+{
+    const PlaylistSortEntry *order = getAlbumOrder(artist);
+    return (order && n < artist->getAlbumCount())? order[n].key : 0;
+}
@@ -3,6 +3,8 @@
 
 #include <Arduino.h>
 #include <SD.h>
+#include "block_cache.h"
+#include "playlist_format.h"
 
 // -----------------------------------------------------------------------------
 template <typename T>
@@ -15,6 +17,9 @@ class Vector
     public:
         Vector() : m_capacity(0), m_size(0), m_buffer(NULL){
         }
+        ~Vector(){
+            release();
+        }
         void alloc(uint16_t capacity){
             if( !m_buffer )
             {
@@ -22,6 +27,23 @@ class Vector
                 m_buffer = new T[capacity];
             }
         }
+        void release(){
+            delete [] m_buffer;
+            m_buffer = NULL;
+            m_capacity = 0;
+            m_size = 0;
+        }
+        void swap(Vector& other){
+            uint16_t capacity = m_capacity;
+            uint16_t size = m_size;
+            T *buffer = m_buffer;
+            m_capacity = other.m_capacity;
+            m_size = other.m_size;
+            m_buffer = other.m_buffer;
+            other.m_capacity = capacity;
+            other.m_size = size;
+            other.m_buffer = buffer;
+        }
         uint16_t capacity(){
             return m_capacity;
         }
@@ -48,6 +70,55 @@ class Vector
         }
 };
 
+// -----------------------------------------------------------------------------
+//  playlist.dat(v2) から読み込んだセクションデータ
+//  インデックス、オフセットはファイル全体での値で指定する
+//  (xxx_base は読み込んだ範囲の先頭を表す)
+// -----------------------------------------------------------------------------
+class PlaylistImage
+{
+    public:
+        PlaylistAlbumRecord *albums;
+        uint32_t             album_base;
+        uint32_t             album_count;
+        PlaylistSongRecord  *songs;
+        uint32_t             song_base;
+        uint32_t             song_count;
+        uint32_t            *file_sizes;    // FSIZ セクション(songs と同じ範囲。なければ NULL)
+        char                *strings;
+        uint32_t             string_base;
+        uint32_t             string_size;
+
+        PlaylistImage() : albums(NULL), album_base(0), album_count(0),
+            songs(NULL), song_base(0), song_count(0), file_sizes(NULL),
+            strings(NULL), string_base(0), string_size(0){
+        }
+        const PlaylistAlbumRecord *getAlbum(uint32_t index){
+            if( index < album_base || index - album_base >= album_count )
+            {
+                return NULL;
+            }
+            return &albums[index - album_base];
+        }
+        const PlaylistSongRecord *getSong(uint32_t index){
+            if( index < song_base || index - song_base >= song_count )
+            {
+                return NULL;
+            }
+            return &songs[index - song_base];
+        }
+        uint32_t getFileSize(const PlaylistSongRecord *rec){
+            return file_sizes? file_sizes[rec - songs] : 0;
+        }
+        const char *getString(uint32_t offset){
+            if( offset < string_base || offset - string_base >= string_size )
+            {
+                return "";
+            }
+            return strings + (offset - string_base);
+        }
+};
+
 // -----------------------------------------------------------------------------
 class Album;
 class Song
@@ -58,16 +129,19 @@ class Song
         Album *m_album;
         uint16_t m_length;
         uint16_t m_track_index;
+        uint32_t m_file_size;       // 曲ファイルのバイト数(不明なら 0)
         char m_title[MAX_TITLE_LENGTH];
         char m_filename[MAX_FILENAME_LENGTH];
     public:
         Song(Album *album);
-        void load(File f);
+        void load(const PlaylistV1SongRecord *rec);
+        bool load(const PlaylistSongRecord *rec, PlaylistImage& image);
         Album *getAlbum(){ return m_album; }
         uint16_t getTrackIndex(){ return m_track_index; }
         uint16_t getLength(){ return m_length; }
         const char *getTitle(){ return m_title; }
         const char *getFileName(){ return m_filename; }
+        uint32_t getFileSize(){ return m_file_size; }
 };
 
 // -----------------------------------------------------------------------------
@@ -85,7 +159,9 @@ class Album
         char           m_title[MAX_TITLE_LENGTH];
     public:
         Album(Artist *artist);
-        void            load(File f);
+        ~Album();
+        bool            load(CachedFile& f);
+        bool            load(const PlaylistAlbumRecord *rec, PlaylistImage& image);
         Artist         *getArtist(){ return m_artist; }
         uint16_t        getID(){ return m_id; }
         const char     *getTitle(){ return m_title; }
@@ -98,6 +174,7 @@ class Album
         bool            hasNext();
         void            seekPrev();
         void            seekTo(uint16_t index); 
+        uint16_t        getCurrentIndex(){ return m_current_index; }
         Song           *getCurrentSong(){ return m_songs.at(m_current_index); }
 };
 
@@ -112,7 +189,9 @@ class Artist
         uint16_t        m_selected_album_id;
     public:
         Artist();
-        void             load(File f);
+        ~Artist();
+        bool             load(CachedFile& f);
+        bool             load(const PlaylistArtistRecord *rec, PlaylistImage& image);
         uint16_t         getID(){ return m_id; }
         const char      *getName(){ return m_name; }
         uint16_t         getAlbumCount(){ return m_albums.size(); }
@@ -121,24 +200,88 @@ class Artist
         Album           *getSelectedAlbum();
         void             selectAlbumByID(uint16_t album_id=0);
         uint16_t         getIndexOfAlbum(Album *album);
+        Album           *getAlbumOfSong(uint16_t song_index, uint16_t& index_in_album);
 };
 
 // -----------------------------------------------------------------------------
 class Playlist
 {
+    public:
+        enum{INDEX_YEAR = 0, INDEX_ADDED = 1, INDEX_GENRE = 2, NUM_ALBUM_INDEXES = 3};
+
     private:
+        struct LoadState;
         Vector<Artist *> m_artists;
         uint16_t         m_selected_artist_id;
+        const char      *m_path;
+        uint32_t         m_generation;      // 読み込み済みの playlist.dat の世代(v1 は 0)
+        PlaylistSearchEntry *m_search;      // SRCH セクション(なければ NULL)
+        uint32_t         m_search_count;
+        PlaylistAlbumIndexEntry *m_album_index[NUM_ALBUM_INDEXES];  // YEAR, ADDD, GALB セクション
+        uint32_t         m_album_index_count[NUM_ALBUM_INDEXES];
+        PlaylistGenreRecord *m_genres;      // GENR セクション(なければ NULL)
+        uint32_t         m_genre_count;
+        PlaylistSortEntry *m_artist_order;  // ASRT セクション(なければ NULL)
+        uint32_t         m_artist_order_count;
+        PlaylistSortEntry *m_album_order;   // BSRT セクション(なければ NULL)
+        uint32_t         m_album_order_count;
+        LoadState       *m_load;            // 段階的な読み込みの途中経過(読み込み中以外は NULL)
+        void              loadV1(CachedFile& f);
+        bool              loadV2(CachedFile& f);
+        bool              beginV2(CachedFile& f);
+        bool              readChunk();
+        bool              buildArtist();
+        void              finishLoading(bool result);
+        PlaylistSection  *readHeader(CachedFile& f, PlaylistHeader& header);
+        void             *readSection(CachedFile& f, PlaylistSection *section);
+        void             *readRange(CachedFile& f, PlaylistSection *section, uint32_t offset, uint32_t size);
+        Artist           *loadArtist(CachedFile& f, const PlaylistArtistRecord *rec, PlaylistSection *albm,
+                                     PlaylistSection *song, PlaylistSection *strs, PlaylistSection *fsiz);
+        bool              reloadArtists(CachedFile& f, PlaylistHeader& header, PlaylistSection *sections,
+                                        const uint16_t *ids, uint16_t id_count);
+        bool              reloadAll(CachedFile& f);
+        bool              readSelection(uint16_t& artist_id, uint16_t& album_id);
+        void              restoreSelection();
+        void              loadIndexes(CachedFile& f, PlaylistHeader& header, PlaylistSection *sections);
+        void              setIndex(uint32_t id, void *data, uint32_t size);
+        bool              hasArtistOrder(){ return m_artist_order_count == m_artists.size(); }
+        const PlaylistSortEntry *getAlbumOrder(Artist *artist);
     public:
         Playlist();
-        void              load(const char *path);
+        bool              begin(const char *path);
+        bool              loadNext(uint32_t slice);
+        bool              isLoading(){ return m_load != NULL; }
+        uint8_t           getLoadProgress();
+        bool              update(const char *journal_path);
         void              save();
         uint16_t          getArtistCount(){ return m_artists.size(); }
         Vector<Artist *>& getArtists(){ return m_artists; }
         Artist           *getArtistByID(uint16_t artist_id);
+        Album            *getAlbumByID(uint16_t album_id);
         Artist           *getSelectedArtist();
         void              selectArtistByID(uint16_t artist_id=0);
         uint16_t          getIndexOfArtist(Artist *artist);
+        Artist           *getSortedArtist(uint16_t n);
+        uint16_t          getSortedIndexOfArtist(Artist *artist);
+        uint32_t          getArtistSortKey(uint16_t n){
+            return (hasArtistOrder() && n < m_artist_order_count)? m_artist_order[n].key : 0;
+        }
+        Album            *getSortedAlbum(Artist *artist, uint16_t n);
+        uint16_t          getSortedIndexOfAlbum(Artist *artist, Album *album);
+        uint32_t          getAlbumSortKey(Artist *artist, uint16_t n);
+        uint32_t          findSearchRange(uint32_t key, uint8_t digits, uint32_t& first);
+        const PlaylistSearchEntry *getSearchEntry(uint32_t index){
+            return (index < m_search_count)? &m_search[index] : NULL;
+        }
+        uint32_t          getAlbumIndexCount(uint8_t type){ return m_album_index_count[type]; }
+        const PlaylistAlbumIndexEntry *getAlbumIndexEntry(uint8_t type, uint32_t index){
+            return (index < m_album_index_count[type])? &m_album_index[type][index] : NULL;
+        }
+        Album            *getIndexedAlbum(const PlaylistAlbumIndexEntry *entry);
+        uint32_t          getGenreCount(){ return m_genre_count; }
+        const PlaylistGenreRecord *getGenre(uint32_t index){
+            return (index < m_genre_count)? &m_genres[index] : NULL;
+        }
 };
 
 #endif
@@ -0,0 +1,233 @@
+#ifndef PLAYLIST_FORMAT_H
+#define PLAYLIST_FORMAT_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+//  playlist.dat (v2) のファイルフォーマット
+//  ホスト側ツール(tools/)とも共有するため、Arduino のヘッダには依存しないこと
+//  数値はすべてリトルエンディアン
+//
+//  +------------------------------+ 0
+//  | PlaylistHeader               |
+//  +------------------------------+ sizeof(PlaylistHeader)
+//  | PlaylistSection x N          | セクションテーブル
+//  +------------------------------+
+//  | セクション本体 ...            | 各セクションは4バイト境界に配置する
+//  +------------------------------+ file_size
+//
+//  セクションの後ろには余白を置いてよい(次のセクションの offset までが使用可能な領域)
+//  差分更新ではこの余白に変更のあったアーティストのレコードを追記し、
+//  変更のないアーティストのレコードは元の位置のまま残す
+//
+//  ARTS : PlaylistArtistRecord の配列(アーティスト順)
+//  ALBM : PlaylistAlbumRecord の配列(アーティストごとに連続して格納)
+//  SONG : PlaylistSongRecord の配列(アルバムごとに連続して格納)
+//  STRS : NUL終端された UTF-8 文字列の集合
+//         アーティスト１人ぶんの文字列(名前、アルバムタイトル、曲名、ファイル名)は
+//         連続したブロックとして格納し、ARTS に範囲を記録する
+//  SRCH : PlaylistSearchEntry の配列(key の昇順)。省略可
+//         アーティスト名、アルバムタイトル、曲名(と読み)をリモコンの数字キー列に
+//         変換したもの。入力された数字列を前方一致で二分探索する
+//  YEAR : PlaylistAlbumIndexEntry の配列(key は年。年の昇順、年が不明なものは末尾)。省略可
+//  ADDD : PlaylistAlbumIndexEntry の配列(key は追加日時。新しい順)。省略可
+//  GENR : PlaylistGenreRecord の配列(ジャンル名の順、ジャンルが不明なものは末尾)。省略可
+//  GALB : PlaylistAlbumIndexEntry の配列(key はジャンルの番号。ジャンルごとに連続して
+//         格納し、GENR から範囲を参照する)。省略可
+//         YEAR, ADDD, GALB は同じキーの中ではアーティスト、アルバムの順。どれもホスト側で
+//         並べ替えておき、プレイヤーはそのまま順にたどる
+//  ASRT : PlaylistSortEntry の配列(アーティストの表示順。album は使わない)。省略可
+//  BSRT : PlaylistSortEntry の配列(アーティストごとに ARTS の順で連続して格納し、
+//         その中はアルバムタイトルの表示順)。省略可
+//         どちらも読みによる照合順にホスト側で並べ替えたもの。key は頭文字での移動に使う
+//  FSIZ : uint32_t の配列(曲ファイルのバイト数。SONG と同じ番号で対応する)。省略可
+//         プレイヤーは先に開いておいたファイルがこの曲のものかどうかの確認に使う
+//
+//  v1 (先頭がマジックナンバーでないもの) は従来通りのストリーム形式
+//      uint16_t アーティスト数に続いて、アーティストごとに PlaylistV1ArtistRecord、
+//      そのアルバムごとに PlaylistV1AlbumRecord と曲数ぶんの PlaylistV1SongRecord を並べる
+//      アルバムの曲は固定長レコードが連続しているので、まとめて１回で読み込める
+//
+//  playlist.jnl (差分更新のジャーナル)
+//      PlaylistJournalHeader に続いて、変更(追加、削除を含む)のあったアーティストの ID
+//      (uint16_t) を artist_count 個並べたもの。プレイヤーは読み込み済みの世代が
+//      base_generation と一致していれば、列挙されたアーティストだけを読み直す
+// -----------------------------------------------------------------------------
+#define PLAYLIST_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define PLAYLIST_MAGIC              PLAYLIST_FOURCC('P', 'L', 'S', 'T')
+#define PLAYLIST_VERSION            2
+
+#define PLAYLIST_SECTION_ARTISTS    PLAYLIST_FOURCC('A', 'R', 'T', 'S')
+#define PLAYLIST_SECTION_ALBUMS     PLAYLIST_FOURCC('A', 'L', 'B', 'M')
+#define PLAYLIST_SECTION_SONGS      PLAYLIST_FOURCC('S', 'O', 'N', 'G')
+#define PLAYLIST_SECTION_STRINGS    PLAYLIST_FOURCC('S', 'T', 'R', 'S')
+#define PLAYLIST_SECTION_SEARCH     PLAYLIST_FOURCC('S', 'R', 'C', 'H')
+#define PLAYLIST_SECTION_YEARS      PLAYLIST_FOURCC('Y', 'E', 'A', 'R')
+#define PLAYLIST_SECTION_ADDED      PLAYLIST_FOURCC('A', 'D', 'D', 'D')
+#define PLAYLIST_SECTION_GENRES     PLAYLIST_FOURCC('G', 'E', 'N', 'R')
+#define PLAYLIST_SECTION_GENRE_ALBUMS PLAYLIST_FOURCC('G', 'A', 'L', 'B')
+#define PLAYLIST_SECTION_ARTIST_ORDER PLAYLIST_FOURCC('A', 'S', 'R', 'T')
+#define PLAYLIST_SECTION_ALBUM_ORDER  PLAYLIST_FOURCC('B', 'S', 'R', 'T')
+#define PLAYLIST_SECTION_FILE_SIZES   PLAYLIST_FOURCC('F', 'S', 'I', 'Z')
+
+#define PLAYLIST_JOURNAL_MAGIC      PLAYLIST_FOURCC('P', 'J', 'N', 'L')
+
+// 32 bytes
+struct PlaylistHeader
+{
+    uint32_t magic;             // PLAYLIST_MAGIC
+    uint16_t version;           // PLAYLIST_VERSION
+    uint16_t section_count;     // セクションテーブルのエントリ数
+    uint32_t file_size;         // ファイル全体のサイズ
+    uint32_t header_crc;        // ヘッダ(このフィールドは0として計算)とセクションテーブルの CRC-32
+    uint32_t artist_count;
+    uint32_t album_count;
+    uint32_t song_count;
+    uint32_t generation;        // 更新のたびに増える世代番号
+};
+
+// 16 bytes
+struct PlaylistSection
+{
+    uint32_t id;                // PLAYLIST_SECTION_???
+    uint32_t offset;            // ファイル先頭からのオフセット
+    uint32_t size;              // バイト数
+    uint32_t crc;               // セクション本体の CRC-32
+};
+
+// 28 bytes
+struct PlaylistArtistRecord
+{
+    uint16_t id;
+    uint16_t album_count;
+    uint32_t first_album;       // ALBM 内の先頭アルバムのインデックス
+    uint32_t first_song;        // SONG 内の先頭曲のインデックス
+    uint32_t song_count;        // 全アルバムの合計曲数
+    uint32_t name;              // STRS 内のオフセット
+    uint32_t string_offset;     // このアーティストの文字列ブロック(STRS 内のオフセット)
+    uint32_t string_size;       // 文字列ブロックのバイト数
+};
+
+// 16 bytes
+struct PlaylistAlbumRecord
+{
+    uint16_t id;
+    uint16_t year;
+    uint16_t total_length;      // 秒
+    uint16_t song_count;
+    uint32_t first_song;        // SONG 内の先頭曲のインデックス
+    uint32_t title;             // STRS 内のオフセット
+};
+
+// 12 bytes
+struct PlaylistSongRecord
+{
+    uint16_t track_index;
+    uint16_t length;            // 秒
+    uint32_t filename;          // STRS 内のオフセット
+    uint32_t title;             // STRS 内のオフセット
+};
+
+// 132 bytes (v1)
+struct PlaylistV1ArtistRecord
+{
+    uint16_t id;
+    char     name[128];
+    uint16_t album_count;
+};
+
+// 136 bytes (v1)
+struct PlaylistV1AlbumRecord
+{
+    uint16_t id;
+    char     title[128];
+    uint16_t year;
+    uint16_t total_length;      // 秒
+    uint16_t song_count;
+};
+
+// 196 bytes (v1)
+struct PlaylistV1SongRecord
+{
+    uint16_t track_index;
+    uint16_t length;            // 秒
+    char     filename[64];
+    char     title[128];
+};
+
+// -----------------------------------------------------------------------------
+//  検索キー
+//  英字は携帯電話のキー配列(ABC=2 ... WXYZ=9)、かなは行(あ=1 か=2 ... わ=0)、
+//  数字はそのままの数字に変換する。全角英数字、カタカナ、半角カナは同じものとみなす
+//  先頭から最大8桁を、１桁4ビット(数字+1、0は終端)で上位から詰める
+// -----------------------------------------------------------------------------
+#define PLAYLIST_SEARCH_MAX_DIGITS  8
+#define PLAYLIST_SEARCH_ARTIST      0xFFFF      // item : アーティスト自身
+#define PLAYLIST_SEARCH_ALBUM       0x8000      // item : アルバム(下位15ビットがアーティスト内の番号)
+                                                //        それ以外はアーティスト内の通し番号の曲
+
+// 8 bytes
+struct PlaylistSearchEntry
+{
+    uint32_t key;
+    uint16_t artist;            // ARTS 内のインデックス
+    uint16_t item;
+};
+
+// -----------------------------------------------------------------------------
+//  アルバムの索引(年、追加日時、ジャンル)
+// -----------------------------------------------------------------------------
+#define PLAYLIST_YEAR_UNKNOWN       0xFFFF      // YEAR の key : 年が不明
+#define PLAYLIST_GENRE_NAME_SIZE    24          // NUL を含む
+
+// 8 bytes
+struct PlaylistAlbumIndexEntry
+{
+    uint32_t key;               // 年、追加日時(UNIX時間)、ジャンルの番号
+    uint16_t artist;            // ARTS 内のインデックス
+    uint16_t album;             // アーティスト内のアルバムの番号
+};
+
+// 32 bytes
+struct PlaylistGenreRecord
+{
+    uint32_t first_album;       // GALB 内の先頭のインデックス
+    uint16_t album_count;
+    uint16_t reserved;
+    char     name[PLAYLIST_GENRE_NAME_SIZE];    // UTF-8、NUL 終端。空文字列はジャンル不明
+};
+
+// -----------------------------------------------------------------------------
+//  照合キー(ASRT, BSRT)
+//  読み(なければ名前)の先頭から、記号や空白、長音記号を除いた最大4文字を
+//  １文字8ビットで上位から詰める(0は終端)。大文字と小文字、全角と半角、ひらがなと
+//  カタカナ、清音と濁音、拗音は同じ文字とみなす
+//      0x10 - 0x19 : 数字
+//      0x20 - 0x39 : 英字(A - Z)
+//      0x40 - 0x6D : かな(あいうえお か ... わ を ん の五十音順)
+//      0xF0        : その他(漢字など)
+//  最上位の8ビットが同じものを同じ頭文字とみなす
+// -----------------------------------------------------------------------------
+#define PLAYLIST_SORT_KEY_CHARS     4
+
+// 8 bytes
+struct PlaylistSortEntry
+{
+    uint32_t key;
+    uint16_t artist;            // ARTS 内のインデックス
+    uint16_t album;             // アーティスト内のアルバムの番号(ASRT では 0)
+};
+
+// 16 bytes
+struct PlaylistJournalHeader
+{
+    uint32_t magic;             // PLAYLIST_JOURNAL_MAGIC
+    uint32_t base_generation;   // 差分の基準となる世代(0 なら全体を読み直す)
+    uint32_t generation;        // 更新後の playlist.dat の世代
+    uint16_t artist_count;      // 続く ID の数
+    uint16_t crc;               // ヘッダ(このフィールドは0として計算)と ID 列の CRC-32 の下位16ビット
+};
+
+#endif
@@ -0,0 +1,279 @@
+// -----------------------------------------------------------------------------
+//  mkfont : v1 のフォントファイル(font_*.dat)を v2 に変換する
+//
+//  ビルド(Linux)
+//      cd tools/mkfont
+//      g++ -O2 -std=c++11 -I../.. -o mkfont mkfont.cpp ../../crc32.cpp
+//
+//  使い方
+//      mkfont -H <height> -o <output> <input>
+//          -H <n>      グリフの高さ(v1 のファイルには含まれないので必ず指定する)
+//                      font_t.dat は 9、font_s.dat は 14、font_l.dat は 16
+//          -o <file>   出力ファイル(入力と同じでもよい)
+//          -v          グリフ数、ファイルサイズを表示する
+//
+//  v1 の列ごとのビットマップを行優先に並べ替え、文字コード順に並べて索引を付ける
+//  同じ文字コードのグリフが複数あるときは、先にあるものを使う(v1 を読み込んでいたときと同じ)
+// -----------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "font_format.h"
+#include "crc32.h"
+
+struct SourceGlyph
+{
+    uint16_t code;
+    int16_t  width;
+    int16_t  offset;
+    int16_t  advance;
+    uint32_t order;                     // v1 のファイル内の順番
+    std::vector<uint16_t> columns;      // 最下位ビットが上端
+};
+
+// -----------------------------------------------------------------------------
+static void usage()
+{
+    fprintf(stderr, "usage: mkfont -H height -o output [-v] input\n");
+    exit(1);
+}
+
+// -----------------------------------------------------------------------------
+static bool readFile(const std::string& path, std::vector<uint8_t>& data)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if( !fp )
+    {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t n;
+    while( (n = fread(buffer, 1, sizeof(buffer), fp)) > 0 )
+    {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+static uint16_t getU16(const std::vector<uint8_t>& data, size_t pos)
+{
+    return data[pos] | (data[pos + 1] << 8);
+}
+
+// -----------------------------------------------------------------------------
+//  v1 のグリフを読み込む。形式が壊れていれば false
+// -----------------------------------------------------------------------------
+static bool parseV1(const std::vector<uint8_t>& data, std::vector<SourceGlyph>& glyphs)
+{
+    if( data.size() < 2 )
+    {
+        return false;
+    }
+    uint16_t count = getU16(data, 0);
+    size_t pos = 2;
+    for( uint16_t i = 0 ; i < count ; i++ )
+    {
+        if( pos + 8 > data.size() )
+        {
+            return false;
+        }
+        SourceGlyph g;
+        g.code = getU16(data, pos);
+        g.width = (int16_t)getU16(data, pos + 2);
+        g.offset = (int16_t)getU16(data, pos + 4);
+        g.advance = (int16_t)getU16(data, pos + 6);
+        g.order = i;
+        pos += 8;
+        if( g.width > 0 )
+        {
+            if( pos + 2 * g.width > data.size() )
+            {
+                return false;
+            }
+            for( int16_t x = 0 ; x < g.width ; x++ )
+            {
+                g.columns.push_back(getU16(data, pos + 2 * x));
+            }
+            pos += 2 * g.width;
+        }
+        glyphs.push_back(g);
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+static void align4(std::vector<uint8_t>& data)
+{
+    while( data.size() % 4 )
+    {
+        data.push_back(0);
+    }
+}
+
+// -----------------------------------------------------------------------------
+template <typename T> static void append(std::vector<uint8_t>& data, const T& value)
+{
+    const uint8_t *p = (const uint8_t *)&value;
+    data.insert(data.end(), p, p + sizeof(T));
+}
+
+// -----------------------------------------------------------------------------
+//  v2 のファイルを組み立てる
+// -----------------------------------------------------------------------------
+static void buildV2(std::vector<SourceGlyph>& glyphs, int height, std::vector<uint8_t>& out)
+{
+    std::stable_sort(glyphs.begin(), glyphs.end(),
+        [](const SourceGlyph& a, const SourceGlyph& b){ return a.code < b.code; });
+    std::vector<SourceGlyph> unique;
+    for( size_t i = 0 ; i < glyphs.size() ; i++ )
+    {
+        if( unique.empty() || unique.back().code != glyphs[i].code )
+        {
+            unique.push_back(glyphs[i]);
+        }
+    }
+
+    // ビットマップ(行優先)
+    std::vector<uint8_t> bitmaps;
+    std::vector<FontGlyphRecord> records;
+    for( size_t i = 0 ; i < unique.size() ; i++ )
+    {
+        const SourceGlyph& g = unique[i];
+        FontGlyphRecord r;
+        r.code = g.code;
+        r.width = g.width;
+        r.offset = g.offset;
+        r.advance = g.advance;
+        r.bitmap = bitmaps.size();
+        if( g.width > 0 )
+        {
+            int pitch = (g.width + 7) / 8;
+            size_t base = bitmaps.size();
+            bitmaps.resize(base + pitch * height, 0);
+            for( int y = 0 ; y < height && y < 16 ; y++ )
+            {
+                for( int x = 0 ; x < g.width ; x++ )
+                {
+                    if( g.columns[x] & (1 << y) )
+                    {
+                        bitmaps[base + y * pitch + x / 8] |= 0x80 >> (x % 8);
+                    }
+                }
+            }
+        }
+        records.push_back(r);
+    }
+
+    // 上位バイトごとの先頭位置
+    uint32_t lookup[FONT_LOOKUP_SIZE];
+    size_t n = 0;
+    for( int b = 0 ; b < FONT_LOOKUP_SIZE ; b++ )
+    {
+        while( n < records.size() && (records[n].code >> 8) < b )
+        {
+            n++;
+        }
+        lookup[b] = n;
+    }
+
+    FontHeader header;
+    memset(&header, 0, sizeof(header));
+    out.assign(sizeof(FontHeader), 0);
+    header.lookup_offset = out.size();
+    for( int b = 0 ; b < FONT_LOOKUP_SIZE ; b++ )
+    {
+        append(out, lookup[b]);
+    }
+    align4(out);
+    header.glyph_offset = out.size();
+    for( size_t i = 0 ; i < records.size() ; i++ )
+    {
+        append(out, records[i]);
+    }
+    align4(out);
+    header.bitmap_offset = out.size();
+    out.insert(out.end(), bitmaps.begin(), bitmaps.end());
+    align4(out);
+
+    header.magic = FONT_MAGIC;
+    header.version = FONT_VERSION;
+    header.height = height;
+    header.glyph_count = records.size();
+    header.file_size = out.size();
+    header.crc = CRC32::calc(&out[sizeof(FontHeader)], header.bitmap_offset - sizeof(FontHeader));
+    memcpy(&out[0], &header, sizeof(header));
+}
+
+// -----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    std::string output;
+    int height = 0;
+    bool verbose = false;
+    int opt;
+    while( (opt = getopt(argc, argv, "H:o:v")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'H': height = atoi(optarg); break;
+            case 'o': output = optarg; break;
+            case 'v': verbose = true; break;
+            default:  usage();
+        }
+    }
+    if( optind != argc - 1 || output.empty() || height <= 0 )
+    {
+        usage();
+    }
+    if( height > 16 )
+    {
+        fprintf(stderr, "error: height must be 16 or less\n");
+        return 1;
+    }
+    std::string input = argv[optind];
+
+    std::vector<uint8_t> data;
+    if( !readFile(input, data) )
+    {
+        fprintf(stderr, "error: cannot open %s\n", input.c_str());
+        return 1;
+    }
+    if( data.size() >= 4 && (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24)) == FONT_MAGIC )
+    {
+        fprintf(stderr, "error: %s is already a v2 font\n", input.c_str());
+        return 1;
+    }
+    std::vector<SourceGlyph> glyphs;
+    if( !parseV1(data, glyphs) )
+    {
+        fprintf(stderr, "error: %s is not a v1 font\n", input.c_str());
+        return 1;
+    }
+
+    std::vector<uint8_t> out;
+    buildV2(glyphs, height, out);
+    FILE *fp = fopen(output.c_str(), "wb");
+    if( !fp || fwrite(&out[0], 1, out.size(), fp) != out.size() )
+    {
+        fprintf(stderr, "error: cannot write %s\n", output.c_str());
+        if( fp )
+        {
+            fclose(fp);
+        }
+        return 1;
+    }
+    fclose(fp);
+    if( verbose )
+    {
+        const FontHeader *header = (const FontHeader *)&out[0];
+        printf("%s: %u glyph(s) (%u in v1), %u bytes\n", output.c_str(),
+               header->glyph_count, (unsigned)glyphs.size(), header->file_size);
+    }
+    return 0;
+}
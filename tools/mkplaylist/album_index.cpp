@@ -0,0 +1,104 @@
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include "album_index.h"
+
+// -----------------------------------------------------------------------------
+//  ジャンル名の比較(大文字、小文字を区別しない)
+// -----------------------------------------------------------------------------
+struct GenreLess
+{
+    bool operator () (const std::string& a, const std::string& b) const {
+        return strcasecmp(a.c_str(), b.c_str()) < 0;
+    }
+};
+
+// -----------------------------------------------------------------------------
+static PlaylistAlbumIndexEntry makeEntry(uint32_t key, size_t artist, size_t album)
+{
+    PlaylistAlbumIndexEntry e;
+    e.key = key;
+    e.artist = (uint16_t)artist;
+    e.album = (uint16_t)album;
+    return e;
+}
+
+// -----------------------------------------------------------------------------
+//  エントリはアーティスト、アルバムの順に作るので、安定ソートで key だけを比べれば
+//  同じ key の中はその順になる
+// -----------------------------------------------------------------------------
+void AlbumIndex::build(const std::vector<LibraryArtist>& artists)
+{
+    years.clear();
+    added.clear();
+    genres.clear();
+    genre_albums.clear();
+
+    // ジャンル名の順に番号を振る。ジャンルが不明なアルバムは末尾にまとめる
+    std::map<std::string, uint32_t, GenreLess> genre_map;
+    bool has_unknown = false;
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        for( size_t j = 0 ; j < artists[i].albums.size() ; j++ )
+        {
+            const std::string& genre = artists[i].albums[j].genre;
+            if( genre.empty() )
+            {
+                has_unknown = true;
+            }
+            else
+            {
+                genre_map.insert(std::make_pair(genre, 0));
+            }
+        }
+    }
+    for( std::map<std::string, uint32_t, GenreLess>::iterator it = genre_map.begin() ; it != genre_map.end() ; ++it )
+    {
+        it->second = genres.size();
+        PlaylistGenreRecord g;
+        memset(&g, 0, sizeof(g));
+        std::string name = truncateUTF8(it->first, PLAYLIST_GENRE_NAME_SIZE - 1);
+        memcpy(g.name, name.data(), name.size());
+        genres.push_back(g);
+    }
+    uint32_t unknown = genres.size();
+    if( has_unknown )
+    {
+        PlaylistGenreRecord g;
+        memset(&g, 0, sizeof(g));
+        genres.push_back(g);
+    }
+
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        for( size_t j = 0 ; j < artists[i].albums.size() ; j++ )
+        {
+            const LibraryAlbum& album = artists[i].albums[j];
+            years.push_back(makeEntry(album.year? album.year : PLAYLIST_YEAR_UNKNOWN, i, j));
+            added.push_back(makeEntry(album.added, i, j));
+            uint32_t genre = album.genre.empty()? unknown : genre_map[album.genre];
+            genre_albums.push_back(makeEntry(genre, i, j));
+        }
+    }
+    std::stable_sort(years.begin(), years.end(),
+        [](const PlaylistAlbumIndexEntry& a, const PlaylistAlbumIndexEntry& b){ return a.key < b.key; });
+    std::stable_sort(added.begin(), added.end(),
+        [](const PlaylistAlbumIndexEntry& a, const PlaylistAlbumIndexEntry& b){ return a.key > b.key; });
+    std::stable_sort(genre_albums.begin(), genre_albums.end(),
+        [](const PlaylistAlbumIndexEntry& a, const PlaylistAlbumIndexEntry& b){ return a.key < b.key; });
+
+    for( size_t n = 0 ; n < genre_albums.size() ; n++ )
+    {
+        PlaylistGenreRecord& g = genres[genre_albums[n].key];
+        if( g.album_count == 0 )
+        {
+            g.first_album = n;
+        }
+        if( g.album_count < 0xFFFF )
+        {
+            g.album_count++;
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef ALBUM_INDEX_H
+#define ALBUM_INDEX_H
+
+#include <stdint.h>
+#include <vector>
+#include "library.h"
+#include "playlist_format.h"
+
+// -----------------------------------------------------------------------------
+//  アルバムの索引(YEAR, ADDD, GENR, GALB セクション)
+//  並べ替えはすべてここで行い、プレイヤーは配列を順にたどるだけにする
+// -----------------------------------------------------------------------------
+class AlbumIndex
+{
+    public:
+        std::vector<PlaylistAlbumIndexEntry> years;
+        std::vector<PlaylistAlbumIndexEntry> added;
+        std::vector<PlaylistGenreRecord>     genres;
+        std::vector<PlaylistAlbumIndexEntry> genre_albums;
+
+        void build(const std::vector<LibraryArtist>& artists);
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include "collation.h"
+
+// 照合の要素(toElement の戻り値)
+enum{ELEMENT_IGNORE = 0x00};    // 無視する(記号、空白、長音記号、濁点など)
+enum{ELEMENT_DIGIT  = 0x10};
+enum{ELEMENT_LATIN  = 0x20};
+enum{ELEMENT_KANA   = 0x40};
+enum{ELEMENT_OTHER  = 0xF0};    // 漢字など
+
+// ひらがな(U+3041 ぁ 〜 U+3096 ゖ)の五十音順の番号(あ=0 ... ん=45)
+static const uint8_t HIRAGANA_ORDER[] = {
+     0,  0,  1,  1,  2,  2,  3,  3,  4,  4,                     // ぁあぃいぅうぇえぉお
+     5,  5,  6,  6,  7,  7,  8,  8,  9,  9,                     // かがきぎくぐけげこご
+    10, 10, 11, 11, 12, 12, 13, 13, 14, 14,                     // さざしじすずせぜそぞ
+    15, 15, 16, 16, 17, 17, 17, 18, 18, 19, 19,                 // ただちぢっつづてでとど
+    20, 21, 22, 23, 24,                                         // なにぬねの
+    25, 25, 25, 26, 26, 26, 27, 27, 27, 28, 28, 28, 29, 29, 29, // はばぱひびぴふぶぷへべぺほぼぽ
+    30, 31, 32, 33, 34,                                         // まみむめも
+    35, 35, 36, 36, 37, 37,                                     // ゃやゅゆょよ
+    38, 39, 40, 41, 42,                                         // らりるれろ
+    43, 43,  1,  3, 44, 45,                                     // ゎわゐゑをん
+     2,  5,  8                                                  // ゔゕゖ
+};
+
+// 半角カナ(U+FF66 ｦ 〜 U+FF9F ﾟ)の五十音順の番号(0xFF は無視する)
+static const uint8_t HANKAKU_ORDER[] = {
+    44,                                                         // ｦ
+     0,  1,  2,  3,  4, 35, 36, 37,                             // ｧｨｩｪｫ ｬｭｮ
+    17, 0xFF,                                                   // ｯ ｰ
+     0,  1,  2,  3,  4,                                         // ｱｲｳｴｵ
+     5,  6,  7,  8,  9,                                         // ｶｷｸｹｺ
+    10, 11, 12, 13, 14,                                         // ｻｼｽｾｿ
+    15, 16, 17, 18, 19,                                         // ﾀﾁﾂﾃﾄ
+    20, 21, 22, 23, 24,                                         // ﾅﾆﾇﾈﾉ
+    25, 26, 27, 28, 29,                                         // ﾊﾋﾌﾍﾎ
+    30, 31, 32, 33, 34,                                         // ﾏﾐﾑﾒﾓ
+    35, 36, 37,                                                 // ﾔﾕﾖ
+    38, 39, 40, 41, 42,                                         // ﾗﾘﾙﾚﾛ
+    43, 45,                                                     // ﾜﾝ
+    0xFF, 0xFF                                                  // ﾞﾟ
+};
+
+static_assert(sizeof(HIRAGANA_ORDER) == 0x3096 - 0x3041 + 1, "HIRAGANA_ORDER");
+static_assert(sizeof(HANKAKU_ORDER) == 0xFF9F - 0xFF66 + 1, "HANKAKU_ORDER");
+
+// Latin-1 の英字(U+00C0 〜 U+00FF)を基本の英字に寄せる
+static const char LATIN1_BASE[] =
+    "AAAAAAACEEEEIIII" "DNOOOOO*OUUUUYTs"
+    "aaaaaaaceeeeiiii" "dnooooo/ouuuuyty";
+
+// -----------------------------------------------------------------------------
+//  １文字を照合の要素に変換する
+// -----------------------------------------------------------------------------
+uint8_t Collation::toElement(uint32_t c)
+{
+    if( c >= 0xFF01 && c <= 0xFF5E )
+    {
+        c -= 0xFEE0;        // 全角英数字、記号
+    }
+    else if( c >= 0x30A1 && c <= 0x30F6 )
+    {
+        c -= 0x60;          // カタカナ
+    }
+    else if( c >= 0xC0 && c <= 0xFF )
+    {
+        char base = LATIN1_BASE[c - 0xC0];
+        c = (base == '*' || base == '/')? ' ' : base;
+    }
+
+    if( c >= '0' && c <= '9' )
+    {
+        return ELEMENT_DIGIT + (c - '0');
+    }
+    if( c >= 'a' && c <= 'z' )
+    {
+        c -= 'a' - 'A';
+    }
+    if( c >= 'A' && c <= 'Z' )
+    {
+        return ELEMENT_LATIN + (c - 'A');
+    }
+    if( c < 0x80 || (c >= 0x3000 && c <= 0x3002) || c == 0x30FB || c == 0x30FC || c == 0x309B || c == 0x309C )
+    {
+        return ELEMENT_IGNORE;  // 記号、空白、読点、句点、中黒、長音記号、濁点、半濁点
+    }
+    if( c >= 0x3041 && c <= 0x3096 )
+    {
+        return ELEMENT_KANA + HIRAGANA_ORDER[c - 0x3041];
+    }
+    if( c >= 0xFF66 && c <= 0xFF9F )
+    {
+        uint8_t n = HANKAKU_ORDER[c - 0xFF66];
+        return (n == 0xFF)? ELEMENT_IGNORE : (ELEMENT_KANA + n);
+    }
+    if( c >= 0x30F7 && c <= 0x30FA )
+    {
+        return ELEMENT_KANA + 43;   // ヷヸヹヺ
+    }
+    return ELEMENT_OTHER;
+}
+
+// -----------------------------------------------------------------------------
+//  text を照合の要素の列に変換する(無視する文字は含めない)
+// -----------------------------------------------------------------------------
+void Collation::makeElements(const std::string& text, std::vector<uint8_t>& elements)
+{
+    elements.clear();
+    size_t pos = 0;
+    while( pos < text.size() )
+    {
+        uint8_t e = toElement(decodeUTF8(text, pos));
+        if( e != ELEMENT_IGNORE )
+        {
+            elements.push_back(e);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  照合キー(先頭の PLAYLIST_SORT_KEY_CHARS 文字)
+// -----------------------------------------------------------------------------
+uint32_t Collation::makeKey(const std::string& text)
+{
+    std::vector<uint8_t> elements;
+    makeElements(text, elements);
+    uint32_t key = 0;
+    for( size_t i = 0 ; i < elements.size() && i < PLAYLIST_SORT_KEY_CHARS ; i++ )
+    {
+        key |= (uint32_t)elements[i] << (24 - i * 8);
+    }
+    return key;
+}
+
+// -----------------------------------------------------------------------------
+//  照合順で比較する。要素の列が同じであれば、大文字と小文字を区別せずに比べ、
+//  最後はバイト列で比べる
+// -----------------------------------------------------------------------------
+int Collation::compare(const std::string& a, const std::string& b)
+{
+    std::vector<uint8_t> ea;
+    std::vector<uint8_t> eb;
+    makeElements(a, ea);
+    makeElements(b, eb);
+    if( ea != eb )
+    {
+        return (ea < eb)? -1 : 1;
+    }
+    int c = strcasecmp(a.c_str(), b.c_str());
+    return (c != 0)? c : a.compare(b);
+}
+
+// -----------------------------------------------------------------------------
+//  アーティストは読み(なければ名前)の照合順、アルバムはアーティストごとに
+//  読み(なければタイトル)の照合順に並べる。artists は ARTS と同じ順
+// -----------------------------------------------------------------------------
+void Collation::build(const std::vector<LibraryArtist>& artists,
+    std::vector<PlaylistSortEntry>& artist_order, std::vector<PlaylistSortEntry>& album_order)
+{
+    artist_order.clear();
+    album_order.clear();
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        PlaylistSortEntry e;
+        e.key = makeKey(artists[i].sort_key);
+        e.artist = (uint16_t)i;
+        e.album = 0;
+        artist_order.push_back(e);
+    }
+    std::stable_sort(artist_order.begin(), artist_order.end(),
+        [&artists](const PlaylistSortEntry& a, const PlaylistSortEntry& b){
+            const LibraryArtist& x = artists[a.artist];
+            const LibraryArtist& y = artists[b.artist];
+            int c = compare(x.sort_key, y.sort_key);
+            return (c != 0)? (c < 0) : (compare(x.name, y.name) < 0);
+        });
+
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        const std::vector<LibraryAlbum>& albums = artists[i].albums;
+        size_t first = album_order.size();
+        for( size_t j = 0 ; j < albums.size() ; j++ )
+        {
+            PlaylistSortEntry e;
+            e.key = makeKey(albums[j].sort_key);
+            e.artist = (uint16_t)i;
+            e.album = (uint16_t)j;
+            album_order.push_back(e);
+        }
+        std::stable_sort(album_order.begin() + first, album_order.end(),
+            [&albums](const PlaylistSortEntry& a, const PlaylistSortEntry& b){
+                const LibraryAlbum& x = albums[a.album];
+                const LibraryAlbum& y = albums[b.album];
+                int c = compare(x.sort_key, y.sort_key);
+                return (c != 0)? (c < 0) : (compare(x.title, y.title) < 0);
+            });
+    }
+}
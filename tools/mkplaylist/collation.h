@@ -0,0 +1,27 @@
+#ifndef COLLATION_H
+#define COLLATION_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "library.h"
+#include "playlist_format.h"
+
+// -----------------------------------------------------------------------------
+//  読みによる照合順と、表示順の並び(ASRT, BSRT セクション)
+//  照合キーの形式は playlist_format.h を参照
+// -----------------------------------------------------------------------------
+class Collation
+{
+    private:
+        static uint8_t toElement(uint32_t c);
+        static void    makeElements(const std::string& text, std::vector<uint8_t>& elements);
+
+    public:
+        static uint32_t makeKey(const std::string& text);
+        static int  compare(const std::string& a, const std::string& b);
+        static void build(const std::vector<LibraryArtist>& artists,
+                          std::vector<PlaylistSortEntry>& artist_order, std::vector<PlaylistSortEntry>& album_order);
+};
+
+#endif
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+#include "library.h"
+
+// -----------------------------------------------------------------------------
+static std::string baseName(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    return (slash == std::string::npos)? path : path.substr(slash + 1);
+}
+
+// -----------------------------------------------------------------------------
+static std::string dirName(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    return (slash == std::string::npos)? std::string() : path.substr(0, slash);
+}
+
+// -----------------------------------------------------------------------------
+static std::string stripExtension(const std::string& name)
+{
+    size_t dot = name.rfind('.');
+    return (dot == std::string::npos)? name : name.substr(0, dot);
+}
+
+// -----------------------------------------------------------------------------
+static int compareKey(const std::string& a, const std::string& b)
+{
+    return strcasecmp(a.c_str(), b.c_str());
+}
+
+// -----------------------------------------------------------------------------
+uint32_t LibraryArtist::getSongCount() const
+{
+    uint32_t count = 0;
+    for( size_t i = 0 ; i < albums.size() ; i++ )
+    {
+        count += albums[i].songs.size();
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  Library
+////////////////////////////////////////////////////////////////////////////////
+Library::Library(const std::string& root, const std::string& prefix, bool verbose) :
+    m_root(root), m_prefix(prefix), m_verbose(verbose), m_skipped(0)
+{
+    while( m_root.size() > 1 && m_root[m_root.size()-1] == '/' )
+    {
+        m_root.erase(m_root.size()-1);
+    }
+    if( !m_prefix.empty() && m_prefix[m_prefix.size()-1] != '/' )
+    {
+        m_prefix += '/';
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  対応する拡張子のファイルを列挙する。戻り値はファイル数
+// -----------------------------------------------------------------------------
+uint32_t Library::scan()
+{
+    m_tracks.clear();
+    m_skipped = 0;
+    scanDirectory("");
+    // 走査順はファイルシステムに依存するので、パス順に並べておく
+    std::sort(m_tracks.begin(), m_tracks.end(),
+        [](const TrackInfo& a, const TrackInfo& b){ return a.path < b.path; });
+    return m_tracks.size();
+}
+
+// -----------------------------------------------------------------------------
+void Library::scanDirectory(const std::string& relpath)
+{
+    std::string dirpath = relpath.empty()? m_root : (m_root + "/" + relpath);
+    DIR *dir = opendir(dirpath.c_str());
+    if( !dir )
+    {
+        fprintf(stderr, "warning: cannot open directory %s\n", dirpath.c_str());
+        return;
+    }
+    struct dirent *ent;
+    while( (ent = readdir(dir)) != NULL )
+    {
+        if( ent->d_name[0] == '.' )
+        {
+            continue;   // ".", ".." と隠しファイル
+        }
+        std::string rel = relpath.empty()? std::string(ent->d_name) : (relpath + "/" + ent->d_name);
+        std::string full = m_root + "/" + rel;
+        struct stat st;
+        if( stat(full.c_str(), &st) )
+        {
+            continue;
+        }
+        if( S_ISDIR(st.st_mode) )
+        {
+            scanDirectory(rel);
+        }
+        else if( S_ISREG(st.st_mode) && TagReader::isSupported(rel) )
+        {
+            TrackInfo info;
+            info.path = m_prefix + rel;
+            if( info.path.size() > MAX_FILENAME_BYTES )
+            {
+                // プレイヤー側のファイル名バッファに収まらない
+                fprintf(stderr, "warning: path too long, skipped: %s\n", info.path.c_str());
+                m_skipped++;
+                continue;
+            }
+            info.file_size = (uint32_t)st.st_size;
+            info.mtime = (uint32_t)st.st_mtime;
+            m_tracks.push_back(info);
+        }
+    }
+    closedir(dir);
+}
+
+// -----------------------------------------------------------------------------
+//  前回の走査結果のうち、サイズと更新時刻が一致するファイルのタグ情報を引き継ぐ
+//  戻り値は引き継いだファイル数
+// -----------------------------------------------------------------------------
+uint32_t Library::reuse(const std::vector<TrackInfo>& cached)
+{
+    std::map<std::string, const TrackInfo *> index;
+    for( size_t i = 0 ; i < cached.size() ; i++ )
+    {
+        index[cached[i].path] = &cached[i];
+    }
+    uint32_t count = 0;
+    for( size_t n = 0 ; n < m_tracks.size() ; n++ )
+    {
+        TrackInfo& info = m_tracks[n];
+        std::map<std::string, const TrackInfo *>::iterator it = index.find(info.path);
+        if( it != index.end() && it->second->valid &&
+            it->second->file_size == info.file_size && it->second->mtime == info.mtime )
+        {
+            info = *it->second;
+            count++;
+        }
+    }
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+//  タグを並列に読み込む(reuse で引き継いだものは除く)。戻り値は読み込めたファイル数
+// -----------------------------------------------------------------------------
+uint32_t Library::parse(int threads, bool sjis)
+{
+    if( threads < 1 )
+    {
+        threads = 1;
+    }
+    std::atomic<uint32_t> next(0);
+    std::atomic<uint32_t> parsed(0);
+    size_t prefix_len = m_prefix.size();
+    auto worker = [&](){
+        TagReader reader(sjis);
+        uint32_t n;
+        while( (n = next.fetch_add(1)) < m_tracks.size() )
+        {
+            TrackInfo& info = m_tracks[n];
+            if( info.valid )
+            {
+                continue;
+            }
+            std::string full = m_root + "/" + info.path.substr(prefix_len);
+            if( reader.read(full, info) )
+            {
+                parsed++;
+            }
+            else
+            {
+                fprintf(stderr, "warning: unsupported or broken file: %s\n", full.c_str());
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for( int i = 0 ; i < threads ; i++ )
+    {
+        pool.push_back(std::thread(worker));
+    }
+    for( size_t i = 0 ; i < pool.size() ; i++ )
+    {
+        pool[i].join();
+    }
+    return parsed;
+}
+
+// -----------------------------------------------------------------------------
+//  key に対応する ID を返す。未登録であれば最大値の次(使い切った場合は空き番号)を割り当てる
+// -----------------------------------------------------------------------------
+uint16_t Library::assignID(std::map<std::string, uint16_t>& ids, const std::string& key)
+{
+    std::map<std::string, uint16_t>::iterator it = ids.find(key);
+    if( it != ids.end() )
+    {
+        return it->second;
+    }
+    uint32_t id = 1;
+    for( it = ids.begin() ; it != ids.end() ; ++it )
+    {
+        if( it->second >= id )
+        {
+            id = it->second + 1;
+        }
+    }
+    if( id > 0xFFFF )
+    {
+        std::vector<bool> used(0x10000, false);
+        for( it = ids.begin() ; it != ids.end() ; ++it )
+        {
+            used[it->second] = true;
+        }
+        for( id = 1 ; id <= 0xFFFF && used[id] ; id++ )
+        {
+        }
+    }
+    if( id > 0xFFFF )
+    {
+        return 0;
+    }
+    ids[key] = (uint16_t)id;
+    return (uint16_t)id;
+}
+
+// -----------------------------------------------------------------------------
+//  アーティスト > アルバム > 曲 に整理し、IDを振る
+//  タグが無い場合はディレクトリ名(.../アーティスト/アルバム/曲)で補う
+// -----------------------------------------------------------------------------
+void Library::build()
+{
+    m_artists.clear();
+    std::map<std::string, size_t> artist_map;
+    std::vector<std::map<std::string, size_t> > album_maps;
+
+    for( size_t n = 0 ; n < m_tracks.size() ; n++ )
+    {
+        TrackInfo& info = m_tracks[n];
+        if( !info.valid )
+        {
+            m_skipped++;
+            continue;
+        }
+        std::string dir = dirName(info.path.substr(m_prefix.size()));
+        if( info.title.empty() )
+        {
+            info.title = stripExtension(baseName(info.path));
+        }
+        if( info.album.empty() )
+        {
+            info.album = dir.empty()? std::string("Unknown Album") : baseName(dir);
+        }
+        std::string name = !info.album_artist.empty()? info.album_artist : info.artist;
+        std::string sort_key = !info.album_artist.empty()? info.album_artist_sort : info.artist_sort;
+        if( name.empty() )
+        {
+            std::string parent = dirName(dir);
+            name = parent.empty()? std::string("Unknown Artist") : baseName(parent);
+        }
+        name = truncateUTF8(name, MAX_NAME_BYTES);
+        info.title = truncateUTF8(info.title, MAX_TITLE_BYTES);
+        info.album = truncateUTF8(info.album, MAX_TITLE_BYTES);
+
+        std::map<std::string, size_t>::iterator ai = artist_map.find(name);
+        if( ai == artist_map.end() )
+        {
+            ai = artist_map.insert(std::make_pair(name, m_artists.size())).first;
+            m_artists.push_back(LibraryArtist());
+            album_maps.push_back(std::map<std::string, size_t>());
+            m_artists.back().name = name;
+        }
+        LibraryArtist& artist = m_artists[ai->second];
+        if( artist.sort_key.empty() && !sort_key.empty() )
+        {
+            artist.sort_key = sort_key;
+        }
+
+        std::map<std::string, size_t>& album_map = album_maps[ai->second];
+        std::map<std::string, size_t>::iterator bi = album_map.find(info.album);
+        if( bi == album_map.end() )
+        {
+            bi = album_map.insert(std::make_pair(info.album, artist.albums.size())).first;
+            artist.albums.push_back(LibraryAlbum());
+            artist.albums.back().title = info.album;
+        }
+        LibraryAlbum& album = artist.albums[bi->second];
+        if( album.sort_key.empty() && !info.album_sort.empty() )
+        {
+            album.sort_key = info.album_sort;
+        }
+        if( info.year > album.year )
+        {
+            album.year = info.year;
+        }
+        album.songs.push_back(&info);
+    }
+
+    // 並べ替え
+    //   アーティスト : 読み(なければ名前)順
+    //   アルバム     : 年順、同じ年は読み(なければタイトル)順
+    //   曲           : ディスク番号、トラック番号、ファイル名順
+    for( size_t i = 0 ; i < m_artists.size() ; i++ )
+    {
+        LibraryArtist& artist = m_artists[i];
+        if( artist.sort_key.empty() )
+        {
+            artist.sort_key = artist.name;
+        }
+        for( size_t j = 0 ; j < artist.albums.size() ; j++ )
+        {
+            LibraryAlbum& album = artist.albums[j];
+            if( album.sort_key.empty() )
+            {
+                album.sort_key = album.title;
+            }
+            std::sort(album.songs.begin(), album.songs.end(),
+                [](const TrackInfo *a, const TrackInfo *b){
+                    if( a->disc != b->disc ) return a->disc < b->disc;
+                    if( a->track != b->track ) return a->track < b->track;
+                    return a->path < b->path;
+                });
+            album.total_ms = 0;
+            album.added = 0;
+            std::map<std::string, size_t> genres;
+            size_t best = 0;
+            for( size_t k = 0 ; k < album.songs.size() ; k++ )
+            {
+                const TrackInfo *song = album.songs[k];
+                album.total_ms += song->duration_ms;
+                album.added = std::max(album.added, song->mtime);
+                std::string genre = trim(song->genre);
+                if( !genre.empty() && ++genres[genre] > best )
+                {
+                    best = genres[genre];
+                    album.genre = genre;
+                }
+            }
+        }
+        std::sort(artist.albums.begin(), artist.albums.end(),
+            [](const LibraryAlbum& a, const LibraryAlbum& b){
+                if( a.year != b.year ) return a.year < b.year;
+                return compareKey(a.sort_key, b.sort_key) < 0;
+            });
+    }
+    std::sort(m_artists.begin(), m_artists.end(),
+        [](const LibraryArtist& a, const LibraryArtist& b){
+            int c = compareKey(a.sort_key, b.sort_key);
+            return (c != 0)? (c < 0) : (a.name < b.name);
+        });
+
+    // ID はどちらも 1 から。アルバムIDはアーティストをまたいで一意にする
+    // 前回の対応表にある名前は同じ ID を使い、新しい名前には未使用の ID を割り当てる
+    for( size_t i = 0 ; i < m_artists.size() ; i++ )
+    {
+        LibraryArtist& artist = m_artists[i];
+        artist.id = assignID(m_artist_ids, artist.name);
+        for( size_t j = 0 ; j < artist.albums.size() ; j++ )
+        {
+            artist.albums[j].id = assignID(m_album_ids, artist.name + '\x1F' + artist.albums[j].title);
+        }
+    }
+    if( m_artists.size() > 0xFFFF || m_album_ids.size() > 0xFFFF )
+    {
+        fprintf(stderr, "error: too many artists or albums (max 65535)\n");
+        m_artists.clear();
+    }
+
+    if( m_verbose )
+    {
+        for( size_t i = 0 ; i < m_artists.size() ; i++ )
+        {
+            const LibraryArtist& artist = m_artists[i];
+            printf("%5u %s\n", artist.id, artist.name.c_str());
+            for( size_t j = 0 ; j < artist.albums.size() ; j++ )
+            {
+                const LibraryAlbum& album = artist.albums[j];
+                printf("      %5u [%u] %s (%u songs)\n", album.id, album.year,
+                    album.title.c_str(), (unsigned)album.songs.size());
+            }
+        }
+    }
+}
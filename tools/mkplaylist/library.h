@@ -0,0 +1,83 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "tag_reader.h"
+
+// -----------------------------------------------------------------------------
+//  プレイヤー側のバッファサイズ(playlist.h の MAX_???_LENGTH から NUL を除いたもの)
+// -----------------------------------------------------------------------------
+enum{MAX_TITLE_BYTES    = 127};
+enum{MAX_NAME_BYTES     = 127};
+enum{MAX_FILENAME_BYTES = 63};
+
+// -----------------------------------------------------------------------------
+class LibraryAlbum
+{
+    public:
+        uint16_t    id;
+        std::string title;
+        std::string sort_key;
+        uint16_t    year;
+        uint32_t    total_ms;
+        std::string genre;          // 曲のジャンルのうち最も多いもの
+        uint32_t    added;          // 曲ファイルの更新時刻のうち最も新しいもの
+        std::vector<const TrackInfo *> songs;
+
+        LibraryAlbum() : id(0), year(0), total_ms(0), added(0){
+        }
+};
+
+// -----------------------------------------------------------------------------
+class LibraryArtist
+{
+    public:
+        uint16_t    id;
+        std::string name;
+        std::string sort_key;
+        std::vector<LibraryAlbum> albums;
+
+        LibraryArtist() : id(0){
+        }
+        uint32_t getSongCount() const;
+};
+
+// -----------------------------------------------------------------------------
+//  音楽フォルダを走査し、アーティスト > アルバム > 曲 の階層に整理する
+// -----------------------------------------------------------------------------
+class Library
+{
+    private:
+        std::string m_root;         // 走査するディレクトリ(ホスト側のパス)
+        std::string m_prefix;       // SDカード上でのパスの前置詞
+        bool        m_verbose;
+        std::vector<TrackInfo>     m_tracks;
+        std::vector<LibraryArtist> m_artists;
+        uint32_t    m_skipped;
+        // 名前から ID への対応表。前回の ID を引き継ぐことで、EEPROM に保存された
+        // 選択状態やジャーナルの ID が再構築後も同じものを指すようにする
+        std::map<std::string, uint16_t> m_artist_ids;
+        std::map<std::string, uint16_t> m_album_ids;    // キーは "アーティスト名\x1Fアルバム名"
+
+        void scanDirectory(const std::string& relpath);
+        static uint16_t assignID(std::map<std::string, uint16_t>& ids, const std::string& key);
+
+    public:
+        Library(const std::string& root, const std::string& prefix, bool verbose);
+        uint32_t scan();
+        uint32_t reuse(const std::vector<TrackInfo>& cached);
+        uint32_t parse(int threads, bool sjis);
+        void     build();
+
+        const std::vector<LibraryArtist>& getArtists() const { return m_artists; }
+        const std::vector<TrackInfo>& getTracks() const { return m_tracks; }
+        uint32_t getTrackCount() const { return m_tracks.size(); }
+        uint32_t getSkippedCount() const { return m_skipped; }
+        std::map<std::string, uint16_t>& getArtistIDs(){ return m_artist_ids; }
+        std::map<std::string, uint16_t>& getAlbumIDs(){ return m_album_ids; }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include <unistd.h>
+#include "library_cache.h"
+
+// -----------------------------------------------------------------------------
+void LibraryCache::putU16(FILE *fp, uint16_t value)
+{
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+// -----------------------------------------------------------------------------
+void LibraryCache::putU32(FILE *fp, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+// -----------------------------------------------------------------------------
+void LibraryCache::putString(FILE *fp, const std::string& s)
+{
+    uint16_t len = (s.size() > 0xFFFF)? 0xFFFF : (uint16_t)s.size();
+    putU16(fp, len);
+    fwrite(s.data(), 1, len, fp);
+}
+
+// -----------------------------------------------------------------------------
+bool LibraryCache::getU16(FILE *fp, uint16_t& value)
+{
+    return fread(&value, sizeof(value), 1, fp) == 1;
+}
+
+// -----------------------------------------------------------------------------
+bool LibraryCache::getU32(FILE *fp, uint32_t& value)
+{
+    return fread(&value, sizeof(value), 1, fp) == 1;
+}
+
+// -----------------------------------------------------------------------------
+bool LibraryCache::getString(FILE *fp, std::string& s)
+{
+    uint16_t len;
+    if( !getU16(fp, len) )
+    {
+        return false;
+    }
+    s.resize(len);
+    return len == 0 || fread(&s[0], 1, len, fp) == len;
+}
+
+// -----------------------------------------------------------------------------
+bool LibraryCache::getIDMap(FILE *fp, std::map<std::string, uint16_t>& ids)
+{
+    uint32_t count;
+    if( !getU32(fp, count) )
+    {
+        return false;
+    }
+    for( uint32_t i = 0 ; i < count ; i++ )
+    {
+        std::string key;
+        uint16_t id;
+        if( !getString(fp, key) || !getU16(fp, id) )
+        {
+            return false;
+        }
+        ids[key] = id;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+void LibraryCache::putIDMap(FILE *fp, const std::map<std::string, uint16_t>& ids)
+{
+    putU32(fp, ids.size());
+    for( std::map<std::string, uint16_t>::const_iterator it = ids.begin() ; it != ids.end() ; ++it )
+    {
+        putString(fp, it->first);
+        putU16(fp, it->second);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  キャッシュを読み込み、ID 対応表を library に設定する
+//  ファイルがない、または壊れている場合は false(tracks, ID 対応表は空のまま)
+// -----------------------------------------------------------------------------
+bool LibraryCache::load(const std::string& path, Library& library)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if( !fp )
+    {
+        return false;
+    }
+    uint32_t magic, version, count;
+    bool ok = getU32(fp, magic) && getU32(fp, version) && getU32(fp, count) &&
+        magic == MAGIC && version == VERSION;
+    for( uint32_t i = 0 ; i < count && ok ; i++ )
+    {
+        TrackInfo info;
+        uint16_t valid = 0;
+        ok = getString(fp, info.path) && getU32(fp, info.file_size) && getU32(fp, info.mtime) &&
+            getString(fp, info.title) && getString(fp, info.artist) &&
+            getString(fp, info.album_artist) && getString(fp, info.album) &&
+            getString(fp, info.genre) && getString(fp, info.artist_sort) &&
+            getString(fp, info.album_artist_sort) && getString(fp, info.album_sort) &&
+            getString(fp, info.title_sort) && getU16(fp, info.track) && getU16(fp, info.disc) &&
+            getU16(fp, info.year) && getU32(fp, info.duration_ms) && getU16(fp, valid);
+        info.valid = (valid != 0);
+        tracks.push_back(info);
+    }
+    std::map<std::string, uint16_t> artist_ids;
+    std::map<std::string, uint16_t> album_ids;
+    ok = ok && getIDMap(fp, artist_ids) && getIDMap(fp, album_ids);
+    fclose(fp);
+    if( !ok )
+    {
+        fprintf(stderr, "warning: %s is broken, ignored\n", path.c_str());
+        tracks.clear();
+        return false;
+    }
+    library.getArtistIDs().swap(artist_ids);
+    library.getAlbumIDs().swap(album_ids);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool LibraryCache::save(const std::string& path, Library& library)
+{
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if( !fp )
+    {
+        return false;
+    }
+    const std::vector<TrackInfo>& list = library.getTracks();
+    putU32(fp, MAGIC);
+    putU32(fp, VERSION);
+    putU32(fp, list.size());
+    for( size_t i = 0 ; i < list.size() ; i++ )
+    {
+        const TrackInfo& info = list[i];
+        putString(fp, info.path);
+        putU32(fp, info.file_size);
+        putU32(fp, info.mtime);
+        putString(fp, info.title);
+        putString(fp, info.artist);
+        putString(fp, info.album_artist);
+        putString(fp, info.album);
+        putString(fp, info.genre);
+        putString(fp, info.artist_sort);
+        putString(fp, info.album_artist_sort);
+        putString(fp, info.album_sort);
+        putString(fp, info.title_sort);
+        putU16(fp, info.track);
+        putU16(fp, info.disc);
+        putU16(fp, info.year);
+        putU32(fp, info.duration_ms);
+        putU16(fp, info.valid? 1 : 0);
+    }
+    putIDMap(fp, library.getArtistIDs());
+    putIDMap(fp, library.getAlbumIDs());
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if( !ok || rename(tmp.c_str(), path.c_str()) )
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
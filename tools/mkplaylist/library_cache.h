@@ -0,0 +1,37 @@
+#ifndef LIBRARY_CACHE_H
+#define LIBRARY_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "library.h"
+
+// -----------------------------------------------------------------------------
+//  前回の走査結果(mkplaylist.cache)
+//  ファイルごとのサイズ、更新時刻とタグ情報、アーティスト/アルバムの ID 対応表を保存し、
+//  次回の差分更新で変更のないファイルの解析を省略する
+// -----------------------------------------------------------------------------
+class LibraryCache
+{
+    private:
+        enum{MAGIC = 0x43504B4D};   // "MKPC"
+        enum{VERSION = 1};
+
+        static void putU16(FILE *fp, uint16_t value);
+        static void putU32(FILE *fp, uint32_t value);
+        static void putString(FILE *fp, const std::string& s);
+        static bool getU16(FILE *fp, uint16_t& value);
+        static bool getU32(FILE *fp, uint32_t& value);
+        static bool getString(FILE *fp, std::string& s);
+        static bool getIDMap(FILE *fp, std::map<std::string, uint16_t>& ids);
+        static void putIDMap(FILE *fp, const std::map<std::string, uint16_t>& ids);
+
+    public:
+        std::vector<TrackInfo> tracks;
+
+        bool load(const std::string& path, Library& library);
+        static bool save(const std::string& path, Library& library);
+};
+
+#endif
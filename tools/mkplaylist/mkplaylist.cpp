@@ -0,0 +1,169 @@
+// -----------------------------------------------------------------------------
+//  mkplaylist : 音楽フォルダを走査して playlist.dat を生成する
+//
+//  ビルド(Linux)
+//      cd tools/mkplaylist
+//      g++ -O2 -std=c++11 -pthread -I../.. -o mkplaylist *.cpp ../../crc32.cpp
+//
+//  使い方
+//      mkplaylist [options] <music_dir>
+//          -o <file>   出力ファイル(既定値: <music_dir>/playlist.dat)
+//          -p <path>   SDカード上での <music_dir> のパス(既定値: なし = SDのルート)
+//          -j <n>      タグを読み込むスレッド数(既定値: CPU数)
+//          -s          ID3 の ISO-8859-1 テキストを Shift_JIS として扱う
+//          -u          差分更新(変更のあったファイルだけを解析し、playlist.dat の
+//                      変更のあったセクタだけを書き換える)
+//          -c <file>   走査結果のキャッシュ(既定値: 出力先と同じ場所の mkplaylist.cache)
+//          -1          v1 形式で出力する
+//          -v          アーティスト、アルバムの一覧を表示する
+//
+//  v2 形式では、出力先と同じ場所に変更のあったアーティストの一覧(playlist.jnl)も
+//  書き出す。プレイヤーはこれを見つけると該当するアーティストだけを読み直す
+// -----------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include "library.h"
+#include "library_cache.h"
+#include "playlist_writer.h"
+
+// -----------------------------------------------------------------------------
+static void usage()
+{
+    fprintf(stderr,
+        "usage: mkplaylist [-o output] [-p sd_path] [-j threads] [-s] [-u] [-c cache] [-1] [-v] music_dir\n");
+    exit(1);
+}
+
+// -----------------------------------------------------------------------------
+static std::string siblingPath(const std::string& path, const char *name)
+{
+    size_t slash = path.rfind('/');
+    return (slash == std::string::npos)? std::string(name) : (path.substr(0, slash + 1) + name);
+}
+
+// -----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    std::string output;
+    std::string prefix;
+    std::string cache_path;
+    int  threads = std::thread::hardware_concurrency();
+    bool sjis = false;
+    bool v1 = false;
+    bool verbose = false;
+    bool incremental = false;
+    int opt;
+    while( (opt = getopt(argc, argv, "o:p:j:suc:1v")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'o': output = optarg; break;
+            case 'p': prefix = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            case 's': sjis = true; break;
+            case 'u': incremental = true; break;
+            case 'c': cache_path = optarg; break;
+            case '1': v1 = true; break;
+            case 'v': verbose = true; break;
+            default:  usage();
+        }
+    }
+    if( optind != argc - 1 )
+    {
+        usage();
+    }
+    std::string root = argv[optind];
+    if( output.empty() )
+    {
+        output = root + "/playlist.dat";
+    }
+    if( cache_path.empty() )
+    {
+        cache_path = siblingPath(output, "mkplaylist.cache");
+    }
+    std::string journal_path = siblingPath(output, "playlist.jnl");
+    // SD のパスは先頭の '/' なしで扱う(Playlist と同じく SD.open にそのまま渡される)
+    while( !prefix.empty() && prefix[0] == '/' )
+    {
+        prefix.erase(0, 1);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Library library(root, prefix, verbose);
+    LibraryCache cache;
+    cache.load(cache_path, library);       // ID の対応表は差分更新でなくても引き継ぐ
+    uint32_t found = library.scan();
+    uint32_t reused = incremental? library.reuse(cache.tracks) : 0;
+    uint32_t parsed = library.parse(threads, sjis);
+    library.build();
+    const std::vector<LibraryArtist>& artists = library.getArtists();
+    if( artists.empty() )
+    {
+        fprintf(stderr, "error: no playable files in %s\n", root.c_str());
+        return 1;
+    }
+
+    PlaylistWriter writer(library);
+    PlaylistFile base;
+    bool has_base = !v1 && base.load(output);
+    bool ok = true;
+    if( v1 )
+    {
+        writer.buildV1();
+        ok = writer.save(output);
+    }
+    else
+    {
+        writer.buildV2(has_base? &base : NULL, incremental);
+        if( has_base && writer.getTouchedArtists().empty() && !writer.isIndexChanged() )
+        {
+            printf("%s is up to date\n", output.c_str());
+        }
+        else
+        {
+            if( writer.isIncremental() )
+            {
+                uint32_t written = 0;
+                ok = writer.update(output, base, written);
+                printf("%u of %u sectors rewritten\n", written, (unsigned)((writer.getSize() + 511) / 512));
+            }
+            else
+            {
+                ok = writer.save(output);
+            }
+            ok = ok && writer.saveJournal(journal_path, has_base? &base : NULL);
+            if( has_base )
+            {
+                printf("%u artist(s) changed, generation %u\n",
+                    (unsigned)writer.getTouchedArtists().size(), writer.getGeneration());
+            }
+        }
+    }
+    if( !ok )
+    {
+        fprintf(stderr, "error: cannot write %s\n", output.c_str());
+        return 1;
+    }
+    if( !LibraryCache::save(cache_path, library) )
+    {
+        fprintf(stderr, "warning: cannot write %s\n", cache_path.c_str());
+    }
+
+    uint32_t albums = 0;
+    uint32_t songs = 0;
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        albums += artists[i].albums.size();
+        songs += artists[i].getSongCount();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%u files found, %u parsed, %u unchanged, %u skipped\n",
+        found, parsed, reused, library.getSkippedCount());
+    printf("%u artists, %u albums, %u songs -> %s (v%d, %u bytes) in %.2f sec\n",
+        (unsigned)artists.size(), albums, songs, output.c_str(), v1? 1 : 2,
+        (unsigned)writer.getSize(), elapsed);
+    return 0;
+}
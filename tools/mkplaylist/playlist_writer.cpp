@@ -0,0 +1,736 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include "playlist_writer.h"
+#include "search_index.h"
+#include "crc32.h"
+
+// プレイヤー(RZ/A1H)と同じくリトルエンディアンのホストを前提に、構造体をそのまま書き出す
+static_assert(sizeof(PlaylistHeader) == 32, "PlaylistHeader must be 32 bytes");
+static_assert(sizeof(PlaylistSection) == 16, "PlaylistSection must be 16 bytes");
+static_assert(sizeof(PlaylistArtistRecord) == 28, "PlaylistArtistRecord must be 28 bytes");
+static_assert(sizeof(PlaylistAlbumRecord) == 16, "PlaylistAlbumRecord must be 16 bytes");
+static_assert(sizeof(PlaylistSongRecord) == 12, "PlaylistSongRecord must be 12 bytes");
+static_assert(sizeof(PlaylistSearchEntry) == 8, "PlaylistSearchEntry must be 8 bytes");
+static_assert(sizeof(PlaylistAlbumIndexEntry) == 8, "PlaylistAlbumIndexEntry must be 8 bytes");
+static_assert(sizeof(PlaylistGenreRecord) == 32, "PlaylistGenreRecord must be 32 bytes");
+static_assert(sizeof(PlaylistSortEntry) == 8, "PlaylistSortEntry must be 8 bytes");
+static_assert(sizeof(PlaylistJournalHeader) == 16, "PlaylistJournalHeader must be 16 bytes");
+
+// v1 の固定長フィールド(playlist.h の MAX_???_LENGTH)
+enum{V1_NAME_SIZE = 128};
+enum{V1_TITLE_SIZE = 128};
+enum{V1_FILENAME_SIZE = 64};
+
+// 差分更新の書き込み単位(SDカードのセクタサイズ)。セクションもこの境界に配置する
+enum{SECTOR_SIZE = 512};
+
+static const uint32_t SECTION_IDS[PlaylistFile::NUM_SECTIONS] = {
+    PLAYLIST_SECTION_ARTISTS, PLAYLIST_SECTION_ALBUMS, PLAYLIST_SECTION_SONGS, PLAYLIST_SECTION_STRINGS,
+    PLAYLIST_SECTION_SEARCH, PLAYLIST_SECTION_YEARS, PLAYLIST_SECTION_ADDED, PLAYLIST_SECTION_GENRES,
+    PLAYLIST_SECTION_GENRE_ALBUMS, PLAYLIST_SECTION_ARTIST_ORDER, PLAYLIST_SECTION_ALBUM_ORDER,
+    PLAYLIST_SECTION_FILE_SIZES
+};
+
+// 毎回全体を書き直すセクション(アーティストのブロック単位で配置しないもの)
+static const int REWRITTEN[] = {
+    PlaylistFile::ARTS, PlaylistFile::SRCH, PlaylistFile::YEAR, PlaylistFile::ADDD,
+    PlaylistFile::GENR, PlaylistFile::GALB, PlaylistFile::ASRT, PlaylistFile::BSRT
+};
+
+// -----------------------------------------------------------------------------
+static uint32_t alignSector(uint32_t n)
+{
+    return (n + SECTOR_SIZE - 1) & ~(uint32_t)(SECTOR_SIZE - 1);
+}
+
+// -----------------------------------------------------------------------------
+uint16_t toSeconds(uint32_t ms)
+{
+    uint32_t sec = (ms + 500) / 1000;
+    return (sec > 0xFFFF)? 0xFFFF : (uint16_t)sec;
+}
+
+// -----------------------------------------------------------------------------
+//  曲番号はタグのトラック番号、なければアルバム内の順番(1から)
+// -----------------------------------------------------------------------------
+static uint16_t trackIndex(const TrackInfo *info, size_t position)
+{
+    return info->track? info->track : (uint16_t)(position + 1);
+}
+
+// -----------------------------------------------------------------------------
+//  アルバムの合計時間は各曲の秒数の合計とする(表示上の辻褄を合わせるため)
+// -----------------------------------------------------------------------------
+static uint16_t totalSeconds(const LibraryAlbum& album)
+{
+    uint32_t total = 0;
+    for( size_t k = 0 ; k < album.songs.size() ; k++ )
+    {
+        total += toSeconds(album.songs[k]->duration_ms);
+    }
+    return (total > 0xFFFF)? 0xFFFF : (uint16_t)total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  ArtistBlock
+////////////////////////////////////////////////////////////////////////////////
+bool ArtistBlock::operator == (const ArtistBlock& other) const
+{
+    return id == other.id && name == other.name && strings == other.strings &&
+        albums.size() == other.albums.size() && songs.size() == other.songs.size() &&
+        (albums.empty() || !memcmp(&albums[0], &other.albums[0], albums.size() * sizeof(PlaylistAlbumRecord))) &&
+        (songs.empty() || !memcmp(&songs[0], &other.songs[0], songs.size() * sizeof(PlaylistSongRecord))) &&
+        file_sizes == other.file_sizes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  PlaylistFile
+////////////////////////////////////////////////////////////////////////////////
+bool PlaylistFile::load(const std::string& path)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if( !fp )
+    {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data.resize(size > 0? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, fp) == (size_t)size;
+    fclose(fp);
+    if( !ok || data.size() < sizeof(header) )
+    {
+        return false;
+    }
+
+    memcpy(&header, &data[0], sizeof(header));
+    uint32_t table_size = header.section_count * sizeof(PlaylistSection);
+    if( header.magic != PLAYLIST_MAGIC || header.version != PLAYLIST_VERSION ||
+        header.file_size != data.size() || sizeof(header) + table_size > data.size() )
+    {
+        return false;
+    }
+    PlaylistHeader h = header;
+    h.header_crc = 0;
+    const PlaylistSection *table = (const PlaylistSection *)&data[sizeof(header)];
+    if( CRC32::update(CRC32::calc(&h, sizeof(h)), table, table_size) != header.header_crc )
+    {
+        return false;
+    }
+    for( int n = 0 ; n < NUM_SECTIONS ; n++ )
+    {
+        const PlaylistSection *s = NULL;
+        for( uint16_t i = 0 ; i < header.section_count && !s ; i++ )
+        {
+            if( table[i].id == SECTION_IDS[n] )
+            {
+                s = &table[i];
+            }
+        }
+        if( !s || s->offset > data.size() || s->size > data.size() - s->offset ||
+            CRC32::calc(&data[s->offset], s->size) != s->crc )
+        {
+            return false;
+        }
+        sections[n] = *s;
+    }
+    return sections[ARTS].size >= header.artist_count * sizeof(PlaylistArtistRecord);
+}
+
+// -----------------------------------------------------------------------------
+//  セクションに使用できる領域(次のセクションの先頭、またはファイル末尾まで)
+// -----------------------------------------------------------------------------
+uint32_t PlaylistFile::getCapacity(int n) const
+{
+    uint32_t end = header.file_size;
+    for( int i = 0 ; i < NUM_SECTIONS ; i++ )
+    {
+        if( sections[i].offset > sections[n].offset && sections[i].offset < end )
+        {
+            end = sections[i].offset;
+        }
+    }
+    return end - sections[n].offset;
+}
+
+// -----------------------------------------------------------------------------
+const PlaylistArtistRecord *PlaylistFile::getArtist(uint32_t index) const
+{
+    if( index >= header.artist_count )
+    {
+        return NULL;
+    }
+    return (const PlaylistArtistRecord *)&data[sections[ARTS].offset] + index;
+}
+
+// -----------------------------------------------------------------------------
+//  rec のアルバム、曲、文字列を取り出し、相対値に直して block に格納する
+// -----------------------------------------------------------------------------
+bool PlaylistFile::getBlock(const PlaylistArtistRecord *rec, ArtistBlock& block) const
+{
+    const PlaylistSection& albm = sections[ALBM];
+    const PlaylistSection& song = sections[SONG];
+    const PlaylistSection& strs = sections[STRS];
+    const PlaylistSection& fsiz = sections[FSIZ];
+    if( ((uint64_t)rec->first_album + rec->album_count) * sizeof(PlaylistAlbumRecord) > albm.size ||
+        ((uint64_t)rec->first_song + rec->song_count) * sizeof(PlaylistSongRecord) > song.size ||
+        ((uint64_t)rec->first_song + rec->song_count) * sizeof(uint32_t) > fsiz.size ||
+        (uint64_t)rec->string_offset + rec->string_size > strs.size || rec->name < rec->string_offset )
+    {
+        return false;
+    }
+    const PlaylistAlbumRecord *albums = (const PlaylistAlbumRecord *)&data[albm.offset] + rec->first_album;
+    const PlaylistSongRecord *songs = (const PlaylistSongRecord *)&data[song.offset] + rec->first_song;
+    const uint32_t *file_sizes = (const uint32_t *)&data[fsiz.offset] + rec->first_song;
+    block.id = rec->id;
+    block.name = rec->name - rec->string_offset;
+    block.albums.assign(albums, albums + rec->album_count);
+    block.songs.assign(songs, songs + rec->song_count);
+    block.file_sizes.assign(file_sizes, file_sizes + rec->song_count);
+    block.strings.assign((const char *)&data[strs.offset + rec->string_offset], rec->string_size);
+    for( size_t j = 0 ; j < block.albums.size() ; j++ )
+    {
+        block.albums[j].first_song -= rec->first_song;
+        block.albums[j].title -= rec->string_offset;
+    }
+    for( size_t k = 0 ; k < block.songs.size() ; k++ )
+    {
+        block.songs[k].filename -= rec->string_offset;
+        block.songs[k].title -= rec->string_offset;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  PlaylistWriter
+////////////////////////////////////////////////////////////////////////////////
+PlaylistWriter::PlaylistWriter(const Library& library) : m_library(library),
+    m_generation(0), m_incremental(false), m_index_changed(false)
+{
+}
+
+// -----------------------------------------------------------------------------
+void PlaylistWriter::put(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    m_data.insert(m_data.end(), p, p + size);
+}
+
+// -----------------------------------------------------------------------------
+void PlaylistWriter::putU16(uint16_t value)
+{
+    put(&value, sizeof(value));
+}
+
+// -----------------------------------------------------------------------------
+//  固定長フィールドとして書き出す(残りは 0 で埋め、必ず NUL 終端する)
+// -----------------------------------------------------------------------------
+void PlaylistWriter::putString(const std::string& s, size_t field_size)
+{
+    std::string t = truncateUTF8(s, field_size - 1);
+    put(t.data(), t.size());
+    m_data.resize(m_data.size() + (field_size - t.size()), 0);
+}
+
+// -----------------------------------------------------------------------------
+//  v1 : 従来のストリーム形式
+// -----------------------------------------------------------------------------
+void PlaylistWriter::buildV1()
+{
+    const std::vector<LibraryArtist>& artists = m_library.getArtists();
+    m_data.clear();
+    putU16((uint16_t)artists.size());
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        const LibraryArtist& artist = artists[i];
+        putU16(artist.id);
+        putString(artist.name, V1_NAME_SIZE);
+        putU16((uint16_t)artist.albums.size());
+        for( size_t j = 0 ; j < artist.albums.size() ; j++ )
+        {
+            const LibraryAlbum& album = artist.albums[j];
+            putU16(album.id);
+            putString(album.title, V1_TITLE_SIZE);
+            putU16(album.year);
+            putU16(totalSeconds(album));
+            putU16((uint16_t)album.songs.size());
+            for( size_t k = 0 ; k < album.songs.size() ; k++ )
+            {
+                const TrackInfo *song = album.songs[k];
+                putU16(trackIndex(song, k));
+                putU16(toSeconds(song->duration_ms));
+                putString(song->path, V1_FILENAME_SIZE);
+                putString(song->title, V1_TITLE_SIZE);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+void PlaylistWriter::makeBlock(const LibraryArtist& artist, ArtistBlock& block)
+{
+    block.id = artist.id;
+    block.albums.clear();
+    block.songs.clear();
+    block.file_sizes.clear();
+    block.strings.clear();
+    block.name = block.strings.size();
+    block.strings.append(artist.name).push_back('\0');
+    for( size_t j = 0 ; j < artist.albums.size() ; j++ )
+    {
+        const LibraryAlbum& album = artist.albums[j];
+        PlaylistAlbumRecord al;
+        memset(&al, 0, sizeof(al));
+        al.id = album.id;
+        al.year = album.year;
+        al.total_length = totalSeconds(album);
+        al.song_count = (uint16_t)album.songs.size();
+        al.first_song = block.songs.size();
+        al.title = block.strings.size();
+        block.strings.append(album.title).push_back('\0');
+        for( size_t k = 0 ; k < album.songs.size() ; k++ )
+        {
+            const TrackInfo *info = album.songs[k];
+            PlaylistSongRecord so;
+            memset(&so, 0, sizeof(so));
+            so.track_index = trackIndex(info, k);
+            so.length = toSeconds(info->duration_ms);
+            so.filename = block.strings.size();
+            block.strings.append(info->path).push_back('\0');
+            so.title = block.strings.size();
+            block.strings.append(info->title).push_back('\0');
+            block.songs.push_back(so);
+            block.file_sizes.push_back(info->file_size);
+        }
+        block.albums.push_back(al);
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  検索、アルバム、並び順の索引のセクションのサイズ
+// -----------------------------------------------------------------------------
+void PlaylistWriter::getIndexSizes(uint32_t *size)
+{
+    size[PlaylistFile::SRCH] = m_search.size() * sizeof(PlaylistSearchEntry);
+    size[PlaylistFile::YEAR] = m_album_index.years.size() * sizeof(PlaylistAlbumIndexEntry);
+    size[PlaylistFile::ADDD] = m_album_index.added.size() * sizeof(PlaylistAlbumIndexEntry);
+    size[PlaylistFile::GENR] = m_album_index.genres.size() * sizeof(PlaylistGenreRecord);
+    size[PlaylistFile::GALB] = m_album_index.genre_albums.size() * sizeof(PlaylistAlbumIndexEntry);
+    size[PlaylistFile::ASRT] = m_artist_order.size() * sizeof(PlaylistSortEntry);
+    size[PlaylistFile::BSRT] = m_album_order.size() * sizeof(PlaylistSortEntry);
+}
+
+// -----------------------------------------------------------------------------
+//  検索、アルバム、並び順の索引を配置する
+// -----------------------------------------------------------------------------
+void PlaylistWriter::putIndexes(const PlaylistSection *sections)
+{
+    const void *data[PlaylistFile::NUM_SECTIONS] = {NULL};
+    data[PlaylistFile::SRCH] = m_search.data();
+    data[PlaylistFile::YEAR] = m_album_index.years.data();
+    data[PlaylistFile::ADDD] = m_album_index.added.data();
+    data[PlaylistFile::GENR] = m_album_index.genres.data();
+    data[PlaylistFile::GALB] = m_album_index.genre_albums.data();
+    data[PlaylistFile::ASRT] = m_artist_order.data();
+    data[PlaylistFile::BSRT] = m_album_order.data();
+    for( size_t i = 0 ; i < sizeof(REWRITTEN) / sizeof(REWRITTEN[0]) ; i++ )
+    {
+        int n = REWRITTEN[i];
+        if( data[n] && sections[n].size > 0 )
+        {
+            memcpy(&m_data[sections[n].offset], data[n], sections[n].size);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  全体を詰めて配置する。各セクションの後ろには次回の差分更新のための余白を置く
+// -----------------------------------------------------------------------------
+void PlaylistWriter::layoutFull(std::vector<ArtistBlock>& blocks,
+    std::vector<PlaylistArtistRecord>& arts, PlaylistSection *sections, uint32_t& file_size)
+{
+    uint32_t size[PlaylistFile::NUM_SECTIONS] = {0};
+    for( size_t i = 0 ; i < blocks.size() ; i++ )
+    {
+        arts[i].first_album   = size[PlaylistFile::ALBM];
+        arts[i].first_song    = size[PlaylistFile::SONG];
+        arts[i].string_offset = size[PlaylistFile::STRS];
+        size[PlaylistFile::ALBM] += blocks[i].albums.size();
+        size[PlaylistFile::SONG] += blocks[i].songs.size();
+        size[PlaylistFile::STRS] += blocks[i].strings.size();
+    }
+    size[PlaylistFile::ARTS] = blocks.size() * sizeof(PlaylistArtistRecord);
+    size[PlaylistFile::ALBM] *= sizeof(PlaylistAlbumRecord);
+    size[PlaylistFile::FSIZ] = size[PlaylistFile::SONG] * sizeof(uint32_t);
+    size[PlaylistFile::SONG] *= sizeof(PlaylistSongRecord);
+    getIndexSizes(size);
+
+    uint32_t pos = alignSector(sizeof(PlaylistHeader) + sizeof(PlaylistSection) * PlaylistFile::NUM_SECTIONS);
+    for( int n = 0 ; n < PlaylistFile::NUM_SECTIONS ; n++ )
+    {
+        sections[n].id = SECTION_IDS[n];
+        sections[n].offset = pos;
+        sections[n].size = size[n];
+        pos += alignSector(size[n] + size[n] / 8 + SECTOR_SIZE);
+    }
+    file_size = pos;
+}
+
+// -----------------------------------------------------------------------------
+//  既存ファイルの配置を引き継ぐ
+//  内容の変わらないアーティストは元の位置のまま、変わったものは各セクションの末尾に追記する
+//  余白が足りない場合、または使われなくなった領域が多すぎる場合は false
+// -----------------------------------------------------------------------------
+bool PlaylistWriter::layoutIncremental(const PlaylistFile& base, std::vector<ArtistBlock>& blocks,
+    std::vector<bool>& reused, std::vector<PlaylistArtistRecord>& arts, PlaylistSection *sections)
+{
+    uint32_t used[PlaylistFile::NUM_SECTIONS];
+    uint32_t live[PlaylistFile::NUM_SECTIONS] = {0};
+    used[PlaylistFile::ALBM] = base.sections[PlaylistFile::ALBM].size / sizeof(PlaylistAlbumRecord);
+    used[PlaylistFile::SONG] = base.sections[PlaylistFile::SONG].size / sizeof(PlaylistSongRecord);
+    used[PlaylistFile::STRS] = base.sections[PlaylistFile::STRS].size;
+    for( size_t i = 0 ; i < blocks.size() ; i++ )
+    {
+        if( reused[i] )
+        {
+            continue;   // arts[i] は既存のレコードの位置のまま
+        }
+        arts[i].first_album   = used[PlaylistFile::ALBM];
+        arts[i].first_song    = used[PlaylistFile::SONG];
+        arts[i].string_offset = used[PlaylistFile::STRS];
+        used[PlaylistFile::ALBM] += blocks[i].albums.size();
+        used[PlaylistFile::SONG] += blocks[i].songs.size();
+        used[PlaylistFile::STRS] += blocks[i].strings.size();
+    }
+    for( size_t i = 0 ; i < blocks.size() ; i++ )
+    {
+        live[PlaylistFile::ALBM] += blocks[i].albums.size();
+        live[PlaylistFile::SONG] += blocks[i].songs.size();
+        live[PlaylistFile::STRS] += blocks[i].strings.size();
+    }
+    used[PlaylistFile::ARTS] = blocks.size() * sizeof(PlaylistArtistRecord);
+    used[PlaylistFile::ALBM] *= sizeof(PlaylistAlbumRecord);
+    used[PlaylistFile::FSIZ] = used[PlaylistFile::SONG] * sizeof(uint32_t);
+    used[PlaylistFile::SONG] *= sizeof(PlaylistSongRecord);
+    live[PlaylistFile::ARTS] = used[PlaylistFile::ARTS];
+    getIndexSizes(used);
+    getIndexSizes(live);
+    live[PlaylistFile::ALBM] *= sizeof(PlaylistAlbumRecord);
+    live[PlaylistFile::FSIZ] = live[PlaylistFile::SONG] * sizeof(uint32_t);
+    live[PlaylistFile::SONG] *= sizeof(PlaylistSongRecord);
+
+    for( int n = 0 ; n < PlaylistFile::NUM_SECTIONS ; n++ )
+    {
+        if( used[n] > base.getCapacity(n) )
+        {
+            return false;
+        }
+        // 半分以上が使われなくなった領域であれば詰め直す
+        if( used[n] > SECTOR_SIZE && used[n] - live[n] > live[n] )
+        {
+            return false;
+        }
+        sections[n] = base.sections[n];
+        sections[n].size = used[n];
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  v2 : セクション形式(playlist_format.h)
+//  base は既存のファイル(なければ NULL)。内容の変わったアーティストを調べ、
+//  incremental であれば可能な限り既存の配置を引き継ぐ
+// -----------------------------------------------------------------------------
+void PlaylistWriter::buildV2(const PlaylistFile *base, bool incremental)
+{
+    const std::vector<LibraryArtist>& artists = m_library.getArtists();
+    std::vector<ArtistBlock> blocks(artists.size());
+    std::vector<PlaylistArtistRecord> arts(artists.size());
+    std::vector<bool> reused(artists.size(), false);
+    m_touched.clear();
+    SearchIndex::build(artists, m_search);
+    m_album_index.build(artists);
+    Collation::build(artists, m_artist_order, m_album_order);
+
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        makeBlock(artists[i], blocks[i]);
+        PlaylistArtistRecord& ar = arts[i];
+        memset(&ar, 0, sizeof(ar));
+        ar.id = blocks[i].id;
+        ar.album_count = (uint16_t)blocks[i].albums.size();
+        ar.song_count = blocks[i].songs.size();
+        ar.string_size = blocks[i].strings.size();
+    }
+
+    // 既存ファイルと内容を比較する
+    if( base )
+    {
+        std::map<uint16_t, const PlaylistArtistRecord *> old_artists;
+        for( uint32_t i = 0 ; i < base->header.artist_count ; i++ )
+        {
+            const PlaylistArtistRecord *rec = base->getArtist(i);
+            old_artists[rec->id] = rec;
+        }
+        for( size_t i = 0 ; i < blocks.size() ; i++ )
+        {
+            std::map<uint16_t, const PlaylistArtistRecord *>::iterator it = old_artists.find(blocks[i].id);
+            ArtistBlock old;
+            if( it != old_artists.end() && base->getBlock(it->second, old) && old == blocks[i] )
+            {
+                reused[i] = true;
+                arts[i].first_album = it->second->first_album;
+                arts[i].first_song = it->second->first_song;
+                arts[i].string_offset = it->second->string_offset;
+            }
+            else
+            {
+                m_touched.push_back(blocks[i].id);
+            }
+            if( it != old_artists.end() )
+            {
+                old_artists.erase(it);
+            }
+        }
+        // 削除されたアーティスト
+        for( std::map<uint16_t, const PlaylistArtistRecord *>::iterator it = old_artists.begin() ;
+             it != old_artists.end() ; ++it )
+        {
+            m_touched.push_back(it->first);
+        }
+        std::sort(m_touched.begin(), m_touched.end());
+    }
+
+    PlaylistSection sections[PlaylistFile::NUM_SECTIONS];
+    memset(sections, 0, sizeof(sections));
+    uint32_t file_size;
+    m_incremental = incremental && base && layoutIncremental(*base, blocks, reused, arts, sections);
+    if( m_incremental )
+    {
+        file_size = base->header.file_size;
+        m_data = base->data;
+        // ARTS と索引は全体を書き直すので、古いレコードの残りを消しておく
+        for( size_t i = 0 ; i < sizeof(REWRITTEN) / sizeof(REWRITTEN[0]) ; i++ )
+        {
+            uint32_t offset = sections[REWRITTEN[i]].offset;
+            uint32_t end = offset + base->getCapacity(REWRITTEN[i]);
+            std::fill(m_data.begin() + offset, m_data.begin() + end, 0);
+        }
+    }
+    else
+    {
+        layoutFull(blocks, arts, sections, file_size);
+        m_data.assign(file_size, 0);
+        reused.assign(blocks.size(), false);
+    }
+
+    // レコードを絶対値に直して配置する
+    for( size_t i = 0 ; i < blocks.size() ; i++ )
+    {
+        PlaylistArtistRecord& ar = arts[i];
+        ArtistBlock& block = blocks[i];
+        ar.name = ar.string_offset + block.name;
+        if( reused[i] )
+        {
+            continue;
+        }
+        for( size_t j = 0 ; j < block.albums.size() ; j++ )
+        {
+            block.albums[j].first_song += ar.first_song;
+            block.albums[j].title += ar.string_offset;
+        }
+        for( size_t k = 0 ; k < block.songs.size() ; k++ )
+        {
+            block.songs[k].filename += ar.string_offset;
+            block.songs[k].title += ar.string_offset;
+        }
+        if( !block.albums.empty() )
+        {
+            memcpy(&m_data[sections[PlaylistFile::ALBM].offset + ar.first_album * sizeof(PlaylistAlbumRecord)],
+                &block.albums[0], block.albums.size() * sizeof(PlaylistAlbumRecord));
+        }
+        if( !block.songs.empty() )
+        {
+            memcpy(&m_data[sections[PlaylistFile::SONG].offset + ar.first_song * sizeof(PlaylistSongRecord)],
+                &block.songs[0], block.songs.size() * sizeof(PlaylistSongRecord));
+            memcpy(&m_data[sections[PlaylistFile::FSIZ].offset + ar.first_song * sizeof(uint32_t)],
+                &block.file_sizes[0], block.file_sizes.size() * sizeof(uint32_t));
+        }
+        memcpy(&m_data[sections[PlaylistFile::STRS].offset + ar.string_offset],
+            block.strings.data(), block.strings.size());
+    }
+    if( !arts.empty() )
+    {
+        memcpy(&m_data[sections[PlaylistFile::ARTS].offset], &arts[0], arts.size() * sizeof(PlaylistArtistRecord));
+    }
+    putIndexes(sections);
+    for( int n = 0 ; n < PlaylistFile::NUM_SECTIONS ; n++ )
+    {
+        sections[n].crc = CRC32::calc(&m_data[sections[n].offset], sections[n].size);
+    }
+    // ジャンルや追加日時だけが変わった場合は、どのアーティストも変わらないので別に調べる
+    m_index_changed = !base;
+    for( size_t i = 0 ; i < sizeof(REWRITTEN) / sizeof(REWRITTEN[0]) && base ; i++ )
+    {
+        const PlaylistSection& a = sections[REWRITTEN[i]];
+        const PlaylistSection& b = base->sections[REWRITTEN[i]];
+        m_index_changed = m_index_changed || a.size != b.size || a.crc != b.crc;
+    }
+
+    // 世代番号は既存ファイルの次の値。既存ファイルがなければ、以前のファイルと
+    // 重ならないよう現在時刻を使う
+    m_generation = base? (base->header.generation + 1) : (uint32_t)time(NULL);
+    if( m_generation == 0 )
+    {
+        m_generation = 1;
+    }
+
+    PlaylistHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PLAYLIST_MAGIC;
+    header.version = PLAYLIST_VERSION;
+    header.section_count = PlaylistFile::NUM_SECTIONS;
+    header.file_size = file_size;
+    header.artist_count = arts.size();
+    header.album_count = sections[PlaylistFile::ALBM].size / sizeof(PlaylistAlbumRecord);
+    header.song_count = sections[PlaylistFile::SONG].size / sizeof(PlaylistSongRecord);
+    header.generation = m_generation;
+    header.header_crc = CRC32::update(CRC32::calc(&header, sizeof(header)), sections, sizeof(sections));
+    memcpy(&m_data[0], &header, sizeof(header));
+    memcpy(&m_data[sizeof(header)], sections, sizeof(sections));
+}
+
+// -----------------------------------------------------------------------------
+//  一時ファイルに書いてから置き換える(書き込み途中で中断しても元のファイルを壊さない)
+// -----------------------------------------------------------------------------
+bool PlaylistWriter::save(const std::string& path)
+{
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if( !fp )
+    {
+        return false;
+    }
+    bool ok = fwrite(m_data.data(), 1, m_data.size(), fp) == m_data.size();
+    ok = (fclose(fp) == 0) && ok;
+    if( !ok || rename(tmp.c_str(), path.c_str()) )
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  既存ファイルのうち、内容の変わったセクタだけを書き換える
+//  ヘッダを含む先頭セクタは最後に書くので、途中で中断した場合はプレイヤー側で
+//  CRC エラーとして検出される
+// -----------------------------------------------------------------------------
+bool PlaylistWriter::update(const std::string& path, const PlaylistFile& base, uint32_t& written_blocks)
+{
+    written_blocks = 0;
+    int fd = open(path.c_str(), O_WRONLY);
+    if( fd < 0 )
+    {
+        return false;
+    }
+    bool ok = true;
+    uint32_t blocks = (m_data.size() + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    for( uint32_t pass = 0 ; pass < 2 && ok ; pass++ )
+    {
+        for( uint32_t b = (pass == 0)? 1 : 0 ; b < ((pass == 0)? blocks : 1) && ok ; b++ )
+        {
+            size_t offset = b * SECTOR_SIZE;
+            size_t size = std::min((size_t)SECTOR_SIZE, m_data.size() - offset);
+            if( offset + size <= base.data.size() && !memcmp(&m_data[offset], &base.data[offset], size) )
+            {
+                continue;
+            }
+            ok = pwrite(fd, &m_data[offset], size, offset) == (ssize_t)size;
+            written_blocks++;
+        }
+        ok = ok && fsync(fd) == 0;
+    }
+    ok = ok && ftruncate(fd, m_data.size()) == 0;
+    ok = (close(fd) == 0) && ok;
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+//  ジャーナル(playlist.jnl)を書き出す
+//  プレイヤーがまだ読み込んでいない前回のジャーナルがあれば、その基準世代を引き継ぎ、
+//  ID を併合する
+// -----------------------------------------------------------------------------
+bool PlaylistWriter::saveJournal(const std::string& path, const PlaylistFile *base)
+{
+    PlaylistJournalHeader journal;
+    memset(&journal, 0, sizeof(journal));
+    journal.magic = PLAYLIST_JOURNAL_MAGIC;
+    journal.base_generation = base? base->header.generation : 0;
+    journal.generation = m_generation;
+    std::vector<uint16_t> ids = m_touched;
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if( fp )
+    {
+        PlaylistJournalHeader prev;
+        if( base && fread(&prev, sizeof(prev), 1, fp) == 1 && prev.magic == PLAYLIST_JOURNAL_MAGIC &&
+            prev.generation == base->header.generation )
+        {
+            std::vector<uint16_t> prev_ids(prev.artist_count);
+            if( prev_ids.empty() || fread(&prev_ids[0], sizeof(uint16_t), prev_ids.size(), fp) == prev_ids.size() )
+            {
+                journal.base_generation = prev.base_generation;
+                ids.insert(ids.end(), prev_ids.begin(), prev_ids.end());
+                std::sort(ids.begin(), ids.end());
+                ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            }
+            else
+            {
+                journal.base_generation = 0;
+            }
+        }
+        else
+        {
+            // 内容が不明なジャーナルが残っている場合は全体を読み直させる
+            journal.base_generation = 0;
+        }
+        fclose(fp);
+    }
+    if( ids.size() > 0xFFFF )
+    {
+        ids.clear();
+        journal.base_generation = 0;
+    }
+    journal.artist_count = ids.size();
+    uint32_t crc = CRC32::calc(&journal, sizeof(journal));
+    if( !ids.empty() )
+    {
+        crc = CRC32::update(crc, &ids[0], ids.size() * sizeof(uint16_t));
+    }
+    journal.crc = (uint16_t)crc;
+
+    std::string tmp = path + ".tmp";
+    fp = fopen(tmp.c_str(), "wb");
+    if( !fp )
+    {
+        return false;
+    }
+    bool ok = fwrite(&journal, sizeof(journal), 1, fp) == 1;
+    if( !ids.empty() )
+    {
+        ok = ok && fwrite(&ids[0], sizeof(uint16_t), ids.size(), fp) == ids.size();
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if( !ok || rename(tmp.c_str(), path.c_str()) )
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,98 @@
+#ifndef PLAYLIST_WRITER_H
+#define PLAYLIST_WRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "album_index.h"
+#include "collation.h"
+#include "library.h"
+#include "playlist_format.h"
+
+// -----------------------------------------------------------------------------
+//  アーティスト１人ぶんのレコードと文字列
+//  インデックス、オフセットはこのブロックの先頭を 0 とした相対値で持つので、
+//  配置する位置に関係なく内容を比較できる
+// -----------------------------------------------------------------------------
+class ArtistBlock
+{
+    public:
+        uint16_t id;
+        std::vector<PlaylistAlbumRecord> albums;
+        std::vector<PlaylistSongRecord>  songs;
+        std::vector<uint32_t> file_sizes;   // songs と同じ順
+        std::string strings;
+        uint32_t name;
+
+        bool operator == (const ArtistBlock& other) const;
+};
+
+// -----------------------------------------------------------------------------
+//  既存の playlist.dat (v2)
+// -----------------------------------------------------------------------------
+class PlaylistFile
+{
+    public:
+        enum{ARTS, ALBM, SONG, STRS, SRCH, YEAR, ADDD, GENR, GALB, ASRT, BSRT, FSIZ, NUM_SECTIONS};
+
+        std::vector<uint8_t> data;
+        PlaylistHeader  header;
+        PlaylistSection sections[NUM_SECTIONS];
+
+        bool load(const std::string& path);
+        uint32_t getCapacity(int n) const;
+        const PlaylistArtistRecord *getArtist(uint32_t index) const;
+        bool getBlock(const PlaylistArtistRecord *rec, ArtistBlock& block) const;
+};
+
+// -----------------------------------------------------------------------------
+//  Library の内容を playlist.dat として書き出す
+//  レイアウトはプレイヤー側の Playlist::load (playlist.cpp) と一致させること
+// -----------------------------------------------------------------------------
+class PlaylistWriter
+{
+    private:
+        const Library& m_library;
+        std::vector<uint8_t> m_data;
+        std::vector<uint16_t> m_touched;    // 内容が変わった(追加、削除を含む)アーティストの ID
+        std::vector<PlaylistSearchEntry> m_search;
+        AlbumIndex m_album_index;
+        std::vector<PlaylistSortEntry> m_artist_order;
+        std::vector<PlaylistSortEntry> m_album_order;
+        uint32_t m_generation;
+        bool     m_incremental;             // 既存ファイルの配置を引き継いだかどうか
+        bool     m_index_changed;           // 索引の内容が既存ファイルと異なるかどうか
+
+        void put(const void *data, size_t size);
+        void putU16(uint16_t value);
+        void putString(const std::string& s, size_t field_size);
+        void makeBlock(const LibraryArtist& artist, ArtistBlock& block);
+        void getIndexSizes(uint32_t *size);
+        void putIndexes(const PlaylistSection *sections);
+        bool layoutIncremental(const PlaylistFile& base, std::vector<ArtistBlock>& blocks, std::vector<bool>& reused,
+                               std::vector<PlaylistArtistRecord>& arts, PlaylistSection *sections);
+        void layoutFull(std::vector<ArtistBlock>& blocks, std::vector<PlaylistArtistRecord>& arts,
+                        PlaylistSection *sections, uint32_t& file_size);
+
+    public:
+        PlaylistWriter(const Library& library);
+        void buildV1();
+        void buildV2(const PlaylistFile *base, bool incremental);
+        bool save(const std::string& path);
+        bool update(const std::string& path, const PlaylistFile& base, uint32_t& written_blocks);
+        bool saveJournal(const std::string& path, const PlaylistFile *base);
+        size_t getSize() const { return m_data.size(); }
+        uint32_t getGeneration() const { return m_generation; }
+        bool isIncremental() const { return m_incremental; }
+        bool isIndexChanged() const { return m_index_changed; }
+        const std::vector<uint16_t>& getTouchedArtists() const { return m_touched; }
+        uint32_t getSearchEntryCount() const { return m_search.size(); }
+        uint32_t getGenreCount() const { return m_album_index.genres.size(); }
+};
+
+// -----------------------------------------------------------------------------
+//  ミリ秒から、プレイヤーが扱う秒数(uint16_t)への変換
+// -----------------------------------------------------------------------------
+uint16_t toSeconds(uint32_t ms);
+
+#endif
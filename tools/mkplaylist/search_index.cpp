@@ -0,0 +1,226 @@
+#include <string.h>
+#include <algorithm>
+#include "search_index.h"
+
+// 文字の分類(toDigit の戻り値)
+enum{CHAR_SKIP = -1};           // 無視する(長音記号、濁点など)
+enum{CHAR_SPACE = -2};          // 単語の区切り
+enum{CHAR_OTHER = -3};          // 変換できない(漢字など)。キーはここで終わる
+
+// 半角カナ(U+FF66 ｦ 〜 U+FF9F ﾟ)の行
+static const char HANKAKU_ROWS[] =
+    "0"             // ｦ
+    "11111" "888"   // ｧｨｩｪｫ ｬｭｮ
+    "4" "-"         // ｯ ｰ
+    "11111"         // ｱｲｳｴｵ
+    "22222"         // ｶｷｸｹｺ
+    "33333"         // ｻｼｽｾｿ
+    "44444"         // ﾀﾁﾂﾃﾄ
+    "55555"         // ﾅﾆﾇﾈﾉ
+    "66666"         // ﾊﾋﾌﾍﾎ
+    "77777"         // ﾏﾐﾑﾒﾓ
+    "888"           // ﾔﾕﾖ
+    "99999"         // ﾗﾘﾙﾚﾛ
+    "00"            // ﾜﾝ
+    "--";           // ﾞﾟ
+
+// ひらがな(U+3041 ぁ 〜 U+3096 ゖ)の行
+static const char HIRAGANA_ROWS[] =
+    "1111111111"            // ぁあぃいぅうぇえぉお
+    "2222222222"            // かがきぎくぐけげこご
+    "3333333333"            // さざしじすずせぜそぞ
+    "44444444444"           // ただちぢっつづてでとど
+    "55555"                 // なにぬねの
+    "666666666666666"       // はばぱひびぴふぶぷへべぺほぼぽ
+    "77777"                 // まみむめも
+    "888888"                // ゃやゅゆょよ
+    "99999"                 // らりるれろ
+    "000000"                // ゎわゐゑをん
+    "122";                  // ゔゕゖ
+
+static_assert(sizeof(HANKAKU_ROWS) - 1 == 0xFF9F - 0xFF66 + 1, "HANKAKU_ROWS");
+static_assert(sizeof(HIRAGANA_ROWS) - 1 == 0x3096 - 0x3041 + 1, "HIRAGANA_ROWS");
+
+// Latin-1 の英字(U+00C0 〜 U+00FF)を基本の英字に寄せる
+static const char LATIN1_BASE[] =
+    "AAAAAAACEEEEIIII" "DNOOOOO*OUUUUYTs"
+    "aaaaaaaceeeeiiii" "dnooooo/ouuuuyty";
+
+// -----------------------------------------------------------------------------
+//  １文字を数字キー(0〜9)に変換する
+// -----------------------------------------------------------------------------
+int SearchIndex::toDigit(uint32_t c)
+{
+    if( c >= 0xFF01 && c <= 0xFF5E )
+    {
+        c -= 0xFEE0;        // 全角英数字、記号
+    }
+    else if( c >= 0x30A1 && c <= 0x30F6 )
+    {
+        c -= 0x60;          // カタカナ
+    }
+    else if( c >= 0xC0 && c <= 0xFF )
+    {
+        char base = LATIN1_BASE[c - 0xC0];
+        c = (base == '*' || base == '/')? ' ' : base;
+    }
+
+    if( c >= '0' && c <= '9' )
+    {
+        return c - '0';
+    }
+    if( c >= 'A' && c <= 'Z' )
+    {
+        c += 'a' - 'A';
+    }
+    if( c >= 'a' && c <= 'z' )
+    {
+        static const char LETTERS[] = "22233344455566677778889999";
+        return LETTERS[c - 'a'] - '0';
+    }
+    if( c == '\'' )
+    {
+        return CHAR_SKIP;   // Don't, Guns N' Roses
+    }
+    if( c < 0x80 || c == 0x3000 || c == 0x3001 || c == 0x3002 || c == 0x30FB )
+    {
+        return CHAR_SPACE;  // 空白、記号、全角空白、読点、句点、中黒
+    }
+    if( c >= 0x3041 && c <= 0x3096 )
+    {
+        return HIRAGANA_ROWS[c - 0x3041] - '0';
+    }
+    if( c >= 0xFF66 && c <= 0xFF9F )
+    {
+        char row = HANKAKU_ROWS[c - 0xFF66];
+        return (row == '-')? CHAR_SKIP : (row - '0');
+    }
+    if( c == 0x30FC || c == 0x309B || c == 0x309C )
+    {
+        return CHAR_SKIP;   // 長音記号、濁点、半濁点
+    }
+    if( c >= 0x30F7 && c <= 0x30FA )
+    {
+        return 0;           // ヷヸヹヺ
+    }
+    return CHAR_OTHER;
+}
+
+// -----------------------------------------------------------------------------
+//  text の pos バイト目からをキーに変換する
+//  最初に変換できない文字が現れた位置で終わる。数字が１つもなければ 0
+// -----------------------------------------------------------------------------
+uint32_t SearchIndex::makeKey(const std::string& text, size_t pos)
+{
+    uint32_t key = 0;
+    int digits = 0;
+    while( pos < text.size() && digits < PLAYLIST_SEARCH_MAX_DIGITS )
+    {
+        int d = toDigit(decodeUTF8(text, pos));
+        if( d == CHAR_OTHER )
+        {
+            break;
+        }
+        if( d >= 0 )
+        {
+            key |= (uint32_t)(d + 1) << (28 - digits * 4);
+            digits++;
+        }
+    }
+    return key;
+}
+
+// -----------------------------------------------------------------------------
+//  text のキーを追加する。words であれば、途中の単語の先頭からのキーも追加する
+// -----------------------------------------------------------------------------
+void SearchIndex::addKeys(std::vector<PlaylistSearchEntry>& entries, const std::string& text,
+    bool words, uint16_t artist, uint16_t item)
+{
+    PlaylistSearchEntry e;
+    e.artist = artist;
+    e.item = item;
+    int count = 0;
+    bool space = true;
+    size_t pos = 0;
+    while( pos < text.size() && count < (words? (int)MAX_WORDS : 1) )
+    {
+        size_t start = pos;
+        int d = toDigit(decodeUTF8(text, pos));
+        if( d == CHAR_SPACE )
+        {
+            space = true;
+            continue;
+        }
+        if( space && d >= 0 )
+        {
+            e.key = makeKey(text, start);
+            if( e.key )
+            {
+                entries.push_back(e);
+                count++;
+            }
+        }
+        space = (d == CHAR_OTHER);  // 漢字の後ろのかなや英字も単語の先頭とみなす
+    }
+}
+
+// -----------------------------------------------------------------------------
+//  ソート順は key、同じ key ならアーティスト、アルバム、曲の順
+// -----------------------------------------------------------------------------
+static int entryRank(const PlaylistSearchEntry& e)
+{
+    return (e.item == PLAYLIST_SEARCH_ARTIST)? 0 : (e.item & PLAYLIST_SEARCH_ALBUM)? 1 : 2;
+}
+
+// -----------------------------------------------------------------------------
+static bool entryLess(const PlaylistSearchEntry& a, const PlaylistSearchEntry& b)
+{
+    if( a.key != b.key )
+    {
+        return a.key < b.key;
+    }
+    if( entryRank(a) != entryRank(b) )
+    {
+        return entryRank(a) < entryRank(b);
+    }
+    if( a.artist != b.artist )
+    {
+        return a.artist < b.artist;
+    }
+    return a.item < b.item;
+}
+
+// -----------------------------------------------------------------------------
+static bool entryEqual(const PlaylistSearchEntry& a, const PlaylistSearchEntry& b)
+{
+    return a.key == b.key && a.artist == b.artist && a.item == b.item;
+}
+
+// -----------------------------------------------------------------------------
+//  artists (ARTS と同じ順)の索引を作る
+//  名前と読み(ソートキー)の両方から引けるようにする。曲名は先頭からのみ
+// -----------------------------------------------------------------------------
+void SearchIndex::build(const std::vector<LibraryArtist>& artists, std::vector<PlaylistSearchEntry>& entries)
+{
+    entries.clear();
+    for( size_t i = 0 ; i < artists.size() ; i++ )
+    {
+        const LibraryArtist& artist = artists[i];
+        addKeys(entries, artist.name, true, i, PLAYLIST_SEARCH_ARTIST);
+        addKeys(entries, artist.sort_key, true, i, PLAYLIST_SEARCH_ARTIST);
+        uint16_t song = 0;
+        for( size_t j = 0 ; j < artist.albums.size() && j < PLAYLIST_SEARCH_ALBUM ; j++ )
+        {
+            const LibraryAlbum& album = artist.albums[j];
+            addKeys(entries, album.title, true, i, PLAYLIST_SEARCH_ALBUM | j);
+            addKeys(entries, album.sort_key, true, i, PLAYLIST_SEARCH_ALBUM | j);
+            for( size_t k = 0 ; k < album.songs.size() && song < PLAYLIST_SEARCH_ALBUM ; k++, song++ )
+            {
+                addKeys(entries, album.songs[k]->title, false, i, song);
+                addKeys(entries, album.songs[k]->title_sort, false, i, song);
+            }
+        }
+    }
+    std::sort(entries.begin(), entries.end(), entryLess);
+    entries.erase(std::unique(entries.begin(), entries.end(), entryEqual), entries.end());
+}
@@ -0,0 +1,28 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "library.h"
+#include "playlist_format.h"
+
+// -----------------------------------------------------------------------------
+//  リモコンの数字キーによる前方一致検索の索引(SRCH セクション)
+//  キーへの変換規則は playlist_format.h を参照
+// -----------------------------------------------------------------------------
+class SearchIndex
+{
+    private:
+        enum{MAX_WORDS = 4};        // 名前の途中の単語から引けるようにする数(先頭を含む)
+
+        static int  toDigit(uint32_t c);
+        static void addKeys(std::vector<PlaylistSearchEntry>& entries, const std::string& text,
+                            bool words, uint16_t artist, uint16_t item);
+
+    public:
+        static uint32_t makeKey(const std::string& text, size_t pos);
+        static void build(const std::vector<LibraryArtist>& artists, std::vector<PlaylistSearchEntry>& entries);
+};
+
+#endif
@@ -0,0 +1,926 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include <iconv.h>
+#include <vector>
+#include "tag_reader.h"
+
+// -----------------------------------------------------------------------------
+static uint32_t be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+static uint32_t be24(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+static uint32_t le32(const uint8_t *p)
+{
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+static uint64_t le64(const uint8_t *p)
+{
+    return ((uint64_t)le32(p+4) << 32) | le32(p);
+}
+static uint32_t syncsafe32(const uint8_t *p)
+{
+    return ((uint32_t)(p[0] & 0x7F) << 21) | ((uint32_t)(p[1] & 0x7F) << 14) |
+           ((uint32_t)(p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
+
+// -----------------------------------------------------------------------------
+static void appendUTF8(std::string& s, uint32_t c)
+{
+    if( c < 0x80 )
+    {
+        s += (char)c;
+    }
+    else if( c < 0x800 )
+    {
+        s += (char)(0xC0 | (c >> 6));
+        s += (char)(0x80 | (c & 0x3F));
+    }
+    else if( c < 0x10000 )
+    {
+        s += (char)(0xE0 | (c >> 12));
+        s += (char)(0x80 | ((c >> 6) & 0x3F));
+        s += (char)(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        s += (char)(0xF0 | (c >> 18));
+        s += (char)(0x80 | ((c >> 12) & 0x3F));
+        s += (char)(0x80 | ((c >> 6) & 0x3F));
+        s += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+// -----------------------------------------------------------------------------
+std::string utf16ToUTF8(const uint8_t *data, uint32_t size, bool big_endian)
+{
+    std::string s;
+    for( uint32_t i = 0 ; i + 1 < size ; i += 2 )
+    {
+        uint32_t c = big_endian? ((data[i] << 8) | data[i+1]) : ((data[i+1] << 8) | data[i]);
+        if( c == 0 )
+        {
+            break;
+        }
+        if( 0xD800 <= c && c < 0xDC00 && i + 3 < size )
+        {
+            uint32_t c2 = big_endian? ((data[i+2] << 8) | data[i+3]) : ((data[i+3] << 8) | data[i+2]);
+            if( 0xDC00 <= c2 && c2 < 0xE000 )
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+                i += 2;
+            }
+        }
+        appendUTF8(s, c);
+    }
+    return s;
+}
+
+// -----------------------------------------------------------------------------
+//  max_bytes 以下になるよう、UTF-8 の文字境界で切り詰める
+// -----------------------------------------------------------------------------
+std::string truncateUTF8(const std::string& s, size_t max_bytes)
+{
+    if( s.size() <= max_bytes )
+    {
+        return s;
+    }
+    size_t n = max_bytes;
+    while( n > 0 && (s[n] & 0xC0) == 0x80 )
+    {
+        n--;
+    }
+    return s.substr(0, n);
+}
+
+// -----------------------------------------------------------------------------
+//  UTF-8 を１文字取り出す(不正なバイトは１バイトずつ読み飛ばす)
+// -----------------------------------------------------------------------------
+uint32_t decodeUTF8(const std::string& s, size_t& pos)
+{
+    uint8_t c = s[pos++];
+    int extra = (c >= 0xF0)? 3 : (c >= 0xE0)? 2 : (c >= 0xC0)? 1 : 0;
+    uint32_t code = (extra == 0)? c : (c & (0x3F >> extra));
+    for( int i = 0 ; i < extra ; i++ )
+    {
+        if( pos >= s.size() || (s[pos] & 0xC0) != 0x80 )
+        {
+            return 0xFFFD;
+        }
+        code = (code << 6) | (s[pos++] & 0x3F);
+    }
+    return code;
+}
+
+// -----------------------------------------------------------------------------
+std::string trim(const std::string& s)
+{
+    size_t b = 0;
+    size_t e = s.size();
+    while( b < e && (isspace((unsigned char)s[b]) || s[b] == 0) )
+    {
+        b++;
+    }
+    while( e > b && (isspace((unsigned char)s[e-1]) || s[e-1] == 0) )
+    {
+        e--;
+    }
+    return s.substr(b, e - b);
+}
+
+// -----------------------------------------------------------------------------
+static uint16_t parseNumber(const std::string& s)
+{
+    // "3/12" のような表記は先頭の数値のみ取り出す
+    return (uint16_t)strtoul(s.c_str(), NULL, 10);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  TagReader
+////////////////////////////////////////////////////////////////////////////////
+TagReader::TagReader(bool sjis) : m_sjis(sjis)
+{
+}
+
+// -----------------------------------------------------------------------------
+bool TagReader::isSupported(const std::string& filename)
+{
+    static const char *EXTENSIONS[] = {".mp3", ".ogg", ".flac", ".wav", NULL};
+    for( int n = 0 ; EXTENSIONS[n] ; n++ )
+    {
+        size_t len = strlen(EXTENSIONS[n]);
+        if( filename.size() > len && !strcasecmp(filename.c_str() + filename.size() - len, EXTENSIONS[n]) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+bool TagReader::read(const std::string& fullpath, TrackInfo& info)
+{
+    FILE *fp = fopen(fullpath.c_str(), "rb");
+    if( !fp )
+    {
+        return false;
+    }
+    const char *ext = strrchr(fullpath.c_str(), '.');
+    bool result = false;
+    if( !strcasecmp(ext, ".mp3") )
+    {
+        result = readMP3(fp, info);
+    }
+    else if( !strcasecmp(ext, ".flac") )
+    {
+        result = readFLAC(fp, info);
+    }
+    else if( !strcasecmp(ext, ".ogg") )
+    {
+        result = readOgg(fp, info);
+    }
+    else if( !strcasecmp(ext, ".wav") )
+    {
+        result = readWAV(fp, info);
+    }
+    fclose(fp);
+    info.valid = result;
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+//  ISO-8859-1 (または -s 指定時は CP932) のテキストを UTF-8 に変換する
+// -----------------------------------------------------------------------------
+std::string TagReader::legacyToUTF8(const uint8_t *data, uint32_t size)
+{
+    uint32_t len = 0;
+    while( len < size && data[len] )
+    {
+        len++;
+    }
+    std::string s;
+    if( m_sjis )
+    {
+        iconv_t cd = iconv_open("UTF-8", "CP932");
+        if( cd != (iconv_t)-1 )
+        {
+            std::vector<char> out(len * 3 + 1);
+            char *in_p = (char *)data;
+            char *out_p = &out[0];
+            size_t in_left = len;
+            size_t out_left = out.size();
+            size_t r = iconv(cd, &in_p, &in_left, &out_p, &out_left);
+            iconv_close(cd);
+            if( r != (size_t)-1 )
+            {
+                return std::string(&out[0], out_p - &out[0]);
+            }
+        }
+    }
+    for( uint32_t i = 0 ; i < len ; i++ )
+    {
+        appendUTF8(s, data[i]);
+    }
+    return s;
+}
+
+// -----------------------------------------------------------------------------
+std::string TagReader::decodeText(uint8_t encoding, const uint8_t *data, uint32_t size)
+{
+    switch( encoding )
+    {
+        case 0:     // ISO-8859-1
+            return legacyToUTF8(data, size);
+        case 1:     // UTF-16 (BOM付き)
+            if( size >= 2 && data[0] == 0xFE && data[1] == 0xFF )
+            {
+                return utf16ToUTF8(data+2, size-2, true);
+            }
+            if( size >= 2 && data[0] == 0xFF && data[1] == 0xFE )
+            {
+                return utf16ToUTF8(data+2, size-2, false);
+            }
+            return utf16ToUTF8(data, size, false);
+        case 2:     // UTF-16BE
+            return utf16ToUTF8(data, size, true);
+        case 3:     // UTF-8
+            {
+                uint32_t len = 0;
+                while( len < size && data[len] )
+                {
+                    len++;
+                }
+                return std::string((const char *)data, len);
+            }
+    }
+    return std::string();
+}
+
+// -----------------------------------------------------------------------------
+//  ID3v2 タグを読み込み、タグ全体のバイト数(ヘッダ含む)を返す
+//  タグがなければ 0 を返す。ファイル位置は不定
+// -----------------------------------------------------------------------------
+uint32_t TagReader::readID3v2(FILE *fp, TrackInfo& info, uint32_t& tlen_ms)
+{
+    uint8_t header[10];
+    fseek(fp, 0, SEEK_SET);
+    if( fread(header, 1, 10, fp) != 10 || memcmp(header, "ID3", 3) )
+    {
+        return 0;
+    }
+    uint8_t version = header[3];
+    uint8_t flags = header[5];
+    uint32_t tag_size = syncsafe32(header+6);
+    uint32_t total = tag_size + 10 + ((flags & 0x10)? 10 : 0);
+    if( version < 2 || version > 4 )
+    {
+        return total;
+    }
+
+    // 非同期化されたタグ(v2.3以前)は全体を読み込んで復元しておく
+    std::vector<uint8_t> whole;
+    bool unsync = (flags & 0x80) && version < 4;
+    if( unsync )
+    {
+        whole.resize(tag_size);
+        if( fread(&whole[0], 1, tag_size, fp) != tag_size )
+        {
+            return total;
+        }
+        uint32_t w = 0;
+        for( uint32_t r = 0 ; r < tag_size ; r++ )
+        {
+            whole[w++] = whole[r];
+            if( whole[r] == 0xFF && r + 1 < tag_size && whole[r+1] == 0x00 )
+            {
+                r++;
+            }
+        }
+        whole.resize(w);
+    }
+
+    uint32_t pos = 0;
+    uint32_t limit = unsync? (uint32_t)whole.size() : tag_size;
+    // 拡張ヘッダを読み飛ばす
+    if( (flags & 0x40) && version >= 3 )
+    {
+        uint8_t ext[4];
+        if( unsync )
+        {
+            if( limit < 4 ){ return total; }
+            memcpy(ext, &whole[0], 4);
+        }
+        else if( fread(ext, 1, 4, fp) != 4 )
+        {
+            return total;
+        }
+        uint32_t ext_size = (version == 4)? syncsafe32(ext) : (be32(ext) + 4);
+        pos = ext_size;
+        if( !unsync )
+        {
+            fseek(fp, 10 + pos, SEEK_SET);
+        }
+    }
+
+    uint32_t frame_header_size = (version == 2)? 6 : 10;
+    std::vector<uint8_t> frame;
+    while( pos + frame_header_size <= limit )
+    {
+        uint8_t fh[10];
+        if( unsync )
+        {
+            memcpy(fh, &whole[pos], frame_header_size);
+        }
+        else if( fread(fh, 1, frame_header_size, fp) != frame_header_size )
+        {
+            break;
+        }
+        if( fh[0] == 0 )
+        {
+            break;  // パディング
+        }
+        char id[5] = {0};
+        uint32_t size;
+        uint16_t frame_flags = 0;
+        if( version == 2 )
+        {
+            memcpy(id, fh, 3);
+            size = be24(fh+3);
+        }
+        else
+        {
+            memcpy(id, fh, 4);
+            size = (version == 4)? syncsafe32(fh+4) : be32(fh+4);
+            frame_flags = (fh[8] << 8) | fh[9];
+        }
+        pos += frame_header_size;
+        if( size > limit - pos )
+        {
+            break;
+        }
+        // テキストフレーム(T???, TT?)以外は読み飛ばす(画像などで巨大になりうる)
+        bool wanted = (id[0] == 'T') && size < 0x10000 && !(frame_flags & 0x00CF);
+        if( wanted )
+        {
+            frame.resize(size + 1);
+            if( unsync )
+            {
+                memcpy(&frame[0], &whole[pos], size);
+            }
+            else if( fread(&frame[0], 1, size, fp) != size )
+            {
+                break;
+            }
+            frame[size] = 0;
+            parseID3Frame(id, &frame[0], size, info, tlen_ms);
+        }
+        else if( !unsync )
+        {
+            fseek(fp, size, SEEK_CUR);
+        }
+        pos += size;
+    }
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+void TagReader::parseID3Frame(const char *id, const uint8_t *data, uint32_t size, TrackInfo& info, uint32_t& tlen_ms)
+{
+    if( size < 1 )
+    {
+        return;
+    }
+    std::string text = trim(decodeText(data[0], data+1, size-1));
+    if( text.empty() )
+    {
+        return;
+    }
+    if( !strcmp(id, "TIT2") || !strcmp(id, "TT2") )
+    {
+        info.title = text;
+    }
+    else if( !strcmp(id, "TPE1") || !strcmp(id, "TP1") )
+    {
+        info.artist = text;
+    }
+    else if( !strcmp(id, "TPE2") || !strcmp(id, "TP2") )
+    {
+        info.album_artist = text;
+    }
+    else if( !strcmp(id, "TALB") || !strcmp(id, "TAL") )
+    {
+        info.album = text;
+    }
+    else if( !strcmp(id, "TRCK") || !strcmp(id, "TRK") )
+    {
+        info.track = parseNumber(text);
+    }
+    else if( !strcmp(id, "TPOS") || !strcmp(id, "TPA") )
+    {
+        info.disc = parseNumber(text);
+    }
+    else if( !strcmp(id, "TYER") || !strcmp(id, "TYE") || !strcmp(id, "TDRC") || !strcmp(id, "TORY") )
+    {
+        if( !info.year || strcmp(id, "TORY") )
+        {
+            info.year = parseNumber(text);
+        }
+    }
+    else if( !strcmp(id, "TCON") || !strcmp(id, "TCO") )
+    {
+        // "(13)" や "(13)Pop" のような ID3v1 ジャンル番号の参照は番号部分を落とす
+        if( text[0] == '(' )
+        {
+            size_t e = text.find(')');
+            if( e != std::string::npos && e + 1 < text.size() )
+            {
+                text = text.substr(e + 1);
+            }
+        }
+        info.genre = text;
+    }
+    else if( !strcmp(id, "TSOP") || !strcmp(id, "XSOP") )
+    {
+        info.artist_sort = text;
+    }
+    else if( !strcmp(id, "TSO2") )
+    {
+        info.album_artist_sort = text;
+    }
+    else if( !strcmp(id, "TSOA") || !strcmp(id, "XSOA") )
+    {
+        info.album_sort = text;
+    }
+    else if( !strcmp(id, "TSOT") || !strcmp(id, "XSOT") )
+    {
+        info.title_sort = text;
+    }
+    else if( !strcmp(id, "TLEN") || !strcmp(id, "TLE") )
+    {
+        tlen_ms = strtoul(text.c_str(), NULL, 10);
+    }
+}
+
+// -----------------------------------------------------------------------------
+bool TagReader::readID3v1(FILE *fp, TrackInfo& info)
+{
+    uint8_t tag[128];
+    if( fseek(fp, -128, SEEK_END) || fread(tag, 1, 128, fp) != 128 || memcmp(tag, "TAG", 3) )
+    {
+        return false;
+    }
+    if( info.title.empty() )
+    {
+        info.title = trim(legacyToUTF8(tag+3, 30));
+    }
+    if( info.artist.empty() )
+    {
+        info.artist = trim(legacyToUTF8(tag+33, 30));
+    }
+    if( info.album.empty() )
+    {
+        info.album = trim(legacyToUTF8(tag+63, 30));
+    }
+    if( !info.year )
+    {
+        char year[5] = {0};
+        memcpy(year, tag+93, 4);
+        info.year = (uint16_t)atoi(year);
+    }
+    if( !info.track && tag[125] == 0 && tag[126] )
+    {
+        info.track = tag[126];
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+//  MPEG オーディオのフレームヘッダ
+// -----------------------------------------------------------------------------
+class MpegFrame
+{
+    public:
+        uint32_t bitrate;           // bps
+        uint32_t sample_rate;
+        uint32_t samples;           // 1フレームあたりのサンプル数
+        uint32_t length;            // フレーム長(バイト)
+        uint32_t side_info;         // サイド情報のバイト数(Xingヘッダの位置)
+
+        bool parse(const uint8_t *h){
+            static const uint16_t BITRATE[5][16] = {
+                {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},  // V1 L1
+                {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},     // V1 L2
+                {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},      // V1 L3
+                {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},     // V2 L1
+                {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}           // V2 L2/L3
+            };
+            static const uint32_t SAMPLE_RATE[3] = {44100, 48000, 32000};
+            if( h[0] != 0xFF || (h[1] & 0xE0) != 0xE0 )
+            {
+                return false;
+            }
+            int version = (h[1] >> 3) & 3;     // 0:2.5, 2:2, 3:1
+            int layer = 4 - ((h[1] >> 1) & 3);  // 1..3
+            int br_index = h[2] >> 4;
+            int sr_index = (h[2] >> 2) & 3;
+            if( version == 1 || layer == 4 || br_index == 0 || br_index == 15 || sr_index == 3 )
+            {
+                return false;
+            }
+            bool v1 = (version == 3);
+            bool mono = ((h[3] >> 6) == 3);
+            int table = v1? (layer - 1) : ((layer == 1)? 3 : 4);
+            bitrate = BITRATE[table][br_index] * 1000;
+            sample_rate = SAMPLE_RATE[sr_index] >> (v1? 0 : ((version == 2)? 1 : 2));
+            samples = (layer == 1)? 384 : ((layer == 3 && !v1)? 576 : 1152);
+            uint32_t padding = (h[2] >> 1) & 1;
+            if( layer == 1 )
+            {
+                length = (12 * bitrate / sample_rate + padding) * 4;
+            }
+            else
+            {
+                length = (samples / 8) * bitrate / sample_rate + padding;
+            }
+            side_info = v1? (mono? 17 : 32) : (mono? 9 : 17);
+            return true;
+        }
+};
+
+// -----------------------------------------------------------------------------
+bool TagReader::readMP3(FILE *fp, TrackInfo& info)
+{
+    uint32_t tlen_ms = 0;
+    uint32_t audio_start = readID3v2(fp, info, tlen_ms);
+    bool has_v1 = readID3v1(fp, info);
+    uint32_t audio_end = info.file_size - (has_v1? 128 : 0);
+
+    // 先頭のフレームを探す(次のフレームヘッダも正しいことを確認する)
+    enum{SEARCH_SIZE = 65536};
+    std::vector<uint8_t> buf(SEARCH_SIZE + 4);
+    fseek(fp, audio_start, SEEK_SET);
+    size_t n = fread(&buf[0], 1, SEARCH_SIZE, fp);
+    MpegFrame frame;
+    size_t pos = 0;
+    bool found = false;
+    for( ; pos + 4 <= n ; pos++ )
+    {
+        if( frame.parse(&buf[pos]) )
+        {
+            MpegFrame next;
+            size_t np = pos + frame.length;
+            if( np + 4 > n || next.parse(&buf[np]) )
+            {
+                found = true;
+                break;
+            }
+        }
+    }
+    if( !found )
+    {
+        if( tlen_ms )
+        {
+            info.duration_ms = tlen_ms;
+            return true;
+        }
+        return false;
+    }
+
+    // Xing/Info ヘッダ、VBRI ヘッダがあればフレーム数から正確に求める
+    const uint8_t *xing = &buf[pos + 4 + frame.side_info];
+    const uint8_t *vbri = &buf[pos + 4 + 32];
+    uint32_t frames = 0;
+    if( pos + 4 + frame.side_info + 12 <= n && (!memcmp(xing, "Xing", 4) || !memcmp(xing, "Info", 4)) )
+    {
+        if( be32(xing+4) & 0x01 )
+        {
+            frames = be32(xing+8);
+        }
+    }
+    else if( pos + 4 + 32 + 18 <= n && !memcmp(vbri, "VBRI", 4) )
+    {
+        frames = be32(vbri+14);
+    }
+
+    if( frames )
+    {
+        info.duration_ms = (uint32_t)((uint64_t)frames * frame.samples * 1000 / frame.sample_rate);
+    }
+    else if( tlen_ms )
+    {
+        info.duration_ms = tlen_ms;
+    }
+    else
+    {
+        // 固定ビットレートとみなして見積もる
+        uint64_t bytes = audio_end - (audio_start + pos);
+        info.duration_ms = (uint32_t)(bytes * 8 * 1000 / frame.bitrate);
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+bool TagReader::readFLAC(FILE *fp, TrackInfo& info)
+{
+    uint32_t tlen_ms = 0;
+    uint32_t start = readID3v2(fp, info, tlen_ms);
+    uint8_t magic[4];
+    fseek(fp, start, SEEK_SET);
+    if( fread(magic, 1, 4, fp) != 4 || memcmp(magic, "fLaC", 4) )
+    {
+        return false;
+    }
+    bool result = false;
+    bool last = false;
+    while( !last )
+    {
+        uint8_t bh[4];
+        if( fread(bh, 1, 4, fp) != 4 )
+        {
+            break;
+        }
+        last = (bh[0] & 0x80) != 0;
+        uint8_t type = bh[0] & 0x7F;
+        uint32_t size = be24(bh+1);
+        if( type == 0 && size >= 18 )           // STREAMINFO
+        {
+            uint8_t si[34];
+            uint32_t r = (size < sizeof(si))? size : sizeof(si);
+            if( fread(si, 1, r, fp) != r )
+            {
+                break;
+            }
+            fseek(fp, size - r, SEEK_CUR);
+            uint32_t sample_rate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+            uint64_t total = ((uint64_t)(si[13] & 0x0F) << 32) | be32(si+14);
+            if( sample_rate )
+            {
+                info.duration_ms = (uint32_t)(total * 1000 / sample_rate);
+                result = true;
+            }
+        }
+        else if( type == 4 && size < 0x1000000 )  // VORBIS_COMMENT
+        {
+            std::vector<uint8_t> vc(size);
+            if( fread(&vc[0], 1, size, fp) != size )
+            {
+                break;
+            }
+            parseVorbisComment(&vc[0], size, info);
+        }
+        else
+        {
+            fseek(fp, size, SEEK_CUR);
+        }
+    }
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+//  Ogg Vorbis
+//  先頭の２パケット(識別ヘッダ、コメントヘッダ)を組み立てて読み、
+//  演奏時間は最終ページのグラニュール位置から求める
+// -----------------------------------------------------------------------------
+bool TagReader::readOgg(FILE *fp, TrackInfo& info)
+{
+    enum{MAX_PACKET_SIZE = 1024*1024};
+    std::vector<uint8_t> packets[2];
+    int packet = 0;
+    uint32_t serial = 0;
+    fseek(fp, 0, SEEK_SET);
+    while( packet < 2 )
+    {
+        uint8_t ph[27];
+        if( fread(ph, 1, 27, fp) != 27 || memcmp(ph, "OggS", 4) )
+        {
+            return false;
+        }
+        serial = le32(ph+14);
+        uint8_t nsegs = ph[26];
+        uint8_t lacing[255];
+        if( fread(lacing, 1, nsegs, fp) != nsegs )
+        {
+            return false;
+        }
+        for( int i = 0 ; i < nsegs && packet < 2 ; i++ )
+        {
+            std::vector<uint8_t>& p = packets[packet];
+            if( p.size() + lacing[i] <= MAX_PACKET_SIZE )
+            {
+                size_t old = p.size();
+                p.resize(old + lacing[i]);
+                if( lacing[i] && fread(&p[old], 1, lacing[i], fp) != lacing[i] )
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                // 巨大なコメント(埋め込み画像など)は先頭部分のみ使う
+                fseek(fp, lacing[i], SEEK_CUR);
+            }
+            if( lacing[i] < 255 )
+            {
+                packet++;
+            }
+        }
+        if( packet >= 2 )
+        {
+            break;
+        }
+    }
+
+    uint32_t sample_rate = 0;
+    uint64_t pre_skip = 0;
+    std::vector<uint8_t>& id = packets[0];
+    std::vector<uint8_t>& comment = packets[1];
+    if( id.size() >= 16 && !memcmp(&id[0], "\x01vorbis", 7) )
+    {
+        sample_rate = le32(&id[12]);
+        if( comment.size() > 7 && !memcmp(&comment[0], "\x03vorbis", 7) )
+        {
+            parseVorbisComment(&comment[7], comment.size() - 7, info);
+        }
+    }
+    else if( id.size() >= 19 && !memcmp(&id[0], "OpusHead", 8) )
+    {
+        sample_rate = 48000;    // Opus のグラニュール位置は常に 48kHz 単位
+        pre_skip = id[10] | (id[11] << 8);
+        if( comment.size() > 8 && !memcmp(&comment[0], "OpusTags", 8) )
+        {
+            parseVorbisComment(&comment[8], comment.size() - 8, info);
+        }
+    }
+    if( !sample_rate )
+    {
+        return false;
+    }
+
+    // 末尾から最後のページを探す
+    enum{TAIL_SIZE = 65536};
+    uint32_t tail = (info.file_size < TAIL_SIZE)? info.file_size : (uint32_t)TAIL_SIZE;
+    std::vector<uint8_t> buf(tail);
+    fseek(fp, info.file_size - tail, SEEK_SET);
+    if( fread(&buf[0], 1, tail, fp) != tail )
+    {
+        return false;
+    }
+    for( int32_t i = (int32_t)tail - 27 ; i >= 0 ; i-- )
+    {
+        if( !memcmp(&buf[i], "OggS", 4) && le32(&buf[i+14]) == serial )
+        {
+            uint64_t granule = le64(&buf[i+6]);
+            if( granule != (uint64_t)-1 )
+            {
+                if( granule > pre_skip )
+                {
+                    granule -= pre_skip;
+                }
+                info.duration_ms = (uint32_t)(granule * 1000 / sample_rate);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+bool TagReader::readWAV(FILE *fp, TrackInfo& info)
+{
+    uint8_t riff[12];
+    fseek(fp, 0, SEEK_SET);
+    if( fread(riff, 1, 12, fp) != 12 || memcmp(riff, "RIFF", 4) || memcmp(riff+8, "WAVE", 4) )
+    {
+        return false;
+    }
+    uint32_t byte_rate = 0;
+    uint8_t ch[8];
+    while( fread(ch, 1, 8, fp) == 8 )
+    {
+        uint32_t size = le32(ch+4);
+        if( !memcmp(ch, "fmt ", 4) && size >= 16 )
+        {
+            uint8_t fmt[16];
+            if( fread(fmt, 1, 16, fp) != 16 )
+            {
+                return false;
+            }
+            byte_rate = le32(fmt+8);
+            fseek(fp, (size - 16) + (size & 1), SEEK_CUR);
+        }
+        else if( !memcmp(ch, "data", 4) )
+        {
+            if( !byte_rate )
+            {
+                return false;
+            }
+            info.duration_ms = (uint32_t)((uint64_t)size * 1000 / byte_rate);
+            return true;
+        }
+        else
+        {
+            fseek(fp, size + (size & 1), SEEK_CUR);
+        }
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+void TagReader::parseVorbisComment(const uint8_t *data, uint32_t size, TrackInfo& info)
+{
+    if( size < 8 )
+    {
+        return;
+    }
+    uint32_t pos = 4 + le32(data);     // ベンダー文字列を読み飛ばす
+    if( pos + 4 > size )
+    {
+        return;
+    }
+    uint32_t count = le32(data+pos);
+    pos += 4;
+    for( uint32_t i = 0 ; i < count && pos + 4 <= size ; i++ )
+    {
+        uint32_t len = le32(data+pos);
+        pos += 4;
+        if( len > size - pos )
+        {
+            break;
+        }
+        std::string entry((const char *)data+pos, len);
+        pos += len;
+        size_t eq = entry.find('=');
+        if( eq == std::string::npos )
+        {
+            continue;
+        }
+        std::string key = entry.substr(0, eq);
+        for( size_t k = 0 ; k < key.size() ; k++ )
+        {
+            key[k] = toupper((unsigned char)key[k]);
+        }
+        setVorbisField(key, trim(entry.substr(eq + 1)), info);
+    }
+}
+
+// -----------------------------------------------------------------------------
+void TagReader::setVorbisField(const std::string& key, const std::string& value, TrackInfo& info)
+{
+    if( value.empty() )
+    {
+        return;
+    }
+    if( key == "TITLE" )
+    {
+        info.title = value;
+    }
+    else if( key == "ARTIST" )
+    {
+        info.artist = value;
+    }
+    else if( key == "ALBUMARTIST" || key == "ALBUM ARTIST" )
+    {
+        info.album_artist = value;
+    }
+    else if( key == "ALBUM" )
+    {
+        info.album = value;
+    }
+    else if( key == "TRACKNUMBER" )
+    {
+        info.track = parseNumber(value);
+    }
+    else if( key == "DISCNUMBER" )
+    {
+        info.disc = parseNumber(value);
+    }
+    else if( key == "DATE" || key == "YEAR" )
+    {
+        info.year = parseNumber(value);
+    }
+    else if( key == "GENRE" )
+    {
+        info.genre = value;
+    }
+    else if( key == "ARTISTSORT" )
+    {
+        info.artist_sort = value;
+    }
+    else if( key == "ALBUMARTISTSORT" )
+    {
+        info.album_artist_sort = value;
+    }
+    else if( key == "ALBUMSORT" )
+    {
+        info.album_sort = value;
+    }
+    else if( key == "TITLESORT" )
+    {
+        info.title_sort = value;
+    }
+}
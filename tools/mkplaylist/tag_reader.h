@@ -0,0 +1,72 @@
+#ifndef TAG_READER_H
+#define TAG_READER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// -----------------------------------------------------------------------------
+//  １ファイルぶんのタグ情報
+// -----------------------------------------------------------------------------
+class TrackInfo
+{
+    public:
+        std::string path;           // SDカードのルートからの相対パス
+        uint32_t    file_size;
+        uint32_t    mtime;          // 更新時刻(UNIX時間)
+        std::string title;
+        std::string artist;
+        std::string album_artist;
+        std::string album;
+        std::string genre;
+        std::string artist_sort;    // 読み(TSOP, ARTISTSORT など)
+        std::string album_artist_sort;
+        std::string album_sort;
+        std::string title_sort;
+        uint16_t    track;
+        uint16_t    disc;
+        uint16_t    year;
+        uint32_t    duration_ms;
+        bool        valid;
+
+        TrackInfo() : file_size(0), mtime(0), track(0), disc(0), year(0),
+            duration_ms(0), valid(false){
+        }
+};
+
+// -----------------------------------------------------------------------------
+//  MP3(ID3v1/v2), Ogg Vorbis, FLAC, WAV のタグと演奏時間を読み取る
+//  演奏時間はデコードせずにフレームヘッダ等から求める
+// -----------------------------------------------------------------------------
+class TagReader
+{
+    private:
+        bool m_sjis;    // ISO-8859-1 指定のテキストを Shift_JIS(CP932) とみなす
+
+        bool readMP3(FILE *fp, TrackInfo& info);
+        bool readFLAC(FILE *fp, TrackInfo& info);
+        bool readOgg(FILE *fp, TrackInfo& info);
+        bool readWAV(FILE *fp, TrackInfo& info);
+        uint32_t readID3v2(FILE *fp, TrackInfo& info, uint32_t& tlen_ms);
+        bool readID3v1(FILE *fp, TrackInfo& info);
+        void parseID3Frame(const char *id, const uint8_t *data, uint32_t size, TrackInfo& info, uint32_t& tlen_ms);
+        void parseVorbisComment(const uint8_t *data, uint32_t size, TrackInfo& info);
+        void setVorbisField(const std::string& key, const std::string& value, TrackInfo& info);
+        std::string decodeText(uint8_t encoding, const uint8_t *data, uint32_t size);
+        std::string legacyToUTF8(const uint8_t *data, uint32_t size);
+
+    public:
+        TagReader(bool sjis);
+        bool read(const std::string& fullpath, TrackInfo& info);
+        static bool isSupported(const std::string& filename);
+};
+
+// -----------------------------------------------------------------------------
+//  UTF-8 文字列のユーティリティ
+// -----------------------------------------------------------------------------
+std::string utf16ToUTF8(const uint8_t *data, uint32_t size, bool big_endian);
+std::string truncateUTF8(const std::string& s, size_t max_bytes);
+uint32_t    decodeUTF8(const std::string& s, size_t& pos);
+std::string trim(const std::string& s);
+
+#endif